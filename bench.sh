@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+
+# Starts the server with a given number of workers, runs the load generator
+# against it for each scenario and appends the results to an output file.
+
+children=""
+build_dir="./build"
+output_file="bench_output.txt"
+scenarios="text image head post"
+bench_args=()
+port=8080
+
+# Function to display usage information
+usage()
+{
+    echo "Usage: $0 -c <children> [-b <build dir>] [-o <output file>] [-s <scenarios>] [-- <bench options>]"
+    echo "  -c children     Number of workers to start the server with"
+    echo "  -b build dir    Directory holding main, http.so and bench (default: ./build)"
+    echo "  -o output file  File the results are appended to (default: bench_output.txt)"
+    echo "  -s scenarios    Space separated scenarios to run (default: \"text image head post\")"
+    echo "  Options after -- are passed to bench for every scenario (e.g. -- -d 5 -c 32 -k)"
+    exit 1
+}
+
+while getopts ":c:b:o:s:" opt; do
+  case $opt in
+    c)
+      children="$OPTARG"
+      ;;
+    b)
+      build_dir="$OPTARG"
+      ;;
+    o)
+      output_file="$OPTARG"
+      ;;
+    s)
+      scenarios="$OPTARG"
+      ;;
+    \?)
+      echo "Invalid option: -$OPTARG" >&2
+      usage
+      ;;
+    :)
+      echo "Option -$OPTARG requires an argument." >&2
+      usage
+      ;;
+  esac
+done
+shift $((OPTIND - 1))
+bench_args=("$@")
+
+if [ -z "$children" ]; then
+  usage
+fi
+
+for binary in main http.so bench; do
+  if [ ! -f "$build_dir/$binary" ]; then
+    echo "$build_dir/$binary not found, run ./build.sh first"
+    exit 1
+  fi
+done
+
+# The server loads ./http.so and serves ./resources, so run it from a scratch directory
+output_file="$(cd "$(dirname "$output_file")" && pwd)/$(basename "$output_file")"
+run_dir=$(mktemp -d)
+cp "$build_dir/main" "$build_dir/http.so" "$build_dir/bench" "$run_dir"
+cp -r resources "$run_dir"
+
+pushd "$run_dir" > /dev/null || exit 1
+
+./main -c "$children" > server.log 2>&1 &
+server_pid=$!
+
+# Wait for the listener before sending any load
+for _ in $(seq 1 50); do
+  if (echo > /dev/tcp/127.0.0.1/$port) 2> /dev/null; then
+    break
+  fi
+  sleep 0.1
+done
+
+{
+  echo "=== $(date '+%Y-%m-%d %H:%M:%S') children=$children commit=$(git -C "$OLDPWD" rev-parse --short HEAD 2> /dev/null) args=${bench_args[*]}"
+  for scenario in $scenarios; do
+    echo
+    ./bench -s "$scenario" "${bench_args[@]}"
+  done
+  echo
+} | tee -a "$output_file"
+
+kill -INT "$server_pid" 2> /dev/null
+wait "$server_pid" 2> /dev/null
+
+popd > /dev/null || exit 1
+rm -rf "$run_dir"
+echo "Results appended to $output_file"
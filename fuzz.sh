@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+
+# Builds the request parser fuzz target with ASan and UBSan and runs it.
+#   libfuzzer  clang -fsanitize=fuzzer, mutates fuzz/corpus for the given time
+#   afl        afl-clang-fast (or afl-cc), runs afl-fuzz on fuzz/corpus
+#   replay     the compiler of your choice, replays fuzz/corpus (and any crash files) once
+# Set -p to an http.so built from a rewritten parser to check it against http.c on every input.
+
+engine="libfuzzer"
+compiler=""
+candidate=""
+seconds=60
+out_dir="fuzz/build"
+corpus_dir="fuzz/corpus"
+
+# Function to display usage information
+usage()
+{
+    echo "Usage: $0 [-e libfuzzer|afl|replay] [-c <compiler>] [-p <candidate http.so>] [-t <seconds>] [-- <extra inputs>]"
+    echo "  -e engine     How to run the target (default: libfuzzer)"
+    echo "  -c compiler   Compiler to build with (default: clang, afl-clang-fast for afl)"
+    echo "  -p candidate  Shared object whose is_http_request and set_request_path must match http.c"
+    echo "  -t seconds    How long libFuzzer runs (default: 60)"
+    exit 1
+}
+
+while getopts ":e:c:p:t:" opt; do
+  case $opt in
+    e)
+      engine="$OPTARG"
+      ;;
+    c)
+      compiler="$OPTARG"
+      ;;
+    p)
+      candidate="$(realpath "$OPTARG")"
+      ;;
+    t)
+      seconds="$OPTARG"
+      ;;
+    \?)
+      echo "Invalid option: -$OPTARG" >&2
+      usage
+      ;;
+    :)
+      echo "Option -$OPTARG requires an argument." >&2
+      usage
+      ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+flags=(-std=c17 -g -O1 -fno-omit-frame-pointer -D_POSIX_C_SOURCE=200809L -D_XOPEN_SOURCE=700 -D_GNU_SOURCE -D_DARWIN_C_SOURCE -Iinclude -fsanitize=address,undefined -fno-sanitize-recover=undefined)
+libs=(-lgdbm_compat -ldl)
+
+mkdir -p "$out_dir"
+export PARSER_CANDIDATE="$candidate"
+# The parser's scans read past the request as a matter of course once they miss a delimiter, report it at once
+export ASAN_OPTIONS="${ASAN_OPTIONS:-abort_on_error=1:detect_leaks=0}"
+export UBSAN_OPTIONS="${UBSAN_OPTIONS:-print_stacktrace=1}"
+
+case $engine in
+  libfuzzer)
+    "${compiler:-clang}" "${flags[@]}" -DFUZZ_LIBFUZZER -fsanitize=fuzzer src/fuzz_parser.c src/arena.c src/uring.c src/storage.c src/seglog.c src/time_index.c "${libs[@]}" -o "$out_dir/fuzz_parser" || exit 1
+    mkdir -p "$out_dir/corpus"
+    "$out_dir/fuzz_parser" -max_total_time="$seconds" -max_len=1024 -artifact_prefix="$out_dir/" "$out_dir/corpus" "$corpus_dir" "$@"
+    ;;
+  afl)
+    "${compiler:-afl-clang-fast}" "${flags[@]}" src/fuzz_parser.c src/arena.c src/uring.c src/storage.c src/seglog.c src/time_index.c "${libs[@]}" -o "$out_dir/fuzz_parser" || exit 1
+    AFL_SKIP_CPUFREQ=1 afl-fuzz -i "$corpus_dir" -o "$out_dir/afl" -- "$out_dir/fuzz_parser"
+    ;;
+  replay)
+    "${compiler:-cc}" "${flags[@]}" src/fuzz_parser.c src/arena.c src/uring.c src/storage.c src/seglog.c src/time_index.c "${libs[@]}" -o "$out_dir/fuzz_parser" || exit 1
+    "$out_dir/fuzz_parser" "$corpus_dir" "$@"
+    ;;
+  *)
+    usage
+    ;;
+esac
@@ -45,8 +45,13 @@ generate_cmake_content() {
         fi
     done
 
-    # Add executable
-    echo "add_executable($entity \${${entity}_SOURCES})" >> "$output_file"
+    # Add executable, or a loadable module for entities named like a shared object (e.g. http.so)
+    if [[ $entity == *.so ]]; then
+        echo "add_library($entity MODULE \${${entity}_SOURCES})" >> "$output_file"
+        echo "set_target_properties($entity PROPERTIES PREFIX \"\" OUTPUT_NAME ${entity%.so} SUFFIX \".so\")" >> "$output_file"
+    else
+        echo "add_executable($entity \${${entity}_SOURCES})" >> "$output_file"
+    fi
     echo "target_include_directories($entity PRIVATE /usr/local/include) " >> "$output_file"
     echo "target_include_directories($entity PUBLIC \${CMAKE_SOURCE_DIR}/include)" >> "$output_file"
 
@@ -285,6 +290,15 @@ generate_cmake_content() {
   echo "endif()" >> "$output_file"
   echo "" >> "$output_file"
 
+  # USDT probes (include/probes.h) are compiled in only on request, they need <sys/sdt.h>
+  echo "if(ENABLE_USDT STREQUAL \"ON\")" >> "$output_file"
+  echo "    message(STATUS \"ENABLE_USDT is ON\")" >> "$output_file"
+  for entity in "${targets[@]}"; do
+    echo "    target_compile_definitions($entity PRIVATE ENABLE_USDT)" >> "$output_file"
+  done
+  echo "endif()" >> "$output_file"
+  echo "" >> "$output_file"
+
   # Common compiler flags
   echo "set(STANDARD_FLAGS" >> "$output_file"
   echo "    -D_POSIX_C_SOURCE=200809L" >> "$output_file"
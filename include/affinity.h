@@ -0,0 +1,23 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#define CPU_PLAN_MAX 1024
+
+/*
+    Where each process of the server runs.
+    cpus[0] is the listener, cpus[1] the monitor and the rest are handed to the
+    workers in an order that alternates between NUMA nodes.
+ */
+struct cpu_plan
+{
+    int enabled;
+    int count;
+    int cpus[CPU_PLAN_MAX];
+    int nodes[CPU_PLAN_MAX];
+};
+
+int  cpu_plan_init(struct cpu_plan *plan, const char *spec);
+void cpu_plan_pin_listener(const struct cpu_plan *plan);
+void cpu_plan_pin_monitor(const struct cpu_plan *plan);
+void cpu_plan_pin_worker(const struct cpu_plan *plan, int index);
+#endif
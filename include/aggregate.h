@@ -0,0 +1,44 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define AGGREGATE_BUCKETS 65    // Histogram bucket b holds sizes of bit length b, 0 through 64
+
+/*
+    How often one value was seen. value is NULL for an empty slot.
+ */
+struct value_count
+{
+    uint64_t hash;
+    char    *value;
+    size_t   len;
+    uint64_t count;
+};
+
+/*
+    Running totals over a stream of values. Values are counted by content only when
+    top is nonzero, since that keeps a copy of every distinct value.
+ */
+struct aggregate
+{
+    uint64_t            count;
+    uint64_t            bytes;
+    uint64_t            smallest;
+    uint64_t            largest;
+    uint64_t            histogram[AGGREGATE_BUCKETS];
+    size_t              top;
+    struct value_count *values;
+    size_t              capacity;
+    size_t              distinct;
+};
+
+int                 aggregate_init(struct aggregate *agg, size_t top);
+void                aggregate_free(struct aggregate *agg);
+int                 aggregate_add(struct aggregate *agg, const char *value, size_t len);
+int                 aggregate_save(const struct aggregate *agg, FILE *file);
+int                 aggregate_merge(struct aggregate *agg, FILE *file);
+struct value_count *aggregate_sorted(const struct aggregate *agg);
+#endif
@@ -0,0 +1,23 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+    A bump allocator for per-request scratch memory.
+    Allocations are never freed individually; the whole arena is reset once the
+    request is finished. capacity is a hard cap on the memory one request may use.
+ */
+struct arena
+{
+    char  *base;
+    size_t capacity;
+    size_t used;
+    size_t high_water;
+};
+
+int   arena_init(struct arena *arena, size_t capacity);
+void *arena_alloc(struct arena *arena, size_t size);
+void  arena_reset(struct arena *arena);
+void  arena_destroy(struct arena *arena);
+#endif
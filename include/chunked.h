@@ -0,0 +1,44 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CHUNKED_HEADER "Transfer-Encoding:"
+#define CHUNKED_CODING "chunked"
+
+/*
+    Where a chunked decoder is in the body
+ */
+enum chunked_state
+{
+    CHUNKED_SIZE,         // Hex digits of a chunk size
+    CHUNKED_EXTENSION,    // ;name=value after the size, ignored
+    CHUNKED_SIZE_LF,      // The LF ending the size line
+    CHUNKED_DATA,         // Bytes of the chunk
+    CHUNKED_DATA_CR,      // The CRLF after the chunk
+    CHUNKED_DATA_LF,
+    CHUNKED_TRAILER,    // Header lines after the last chunk, ignored
+    CHUNKED_TRAILER_LF,
+    CHUNKED_DONE,    // The empty line after the trailers was seen
+    CHUNKED_ERROR
+};
+
+/*
+    Incremental decoder of a Transfer-Encoding: chunked body. It is fed whatever arrived
+    from the socket and can stop and resume anywhere, even inside a size line.
+ */
+struct chunked
+{
+    enum chunked_state state;
+    uint64_t           remaining;     // Bytes left in the current chunk
+    int                digits;        // Hex digits of the size seen so far
+    int                line_start;    // No byte of the current trailer line was seen yet
+};
+
+void    chunked_init(struct chunked *decoder);
+ssize_t chunked_decode(struct chunked *decoder, char *data, size_t len, size_t *used);
+int     chunked_done(const struct chunked *decoder);
+int     is_chunked(const char *request, const char *end);
+#endif
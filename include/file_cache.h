@@ -0,0 +1,64 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FILE_CACHE_SLOTS 256       // Most distinct files the cache keeps track of, a power of two
+#define FILE_CACHE_PATH_LEN 256    // Longer paths are never cached
+
+/*
+    What a slot of the file cache holds
+ */
+enum file_cache_state
+{
+    FILE_CACHE_EMPTY,      // Claimed for a path that is not written yet
+    FILE_CACHE_FILLING,    // One worker is reading the file in, the others serve it from disk
+    FILE_CACHE_READY,      // The bytes of the version named by the slot are in the data area
+    FILE_CACHE_SKIPPED     // That version did not fit the budget or could not be read
+};
+
+/*
+    One cached file. hash and path are written once, when a worker claims the slot, and a
+    slot is never given to another path. The version fields and the state they go with are
+    changed only by the filler and only while seq is odd, so a reader that sees the same
+    even seq before and after reading them has a consistent copy.
+ */
+struct file_cache_slot
+{
+    uint64_t hash;      // Hash of path, 0 while the slot is free
+    uint64_t status;    // enum file_cache_state in the low half and the filler's pid in the high half, changed as one
+    uint32_t seq;
+    uint64_t device;    // Version of the file the slot describes
+    uint64_t inode;
+    uint64_t size;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    uint64_t offset;    // Where its bytes start in the data area
+    char     path[FILE_CACHE_PATH_LEN];
+};
+
+/*
+    Static files shared by every worker, in one MAP_SHARED mapping made before the fork.
+    The data area is handed out from the front and never reused: a file that changes is
+    read into new space and its old bytes stay valid for anyone still sending them, so
+    readers never take a lock. Once the budget is spent, new files are served from disk.
+ */
+struct file_cache
+{
+    size_t                 budget;    // Bytes of the data area
+    uint64_t               used;      // Bytes of the data area handed out
+    uint64_t               hits;
+    uint64_t               misses;
+    uint64_t               fills;
+    struct file_cache_slot slots[FILE_CACHE_SLOTS];
+    char                   data[];
+};
+
+struct file_cache *file_cache_create(size_t budget);
+void               file_cache_destroy(struct file_cache *cache);
+const char        *file_cache_get(struct file_cache *cache, const char *path, const struct stat *file_stat);
+size_t             file_cache_preload(struct file_cache *cache, const char *dir);
+#endif
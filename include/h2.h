@@ -0,0 +1,56 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"    // What a client speaking HTTP/2 with prior knowledge starts with
+#define H2_PREFACE_LEN 24
+#define H2_ALPN "\x02h2"                                 // ALPN protocol list entry a TLS client asks for HTTP/2 with
+
+struct arena;
+struct resource;
+
+/*
+    What outlives a worker serving an HTTP/2 connection. A worker gives the connection back
+    as soon as no stream is open, like a kept-alive HTTP/1 connection, and the next worker
+    carries on from this. The header tables are not part of it: our settings forbid the
+    client a dynamic table, so once it acknowledged them a header block never refers to
+    an earlier one.
+ */
+struct h2_state
+{
+    int      active;            // The preface was read, the connection speaks HTTP/2
+    uint32_t last_stream;       // Highest stream the client opened
+    int64_t  send_window;       // Connection flow-control window for the DATA we send
+    uint32_t initial_window;    // The client's SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t max_frame;         // The client's SETTINGS_MAX_FRAME_SIZE
+};
+
+/*
+    Why h2_serve gave the connection back
+ */
+enum h2_result
+{
+    H2_IDLE,              // No stream is open and nothing is left to read, the connection can be held
+    H2_CLOSED,            // The client closed the connection or sent GOAWAY
+    H2_ERROR,             // A connection error, GOAWAY was sent
+    H2_HEADER_TIMEOUT,    // The client stopped in the middle of a frame or never acknowledged our settings
+    H2_WRITE_TIMEOUT      // The client stopped reading or stopped opening its flow-control windows
+};
+
+/*
+    What a worker lends h2_serve for serving a connection
+ */
+struct h2_context
+{
+    struct arena *arena;                                                            // Paths and error pages of the open streams, reset whenever none is open
+    int (*open_resource)(struct arena *, const char *, int, struct resource *);    // Resolves a request, from the shared library
+    int      header_timeout;                                                        // Seconds a frame may take to arrive once it started, 0 for no limit
+    int      write_timeout;                                                         // Seconds a send may block, or a stream wait for its window
+    uint64_t bytes_read;                                                            // Set to the bytes read from the client
+};
+
+int            h2_is_preface(const char *buffer, size_t len);
+enum h2_result h2_serve(int fd, struct h2_state *state, const char *early, size_t early_len, struct h2_context *context);
+#endif
@@ -0,0 +1,56 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_TABLE_SIZE 4096                                          // SETTINGS_HEADER_TABLE_SIZE a peer may use until it acknowledges ours
+#define HPACK_ENTRY_OVERHEAD 32                                        // Added to the name and value length of every entry, RFC 7541 section 4.1
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)    // Most entries a table of HPACK_TABLE_SIZE can hold
+#define HPACK_STRING_MAX 4096                                          // Longest Huffman coded name or value decoded
+#define HPACK_STATUS_INDEX 8                                           // Static entries 8 to 14 are :status 200 to 500
+#define HPACK_STATUS_MAX 5                                             // Most bytes a :status field is encoded in
+#define HPACK_CONTENT_LENGTH_INDEX 28
+#define HPACK_CONTENT_TYPE_INDEX 31
+#define HPACK_ALLOW_INDEX 22
+
+/*
+    Called for every header field of a block, in order. The strings are not NUL-terminated
+    and only valid until the call returns. A non-zero return stops the decoding.
+ */
+typedef int (*hpack_header)(const char *name, size_t name_len, const char *value, size_t value_len, void *arg);
+
+/*
+    An entry of the dynamic table, its name and value are stored back to back in data
+ */
+struct hpack_entry
+{
+    size_t offset;
+    size_t name_len;
+    size_t value_len;
+};
+
+/*
+    The decoding side of the header compression of one connection. The dynamic table
+    keeps its entries oldest first, so evicting one moves the rest of data down; with at
+    most HPACK_TABLE_SIZE bytes that is cheaper than a ring that wraps names in two.
+ */
+struct hpack_decoder
+{
+    size_t             limit;       // Largest table size the peer may ask for, what our settings allow
+    size_t             max_size;    // Table size the peer last asked for
+    size_t             size;        // Sum of the entry sizes, with HPACK_ENTRY_OVERHEAD each
+    size_t             used;        // Bytes of data in use
+    int                count;
+    struct hpack_entry entries[HPACK_MAX_ENTRIES];
+    char               data[HPACK_TABLE_SIZE];
+    char               name[HPACK_STRING_MAX];     // Huffman decoded strings and names copied out of the table
+    char               value[HPACK_STRING_MAX];
+};
+
+void   hpack_decoder_init(struct hpack_decoder *decoder, size_t limit);
+void   hpack_set_limit(struct hpack_decoder *decoder, size_t limit);
+int    hpack_decode(struct hpack_decoder *decoder, const uint8_t *block, size_t len, hpack_header emit, void *arg);
+size_t hpack_encode_status(uint8_t *out, int status);
+size_t hpack_encode_literal(uint8_t *out, size_t size, unsigned int name_index, const char *value, size_t value_len);
+#endif
@@ -1,16 +1,42 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include "arena.h"
+#include "file_cache.h"
 #include <sys/stat.h>
 
 #define REQ_HEADER_LEN 8
 #define TEN 10
 #define LEN_405 9
+#define BATCH_PATH "/batch"                        // POSTs here hold many records, see handle_batch_request
+#define MAX_POST_BODY ((size_t)4 * 1024 * 1024)    // Largest POST body the server reads in full, and largest record of a batch
+#define BODY_TIMED_OUT 2                           // Returned by handle_batch_request when the body stopped arriving
+#define RESOURCE_DIR "./resources"                 // Where requested files are looked up
+#define RESOURCE_TYPE_LEN 64                       // Room for the longest Content-Type a file is served with
+
+/*
+    A response resolved by open_resource for a protocol that frames the body itself
+ */
+struct resource
+{
+    int           status;
+    char          content_type[RESOURCE_TYPE_LEN];
+    unsigned long length;    // Bytes of the body
+    const char   *data;      // The body in the shared cache or the arena, NULL when it is read from fd
+    int           fd;        // The file to read the body from, -1 when data holds it or there is no body to send
+};
 
 void my_function(const char *str);
 void set_request_path(char *req_path, const char *buffer);
-int  handle_client(int newsockfd, const char *request_path, int is_head, int is_img);
+void set_io_options(int use_uring, int timeout);
+void set_file_cache(struct file_cache *cache);
+int  set_storage_backend(const char *spec);
+int  prepare_storage(void);
+int  adopt_storage(void);
+int  handle_client(struct arena *arena, int newsockfd, const char *request_path, int is_head, int is_img);
+int  open_resource(struct arena *arena, const char *request_path, int is_head, struct resource *resource);
 int  handle_post_request(const char *buffer, int client_fd);
+int  handle_batch_request(struct arena *arena, const char *request, size_t length, int client_fd);
 int  is_img_request(const char *buffer);
 int  is_http_request(const char *buffer);
 #endif
@@ -0,0 +1,55 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+    USDT probes on each phase of a request, under the "webserver" provider.
+    They are compiled out unless the build defines ENABLE_USDT (cmake -DENABLE_USDT=ON),
+    which needs <sys/sdt.h> (systemtap-sdt-dev). Scripts that use them are in bpftrace/.
+
+    A connection changes fd number every time it crosses a process, so probes that follow
+    a connection pass probe_conn_id(fd): the inode of the socket, which is the same in the
+    listener, the monitor and the worker. It costs one fstat per probe in USDT builds only.
+ */
+#if defined(ENABLE_USDT)
+    #include <sys/sdt.h>
+    #include <sys/stat.h>
+
+    #define PROBE1(name, a) DTRACE_PROBE1(webserver, name, a)
+    #define PROBE2(name, a, b) DTRACE_PROBE2(webserver, name, a, b)
+    #define PROBE3(name, a, b, c) DTRACE_PROBE3(webserver, name, a, b, c)
+
+/*
+    Identifies a connection across processes
+
+    @param
+    fd: A socket of the connection
+
+    @return
+    The inode of the socket, 0 if it cannot be read
+ */
+static inline unsigned long probe_conn_id(int fd)
+{
+    struct stat st;
+
+    if(fstat(fd, &st) != 0)
+    {
+        return 0;
+    }
+    return (unsigned long)st.st_ino;
+}
+#else
+    #define PROBE1(name, a) \
+        do                  \
+        {                   \
+        } while(0)
+    #define PROBE2(name, a, b) \
+        do                     \
+        {                      \
+        } while(0)
+    #define PROBE3(name, a, b, c) \
+        do                        \
+        {                         \
+        } while(0)
+#endif
+
+#endif
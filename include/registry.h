@@ -0,0 +1,72 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include "h2.h"
+#include "timer_wheel.h"
+#include <stdint.h>
+#include <time.h>
+
+/*
+    Where a connection is as seen by the listener
+ */
+enum client_state
+{
+    CLIENT_FREE,         // The slot is on the free list
+    CLIENT_IN_FLIGHT,    // Handed to the monitor, a worker owns it
+    CLIENT_IDLE          // Held by the listener until the client sends its first or next request
+};
+
+/*
+    One connection in the registry.
+    The slot index and generation together form the handle that travels with the fd
+    to the worker and back, so a handle that outlived its slot is recognised as stale.
+ */
+struct client_slot
+{
+    int               fd;            // The listener's descriptor, -1 while the connection is in flight
+    uint32_t          generation;    // Bumped every time the slot is freed
+    enum client_state state;
+    time_t            accepted;      // When the connection was accepted
+    time_t            since;         // When the connection entered its current state
+    uint64_t          bytes;         // Request bytes the workers have read from it
+    int               owner;         // Id of the worker that last served it, -1 before its first request
+    int               tls;           // Accepted on the TLS port and waiting for its handshake
+    struct h2_state   h2;            // Where an HTTP/2 connection left off between requests
+    struct timer      timer;         // Header, keep-alive or lost timeout the listener runs for it
+    int               prev;          // Neighbours on the list of the current state
+    int               next;
+};
+
+/*
+    A doubly linked list of slots threaded through the slot array, oldest first
+ */
+struct client_list
+{
+    int head;
+    int tail;
+};
+
+/*
+    Fixed capacity slot map of every connection the listener knows about.
+    In-flight and idle connections are kept on separate lists so the listener can walk
+    the ones it holds without looking at the rest.
+ */
+struct client_registry
+{
+    struct client_slot *slots;
+    int                 capacity;
+    int                 count;
+    int                 free_head;
+    struct client_list  in_flight;
+    struct client_list  idle;
+};
+
+int                 registry_init(struct client_registry *registry, int capacity);
+void                registry_destroy(struct client_registry *registry);
+struct client_slot *registry_add(struct client_registry *registry, int fd, time_t now);
+struct client_slot *registry_lookup(struct client_registry *registry, uint64_t handle);
+uint64_t            registry_handle(const struct client_registry *registry, const struct client_slot *slot);
+void                registry_set_in_flight(struct client_registry *registry, struct client_slot *slot, time_t now);
+void                registry_set_idle(struct client_registry *registry, struct client_slot *slot, int fd, time_t now);
+void                registry_remove(struct client_registry *registry, struct client_slot *slot);
+#endif
@@ -0,0 +1,22 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "storage.h"
+
+#define SNAPSHOT_STDIO "-"    // File name meaning stdout for an export and stdin for an import
+
+/*
+    A snapshot is a portable copy of a store, optionally gzip compressed:
+
+        "REQDBSNP" version
+        [key length][value length][key][value] ... [0][0]
+        [time entry count] [time_ms][key] ...
+        [pair count][crc32 of everything before the pair count]
+
+    Lengths and counts are little-endian; lengths are 32 bits, counts and time entries
+    64. Pairs are in key order with the counter last, so loading a snapshot into an empty
+    store gives back the same keys, values, counter and times.
+ */
+int snapshot_export(struct storage *store, const char *file, int compress);
+int snapshot_import(struct storage *store, const char *file);
+#endif
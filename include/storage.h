@@ -0,0 +1,98 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "time_index.h"
+#include <stddef.h>
+
+#define STORAGE_DEFAULT_SPEC "ndbm"
+#define STORAGE_PATH "requests_db"        // ndbm adds .dir/.pag, the log keeps its segments in requests_db.log/
+#define STORAGE_COUNTER_KEY "__counter__"  // Holds the key the next appended value gets
+#define STORAGE_KEY_LEN 24    // Fits any 64-bit counter
+
+/*
+    When the log backend flushes appended records to disk
+ */
+enum storage_fsync
+{
+    STORAGE_FSYNC_NONE,        // Left to the kernel
+    STORAGE_FSYNC_INTERVAL,    // At most once per fsync_interval_ms, checked on append
+    STORAGE_FSYNC_ALWAYS       // After every append
+};
+
+/*
+    A backend and its settings, parsed from a spec such as "ndbm" or "log,fsync=always,segment=1048576"
+ */
+struct storage_config
+{
+    const struct storage_ops *ops;
+    enum storage_fsync        fsync;
+    int                       fsync_interval_ms;
+    size_t                    segment_size;        // Log segments are sealed once they reach this size
+    int                       compact_segments;    // Sealed segments that trigger a background compaction, 0 for never
+};
+
+/*
+    An open store. Keys and values are byte strings; the server and the db tool store
+    NUL-terminated strings and include the NUL, as they always have with ndbm.
+ */
+struct storage
+{
+    const struct storage_ops *ops;
+    struct storage_config     config;
+    void                     *state;    // Owned by the backend
+    struct time_index         times;    // When each appended value was stored, kept beside any backend
+};
+
+/*
+    Called for every key/value pair by storage_each, a nonzero return stops the walk
+ */
+typedef int (*storage_visit)(const void *key, size_t key_len, const void *value, size_t value_len, void *arg);
+
+/*
+    Hands storage_load its next key/value pair. Returns 1 with a pair, 0 when there are
+    no more and -1 on error. The pair only needs to stay valid until the next call.
+ */
+typedef int (*storage_source)(const void **key, size_t *key_len, const void **value, size_t *value_len, void *arg);
+
+/*
+    Hands storage_append_batch its next value. Returns 1 with a value, 0 when there are
+    no more and -1 on error. The value only needs to stay valid until the next call.
+ */
+typedef int (*storage_value_source)(const void **value, size_t *value_len, void *arg);
+
+/*
+    What a backend implements. fetch returns memory owned by the backend, valid until the next call on the store.
+ */
+struct storage_ops
+{
+    const char *name;
+    int         keep_open;    // 1 if the store may stay open in several processes at once
+    int         (*open)(struct storage *store, const char *path, int writable);
+    void        (*close)(struct storage *store);
+    const void *(*fetch)(struct storage *store, const void *key, size_t key_len, size_t *value_len);
+    int         (*append)(struct storage *store, const void *value, size_t value_len, char *key_out, size_t key_size);
+    int         (*append_batch)(struct storage *store, storage_value_source next, void *arg, unsigned long *first, unsigned long *count);
+    int         (*each)(struct storage *store, storage_visit visit, void *arg);
+    int         (*range)(struct storage *store, unsigned long first, unsigned long last, storage_visit visit, void *arg);
+    int         (*load)(struct storage *store, storage_source next, void *arg);
+    int         (*destroy)(const char *path);
+    int         (*move)(const char *from, const char *to);
+    int         (*after_fork)(struct storage *store);    // Called in a child forked with the store open, NULL if nothing is shared
+};
+
+extern const struct storage_ops ndbm_storage_ops;
+extern const struct storage_ops log_storage_ops;
+
+int         storage_parse(const char *spec, struct storage_config *config);
+int         storage_open(struct storage *store, const struct storage_config *config, const char *path, int writable);
+void        storage_close(struct storage *store);
+int         storage_after_fork(struct storage *store);
+const void *storage_fetch(struct storage *store, const char *key, size_t *value_len);
+int         storage_append(struct storage *store, const char *value, char *key_out, size_t key_size);
+int         storage_append_batch(struct storage *store, storage_value_source next, void *arg, unsigned long *first, unsigned long *count);
+int         storage_each(struct storage *store, storage_visit visit, void *arg);
+int         storage_range(struct storage *store, unsigned long first, unsigned long last, storage_visit visit, void *arg);
+int         storage_load(struct storage *store, storage_source next, void *arg);
+int         storage_destroy(const struct storage_config *config, const char *path);
+int         storage_move(const struct storage_config *config, const char *from, const char *to);
+#endif
@@ -0,0 +1,40 @@
+#ifndef TIME_INDEX_H
+#define TIME_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIME_INDEX_SUFFIX ".time"
+#define TIME_INDEX_PATH_LEN 256
+
+/*
+    One stored value: when it was stored and under which counter key
+ */
+struct time_entry
+{
+    int64_t  time_ms;    // Milliseconds since the epoch
+    uint64_t key;
+};
+
+/*
+    Secondary index of when each value was stored. A file of fixed size time_entry
+    records, appended under flock with the clock read while the lock is held, so the
+    file is sorted by time and can be binary searched in place.
+ */
+struct time_index
+{
+    int  fd;          // -1 while the file does not exist yet
+    int  writable;
+    char path[TIME_INDEX_PATH_LEN];
+};
+
+int     time_index_open(struct time_index *index, const char *path, int writable);
+void    time_index_close(struct time_index *index);
+int     time_index_after_fork(struct time_index *index);
+int     time_index_append(struct time_index *index, uint64_t key, size_t count);
+int     time_index_write(struct time_index *index, const struct time_entry *entries, size_t count);
+size_t  time_index_count(struct time_index *index);
+size_t  time_index_read(struct time_index *index, size_t position, struct time_entry *entries, size_t count);
+size_t  time_index_lower_bound(struct time_index *index, int64_t time_ms);
+int64_t time_index_now_ms(void);
+#endif
@@ -0,0 +1,47 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS 100    // Resolution of every timer
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4    // 64 slots per level cover 6.4 s, 6.8 min, 7.3 h and 19 days
+
+/*
+    A timer embedded in whatever it times out.
+    It sits on one doubly linked slot list of the wheel, so adding and cancelling are O(1).
+ */
+struct timer
+{
+    struct timer *prev;
+    struct timer *next;
+    uint64_t      expires;    // Tick the timer fires at
+    int           kind;       // What the owner does when it fires
+    void         *data;       // The owner
+};
+
+/*
+    A hierarchical timing wheel.
+    Level 0 holds the timers due in the next 64 ticks, one slot per tick. Each higher level
+    holds 64 times the range of the one below and its slots are moved (cascaded) down a level
+    whenever the level below wraps around.
+ */
+struct timer_wheel
+{
+    struct timer slots[TIMER_LEVELS][TIMER_SLOTS];    // List heads
+    struct timer expired;                             // Timers that are due and not yet handed out
+    uint64_t     now;                                 // Current tick
+    size_t       count;                               // Pending timers, expired ones included
+};
+
+uint64_t      timer_now_ms(void);
+void          timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms);
+void          timer_init(struct timer *timer, int kind, void *data);
+void          timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t now_ms, uint64_t timeout_ms);
+void          timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+int           timer_pending(const struct timer *timer);
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now_ms);
+int           timer_wheel_timeout_ms(const struct timer_wheel *wheel, uint64_t now_ms);
+#endif
@@ -0,0 +1,17 @@
+#ifndef TLS_H
+#define TLS_H
+
+#define TLS_PORT 8443    // Where the listener accepts TLS connections when a certificate is given
+
+/*
+    TLS settings shared by every worker: the certificate, the session cache and the keys
+    session tickets are sealed with. It is made before the fork, so a ticket issued by one
+    worker is accepted by any other and by workers restarted later.
+ */
+struct tls_server;
+
+struct tls_server *tls_server_create(const char *cert, const char *key);
+void               tls_server_destroy(struct tls_server *server);
+int                tls_accept(struct tls_server *server, int fd, int timeout);
+void               tls_wait(int timeout);
+#endif
@@ -0,0 +1,42 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define URING_CHUNK_SIZE 65536    // Size of the registered buffer files are sent through
+
+/*
+    A minimal io_uring driven through the raw system calls, for serving files.
+    Each worker sets one up after it forks. The file being served is opened straight into
+    a registered (fixed) file slot and copied to the socket through a registered buffer,
+    so opening and sizing a file costs one io_uring_enter and each chunk of it another.
+    fd is -1 when io_uring is unavailable and the caller uses plain system calls instead.
+ */
+struct uring
+{
+    int       fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void     *sqes;            // struct io_uring_sqe[], left opaque so the header builds on any platform
+    void     *cqes;            // struct io_uring_cqe[]
+    void     *sq_ring;
+    size_t    sq_ring_size;
+    void     *cq_ring;         // Same mapping as sq_ring on kernels with IORING_FEAT_SINGLE_MMAP
+    size_t    cq_ring_size;
+    size_t    sqes_size;
+    char     *buffer;          // The registered buffer, URING_CHUNK_SIZE bytes
+    unsigned  queued;          // Entries written since the last io_uring_enter
+};
+
+int  uring_init(struct uring *ring);
+void uring_destroy(struct uring *ring);
+int  uring_open_file(struct uring *ring, const char *path, off_t *size);
+int  uring_read_file(struct uring *ring, char *dest, size_t size);
+int  uring_send_file(struct uring *ring, int sock, off_t size, int write_timeout);
+#endif
@@ -0,0 +1,27 @@
+#ifndef WOULD_BLOCK_H
+#define WOULD_BLOCK_H
+
+#include <errno.h>
+
+/*
+    Tells whether a call on a non-blocking socket, or one with a send or receive timeout,
+    failed only because it would have had to wait. POSIX allows EAGAIN and EWOULDBLOCK to
+    be different values; on Linux they are the same, and testing both is a tautology.
+
+    @param
+    error: errno after the call
+
+    @return
+    1 if the call would have blocked or timed out, 0 otherwise
+ */
+static inline int would_block(int error)
+{
+#if EAGAIN != EWOULDBLOCK
+    if(error == EWOULDBLOCK)
+    {
+        return 1;
+    }
+#endif
+    return error == EAGAIN;
+}
+#endif
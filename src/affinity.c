@@ -0,0 +1,341 @@
+#include "affinity.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__)
+    #include <linux/mempolicy.h>
+    #include <sched.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+#define NODE_DIR "/sys/devices/system/node"
+#define NODE_PATH_LEN 64
+#define CPU_LIST_LEN 4096
+#define BASE_TEN 10
+#define BITS_PER_MASK_WORD (8 * sizeof(unsigned long))
+#define FIRST_WORKER_CPU 2    // cpus[0] and cpus[1] belong to the listener and the monitor
+
+static int  parse_cpu_list(const char *list, int *cpus, int max);
+static void load_cpu_nodes(struct cpu_plan *plan);
+static void interleave_worker_cpus(struct cpu_plan *plan);
+static void pin_to_cpu(const struct cpu_plan *plan, int slot, const char *who);
+
+/*
+    Builds the placement plan from the -a option
+
+    @param
+    plan: Output placement plan
+    spec: "auto" to use every CPU the process may run on, or a CPU list such as "0-3,8,10-11"
+
+    @return
+    0: The plan is ready (or pinning is unsupported and the plan is disabled)
+    -1: The CPU list is invalid
+ */
+int cpu_plan_init(struct cpu_plan *plan, const char *spec)
+{
+    memset(plan, 0, sizeof(*plan));
+
+#if defined(__linux__)
+    if(strcmp(spec, "auto") == 0)
+    {
+        cpu_set_t allowed;
+
+        CPU_ZERO(&allowed);
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        {
+            perror("sched_getaffinity");
+            return -1;
+        }
+        for(int cpu = 0; cpu < CPU_SETSIZE && plan->count < CPU_PLAN_MAX; cpu++)
+        {
+            if(CPU_ISSET((size_t)cpu, &allowed))
+            {
+                plan->cpus[plan->count++] = cpu;
+            }
+        }
+    }
+    else
+    {
+        plan->count = parse_cpu_list(spec, plan->cpus, CPU_PLAN_MAX);
+    }
+
+    if(plan->count <= 0)
+    {
+        fprintf(stderr, "Invalid CPU list: %s\n", spec);
+        return -1;
+    }
+
+    load_cpu_nodes(plan);
+    interleave_worker_cpus(plan);
+    plan->enabled = 1;
+
+    printf("CPU pinning: listener on CPU %d, monitor on CPU %d, workers on %d CPU(s)\n", plan->cpus[0], plan->cpus[plan->count > 1 ? 1 : 0], plan->count > FIRST_WORKER_CPU ? plan->count - FIRST_WORKER_CPU : plan->count);
+#else
+    (void)spec;
+    fprintf(stderr, "CPU pinning is only supported on Linux, ignoring -a\n");
+#endif
+    return 0;
+}
+
+/*
+    Pins the calling process (the listener) to the first CPU of the plan
+
+    @param
+    plan: The placement plan
+ */
+void cpu_plan_pin_listener(const struct cpu_plan *plan)
+{
+    pin_to_cpu(plan, 0, "listener");
+}
+
+/*
+    Pins the calling process (the monitor) next to the listener
+
+    @param
+    plan: The placement plan
+ */
+void cpu_plan_pin_monitor(const struct cpu_plan *plan)
+{
+    pin_to_cpu(plan, plan->count > 1 ? 1 : 0, "monitor");
+}
+
+/*
+    Pins the calling process (a worker) to one of the remaining CPUs
+
+    @param
+    plan: The placement plan
+    index: Index of the worker in the pool
+ */
+void cpu_plan_pin_worker(const struct cpu_plan *plan, int index)
+{
+    int slot;
+
+    if(!plan->enabled)
+    {
+        return;
+    }
+
+    // With two CPUs or fewer the workers share them with the listener and the monitor
+    if(plan->count > FIRST_WORKER_CPU)
+    {
+        slot = FIRST_WORKER_CPU + index % (plan->count - FIRST_WORKER_CPU);
+    }
+    else
+    {
+        slot = index % plan->count;
+    }
+    pin_to_cpu(plan, slot, "worker");
+}
+
+/*
+    Parses a Linux style CPU list ("0-3,8,10-11")
+
+    @param
+    list: The CPU list
+    cpus: Output array of CPU numbers
+    max: Capacity of cpus
+
+    @return
+    Number of CPUs parsed, or -1 if the list is malformed
+ */
+static int parse_cpu_list(const char *list, int *cpus, int max)
+{
+    const char *p     = list;
+    int         count = 0;
+
+    while(*p != '\0' && *p != '\n')
+    {
+        char *end;
+        long  first;
+        long  last;
+
+        if(!isdigit((unsigned char)*p))
+        {
+            return -1;
+        }
+        first = strtol(p, &end, BASE_TEN);
+        last  = first;
+        p     = end;
+
+        if(*p == '-')
+        {
+            p++;
+            if(!isdigit((unsigned char)*p))
+            {
+                return -1;
+            }
+            last = strtol(p, &end, BASE_TEN);
+            p    = end;
+        }
+
+        if(last < first || last >= CPU_PLAN_MAX)
+        {
+            return -1;
+        }
+
+        for(long cpu = first; cpu <= last && count < max; cpu++)
+        {
+            cpus[count++] = (int)cpu;
+        }
+
+        if(*p == ',')
+        {
+            p++;
+        }
+        else if(*p != '\0' && *p != '\n')
+        {
+            return -1;
+        }
+    }
+    return count;
+}
+
+/*
+    Looks up the NUMA node of every CPU in the plan from sysfs.
+    CPUs on machines without NUMA information are all placed on node 0.
+
+    @param
+    plan: The placement plan
+ */
+static void load_cpu_nodes(struct cpu_plan *plan)
+{
+    DIR           *dir;
+    struct dirent *entry;
+
+    dir = opendir(NODE_DIR);
+    if(dir == NULL)
+    {
+        return;
+    }
+
+    while((entry = readdir(dir)) != NULL)
+    {
+        char  path[NODE_PATH_LEN + sizeof(entry->d_name)];
+        char  list[CPU_LIST_LEN];
+        int   node_cpus[CPU_PLAN_MAX];
+        int   node_count;
+        int   node;
+        FILE *file;
+
+        if(strncmp(entry->d_name, "node", strlen("node")) != 0 || !isdigit((unsigned char)entry->d_name[strlen("node")]))
+        {
+            continue;
+        }
+        node = (int)strtol(entry->d_name + strlen("node"), NULL, BASE_TEN);
+
+        snprintf(path, sizeof(path), "%s/%s/cpulist", NODE_DIR, entry->d_name);
+        file = fopen(path, "re");
+        if(file == NULL)
+        {
+            continue;
+        }
+        if(fgets(list, sizeof(list), file) == NULL)
+        {
+            fclose(file);
+            continue;
+        }
+        fclose(file);
+
+        node_count = parse_cpu_list(list, node_cpus, CPU_PLAN_MAX);
+        for(int i = 0; i < node_count; i++)
+        {
+            for(int j = 0; j < plan->count; j++)
+            {
+                if(plan->cpus[j] == node_cpus[i])
+                {
+                    plan->nodes[j] = node;
+                }
+            }
+        }
+    }
+    closedir(dir);
+}
+
+/*
+    Reorders the worker CPUs so consecutive workers land on different NUMA nodes
+
+    @param
+    plan: The placement plan
+ */
+static void interleave_worker_cpus(struct cpu_plan *plan)
+{
+    int cpus[CPU_PLAN_MAX];
+    int nodes[CPU_PLAN_MAX];
+    int taken[CPU_PLAN_MAX] = {0};
+    int placed              = 0;
+    int remaining           = plan->count - FIRST_WORKER_CPU;
+
+    if(remaining <= 1)
+    {
+        return;
+    }
+
+    // Take one CPU from each node in turn until every CPU has been placed
+    while(placed < remaining)
+    {
+        int last_node = -1;
+
+        for(int i = FIRST_WORKER_CPU; i < plan->count; i++)
+        {
+            if(taken[i] || plan->nodes[i] <= last_node)
+            {
+                continue;
+            }
+            taken[i]        = 1;
+            cpus[placed]    = plan->cpus[i];
+            nodes[placed++] = plan->nodes[i];
+            last_node       = plan->nodes[i];
+        }
+    }
+
+    memcpy(&plan->cpus[FIRST_WORKER_CPU], cpus, sizeof(int) * (size_t)remaining);
+    memcpy(&plan->nodes[FIRST_WORKER_CPU], nodes, sizeof(int) * (size_t)remaining);
+}
+
+/*
+    Pins the calling process to one CPU of the plan and prefers memory from that CPU's NUMA node,
+    so caches the process allocates afterwards (such as its request arena) stay node-local
+
+    @param
+    plan: The placement plan
+    slot: Index into plan->cpus
+    who: Name of the process, for logging
+ */
+static void pin_to_cpu(const struct cpu_plan *plan, int slot, const char *who)
+{
+#if defined(__linux__)
+    cpu_set_t     set;
+    unsigned long node_mask[(CPU_PLAN_MAX / BITS_PER_MASK_WORD) + 1] = {0};
+    int           node;
+
+    if(!plan->enabled)
+    {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET((size_t)plan->cpus[slot], &set);
+    if(sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+        fprintf(stderr, "Could not pin %s to CPU %d: %s\n", who, plan->cpus[slot], strerror(errno));
+        return;
+    }
+
+    node = plan->nodes[slot];
+    node_mask[(size_t)node / BITS_PER_MASK_WORD] |= 1UL << ((size_t)node % BITS_PER_MASK_WORD);
+    if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, node_mask, (unsigned long)CPU_PLAN_MAX) != 0 && errno != ENOSYS)
+    {
+        fprintf(stderr, "Could not prefer NUMA node %d for %s: %s\n", node, who, strerror(errno));
+    }
+
+    printf("Pinned %s %d to CPU %d (NUMA node %d)\n", who, getpid(), plan->cpus[slot], node);
+#else
+    (void)plan;
+    (void)slot;
+    (void)who;
+#endif
+}
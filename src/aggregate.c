@@ -0,0 +1,384 @@
+#include "aggregate.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TABLE_INITIAL_CAPACITY 1024
+#define TABLE_MAX_LOAD 70    // Percent of slots used before the table doubles
+#define PERCENT 100
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t            hash_value(const char *value, size_t len);
+static struct value_count *find_slot(const struct aggregate *agg, const char *value, size_t len, uint64_t hash);
+static int                 table_grow(struct aggregate *agg);
+static int                 count_value(struct aggregate *agg, const char *value, size_t len, uint64_t times);
+static void                add_size(struct aggregate *agg, uint64_t size, uint64_t times);
+static int                 compare_counts(const void *a, const void *b);
+
+/*
+    Starts an empty aggregate
+
+    @param
+    agg: The aggregate
+    top: How many of the most frequent values will be asked for, 0 to not count values
+
+    @return
+    0: Ready
+    -1: Out of memory
+ */
+int aggregate_init(struct aggregate *agg, size_t top)
+{
+    memset(agg, 0, sizeof(*agg));
+    agg->smallest = UINT64_MAX;
+    agg->top      = top;
+    if(top == 0)
+    {
+        return 0;
+    }
+    agg->values   = (struct value_count *)calloc(TABLE_INITIAL_CAPACITY, sizeof(struct value_count));
+    agg->capacity = TABLE_INITIAL_CAPACITY;
+    return agg->values != NULL ? 0 : -1;
+}
+
+/*
+    Frees the copies of the counted values
+
+    @param
+    agg: The aggregate
+ */
+void aggregate_free(struct aggregate *agg)
+{
+    for(size_t i = 0; i < agg->capacity; i++)
+    {
+        free(agg->values[i].value);
+    }
+    free(agg->values);
+    agg->values   = NULL;
+    agg->capacity = 0;
+}
+
+/*
+    Adds one value
+
+    @param
+    agg: The aggregate
+    value: The value
+    len: Its length in bytes
+
+    @return
+    0: Added
+    -1: Out of memory, only the size was counted
+ */
+int aggregate_add(struct aggregate *agg, const char *value, size_t len)
+{
+    add_size(agg, len, 1);
+    return agg->top > 0 ? count_value(agg, value, len, 1) : 0;
+}
+
+/*
+    Writes an aggregate so another process can merge it, in host byte order
+
+    @param
+    agg: The aggregate
+    file: Where to write it
+
+    @return
+    0: Written
+    -1: The file could not be written
+ */
+int aggregate_save(const struct aggregate *agg, FILE *file)
+{
+    uint64_t totals[4] = {agg->count, agg->bytes, agg->smallest, agg->largest};
+    uint64_t distinct  = agg->distinct;
+
+    if(fwrite(totals, sizeof(totals), 1, file) != 1 || fwrite(agg->histogram, sizeof(agg->histogram), 1, file) != 1 || fwrite(&distinct, sizeof(distinct), 1, file) != 1)
+    {
+        return -1;
+    }
+    for(size_t i = 0; i < agg->capacity; i++)
+    {
+        const struct value_count *slot = &agg->values[i];
+        uint64_t                  header[2];
+
+        if(slot->value == NULL)
+        {
+            continue;
+        }
+        header[0] = slot->count;
+        header[1] = slot->len;
+        if(fwrite(header, sizeof(header), 1, file) != 1 || fwrite(slot->value, 1, slot->len, file) != slot->len)
+        {
+            return -1;
+        }
+    }
+    return fflush(file) == 0 ? 0 : -1;
+}
+
+/*
+    Adds an aggregate written by aggregate_save to this one
+
+    @param
+    agg: The aggregate
+    file: Where the other one was written, read from its current position
+
+    @return
+    0: Merged
+    -1: The file is short or out of memory
+ */
+int aggregate_merge(struct aggregate *agg, FILE *file)
+{
+    uint64_t totals[4];
+    uint64_t histogram[AGGREGATE_BUCKETS];
+    uint64_t distinct;
+    char    *value      = NULL;
+    size_t   value_size = 0;
+    int      result     = 0;
+
+    if(fread(totals, sizeof(totals), 1, file) != 1 || fread(histogram, sizeof(histogram), 1, file) != 1 || fread(&distinct, sizeof(distinct), 1, file) != 1)
+    {
+        return -1;
+    }
+    agg->count    += totals[0];
+    agg->bytes    += totals[1];
+    agg->smallest  = totals[2] < agg->smallest ? totals[2] : agg->smallest;
+    agg->largest   = totals[3] > agg->largest ? totals[3] : agg->largest;
+    for(size_t b = 0; b < AGGREGATE_BUCKETS; b++)
+    {
+        agg->histogram[b] += histogram[b];
+    }
+
+    for(uint64_t i = 0; i < distinct && result == 0; i++)
+    {
+        uint64_t header[2];
+
+        if(fread(header, sizeof(header), 1, file) != 1)
+        {
+            result = -1;
+            break;
+        }
+        if(header[1] > value_size)
+        {
+            char *grown = (char *)realloc(value, header[1]);
+
+            if(grown == NULL)
+            {
+                result = -1;
+                break;
+            }
+            value      = grown;
+            value_size = header[1];
+        }
+        if(fread(value, 1, header[1], file) != header[1])
+        {
+            result = -1;
+            break;
+        }
+        result = agg->top > 0 ? count_value(agg, value, header[1], header[0]) : 0;
+    }
+    free(value);
+    return result;
+}
+
+/*
+    Lists the counted values, most frequent first and ties broken by the shorter then
+    smaller value
+
+    @param
+    agg: The aggregate
+
+    @return
+    agg->distinct entries pointing into the aggregate, to be freed by the caller, or NULL when out of memory
+ */
+struct value_count *aggregate_sorted(const struct aggregate *agg)
+{
+    struct value_count *sorted = (struct value_count *)malloc((agg->distinct + 1) * sizeof(struct value_count));
+    size_t              found  = 0;
+
+    if(sorted == NULL)
+    {
+        return NULL;
+    }
+    for(size_t i = 0; i < agg->capacity; i++)
+    {
+        if(agg->values[i].value != NULL)
+        {
+            sorted[found++] = agg->values[i];
+        }
+    }
+    qsort(sorted, found, sizeof(struct value_count), compare_counts);
+    return sorted;
+}
+
+/*
+    FNV-1a over the value
+
+    @param
+    value: The value
+    len: Its length
+
+    @return
+    The hash
+ */
+static uint64_t hash_value(const char *value, size_t len)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)value[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+    Finds the slot of a value, or the empty slot it would go in, by linear probing
+
+    @param
+    agg: The aggregate
+    value: The value
+    len: Its length
+    hash: Its hash
+
+    @return
+    The slot
+ */
+static struct value_count *find_slot(const struct aggregate *agg, const char *value, size_t len, uint64_t hash)
+{
+    size_t mask = agg->capacity - 1;
+
+    for(size_t i = (size_t)hash & mask;; i = (i + 1) & mask)
+    {
+        struct value_count *slot = &agg->values[i];
+
+        if(slot->value == NULL || (slot->hash == hash && slot->len == len && memcmp(slot->value, value, len) == 0))
+        {
+            return slot;
+        }
+    }
+}
+
+/*
+    Doubles the table and rehashes every value into it
+
+    @param
+    agg: The aggregate
+
+    @return
+    0: Grown
+    -1: Out of memory, the table is unchanged
+ */
+static int table_grow(struct aggregate *agg)
+{
+    struct value_count *old          = agg->values;
+    size_t              old_capacity = agg->capacity;
+
+    agg->values = (struct value_count *)calloc(old_capacity * 2, sizeof(struct value_count));
+    if(agg->values == NULL)
+    {
+        agg->values = old;
+        return -1;
+    }
+    agg->capacity = old_capacity * 2;
+    for(size_t i = 0; i < old_capacity; i++)
+    {
+        if(old[i].value != NULL)
+        {
+            *find_slot(agg, old[i].value, old[i].len, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/*
+    Adds to the count of a value, copying it the first time it is seen
+
+    @param
+    agg: The aggregate
+    value: The value
+    len: Its length
+    times: How many times it was seen
+
+    @return
+    0: Counted
+    -1: Out of memory
+ */
+static int count_value(struct aggregate *agg, const char *value, size_t len, uint64_t times)
+{
+    uint64_t            hash = hash_value(value, len);
+    struct value_count *slot;
+
+    if((agg->distinct + 1) * PERCENT > agg->capacity * TABLE_MAX_LOAD && table_grow(agg) != 0)
+    {
+        return -1;
+    }
+    slot = find_slot(agg, value, len, hash);
+    if(slot->value == NULL)
+    {
+        char *copy;
+
+        copy = (char *)malloc(len + 1);
+        if(copy == NULL)
+        {
+            return -1;
+        }
+        memcpy(copy, value, len);
+        copy[len]        = '\0';
+        slot->value      = copy;
+        slot->hash       = hash;
+        slot->len        = len;
+        agg->distinct++;
+    }
+    slot->count += times;
+    return 0;
+}
+
+/*
+    Adds values of one size to the totals and the histogram
+
+    @param
+    agg: The aggregate
+    size: Their size
+    times: How many
+ */
+static void add_size(struct aggregate *agg, uint64_t size, uint64_t times)
+{
+    size_t bucket = 0;
+
+    for(uint64_t rest = size; rest > 0; rest >>= 1)
+    {
+        bucket++;
+    }
+    agg->count += times;
+    agg->bytes += size * times;
+    agg->histogram[bucket] += times;
+    agg->smallest = size < agg->smallest ? size : agg->smallest;
+    agg->largest  = size > agg->largest ? size : agg->largest;
+}
+
+/*
+    qsort comparator putting the most frequent value first
+
+    @param
+    a: A value_count
+    b: Another
+
+    @return
+    Negative when a goes first
+ */
+static int compare_counts(const void *a, const void *b)
+{
+    const struct value_count *x = (const struct value_count *)a;
+    const struct value_count *y = (const struct value_count *)b;
+
+    if(x->count != y->count)
+    {
+        return x->count > y->count ? -1 : 1;
+    }
+    if(x->len != y->len)
+    {
+        return x->len < y->len ? -1 : 1;
+    }
+    return memcmp(x->value, y->value, x->len);
+}
@@ -0,0 +1,89 @@
+#include "arena.h"
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGNMENT alignof(max_align_t)
+
+/*
+    Allocates the backing memory for an arena
+
+    @param
+    arena: The arena to initialize
+    capacity: Maximum number of bytes the arena can hand out before a reset
+
+    @return
+    0: The arena is ready to use
+    -1: The backing memory could not be allocated
+ */
+int arena_init(struct arena *arena, size_t capacity)
+{
+    arena->base       = (char *)malloc(capacity);
+    arena->capacity   = 0;
+    arena->used       = 0;
+    arena->high_water = 0;
+
+    if(arena->base == NULL)
+    {
+        perror("arena (malloc)");
+        return -1;
+    }
+
+    arena->capacity = capacity;
+    return 0;
+}
+
+/*
+    Hands out a block of memory from the arena
+
+    @param
+    arena: The arena to allocate from
+    size: Number of bytes requested
+
+    @return
+    A pointer aligned for any type, or NULL if the request would exceed the arena's capacity
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size_t start = (arena->used + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    if(arena->base == NULL || start > arena->capacity || size > arena->capacity - start)
+    {
+        fprintf(stderr, "arena: request of %zu bytes exceeds the per-request limit of %zu bytes\n", size, arena->capacity);
+        return NULL;
+    }
+
+    arena->used = start + size;
+    if(arena->used > arena->high_water)
+    {
+        arena->high_water = arena->used;
+    }
+
+    return arena->base + start;
+}
+
+/*
+    Releases every allocation made from the arena at once
+
+    @param
+    arena: The arena to reset
+ */
+void arena_reset(struct arena *arena)
+{
+    arena->used = 0;
+}
+
+/*
+    Frees the backing memory of an arena
+
+    @param
+    arena: The arena to destroy
+ */
+void arena_destroy(struct arena *arena)
+{
+    free(arena->base);
+    arena->base     = NULL;
+    arena->capacity = 0;
+    arena->used     = 0;
+}
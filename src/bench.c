@@ -0,0 +1,2046 @@
+#include "../include/would_block.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+    #include <fcntl.h>
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <pthread.h>
+    #include <sys/epoll.h>
+    #include <sys/socket.h>
+    #include <sys/time.h>
+#endif
+
+#if defined(__linux__)
+
+    #define DEFAULT_HOST "127.0.0.1"
+    #define DEFAULT_PORT "8080"
+    #define DEFAULT_THREADS 2
+    #define DEFAULT_CONNECTIONS 16
+    #define DEFAULT_DURATION 10
+    #define DEFAULT_TIMEOUT_MS 2000
+    #define BASE_TEN 10
+    #define REQUEST_LEN 1024
+    #define HEADER_LEN 4096
+    #define READ_CHUNK 65536
+    #define MAX_EVENTS 256
+    #define NS_PER_SEC ((uint64_t)1000000000)
+    #define NS_PER_MS ((uint64_t)1000000)
+    #define NS_PER_US ((uint64_t)1000)
+    #define US_PER_MS 1000.0
+    #define MS_PER_SEC 1000
+    #define BYTES_PER_MIB (1024.0 * 1024.0)
+    #define PERCENT 100.0
+    #define STATUS_OK_MIN 200
+    #define STATUS_ERROR_MIN 400
+    #define RETRY_DELAY_NS (10 * NS_PER_MS)    // Pause before a connection that failed is used again
+    #define IDLE_WAIT_MS 10                    // epoll_wait timeout when nothing is scheduled sooner
+
+    // Latency histogram layout: values below HIST_SUB_COUNT are exact, larger values keep
+    // HIST_SUB_BITS significant bits, i.e. about three significant decimal digits
+    #define HIST_SUB_BITS 11
+    #define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+    #define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+    #define HIST_MAX_BITS 36    // Latencies are clamped to 2^36 microseconds
+    #define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_HALF_COUNT)
+    #define HIST_LAST_BIT 63
+
+    // The batch scenario stores sixteen records with one request
+    #define BATCH_RECORD "source=bench&payload=hello\n"
+    #define BATCH_RECORDS_4 BATCH_RECORD BATCH_RECORD BATCH_RECORD BATCH_RECORD
+    #define BATCH_BODY BATCH_RECORDS_4 BATCH_RECORDS_4 BATCH_RECORDS_4 BATCH_RECORDS_4
+
+    // The page scenario loads index.html and then what it links to, the way a browser does
+    #define PAGE_ASSETS 6    // Requests that follow index.html, a browser's connection limit per host fetches them all at once
+
+    // HTTP/2 with prior knowledge for the page scenario, RFC 9113
+    #define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+    #define H2_PREFACE_LEN (sizeof(H2_PREFACE) - 1)
+    #define H2_FRAME_HEADER 9                                   // Length, type, flags and stream of every frame
+    #define H2_FRAME_MAX 16384                                  // The SETTINGS_MAX_FRAME_SIZE we leave at its default
+    #define H2_SETTING_LEN 6
+    #define H2_SETTINGS_LEN (2 * H2_SETTING_LEN)                // ENABLE_PUSH and INITIAL_WINDOW_SIZE
+    #define H2_WINDOW_UPDATE_LEN 4
+    #define H2_PRIORITY_LEN 5
+    #define H2_WINDOW_MAX 0x7fffffffU                           // Largest flow-control window, what we open every window to
+    #define H2_DEFAULT_WINDOW 65535U                            // Connection window before any WINDOW_UPDATE
+    #define H2_LAST_STREAM (H2_WINDOW_MAX - 2 * PAGE_ASSETS)    // Reconnect rather than run out of stream identifiers
+    #define H2_DATA 0x0
+    #define H2_HEADERS 0x1
+    #define H2_RST_STREAM 0x3
+    #define H2_SETTINGS 0x4
+    #define H2_PING 0x6
+    #define H2_GOAWAY 0x7
+    #define H2_WINDOW_UPDATE 0x8
+    #define H2_FLAG_END_STREAM 0x1
+    #define H2_FLAG_ACK 0x1
+    #define H2_FLAG_END_HEADERS 0x4
+    #define H2_FLAG_PADDED 0x8
+    #define H2_FLAG_PRIORITY 0x20
+    #define H2_SETTINGS_ENABLE_PUSH 0x2
+    #define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+    #define HPACK_INDEXED 0x80                                  // Indexed header field, the index in the low 7 bits
+    #define HPACK_LITERAL_MASK 0xe0                             // Literal not added to the table when these bits are clear
+    #define HPACK_NAME_MASK 0x0f                                // Name index of such a literal
+    #define HPACK_PREFIX_7 0x7f                                 // String lengths at or above this continue in more bytes
+    #define HPACK_CONTINUE 0x80
+    #define HPACK_METHOD_GET 0x82                               // :method GET from the static table
+    #define HPACK_SCHEME_HTTP 0x86                              // :scheme http from the static table
+    #define HPACK_AUTHORITY 0x01                                // Literal without indexing, name :authority
+    #define HPACK_PATH 0x04                                     // Literal without indexing, name :path
+    #define HPACK_STATUS_INDEX 8                                // Static table entries 8 to 14 are :status 200 to 500
+    #define HPACK_STATUS_DIGITS 3
+    #define BYTE_BITS 8
+
+/*
+    A request mix the load generator can send
+ */
+struct scenario
+{
+    const char        *name;
+    const char        *method;
+    const char        *path;
+    const char        *body;      // NULL for requests without a body
+    const char *const *assets;    // PAGE_ASSETS paths requested once the response to path arrived, NULL for a single request
+};
+
+static const char *const page_assets[PAGE_ASSETS] = {"/styles.css", "/script.js", "/kittens.png", "/dancecat.gif", "/dancecat.gif", "/dancecat.gif"};
+
+static const struct scenario scenarios[] = {
+    {"text",  "GET",  "/index.html",  NULL,                         NULL       },
+    {"image", "GET",  "/kittens.png", NULL,                         NULL       },
+    {"head",  "HEAD", "/index.html",  NULL,                         NULL       },
+    {"post",  "POST", "/submit",      "source=bench&payload=hello", NULL       },
+    {"batch", "POST", "/batch",       BATCH_BODY,                   NULL       },
+    {"page",  "GET",  "/index.html",  NULL,                         page_assets},
+};
+
+/*
+    Raw command-line option values before they are validated
+ */
+struct bench_args
+{
+    const char *host;
+    const char *port;
+    const char *scenario;
+    char       *threads;
+    char       *connections;
+    char       *duration;
+    char       *rate;
+    char       *timeout;
+    int         keep_alive;
+    int         http2;
+};
+
+/*
+    Settings taken from the command line
+ */
+struct bench_config
+{
+    const char            *host;
+    const char            *port;
+    const struct scenario *scenario;
+    int                    threads;
+    int                    connections;
+    int                    duration;      // Seconds
+    int                    rate;          // Requests per second across all threads, 0 for a closed loop
+    int                    timeout_ms;    // How long one request may take before it is abandoned
+    int                    keep_alive;    // Reuse connections instead of opening one per request
+    int                    http2;         // Load pages over one HTTP/2 connection per thread instead of HTTP/1
+};
+
+/*
+    A log-linear latency histogram in microseconds, in the style of HdrHistogram
+ */
+struct histogram
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double   sum;
+    double   sum_squares;
+};
+
+/*
+    Everything one thread observed during the run
+ */
+struct bench_stats
+{
+    uint64_t         completed;
+    uint64_t         pages;    // Pages whose every request succeeded, only for the page scenario
+    uint64_t         bytes;
+    uint64_t         connects;
+    uint64_t         connect_errors;
+    uint64_t         read_errors;
+    uint64_t         write_errors;
+    uint64_t         status_errors;
+    uint64_t         timeouts;
+    struct histogram latency;
+};
+
+/*
+    Where a thread is in loading the page scenario
+ */
+enum page_step
+{
+    PAGE_NONE,
+    PAGE_INDEX,
+    PAGE_ASSETS_LOADING
+};
+
+enum connection_state
+{
+    CONN_IDLE,
+    CONN_CONNECTING,
+    CONN_WRITING,
+    CONN_READING
+};
+
+/*
+    One client connection and the request currently in flight on it
+ */
+struct connection
+{
+    int                   fd;
+    enum connection_state state;
+    const char           *request;
+    size_t                request_len;
+    size_t                written;
+    char                  header[HEADER_LEN];
+    size_t                header_len;
+    int                   headers_done;
+    int                   status;
+    int                   persistent;       // The server will keep the connection open after this response
+    long long             body_expected;    // -1 when the response has no Content-Length
+    long long             body_read;
+    uint64_t              bytes;
+    uint32_t              h2_stream;      // Next HTTP/2 stream to open
+    uint32_t              h2_consumed;    // HTTP/2 DATA received since the connection window was last opened
+    uint64_t              intended_ns;    // When the request should have been sent (open loop) or was sent (closed loop)
+    uint64_t              deadline_ns;
+    uint64_t              retry_at_ns;
+};
+
+/*
+    One load generating thread and the connections it drives
+ */
+struct bench_thread
+{
+    pthread_t                  thread;
+    const struct bench_config *config;
+    const struct addrinfo     *address;
+    const char *const         *requests;        // The scenario's request, followed by those of its page assets
+    const size_t              *request_lens;
+    int                        is_head;
+    int                        connection_count;
+    double                     rate;    // This thread's share of the target rate
+    int                        epoll_fd;
+    struct connection         *connections;
+    char                      *scratch;
+    uint64_t                   end_ns;
+    enum page_step             page_step;       // Which part of the page is loading, PAGE_NONE between pages
+    int                        page_pending;    // Requests of that part still outstanding
+    int                        page_failed;
+    uint64_t                   page_start;
+    struct bench_stats         stats;
+};
+
+static void                   *run_thread(void *arg);
+static void                    thread_loop(struct bench_thread *bt);
+static void                    dispatch_requests(struct bench_thread *bt, uint64_t now, uint64_t *next_send);
+static void                    dispatch_page(struct bench_thread *bt, uint64_t now);
+static void                    start_request(struct bench_thread *bt, struct connection *conn, uint64_t intended, uint64_t now);
+static void                    open_connection(struct bench_thread *bt, struct connection *conn);
+static void                    handle_event(struct bench_thread *bt, struct connection *conn, uint32_t events);
+static void                    write_request(struct bench_thread *bt, struct connection *conn);
+static void                    read_response(struct bench_thread *bt, struct connection *conn);
+static int                     parse_headers(struct bench_thread *bt, struct connection *conn);
+static void                    finish_request(struct bench_thread *bt, struct connection *conn, uint64_t *error_counter);
+static void                    close_connection(struct bench_thread *bt, struct connection *conn);
+static void                    expire_requests(struct bench_thread *bt, uint64_t now);
+static int                     set_interest(const struct bench_thread *bt, const struct connection *conn, uint32_t events);
+static uint64_t                now_ns(void);
+static void                    histogram_record(struct histogram *hist, uint64_t value);
+static void                    histogram_merge(struct histogram *into, const struct histogram *from);
+static uint64_t                histogram_value_at(const struct histogram *hist, double percentile);
+static size_t                  histogram_index(uint64_t value);
+static uint64_t                histogram_highest_equivalent(size_t index);
+static void                    print_report(const struct bench_config *config, const struct bench_stats *stats, double elapsed);
+static void                    print_distribution(const struct histogram *hist);
+static size_t                  build_request(const struct bench_config *config, const char *path, char *request, size_t size);
+static size_t                  hpack_string(uint8_t *out, const char *value);
+static size_t                  build_h2_request(const struct bench_config *config, const char *path, char *request, size_t size);
+static void                    h2_page_loop(struct bench_thread *bt, struct connection *conn);
+static int                     h2_connect(struct bench_thread *bt, struct connection *conn);
+static int                     h2_load(struct bench_thread *bt, struct connection *conn, int first, int count);
+static int                     h2_send(struct bench_thread *bt, const struct connection *conn, const uint8_t *data, size_t len);
+static int                     h2_receive(struct bench_thread *bt, const struct connection *conn, uint8_t *data, size_t len);
+static int                     h2_status(const uint8_t *block, size_t len);
+static void                    h2_frame_header(uint8_t *out, uint32_t len, uint8_t type, uint8_t flags, uint32_t stream);
+static void                    put_u32(uint8_t *out, uint32_t value);
+static uint32_t                get_u32(const uint8_t *in);
+static const struct scenario  *find_scenario(const char *name);
+static void                    setup_signal_handler(void);
+static void                    sigint_handler(int signum);
+_Noreturn static void          usage(const char *program_name, int exit_code, const char *message);
+static int                     parse_positive_int(const char *binary_name, const char *str);
+static void                    handle_arguments(const char *binary_name, const struct bench_args *args, struct bench_config *config);
+static void                    parse_arguments(int argc, char *argv[], struct bench_args *args);
+
+static volatile sig_atomic_t stop_flag = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+int main(int argc, char *argv[])
+{
+    struct bench_args    args = {0};
+    struct bench_config  config;
+    struct addrinfo      hints = {0};
+    struct addrinfo     *address;
+    struct bench_thread *threads;
+    struct bench_stats  *total;
+    char                 requests[PAGE_ASSETS + 1][REQUEST_LEN];
+    const char          *request_list[PAGE_ASSETS + 1];
+    size_t               request_lens[PAGE_ASSETS + 1];
+    int                  request_count;
+    uint64_t             start;
+    uint64_t             end;
+    int                  status;
+    int                  started = 0;
+
+    parse_arguments(argc, argv, &args);
+    handle_arguments(argv[0], &args, &config);
+
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    status            = getaddrinfo(config.host, config.port, &hints, &address);
+    if(status != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    request_count = config.scenario->assets != NULL ? PAGE_ASSETS + 1 : 1;
+    for(int i = 0; i < request_count; i++)
+    {
+        const char *path = i == 0 ? config.scenario->path : config.scenario->assets[i - 1];
+
+        request_list[i] = requests[i];
+        request_lens[i] = config.http2 ? build_h2_request(&config, path, requests[i], REQUEST_LEN) : build_request(&config, path, requests[i], REQUEST_LEN);
+    }
+
+    threads = (struct bench_thread *)calloc((size_t)config.threads, sizeof(*threads));
+    total   = (struct bench_stats *)calloc(1, sizeof(*total));
+    if(threads == NULL || total == NULL)
+    {
+        perror("calloc");
+        free(threads);
+        free(total);
+        freeaddrinfo(address);
+        return EXIT_FAILURE;
+    }
+
+    setup_signal_handler();
+
+    start = now_ns();
+    end   = start + (uint64_t)config.duration * NS_PER_SEC;
+    for(int i = 0; i < config.threads; i++)
+    {
+        struct bench_thread *bt = &threads[i];
+
+        bt->config           = &config;
+        bt->address          = address;
+        bt->requests         = request_list;
+        bt->request_lens     = request_lens;
+        bt->is_head          = strcmp(config.scenario->method, "HEAD") == 0;
+        bt->connection_count = config.connections / config.threads + (i < config.connections % config.threads ? 1 : 0);
+        bt->rate             = (double)config.rate / config.threads;
+        bt->end_ns           = end;
+
+        if(pthread_create(&bt->thread, NULL, run_thread, bt) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+
+    total->latency.min = UINT64_MAX;
+    for(int i = 0; i < started; i++)
+    {
+        const struct bench_stats *stats = &threads[i].stats;
+
+        pthread_join(threads[i].thread, NULL);
+        total->completed += stats->completed;
+        total->pages += stats->pages;
+        total->bytes += stats->bytes;
+        total->connects += stats->connects;
+        total->connect_errors += stats->connect_errors;
+        total->read_errors += stats->read_errors;
+        total->write_errors += stats->write_errors;
+        total->status_errors += stats->status_errors;
+        total->timeouts += stats->timeouts;
+        histogram_merge(&total->latency, &stats->latency);
+    }
+    end = now_ns();
+
+    print_report(&config, total, (double)(end - start) / (double)NS_PER_SEC);
+
+    free(threads);
+    free(total);
+    freeaddrinfo(address);
+    return started == config.threads ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+    Drives one thread's connections with epoll until the run ends
+
+    @param
+    arg: The bench_thread to run
+
+    @return
+    NULL
+ */
+static void *run_thread(void *arg)
+{
+    struct bench_thread *bt = (struct bench_thread *)arg;
+
+    bt->stats.latency.min = UINT64_MAX;
+    bt->epoll_fd          = epoll_create1(EPOLL_CLOEXEC);
+    bt->connections       = (struct connection *)calloc((size_t)bt->connection_count, sizeof(*bt->connections));
+    bt->scratch           = (char *)malloc(READ_CHUNK);
+    if(bt->epoll_fd < 0 || bt->connections == NULL || bt->scratch == NULL)
+    {
+        perror("bench thread setup");
+    }
+    else
+    {
+        for(int i = 0; i < bt->connection_count; i++)
+        {
+            bt->connections[i].fd          = -1;
+            bt->connections[i].state       = CONN_IDLE;
+            bt->connections[i].request     = bt->requests[0];
+            bt->connections[i].request_len = bt->request_lens[0];
+        }
+        if(bt->config->http2)
+        {
+            h2_page_loop(bt, &bt->connections[0]);
+        }
+        else
+        {
+            thread_loop(bt);
+        }
+
+        for(int i = 0; i < bt->connection_count; i++)
+        {
+            if(bt->connections[i].fd >= 0)
+            {
+                close(bt->connections[i].fd);
+            }
+        }
+    }
+
+    if(bt->epoll_fd >= 0)
+    {
+        close(bt->epoll_fd);
+    }
+    free(bt->connections);
+    free(bt->scratch);
+    return NULL;
+}
+
+/*
+    Sends requests and processes epoll events until the run ends or is interrupted
+
+    @param
+    bt: The thread
+ */
+static void thread_loop(struct bench_thread *bt)
+{
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t           next_send = now_ns();
+
+    while(!stop_flag)
+    {
+        uint64_t now = now_ns();
+        int      ready;
+        int      wait_ms;
+
+        if(now >= bt->end_ns)
+        {
+            break;
+        }
+
+        if(bt->config->scenario->assets != NULL)
+        {
+            dispatch_page(bt, now);
+        }
+        else
+        {
+            dispatch_requests(bt, now, &next_send);
+        }
+
+        // An open loop has to wake up for the next send, a closed loop only for retries and timeouts
+        wait_ms = IDLE_WAIT_MS;
+        if(bt->rate > 0 && next_send > now && next_send - now < (uint64_t)IDLE_WAIT_MS * NS_PER_MS)
+        {
+            wait_ms = (int)((next_send - now) / NS_PER_MS);
+        }
+
+        ready = epoll_wait(bt->epoll_fd, events, MAX_EVENTS, wait_ms);
+        if(ready < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for(int i = 0; i < ready; i++)
+        {
+            handle_event(bt, (struct connection *)events[i].data.ptr, events[i].events);
+        }
+
+        expire_requests(bt, now_ns());
+    }
+}
+
+/*
+    Starts new requests on idle connections.
+    In a closed loop every idle connection sends straight away. In an open loop requests are
+    scheduled at a fixed rate and latency is measured from the scheduled time, so a server
+    that falls behind is charged for the queueing it causes (no coordinated omission).
+
+    @param
+    bt: The thread
+    now: Current time
+    next_send: When the next open loop request is due, advanced as requests are started
+ */
+static void dispatch_requests(struct bench_thread *bt, uint64_t now, uint64_t *next_send)
+{
+    uint64_t interval;
+
+    if(bt->rate <= 0)
+    {
+        for(int i = 0; i < bt->connection_count; i++)
+        {
+            struct connection *conn = &bt->connections[i];
+
+            if(conn->state == CONN_IDLE && conn->retry_at_ns <= now)
+            {
+                start_request(bt, conn, now, now);
+            }
+        }
+        return;
+    }
+
+    interval = (uint64_t)((double)NS_PER_SEC / bt->rate);
+    for(int i = 0; i < bt->connection_count && *next_send <= now; i++)
+    {
+        struct connection *conn = &bt->connections[i];
+
+        if(conn->state == CONN_IDLE && conn->retry_at_ns <= now)
+        {
+            start_request(bt, conn, *next_send, now);
+            *next_send += interval;
+        }
+    }
+}
+
+/*
+    Moves the page scenario along once every request of the part loading finished: index.html
+    goes first on the first connection, then each asset on a connection of its own, as a browser
+    that found them in the page does. A page counts when all of its requests succeeded.
+
+    @param
+    bt: The thread
+    now: Current time
+ */
+static void dispatch_page(struct bench_thread *bt, uint64_t now)
+{
+    if(bt->page_pending > 0)
+    {
+        return;
+    }
+
+    if(bt->page_step == PAGE_INDEX && !bt->page_failed)
+    {
+        bt->page_step    = PAGE_ASSETS_LOADING;
+        bt->page_pending = PAGE_ASSETS;
+        for(int i = 0; i < PAGE_ASSETS; i++)
+        {
+            struct connection *conn = &bt->connections[i];
+
+            conn->request     = bt->requests[i + 1];
+            conn->request_len = bt->request_lens[i + 1];
+            start_request(bt, conn, bt->page_start, now);
+        }
+        return;
+    }
+
+    if(bt->page_step == PAGE_ASSETS_LOADING && !bt->page_failed)
+    {
+        bt->stats.pages++;
+        histogram_record(&bt->stats.latency, (now_ns() - bt->page_start) / NS_PER_US);
+    }
+    bt->page_step = PAGE_NONE;
+
+    if(bt->connections[0].retry_at_ns <= now)
+    {
+        struct connection *conn = &bt->connections[0];
+
+        bt->page_step     = PAGE_INDEX;
+        bt->page_pending  = 1;
+        bt->page_failed   = 0;
+        bt->page_start    = now;
+        conn->request     = bt->requests[0];
+        conn->request_len = bt->request_lens[0];
+        start_request(bt, conn, now, now);
+    }
+}
+
+/*
+    Sends the scenario's request on a connection, opening one first if needed
+
+    @param
+    bt: The thread
+    conn: An idle connection
+    intended: The time latency is measured from
+    now: Current time
+ */
+static void start_request(struct bench_thread *bt, struct connection *conn, uint64_t intended, uint64_t now)
+{
+    conn->intended_ns   = intended;
+    conn->deadline_ns   = now + (uint64_t)bt->config->timeout_ms * NS_PER_MS;
+    conn->written       = 0;
+    conn->header_len    = 0;
+    conn->headers_done  = 0;
+    conn->status        = 0;
+    conn->persistent    = 0;
+    conn->body_expected = -1;
+    conn->body_read     = 0;
+    conn->bytes         = 0;
+
+    if(conn->fd < 0)
+    {
+        open_connection(bt, conn);
+        return;
+    }
+
+    conn->state = CONN_WRITING;
+    write_request(bt, conn);
+}
+
+/*
+    Starts a non-blocking connect, the request is written once the socket becomes writable
+
+    @param
+    bt: The thread
+    conn: The connection to open
+ */
+static void open_connection(struct bench_thread *bt, struct connection *conn)
+{
+    struct epoll_event event = {0};
+    int                one   = 1;
+
+    conn->fd = socket(bt->address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(conn->fd < 0)
+    {
+        perror("socket");
+        finish_request(bt, conn, &bt->stats.connect_errors);
+        return;
+    }
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    bt->stats.connects++;
+
+    if(connect(conn->fd, bt->address->ai_addr, bt->address->ai_addrlen) != 0 && errno != EINPROGRESS)
+    {
+        finish_request(bt, conn, &bt->stats.connect_errors);
+        return;
+    }
+
+    conn->state      = CONN_CONNECTING;
+    event.events     = EPOLLOUT;
+    event.data.ptr   = conn;
+    if(epoll_ctl(bt->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) != 0)
+    {
+        perror("epoll_ctl");
+        finish_request(bt, conn, &bt->stats.connect_errors);
+    }
+}
+
+/*
+    Advances a connection's state machine after epoll reported it ready
+
+    @param
+    bt: The thread
+    conn: The ready connection
+    events: The epoll events
+ */
+static void handle_event(struct bench_thread *bt, struct connection *conn, uint32_t events)
+{
+    if(conn->state == CONN_CONNECTING)
+    {
+        int       error = 0;
+        socklen_t len   = sizeof(error);
+
+        if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0)
+        {
+            finish_request(bt, conn, &bt->stats.connect_errors);
+            return;
+        }
+        conn->state = CONN_WRITING;
+    }
+
+    if(conn->state == CONN_WRITING && (events & EPOLLOUT))
+    {
+        write_request(bt, conn);
+        return;
+    }
+
+    if(conn->state == CONN_READING && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    {
+        read_response(bt, conn);
+        return;
+    }
+
+    // A kept-alive connection that becomes readable while idle was closed by the server
+    if(conn->state == CONN_IDLE)
+    {
+        close_connection(bt, conn);
+    }
+}
+
+/*
+    Writes as much of the request as the socket accepts
+
+    @param
+    bt: The thread
+    conn: A connection in the writing state
+ */
+static void write_request(struct bench_thread *bt, struct connection *conn)
+{
+    while(conn->written < conn->request_len)
+    {
+        ssize_t sent = send(conn->fd, conn->request + conn->written, conn->request_len - conn->written, MSG_NOSIGNAL);
+
+        if(sent < 0)
+        {
+            if(would_block(errno))
+            {
+                if(set_interest(bt, conn, EPOLLOUT) != 0)
+                {
+                    finish_request(bt, conn, &bt->stats.write_errors);
+                }
+                return;
+            }
+            finish_request(bt, conn, &bt->stats.write_errors);
+            return;
+        }
+        conn->written += (size_t)sent;
+    }
+
+    conn->state = CONN_READING;
+    if(set_interest(bt, conn, EPOLLIN) != 0)
+    {
+        finish_request(bt, conn, &bt->stats.read_errors);
+    }
+}
+
+/*
+    Reads the response until it is complete, the socket would block or the server closes it
+
+    @param
+    bt: The thread
+    conn: A connection in the reading state
+ */
+static void read_response(struct bench_thread *bt, struct connection *conn)
+{
+    for(;;)
+    {
+        ssize_t received;
+
+        if(conn->headers_done)
+        {
+            received = recv(conn->fd, bt->scratch, READ_CHUNK, 0);
+        }
+        else
+        {
+            received = recv(conn->fd, conn->header + conn->header_len, HEADER_LEN - 1 - conn->header_len, 0);
+        }
+
+        if(received < 0)
+        {
+            if(!would_block(errno))
+            {
+                finish_request(bt, conn, &bt->stats.read_errors);
+            }
+            return;
+        }
+
+        if(received == 0)
+        {
+            // Without a Content-Length the response ends when the server closes the connection
+            if(conn->headers_done && conn->body_expected < 0)
+            {
+                close_connection(bt, conn);
+                finish_request(bt, conn, NULL);
+            }
+            else
+            {
+                finish_request(bt, conn, &bt->stats.read_errors);
+            }
+            return;
+        }
+
+        conn->bytes += (uint64_t)received;
+        if(conn->headers_done)
+        {
+            conn->body_read += received;
+        }
+        else
+        {
+            conn->header_len += (size_t)received;
+            if(parse_headers(bt, conn) != 0)
+            {
+                finish_request(bt, conn, &bt->stats.read_errors);
+                return;
+            }
+        }
+
+        if(conn->headers_done && conn->body_expected >= 0 && conn->body_read >= conn->body_expected)
+        {
+            finish_request(bt, conn, NULL);
+            return;
+        }
+    }
+}
+
+/*
+    Looks for the end of the response headers and extracts the status and Content-Length
+
+    @param
+    bt: The thread
+    conn: The connection whose header buffer has new data
+
+    @return
+    0: The headers are complete or more data is needed
+    -1: The response is malformed or its headers do not fit in the buffer
+ */
+static int parse_headers(struct bench_thread *bt, struct connection *conn)
+{
+    char       *start = conn->header;
+    const char *end;
+    const char *line;
+
+    conn->header[conn->header_len] = '\0';
+
+    // The server ends some bodies with an extra CRLF that leaks into the next response on a kept-alive connection
+    while(*start == '\r' || *start == '\n')
+    {
+        start++;
+    }
+
+    end = strstr(start, "\r\n\r\n");
+    if(end == NULL)
+    {
+        return conn->header_len >= HEADER_LEN - 1 ? -1 : 0;
+    }
+
+    if(strncmp(start, "HTTP/", strlen("HTTP/")) != 0 || strchr(start, ' ') == NULL)
+    {
+        return -1;
+    }
+    conn->status = (int)strtol(strchr(start, ' ') + 1, NULL, BASE_TEN);
+
+    // HTTP/1.1 connections persist unless the server says otherwise, HTTP/1.0 ones only when it asks
+    conn->persistent = strncmp(start, "HTTP/1.0", strlen("HTTP/1.0")) != 0;
+    for(line = strstr(start, "\r\n"); line != NULL && line < end; line = strstr(line + 2, "\r\n"))
+    {
+        const char *field = line + 2;
+
+        if(strncasecmp(field, "Content-Length:", strlen("Content-Length:")) == 0)
+        {
+            conn->body_expected = strtoll(field + strlen("Content-Length:"), NULL, BASE_TEN);
+        }
+        else if(strncasecmp(field, "Connection:", strlen("Connection:")) == 0)
+        {
+            field += strlen("Connection:");
+            field += strspn(field, " \t");
+            if(strncasecmp(field, "close", strlen("close")) == 0)
+            {
+                conn->persistent = 0;
+            }
+            else if(strncasecmp(field, "keep-alive", strlen("keep-alive")) == 0)
+            {
+                conn->persistent = 1;
+            }
+        }
+    }
+
+    // A HEAD response advertises the length of a body it does not send
+    if(bt->is_head)
+    {
+        conn->body_expected = 0;
+    }
+
+    conn->headers_done = 1;
+    conn->body_read    = (long long)(conn->header + conn->header_len - (end + strlen("\r\n\r\n")));
+    return 0;
+}
+
+/*
+    Ends the current request on a connection, recording its latency or counting the error.
+    The connection is closed unless keep-alive is on, the request succeeded and the server agreed to keep it open.
+    For the page scenario the latency is the whole page's, recorded by dispatch_page.
+
+    @param
+    bt: The thread
+    conn: The connection
+    error_counter: The counter to increment, or NULL if the response was received
+ */
+static void finish_request(struct bench_thread *bt, struct connection *conn, uint64_t *error_counter)
+{
+    uint64_t now = now_ns();
+
+    if(bt->config->scenario->assets != NULL)
+    {
+        bt->page_pending--;
+        bt->page_failed |= error_counter != NULL || conn->status < STATUS_OK_MIN || conn->status >= STATUS_ERROR_MIN;
+    }
+
+    if(error_counter != NULL)
+    {
+        (*error_counter)++;
+        close_connection(bt, conn);
+        conn->retry_at_ns = now + RETRY_DELAY_NS;
+        conn->state       = CONN_IDLE;
+        return;
+    }
+
+    bt->stats.completed++;
+    bt->stats.bytes += conn->bytes;
+    if(conn->status < STATUS_OK_MIN || conn->status >= STATUS_ERROR_MIN)
+    {
+        bt->stats.status_errors++;
+    }
+    if(bt->config->scenario->assets == NULL)
+    {
+        histogram_record(&bt->stats.latency, (now - conn->intended_ns) / NS_PER_US);
+    }
+
+    if(!bt->config->keep_alive || !conn->persistent)
+    {
+        close_connection(bt, conn);
+    }
+    else if(conn->fd >= 0 && set_interest(bt, conn, EPOLLIN) != 0)
+    {
+        close_connection(bt, conn);
+    }
+    conn->retry_at_ns = 0;
+    conn->state       = CONN_IDLE;
+}
+
+/*
+    Closes a connection's socket, the next request on it reconnects
+
+    @param
+    bt: The thread
+    conn: The connection
+ */
+static void close_connection(struct bench_thread *bt, struct connection *conn)
+{
+    (void)bt;
+
+    if(conn->fd >= 0)
+    {
+        close(conn->fd);    // Also removes it from the epoll set
+        conn->fd = -1;
+    }
+    conn->state = CONN_IDLE;
+}
+
+/*
+    Abandons requests that have been outstanding for longer than the timeout
+
+    @param
+    bt: The thread
+    now: Current time
+ */
+static void expire_requests(struct bench_thread *bt, uint64_t now)
+{
+    for(int i = 0; i < bt->connection_count; i++)
+    {
+        struct connection *conn = &bt->connections[i];
+
+        if(conn->state != CONN_IDLE && now > conn->deadline_ns)
+        {
+            finish_request(bt, conn, &bt->stats.timeouts);
+        }
+    }
+}
+
+/*
+    Changes the events epoll reports for a connection
+
+    @param
+    bt: The thread
+    conn: The connection
+    events: EPOLLIN or EPOLLOUT
+
+    @return
+    0 on success, -1 on failure
+ */
+static int set_interest(const struct bench_thread *bt, const struct connection *conn, uint32_t events)
+{
+    struct epoll_event event = {0};
+
+    event.events   = events;
+    event.data.ptr = (void *)(uintptr_t)conn;
+    return epoll_ctl(bt->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/*
+    Reads the monotonic clock
+
+    @return
+    Nanoseconds since an arbitrary point
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/*
+    Adds one latency sample to a histogram
+
+    @param
+    hist: The histogram
+    value: Latency in microseconds
+ */
+static void histogram_record(struct histogram *hist, uint64_t value)
+{
+    hist->counts[histogram_index(value)]++;
+    hist->total++;
+    hist->sum += (double)value;
+    hist->sum_squares += (double)value * (double)value;
+    if(value < hist->min)
+    {
+        hist->min = value;
+    }
+    if(value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+/*
+    Adds every sample of one histogram to another
+
+    @param
+    into: The histogram to add to
+    from: The histogram to add
+ */
+static void histogram_merge(struct histogram *into, const struct histogram *from)
+{
+    for(size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    into->sum_squares += from->sum_squares;
+    if(from->total > 0 && from->min < into->min)
+    {
+        into->min = from->min;
+    }
+    if(from->max > into->max)
+    {
+        into->max = from->max;
+    }
+}
+
+/*
+    Finds the smallest recorded value that at least the given share of samples do not exceed
+
+    @param
+    hist: The histogram
+    percentile: Between 0 and 100
+
+    @return
+    The value, accurate to the histogram's resolution
+ */
+static uint64_t histogram_value_at(const struct histogram *hist, double percentile)
+{
+    double   rank   = ceil(percentile / PERCENT * (double)hist->total);
+    uint64_t target = (uint64_t)rank;
+    uint64_t seen   = 0;
+
+    if(target == 0)
+    {
+        target = 1;
+    }
+
+    for(size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if(seen >= target)
+        {
+            uint64_t value = histogram_highest_equivalent(i);
+
+            return value > hist->max ? hist->max : value;
+        }
+    }
+    return hist->max;
+}
+
+/*
+    Maps a value to its histogram bucket
+
+    @param
+    value: Latency in microseconds
+
+    @return
+    The bucket index
+ */
+static size_t histogram_index(uint64_t value)
+{
+    int shift;
+
+    if(value >= (1ULL << HIST_MAX_BITS))
+    {
+        value = (1ULL << HIST_MAX_BITS) - 1;
+    }
+    if(value < HIST_SUB_COUNT)
+    {
+        return (size_t)value;
+    }
+
+    // Keep the top HIST_SUB_BITS bits of the value, the bucket counts how many were dropped
+    shift = HIST_LAST_BIT - __builtin_clzll(value) - HIST_SUB_BITS + 1;
+    return (size_t)shift * HIST_HALF_COUNT + (size_t)(value >> shift);
+}
+
+/*
+    Returns the largest value that maps to a bucket
+
+    @param
+    index: The bucket index
+
+    @return
+    The value in microseconds
+ */
+static uint64_t histogram_highest_equivalent(size_t index)
+{
+    size_t shift;
+    size_t sub;
+
+    if(index < HIST_SUB_COUNT)
+    {
+        return index;
+    }
+
+    shift = index / HIST_HALF_COUNT - 1;
+    sub   = index - shift * HIST_HALF_COUNT;
+    return ((uint64_t)(sub + 1) << shift) - 1;
+}
+
+/*
+    Prints the summary of a run
+
+    @param
+    config: The run's settings
+    stats: Totals from every thread
+    elapsed: Length of the run in seconds
+ */
+static void print_report(const struct bench_config *config, const struct bench_stats *stats, double elapsed)
+{
+    const struct histogram *hist     = &stats->latency;
+    const double            marks[]  = {50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 100.0};
+    double                  mean     = 0.0;
+    double                  variance = 0.0;
+
+    if(config->scenario->assets != NULL)
+    {
+        printf("Scenario:    %s (%s %s and %d assets, %s)\n", config->scenario->name, config->scenario->method, config->scenario->path, PAGE_ASSETS, config->http2 ? "HTTP/2" : config->keep_alive ? "HTTP/1, keep-alive" : "HTTP/1, close");
+    }
+    else
+    {
+        printf("Scenario:    %s (%s %s, %s)\n", config->scenario->name, config->scenario->method, config->scenario->path, config->keep_alive ? "keep-alive" : "close");
+    }
+    if(config->rate > 0)
+    {
+        printf("Mode:        open loop at %d req/s, %d threads, %d connections, %d s\n", config->rate, config->threads, config->connections, config->duration);
+    }
+    else
+    {
+        printf("Mode:        closed loop, %d threads, %d connections, %d s\n", config->threads, config->connections, config->duration);
+    }
+    printf("Requests:    %" PRIu64 " in %.2f s\n", stats->completed, elapsed);
+    if(config->scenario->assets != NULL)
+    {
+        printf("Pages:       %" PRIu64 ", %.2f pages/s, latency below is per page\n", stats->pages, (double)stats->pages / elapsed);
+    }
+    printf("Throughput:  %.2f req/s, %.2f MiB/s\n", (double)stats->completed / elapsed, (double)stats->bytes / BYTES_PER_MIB / elapsed);
+    printf("Connections: %" PRIu64 " opened\n", stats->connects);
+    printf("Errors:      connect %" PRIu64 ", read %" PRIu64 ", write %" PRIu64 ", status %" PRIu64 ", timeout %" PRIu64 "\n", stats->connect_errors, stats->read_errors, stats->write_errors, stats->status_errors, stats->timeouts);
+
+    if(hist->total == 0)
+    {
+        printf("Latency:     no responses\n");
+        return;
+    }
+
+    mean     = hist->sum / (double)hist->total;
+    variance = hist->sum_squares / (double)hist->total - mean * mean;
+    printf("Latency:     min %.3f ms, mean %.3f ms, stdev %.3f ms, max %.3f ms\n", (double)hist->min / US_PER_MS, mean / US_PER_MS, sqrt(variance > 0 ? variance : 0) / US_PER_MS, (double)hist->max / US_PER_MS);
+    for(size_t i = 0; i < sizeof(marks) / sizeof(marks[0]); i++)
+    {
+        uint64_t value = histogram_value_at(hist, marks[i]);
+
+        printf("  %7.3f%%  %10.3f ms\n", marks[i], (double)value / US_PER_MS);
+    }
+
+    print_distribution(hist);
+}
+
+/*
+    Prints the full percentile spectrum in HdrHistogram's text format,
+    with the percentiles getting closer together as they approach 100
+
+    @param
+    hist: The histogram
+ */
+static void print_distribution(const struct histogram *hist)
+{
+    double remaining = 1.0;
+
+    printf("\n%12s %14s %12s %18s\n\n", "Value(ms)", "Percentile", "TotalCount", "1/(1-Percentile)");
+    while(1.0 / remaining <= (double)hist->total)
+    {
+        double   percentile = PERCENT * (1.0 - remaining);
+        uint64_t value      = histogram_value_at(hist, percentile);
+        uint64_t count      = 0;
+
+        for(size_t i = 0; i < HIST_BUCKETS && histogram_highest_equivalent(i) <= value; i++)
+        {
+            count += hist->counts[i];
+        }
+        printf("%12.3f %14.12f %12" PRIu64 " %18.2f\n", (double)value / US_PER_MS, 1.0 - remaining, count, 1.0 / remaining);
+        remaining /= 2;
+    }
+    printf("%12.3f %14.12f %12" PRIu64 " %18s\n", (double)hist->max / US_PER_MS, 1.0, hist->total, "inf");
+    printf("#[Mean = %.3f, StdDeviation = %.3f]\n", hist->sum / (double)hist->total / US_PER_MS, sqrt(fmax(hist->sum_squares / (double)hist->total - pow(hist->sum / (double)hist->total, 2), 0)) / US_PER_MS);
+    printf("#[Max = %.3f, Total count = %" PRIu64 "]\n", (double)hist->max / US_PER_MS, hist->total);
+}
+
+/*
+    Formats a request of the scenario once, every connection sends the same bytes
+
+    @param
+    config: The run's settings
+    path: The path to request
+    request: Output buffer
+    size: Size of the output buffer
+
+    @return
+    Length of the request
+ */
+static size_t build_request(const struct bench_config *config, const char *path, char *request, size_t size)
+{
+    const struct scenario *scenario = config->scenario;
+    const char            *connection = config->keep_alive ? "keep-alive" : "close";
+    int                    len;
+
+    if(scenario->body != NULL)
+    {
+        len = snprintf(request, size, "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: %zu\r\n\r\n%s", scenario->method, path, config->host, connection, strlen(scenario->body), scenario->body);
+    }
+    else
+    {
+        len = snprintf(request, size, "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", scenario->method, path, config->host, connection);
+    }
+
+    if(len < 0 || (size_t)len >= size)
+    {
+        return size - 1;
+    }
+    return (size_t)len;
+}
+
+/*
+    Appends an HPACK string literal without Huffman coding
+
+    @param
+    out: Where to write
+    value: The string
+
+    @return
+    Bytes written
+ */
+static size_t hpack_string(uint8_t *out, const char *value)
+{
+    size_t len     = strlen(value);
+    size_t written = 0;
+
+    if(len < HPACK_PREFIX_7)
+    {
+        out[written++] = (uint8_t)len;
+    }
+    else
+    {
+        size_t rest = len - HPACK_PREFIX_7;
+
+        out[written++] = HPACK_PREFIX_7;
+        while(rest >= HPACK_CONTINUE)
+        {
+            out[written++] = (uint8_t)(rest % HPACK_CONTINUE + HPACK_CONTINUE);
+            rest /= HPACK_CONTINUE;
+        }
+        out[written++] = (uint8_t)rest;
+    }
+    memcpy(out + written, value, len);
+    return written + len;
+}
+
+/*
+    Formats a GET of the page scenario as an HTTP/2 HEADERS frame that ends its stream. The
+    stream identifier is left zero for h2_load to fill in, the fields are literals that are
+    never added to the server's table, so every request is the same bytes whenever it is sent.
+
+    @param
+    config: The run's settings
+    path: The path to request
+    request: Output buffer, REQUEST_LEN is plenty for a path and a host name
+    size: Size of the output buffer
+
+    @return
+    Length of the frame
+ */
+static size_t build_h2_request(const struct bench_config *config, const char *path, char *request, size_t size)
+{
+    uint8_t *frame = (uint8_t *)request;
+    size_t   len   = H2_FRAME_HEADER;
+
+    (void)size;
+    frame[len++] = HPACK_METHOD_GET;
+    frame[len++] = HPACK_SCHEME_HTTP;
+    frame[len++] = HPACK_PATH;
+    len += hpack_string(frame + len, path);
+    frame[len++] = HPACK_AUTHORITY;
+    len += hpack_string(frame + len, config->host);
+
+    h2_frame_header(frame, (uint32_t)(len - H2_FRAME_HEADER), H2_HEADERS, H2_FLAG_END_STREAM | H2_FLAG_END_HEADERS, 0);
+    return len;
+}
+
+/*
+    Loads the page scenario over HTTP/2 with prior knowledge until the run ends: index.html on
+    one stream, then every asset on a stream of its own, all on the thread's one connection.
+    The socket blocks with the request timeout, one client per thread needs nothing more.
+
+    @param
+    bt: The thread
+    conn: The thread's connection
+ */
+static void h2_page_loop(struct bench_thread *bt, struct connection *conn)
+{
+    while(!stop_flag && now_ns() < bt->end_ns)
+    {
+        uint64_t start;
+
+        if(conn->fd >= 0 && conn->h2_stream > H2_LAST_STREAM)
+        {
+            close_connection(bt, conn);
+        }
+        if(conn->fd < 0 && h2_connect(bt, conn) != 0)
+        {
+            const struct timespec delay = {0, (long)RETRY_DELAY_NS};
+
+            close_connection(bt, conn);
+            nanosleep(&delay, NULL);
+            continue;
+        }
+
+        start           = now_ns();
+        bt->page_failed = 0;
+        if(h2_load(bt, conn, 0, 1) != 0 || (!bt->page_failed && h2_load(bt, conn, 1, PAGE_ASSETS) != 0))
+        {
+            close_connection(bt, conn);
+            continue;
+        }
+        if(!bt->page_failed)
+        {
+            bt->stats.pages++;
+            histogram_record(&bt->stats.latency, (now_ns() - start) / NS_PER_US);
+        }
+    }
+}
+
+/*
+    Opens the thread's HTTP/2 connection and sends the preface with our settings: no server
+    push, and every flow-control window opened all the way, so the server is never held up
+    waiting for a WINDOW_UPDATE from us
+
+    @param
+    bt: The thread
+    conn: The thread's connection, closed
+
+    @return
+    0 on success, -1 on failure
+ */
+static int h2_connect(struct bench_thread *bt, struct connection *conn)
+{
+    uint8_t        hello[H2_PREFACE_LEN + H2_FRAME_HEADER + H2_SETTINGS_LEN + H2_FRAME_HEADER + H2_WINDOW_UPDATE_LEN];
+    uint8_t       *settings = hello + H2_PREFACE_LEN;
+    uint8_t       *update   = settings + H2_FRAME_HEADER + H2_SETTINGS_LEN;
+    struct timeval timeout;
+    int            one = 1;
+
+    conn->fd = socket(bt->address->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(conn->fd < 0)
+    {
+        perror("socket");
+        bt->stats.connect_errors++;
+        return -1;
+    }
+    timeout.tv_sec  = bt->config->timeout_ms / MS_PER_SEC;
+    timeout.tv_usec = bt->config->timeout_ms % MS_PER_SEC * (int)US_PER_MS;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    bt->stats.connects++;
+
+    if(connect(conn->fd, bt->address->ai_addr, bt->address->ai_addrlen) != 0)
+    {
+        bt->stats.connect_errors++;
+        return -1;
+    }
+
+    memcpy(hello, H2_PREFACE, H2_PREFACE_LEN);
+    h2_frame_header(settings, H2_SETTINGS_LEN, H2_SETTINGS, 0, 0);
+    settings[H2_FRAME_HEADER]     = 0;
+    settings[H2_FRAME_HEADER + 1] = H2_SETTINGS_ENABLE_PUSH;
+    put_u32(settings + H2_FRAME_HEADER + 2, 0);
+    settings[H2_FRAME_HEADER + H2_SETTING_LEN]     = 0;
+    settings[H2_FRAME_HEADER + H2_SETTING_LEN + 1] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    put_u32(settings + H2_FRAME_HEADER + H2_SETTING_LEN + 2, H2_WINDOW_MAX);
+    h2_frame_header(update, H2_WINDOW_UPDATE_LEN, H2_WINDOW_UPDATE, 0, 0);
+    put_u32(update + H2_FRAME_HEADER, H2_WINDOW_MAX - H2_DEFAULT_WINDOW);
+
+    conn->h2_stream   = 1;
+    conn->h2_consumed = 0;
+    return h2_send(bt, conn, hello, sizeof(hello));
+}
+
+/*
+    Requests some of the scenario's paths at once, each on a new stream, and reads frames until
+    every one of them ended. A response that is not a success fails the page, the connection
+    carries on.
+
+    @param
+    bt: The thread
+    conn: The thread's connection
+    first: Index of the first request in bt->requests
+    count: How many requests to send, at most PAGE_ASSETS
+
+    @return
+    0 when every stream ended, -1 when the connection failed and has to be closed
+ */
+static int h2_load(struct bench_thread *bt, struct connection *conn, int first, int count)
+{
+    uint8_t  out[PAGE_ASSETS * REQUEST_LEN];
+    uint8_t  header[H2_FRAME_HEADER];
+    uint8_t *payload = (uint8_t *)bt->scratch;
+    int      status[PAGE_ASSETS];
+    uint32_t base    = conn->h2_stream;
+    size_t   out_len = 0;
+    int      open    = count;
+
+    for(int i = 0; i < count; i++)
+    {
+        memcpy(out + out_len, bt->requests[first + i], bt->request_lens[first + i]);
+        put_u32(out + out_len + H2_FRAME_HEADER - sizeof(uint32_t), conn->h2_stream);
+        out_len += bt->request_lens[first + i];
+        conn->h2_stream += 2;
+        status[i] = 0;
+    }
+    if(h2_send(bt, conn, out, out_len) != 0)
+    {
+        return -1;
+    }
+
+    while(open > 0)
+    {
+        uint32_t len;
+        uint32_t stream;
+        int      index;
+
+        if(h2_receive(bt, conn, header, sizeof(header)) != 0)
+        {
+            return -1;
+        }
+        len    = get_u32(header) >> BYTE_BITS;
+        stream = get_u32(header + H2_FRAME_HEADER - sizeof(uint32_t)) & H2_WINDOW_MAX;
+        if(len > H2_FRAME_MAX)
+        {
+            bt->stats.read_errors++;
+            return -1;
+        }
+        if(h2_receive(bt, conn, payload, len) != 0)
+        {
+            return -1;
+        }
+
+        // Frames of streams this call did not open, a late RST_STREAM say, carry nothing we wait for
+        index = stream >= base && (stream - base) / 2 < (uint32_t)count ? (int)((stream - base) / 2) : -1;
+        switch(header[3])
+        {
+            case H2_DATA:
+            {
+                conn->h2_consumed += len;
+                if(conn->h2_consumed >= H2_WINDOW_MAX / 2)
+                {
+                    uint8_t update[H2_FRAME_HEADER + H2_WINDOW_UPDATE_LEN];
+
+                    h2_frame_header(update, H2_WINDOW_UPDATE_LEN, H2_WINDOW_UPDATE, 0, 0);
+                    put_u32(update + H2_FRAME_HEADER, conn->h2_consumed);
+                    conn->h2_consumed = 0;
+                    if(h2_send(bt, conn, update, sizeof(update)) != 0)
+                    {
+                        return -1;
+                    }
+                }
+                break;
+            }
+            case H2_HEADERS:
+            {
+                uint32_t skip = 0;
+                uint32_t pad  = 0;
+
+                if(header[4] & H2_FLAG_PADDED)
+                {
+                    pad  = len > 0 ? payload[0] : 0;
+                    skip = 1;
+                }
+                if(header[4] & H2_FLAG_PRIORITY)
+                {
+                    skip += H2_PRIORITY_LEN;
+                }
+                if(index >= 0 && skip + pad <= len)
+                {
+                    status[index] = h2_status(payload + skip, len - skip - pad);
+                }
+                break;
+            }
+            case H2_RST_STREAM:
+            {
+                if(index >= 0 && status[index] >= 0)
+                {
+                    bt->stats.read_errors++;
+                    bt->page_failed = 1;
+                    status[index]   = -1;
+                    open--;
+                }
+                continue;
+            }
+            case H2_SETTINGS:
+            case H2_PING:
+            {
+                uint32_t echo = header[3] == H2_PING ? len : 0;
+
+                if(!(header[4] & H2_FLAG_ACK))
+                {
+                    h2_frame_header(header, echo, header[3], H2_FLAG_ACK, 0);
+                    if(h2_send(bt, conn, header, sizeof(header)) != 0 || h2_send(bt, conn, payload, echo) != 0)
+                    {
+                        return -1;
+                    }
+                }
+                continue;
+            }
+            case H2_GOAWAY:
+            {
+                bt->stats.read_errors++;
+                return -1;
+            }
+            default:
+            {
+                continue;
+            }
+        }
+
+        if(index >= 0 && status[index] >= 0 && (header[4] & H2_FLAG_END_STREAM))
+        {
+            bt->stats.completed++;
+            if(status[index] < STATUS_OK_MIN || status[index] >= STATUS_ERROR_MIN)
+            {
+                bt->stats.status_errors++;
+                bt->page_failed = 1;
+            }
+            status[index] = -1;
+            open--;
+        }
+    }
+    return 0;
+}
+
+/*
+    Writes all of a buffer to the thread's HTTP/2 connection
+
+    @param
+    bt: The thread
+    conn: The thread's connection
+    data: What to send
+    len: Its length
+
+    @return
+    0 on success, -1 on failure
+ */
+static int h2_send(struct bench_thread *bt, const struct connection *conn, const uint8_t *data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t sent = send(conn->fd, data, len, MSG_NOSIGNAL);
+
+        if(sent < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(would_block(errno))
+            {
+                bt->stats.timeouts++;
+            }
+            else
+            {
+                bt->stats.write_errors++;
+            }
+            return -1;
+        }
+        data += sent;
+        len -= (size_t)sent;
+    }
+    return 0;
+}
+
+/*
+    Reads exactly len bytes from the thread's HTTP/2 connection
+
+    @param
+    bt: The thread
+    conn: The thread's connection
+    data: Where to put them
+    len: How many to read
+
+    @return
+    0 on success, -1 when the connection failed, closed or timed out
+ */
+static int h2_receive(struct bench_thread *bt, const struct connection *conn, uint8_t *data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t received = recv(conn->fd, data, len, 0);
+
+        if(received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(received <= 0)
+        {
+            if(received < 0 && would_block(errno))
+            {
+                bt->stats.timeouts++;
+            }
+            else
+            {
+                bt->stats.read_errors++;
+            }
+            return -1;
+        }
+        bt->stats.bytes += (uint64_t)received;
+        data += received;
+        len -= (size_t)received;
+    }
+    return 0;
+}
+
+/*
+    Finds the status in a response's header block. The server sends :status first, from the
+    static table when it has the code and as a literal with the name from the table otherwise.
+
+    @param
+    block: The header block
+    len: Its length
+
+    @return
+    The status code, 0 if the block does not start with one
+ */
+static int h2_status(const uint8_t *block, size_t len)
+{
+    static const int indexed[] = {200, 204, 206, 304, 400, 404, 500};
+    int              status    = 0;
+
+    if(len > 0 && (block[0] & HPACK_INDEXED))
+    {
+        size_t index = (size_t)(block[0] & ~HPACK_INDEXED);
+
+        if(index >= HPACK_STATUS_INDEX && index - HPACK_STATUS_INDEX < sizeof(indexed) / sizeof(indexed[0]))
+        {
+            status = indexed[index - HPACK_STATUS_INDEX];
+        }
+        return status;
+    }
+
+    if(len < 2 + HPACK_STATUS_DIGITS || (block[0] & HPACK_LITERAL_MASK) != 0 || (block[0] & HPACK_NAME_MASK) != HPACK_STATUS_INDEX || block[1] != HPACK_STATUS_DIGITS)
+    {
+        return 0;
+    }
+    for(size_t i = 0; i < HPACK_STATUS_DIGITS; i++)
+    {
+        status = status * BASE_TEN + block[2 + i] - '0';
+    }
+    return status;
+}
+
+/*
+    Writes the nine bytes every HTTP/2 frame starts with
+
+    @param
+    out: Where to write
+    len: Length of the payload
+    type: Frame type
+    flags: Frame flags
+    stream: Stream identifier, 0 for the connection
+ */
+static void h2_frame_header(uint8_t *out, uint32_t len, uint8_t type, uint8_t flags, uint32_t stream)
+{
+    put_u32(out, len << BYTE_BITS | type);
+    out[4] = flags;
+    put_u32(out + H2_FRAME_HEADER - sizeof(uint32_t), stream);
+}
+
+/*
+    Stores a 32 bit value in network byte order
+
+    @param
+    out: Where to write the four bytes
+    value: The value
+ */
+static void put_u32(uint8_t *out, uint32_t value)
+{
+    for(int i = (int)sizeof(value) - 1; i >= 0; i--)
+    {
+        out[i] = (uint8_t)value;
+        value >>= BYTE_BITS;
+    }
+}
+
+/*
+    Loads a 32 bit value stored in network byte order
+
+    @param
+    in: The four bytes
+
+    @return
+    The value
+ */
+static uint32_t get_u32(const uint8_t *in)
+{
+    uint32_t value = 0;
+
+    for(size_t i = 0; i < sizeof(value); i++)
+    {
+        value = value << BYTE_BITS | in[i];
+    }
+    return value;
+}
+
+/*
+    Looks up a scenario by name
+
+    @param
+    name: The scenario name
+
+    @return
+    The scenario, or NULL if there is none with that name
+ */
+static const struct scenario *find_scenario(const char *name)
+{
+    for(size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    {
+        if(strcmp(scenarios[i].name, name) == 0)
+        {
+            return &scenarios[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+    Lets SIGINT end the run early while still printing the results
+ */
+static void setup_signal_handler(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    #if defined(__clang__)
+        #pragma clang diagnostic push
+        #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+    #endif
+    sa.sa_handler = sigint_handler;
+    #if defined(__clang__)
+        #pragma clang diagnostic pop
+    #endif
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    if(sigaction(SIGINT, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+}
+
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wunused-parameter"
+
+/*
+    Stops every thread at its next loop iteration
+
+    @param
+    signum: The signal number
+ */
+static void sigint_handler(int signum)
+{
+    stop_flag = 1;
+}
+
+    #pragma GCC diagnostic pop
+
+/*
+    Parses command-line arguments for program options
+
+    @param
+    argc: Argument count
+    argv: Argument vector
+    args: Output struct storing the raw option values (as strings)
+ */
+static void parse_arguments(int argc, char *argv[], struct bench_args *args)
+{
+    int opt;
+
+    opterr = 0;
+
+    while((opt = getopt(argc, argv, "hH:p:s:t:c:d:r:T:k2")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H':
+            {
+                args->host = optarg;
+                break;
+            }
+            case 'p':
+            {
+                args->port = optarg;
+                break;
+            }
+            case 's':
+            {
+                args->scenario = optarg;
+                break;
+            }
+            case 't':
+            {
+                args->threads = optarg;
+                break;
+            }
+            case 'c':
+            {
+                args->connections = optarg;
+                break;
+            }
+            case 'd':
+            {
+                args->duration = optarg;
+                break;
+            }
+            case 'r':
+            {
+                args->rate = optarg;
+                break;
+            }
+            case 'T':
+            {
+                args->timeout = optarg;
+                break;
+            }
+            case 'k':
+            {
+                args->keep_alive = 1;
+                break;
+            }
+            case '2':
+            {
+                args->http2 = 1;
+                break;
+            }
+            case 'h':
+            {
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            }
+
+            default:
+            {
+                usage(argv[0], EXIT_FAILURE, NULL);
+            }
+        }
+    }
+
+    if(optind < argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "Error: Too many arguments.");
+    }
+}
+
+/*
+    Prints usage information and exits the program
+
+    @param
+    program_name: Name of the executable
+    exit_code: Exit status code
+    message: Optional error or help message to display
+ */
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-H <host>] [-p <port>] [-s <scenario>] [-t <threads>] [-c <connections>] [-d <seconds>] [-r <rate>] [-T <ms>] [-k] [-2]\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h  Display this help message\n", stderr);
+    fputs("  -H <host> server to load (default: 127.0.0.1)\n", stderr);
+    fputs("  -p <port> server port (default: 8080)\n", stderr);
+    fputs("  -s <scenario> text, image, head, post, batch or page (default: text)\n", stderr);
+    fputs("  -t <threads> load generating threads (default: 2)\n", stderr);
+    fputs("  -c <connections> concurrent connections across all threads (default: 16), page loads one page per thread instead\n", stderr);
+    fputs("  -d <seconds> length of the run (default: 10)\n", stderr);
+    fputs("  -r <rate> open loop at this many requests per second (default: closed loop)\n", stderr);
+    fputs("  -T <ms> abandon a request after this long (default: 2000)\n", stderr);
+    fputs("  -k keep connections alive instead of opening one per request\n", stderr);
+    fputs("  -2 load the page over one HTTP/2 connection per thread instead of six HTTP/1 ones\n", stderr);
+    exit(exit_code);
+}
+
+/*
+    Converts the argument strings to integers and checks that they are consistent
+
+    @param
+    binary_name: Name of the executable (used for error reporting)
+    args: Raw option values
+    config: Output struct to store the parsed values
+ */
+static void handle_arguments(const char *binary_name, const struct bench_args *args, struct bench_config *config)
+{
+    config->host        = args->host != NULL ? args->host : DEFAULT_HOST;
+    config->port        = args->port != NULL ? args->port : DEFAULT_PORT;
+    config->scenario    = find_scenario(args->scenario != NULL ? args->scenario : "text");
+    config->threads     = args->threads != NULL ? parse_positive_int(binary_name, args->threads) : DEFAULT_THREADS;
+    config->connections = args->connections != NULL ? parse_positive_int(binary_name, args->connections) : DEFAULT_CONNECTIONS;
+    config->duration    = args->duration != NULL ? parse_positive_int(binary_name, args->duration) : DEFAULT_DURATION;
+    config->rate        = args->rate != NULL ? parse_positive_int(binary_name, args->rate) : 0;
+    config->timeout_ms  = args->timeout != NULL ? parse_positive_int(binary_name, args->timeout) : DEFAULT_TIMEOUT_MS;
+    config->keep_alive  = args->keep_alive;
+    config->http2       = args->http2;
+
+    if(config->scenario == NULL)
+    {
+        usage(binary_name, EXIT_FAILURE, "Error: unknown scenario.");
+    }
+
+    // A page is loaded by one client per thread, back to back, over as many connections as it needs
+    if(config->scenario->assets != NULL)
+    {
+        if(config->rate > 0)
+        {
+            usage(binary_name, EXIT_FAILURE, "Error: the page scenario only runs as a closed loop.");
+        }
+        config->connections = config->threads * (config->http2 ? 1 : PAGE_ASSETS);
+    }
+    else if(config->http2)
+    {
+        usage(binary_name, EXIT_FAILURE, "Error: -2 only loads the page scenario.");
+    }
+
+    if(config->threads == 0 || config->connections < config->threads || config->duration == 0 || config->timeout_ms == 0)
+    {
+        usage(binary_name, EXIT_FAILURE, "Error: threads, duration and timeout must be nonzero and there must be at least one connection per thread.");
+    }
+}
+
+/*
+    Parses a string as a positive integer with error handling
+
+    @param
+    binary_name: Name of the executable (used for error reporting)
+    str: String to parse
+
+    @return
+    Parsed positive integer value, exits on error
+ */
+static int parse_positive_int(const char *binary_name, const char *str)
+{
+    char    *endptr;
+    intmax_t parsed_value;
+
+    errno        = 0;
+    parsed_value = strtoimax(str, &endptr, BASE_TEN);
+
+    if(errno != 0)
+    {
+        usage(binary_name, EXIT_FAILURE, "Error parsing integer.");
+    }
+
+    // Check if there are any non-numeric characters in the input string
+    if(*endptr != '\0')
+    {
+        usage(binary_name, EXIT_FAILURE, "Invalid characters in input.");
+    }
+
+    // Check if the parsed value is non-negative
+    if(parsed_value < 0 || parsed_value > INT_MAX)
+    {
+        usage(binary_name, EXIT_FAILURE, "Integer out of range or negative.");
+    }
+
+    return (int)parsed_value;
+}
+
+#else
+
+int main(void)
+{
+    fputs("bench uses epoll and only runs on Linux\n", stderr);
+    return EXIT_FAILURE;
+}
+
+#endif
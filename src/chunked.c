@@ -0,0 +1,233 @@
+#include "chunked.h"
+#include <string.h>
+#include <strings.h>
+
+#define HEX_DIGIT_BITS 4
+#define HEX_LETTER_BASE 10
+#define MAX_SIZE_DIGITS 15    // Chunks below 2^60 bytes, so the size never overflows
+
+static int hex_value(char c);
+static int feed(struct chunked *decoder, char c);
+
+/*
+    Starts decoding a new body
+
+    @param
+    decoder: The decoder
+ */
+void chunked_init(struct chunked *decoder)
+{
+    decoder->state      = CHUNKED_SIZE;
+    decoder->remaining  = 0;
+    decoder->digits     = 0;
+    decoder->line_start = 1;
+}
+
+/*
+    Decodes the next bytes of a chunked body in place: the chunk data is moved to the
+    front of data, which is safe because it never gets ahead of the framing around it.
+    Decoding stops at the end of the body, bytes after it are left for the caller.
+
+    @param
+    decoder: The decoder
+    data: Bytes as they arrived, overwritten with the data they carry
+    len: Number of bytes
+    used: Set to the number of bytes that belonged to the body
+
+    @return
+    Number of data bytes now at the front of data, or -1 if the framing is invalid
+ */
+ssize_t chunked_decode(struct chunked *decoder, char *data, size_t len, size_t *used)
+{
+    size_t in  = 0;
+    size_t out = 0;
+
+    while(in < len && decoder->state != CHUNKED_DONE)
+    {
+        if(decoder->state == CHUNKED_DATA)
+        {
+            size_t take = len - in < decoder->remaining ? len - in : (size_t)decoder->remaining;
+
+            memmove(data + out, data + in, take);
+            in += take;
+            out += take;
+            decoder->remaining -= take;
+            if(decoder->remaining == 0)
+            {
+                decoder->state = CHUNKED_DATA_CR;
+            }
+            continue;
+        }
+        if(feed(decoder, data[in++]) != 0)
+        {
+            decoder->state = CHUNKED_ERROR;
+            return -1;
+        }
+    }
+    *used = in;
+    return (ssize_t)out;
+}
+
+/*
+    Tells whether the whole body was decoded
+
+    @param
+    decoder: The decoder
+
+    @return
+    1: The last chunk and the trailers were seen
+    0: More is expected
+ */
+int chunked_done(const struct chunked *decoder)
+{
+    return decoder->state == CHUNKED_DONE;
+}
+
+/*
+    Tells whether a request sends its body with Transfer-Encoding: chunked
+
+    @param
+    request: The request
+    end: End of its headers
+
+    @return
+    1: The body is chunked
+    0: It is not
+ */
+int is_chunked(const char *request, const char *end)
+{
+    const char *line = strstr(request, "\r\n");
+
+    while(line != NULL && line + 2 < end)
+    {
+        line += 2;
+        if(strncasecmp(line, CHUNKED_HEADER, sizeof(CHUNKED_HEADER) - 1) == 0)
+        {
+            const char *eol    = strstr(line, "\r\n");
+            size_t      coding = sizeof(CHUNKED_CODING) - 1;
+
+            // The coding applied last is the one that has to be chunked
+            while(eol != NULL && eol > line && (eol[-1] == ' ' || eol[-1] == '\t'))
+            {
+                eol--;
+            }
+            return eol != NULL && (size_t)(eol - line) >= coding && strncasecmp(eol - coding, CHUNKED_CODING, coding) == 0;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return 0;
+}
+
+/*
+    Value of a hex digit
+
+    @param
+    c: The character
+
+    @return
+    0 to 15, or -1 if c is not a hex digit
+ */
+static int hex_value(char c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + HEX_LETTER_BASE;
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + HEX_LETTER_BASE;
+    }
+    return -1;
+}
+
+/*
+    Advances the decoder over one byte of framing
+
+    @param
+    decoder: The decoder, not in CHUNKED_DATA
+    c: The byte
+
+    @return
+    0: Accepted
+    -1: The framing is invalid
+ */
+static int feed(struct chunked *decoder, char c)
+{
+    switch(decoder->state)
+    {
+        case CHUNKED_SIZE:
+        {
+            int digit = hex_value(c);
+
+            if(digit >= 0 && decoder->digits < MAX_SIZE_DIGITS)
+            {
+                decoder->remaining = (decoder->remaining << HEX_DIGIT_BITS) | (uint64_t)digit;
+                decoder->digits++;
+                return 0;
+            }
+            if(digit >= 0 || decoder->digits == 0)
+            {
+                return -1;
+            }
+            decoder->state = c == '\r' ? CHUNKED_SIZE_LF : CHUNKED_EXTENSION;
+            return c == '\r' || c == ';' || c == ' ' || c == '\t' ? 0 : -1;
+        }
+        case CHUNKED_EXTENSION:
+        {
+            decoder->state = c == '\r' ? CHUNKED_SIZE_LF : CHUNKED_EXTENSION;
+            return c == '\n' ? -1 : 0;
+        }
+        case CHUNKED_SIZE_LF:
+        {
+            if(c != '\n')
+            {
+                return -1;
+            }
+            decoder->digits     = 0;
+            decoder->line_start = 1;
+            decoder->state      = decoder->remaining > 0 ? CHUNKED_DATA : CHUNKED_TRAILER;
+            return 0;
+        }
+        case CHUNKED_DATA_CR:
+        {
+            decoder->state = CHUNKED_DATA_LF;
+            return c == '\r' ? 0 : -1;
+        }
+        case CHUNKED_DATA_LF:
+        {
+            decoder->state = CHUNKED_SIZE;
+            return c == '\n' ? 0 : -1;
+        }
+        case CHUNKED_TRAILER:
+        {
+            if(c == '\r')
+            {
+                decoder->state = CHUNKED_TRAILER_LF;
+                return 0;
+            }
+            decoder->line_start = 0;
+            return c == '\n' ? -1 : 0;
+        }
+        case CHUNKED_TRAILER_LF:
+        {
+            if(c != '\n')
+            {
+                return -1;
+            }
+            decoder->state      = decoder->line_start ? CHUNKED_DONE : CHUNKED_TRAILER;
+            decoder->line_start = 1;
+            return 0;
+        }
+        case CHUNKED_DATA:
+        case CHUNKED_DONE:
+        case CHUNKED_ERROR:
+        default:
+        {
+            return -1;
+        }
+    }
+}
@@ -1,21 +1,52 @@
+#include "aggregate.h"
+#include "snapshot.h"
+#include "storage.h"
 #include <errno.h>
-#include <fcntl.h>
-#include <ndbm.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-#ifdef __APPLE__
-typedef size_t datum_size;
-#else
-typedef int datum_size;
+#if defined(__linux__)
+    #include <sys/inotify.h>
 #endif
 
-#define MAKE_CONST_DATUM(str) ((const_datum){(str), (datum_size)strlen(str) + 1})
-#define BUFFER_SIZE 16
 #define BASE_TEN 10
+#define OUTPUT_BUFFER_SIZE ((size_t)1 << 20)    // stdout is fully buffered through this much memory
+#define JSON_ESCAPE_LEN 8
+#define JSON_CONTROL_LIMIT 0x20    // Bytes below this are written as \u00XX
+#define RANGE_SEPARATOR ':'
+#define OPT_LIMIT 256    // getopt_long values of options with no short form
+#define OPT_OFFSET 257
+#define OPT_SINCE 258
+#define OPT_UNTIL 259
+#define OPT_STATS 260
+#define OPT_HISTOGRAM 261
+#define OPT_TOP 262
+#define OPT_SAMPLE 263
+#define TIME_BATCH 1024        // Time index entries read at once
+#define FOLLOW_POLL_MS 250     // How often -f looks for new entries without inotify, and at most how long it waits with it
+#define EVENT_BUFFER_SIZE 4096
+#define MS_PER_SEC 1000
+#define SECONDS_PER_MINUTE 60
+#define SECONDS_PER_HOUR 3600
+#define SECONDS_PER_DAY 86400
+#define MAX_JOBS 64
+#define COPY_BUFFER_SIZE ((size_t)1 << 16)
+#define SAMPLE_SHIFT 11    // Keeps the 53 bits of a key hash that fit a double exactly
+#define SAMPLE_SCALE (1.0 / 9007199254740992.0)    // 2^-53, maps those bits onto [0, 1)
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define HISTOGRAM_BAR_WIDTH 40
+#define TOP_VALUE_WIDTH 60    // Longest value shown in text output
+#define IMPORT_PATH STORAGE_PATH ".import"    // Where an import builds the new store before it replaces the old one
 
 typedef enum
 {
@@ -23,43 +54,108 @@ typedef enum
     CMD_KEY,
     CMD_ALL,
     CMD_LATEST,
+    CMD_EXPORT,
+    CMD_IMPORT,
     CMD_HELP
 } DBCommand;
 
+typedef enum
+{
+    FORMAT_TEXT,
+    FORMAT_JSONL,
+    FORMAT_CSV
+} OutputFormat;
+
 typedef struct
 {
-    // cppcheck-suppress unusedStructMember
-    const void *dptr;
-    // cppcheck-suppress unusedStructMember
-    datum_size dsize;
-} const_datum;
+    DBCommand     cmd;
+    const char   *key_arg;
+    const char   *backend;
+    unsigned long first;       // Key range of -a and -r
+    unsigned long last;
+    unsigned long offset;      // Matching entries skipped before printing
+    unsigned long limit;       // Most entries printed, ULONG_MAX for no limit
+    const char   *prefix;      // Only values starting with this are printed
+    const char   *contains;    // Only values containing this are printed
+    int64_t       since_ms;    // Only values stored in this time range are printed
+    int64_t       until_ms;
+    int           timed;       // Set when --since or --until was given
+    int           follow;
+    OutputFormat  format;
+    const char   *file;        // Snapshot of export and import
+    int           compress;    // Gzip the exported snapshot
+    unsigned long jobs;        // Reader processes -a and -r scan with
+    int           stats;       // Print totals instead of the entries
+    int           histogram;
+    unsigned long top;         // Most frequent values to print, 0 for none
+    double        sample;      // Fraction of the keys looked at, 1 for all
+} ParsedArgs;
 
 typedef struct
 {
-    DBM *request_db;
+    struct storage        request_db;
+    struct storage_config config;
+    const ParsedArgs     *args;
+    unsigned long         skipped;
+    unsigned long         printed;
+    unsigned long         next_key;    // One past the highest key looked at, -f prints from here on
+    FILE                 *marks;       // Where a reader process records the end offset of each entry it prints
+    struct aggregate     *agg;         // Entries are added here instead of printed when aggregating
 } DBContext;
 
+/*
+    One reader process of a parallel scan and the key range it prints
+ */
 typedef struct
 {
-    DBCommand   cmd;
-    const char *key_arg;
-} ParsedArgs;
+    unsigned long first;
+    unsigned long last;
+    FILE         *data;     // What it printed
+    FILE         *marks;    // End offset of each entry in data, when entries have to be counted
+    pid_t         pid;
+} ScanPart;
 
 static int            fetch_value(DBContext *ctx, const char *key_str);
+static int            import_snapshot(const struct storage_config *config, const char *file);
 static void           parse_arguments(int argc, char *argv[], ParsedArgs *parsed_args);
+static int            parse_count(const char *str, unsigned long *value);
+static int            parse_range(const char *str, ParsedArgs *parsed_args);
+static int            parse_time(const char *str, int64_t *time_ms);
 static int            fetch_all(DBContext *ctx);
-static int            get_last_key(DBM *db, char *key_out, size_t buf_size);
+static int            fetch_entries(DBContext *ctx);
+static int            fetch_sampled(DBContext *ctx);
+static int            fetch_by_time(DBContext *ctx);
+static int            fetch_parallel(DBContext *ctx);
+static int            start_part(DBContext *ctx, ScanPart *part, int counted);
+_Noreturn static void run_part(DBContext *ctx, const ScanPart *part);
+static int            copy_part(const ScanPart *part, unsigned long *skip, unsigned long *take);
+static int            read_mark(FILE *marks, unsigned long index, long *offset);
+static unsigned long  key_count(struct storage *db);
+static void           report_empty(const DBContext *ctx);
+static int            is_aggregating(const ParsedArgs *args);
+static int            is_sampled(const char *key, size_t key_len, double rate);
+static void           print_aggregate(const ParsedArgs *args, const struct aggregate *agg);
+static void           print_histogram(const ParsedArgs *args, const struct aggregate *agg, double scale);
+static void           print_top(const ParsedArgs *args, const struct aggregate *agg, double scale);
+static int            parse_rate(const char *str, double *rate);
+static int            print_stored(DBContext *ctx, const struct time_entry *entry);
+static int            follow(DBContext *ctx, size_t position);
+static int            start_watch(const char *path);
+static void           wait_for_change(int watch);
+static int            get_last_key(struct storage *db, char *key_out, size_t buf_size);
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
-static void           print_key_value(const char *key, const char *value);
+static void           print_key_value(OutputFormat format, const char *key, const char *value);
+static void           print_json_string(const char *str);
+static void           print_csv_field(const char *str);
+static int            print_entry(const void *key, size_t key_len, const void *value, size_t value_len, void *arg);
 
 int main(int argc, char *argv[])
 {
     DBContext  db_ctx;
     ParsedArgs args;
+    size_t     position;
     int        result = EXIT_SUCCESS;
-    char       db_name[BUFFER_SIZE];
 
-    strcpy(db_name, "requests_db");
     parse_arguments(argc, argv, &args);
 
     if(args.cmd == CMD_HELP)
@@ -67,12 +163,40 @@ int main(int argc, char *argv[])
         usage(argv[0], EXIT_SUCCESS, NULL);
     }
 
-    db_ctx.request_db = dbm_open(db_name, O_RDONLY, 0);
-    if(!db_ctx.request_db)
+    if(storage_parse(args.backend, &db_ctx.config) != 0)
+    {
+        usage(argv[0], EXIT_FAILURE, "Invalid storage backend.");
+    }
+
+    if(args.cmd == CMD_IMPORT)
+    {
+        return import_snapshot(&db_ctx.config, args.file);
+    }
+
+    // Everything goes out through one large buffer instead of a write per line
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    db_ctx.args     = &args;
+    db_ctx.skipped  = 0;
+    db_ctx.printed  = 0;
+    db_ctx.next_key = 0;
+    db_ctx.marks    = NULL;
+    db_ctx.agg      = NULL;
+    if(args.format == FORMAT_CSV && args.cmd != CMD_EXPORT && !is_aggregating(&args))
+    {
+        fputs("key,value\n", stdout);
+    }
+
+    if(storage_open(&db_ctx.request_db, &db_ctx.config, STORAGE_PATH, 0) != 0)
     {
-        perror("dbm_open");
+        perror("storage_open");
         return EXIT_FAILURE;
     }
+    position = time_index_count(&db_ctx.request_db.times);
+
+    if(args.cmd == CMD_EXPORT)
+    {
+        result = snapshot_export(&db_ctx.request_db, args.file, args.compress) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     if(args.cmd == CMD_ALL)
     {
@@ -86,16 +210,27 @@ int main(int argc, char *argv[])
 
     if(args.cmd == CMD_LATEST)
     {
-        char last_key[BUFFER_SIZE];
+        char last_key[STORAGE_KEY_LEN];
 
-        result = get_last_key(db_ctx.request_db, last_key, BUFFER_SIZE);
+        result = get_last_key(&db_ctx.request_db, last_key, sizeof(last_key));
         if(result == EXIT_SUCCESS)
         {
-            result = fetch_value(&db_ctx, last_key);
+            result          = fetch_value(&db_ctx, last_key);
+            db_ctx.next_key = strtoul(last_key, NULL, BASE_TEN) + 1;
         }
     }
 
-    dbm_close(db_ctx.request_db);
+    if(args.follow && result == EXIT_SUCCESS)
+    {
+        result = follow(&db_ctx, position);
+    }
+
+    storage_close(&db_ctx.request_db);
+    if(fflush(stdout) != 0)
+    {
+        perror("stdout");
+        return EXIT_FAILURE;
+    }
     return result;
 }
 
@@ -112,26 +247,61 @@ int main(int argc, char *argv[])
  */
 static int fetch_value(DBContext *ctx, const char *key_str)
 {
-    const_datum key_datum;
-    datum       result;
-
-    key_datum = MAKE_CONST_DATUM(key_str);
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-    result = dbm_fetch(ctx->request_db, *(datum *)&key_datum);
-#pragma GCC diagnostic pop
+    const char *value;
+    size_t      value_len;
 
-    if(result.dptr)
+    value = (const char *)storage_fetch(&ctx->request_db, key_str, &value_len);
+    if(value)
     {
-        print_key_value(key_str, result.dptr);
+        print_key_value(ctx->args->format, key_str, value);
         return EXIT_SUCCESS;
     }
 
-    printf("Key \"%s\" not found in database.\n", key_str);
+    fprintf(stderr, "Key \"%s\" not found in database.\n", key_str);
     return EXIT_FAILURE;
 }
 
+/*
+    Builds a new store from a snapshot beside the current one, then swaps it in. The new
+    store holds each key once, so this also compacts a store exported from.
+
+    @param
+    config: Backend to build, need not be the one the snapshot was exported from
+    file: The snapshot
+
+    @return
+    EXIT_SUCCESS: The store now holds exactly what the snapshot does
+    EXIT_FAILURE: The snapshot could not be imported, the current store is untouched
+ */
+static int import_snapshot(const struct storage_config *config, const char *file)
+{
+    struct storage_config fresh = *config;
+    struct storage        store;
+    int                   result;
+
+    fresh.compact_segments = 0;    // Nothing in a fresh store is stale
+    if(storage_destroy(&fresh, IMPORT_PATH) != 0 || storage_open(&store, &fresh, IMPORT_PATH, 1) != 0)
+    {
+        perror(IMPORT_PATH);
+        return EXIT_FAILURE;
+    }
+
+    result = snapshot_import(&store, file);
+    storage_close(&store);
+    if(result != 0)
+    {
+        storage_destroy(&fresh, IMPORT_PATH);
+        return EXIT_FAILURE;
+    }
+
+    if(storage_move(&fresh, IMPORT_PATH, STORAGE_PATH) != 0)
+    {
+        perror(STORAGE_PATH);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 /*
     Parses command-line arguments and stores results in ParsedArgs
 
@@ -142,13 +312,56 @@ static int fetch_value(DBContext *ctx, const char *key_str)
  */
 static void parse_arguments(int argc, char *argv[], ParsedArgs *parsed_args)
 {
+    static const struct option long_options[] = {
+        {"help",      no_argument,       NULL, 'h'          },
+        {"all",       no_argument,       NULL, 'a'          },
+        {"key",       required_argument, NULL, 'k'          },
+        {"latest",    no_argument,       NULL, 'l'          },
+        {"backend",   required_argument, NULL, 'b'          },
+        {"range",     required_argument, NULL, 'r'          },
+        {"prefix",    required_argument, NULL, 'p'          },
+        {"contains",  required_argument, NULL, 's'          },
+        {"format",    required_argument, NULL, 'o'          },
+        {"limit",     required_argument, NULL, OPT_LIMIT    },
+        {"offset",    required_argument, NULL, OPT_OFFSET   },
+        {"since",     required_argument, NULL, OPT_SINCE    },
+        {"until",     required_argument, NULL, OPT_UNTIL    },
+        {"follow",    no_argument,       NULL, 'f'          },
+        {"compress",  no_argument,       NULL, 'z'          },
+        {"jobs",      required_argument, NULL, 'j'          },
+        {"stats",     no_argument,       NULL, OPT_STATS    },
+        {"histogram", no_argument,       NULL, OPT_HISTOGRAM},
+        {"top",       required_argument, NULL, OPT_TOP      },
+        {"sample",    required_argument, NULL, OPT_SAMPLE   },
+        {NULL,        0,                 NULL, 0            }
+    };
     int opt;
-    parsed_args->cmd     = CMD_NONE;
-    parsed_args->key_arg = NULL;
+
+    parsed_args->cmd       = CMD_NONE;
+    parsed_args->key_arg   = NULL;
+    parsed_args->backend   = STORAGE_DEFAULT_SPEC;
+    parsed_args->first     = 0;
+    parsed_args->last      = ULONG_MAX;
+    parsed_args->offset    = 0;
+    parsed_args->limit     = ULONG_MAX;
+    parsed_args->prefix    = NULL;
+    parsed_args->contains  = NULL;
+    parsed_args->since_ms  = INT64_MIN;
+    parsed_args->until_ms  = INT64_MAX;
+    parsed_args->timed     = 0;
+    parsed_args->follow    = 0;
+    parsed_args->format    = FORMAT_TEXT;
+    parsed_args->file      = SNAPSHOT_STDIO;
+    parsed_args->compress  = 0;
+    parsed_args->jobs      = 1;
+    parsed_args->stats     = 0;
+    parsed_args->histogram = 0;
+    parsed_args->top       = 0;
+    parsed_args->sample    = 1;
 
     opterr = 0;
 
-    while((opt = getopt(argc, argv, "hak:l")) != -1)
+    while((opt = getopt_long(argc, argv, "hak:lb:r:p:s:o:fzj:", long_options, NULL)) != -1)
     {
         if(opt == 'h')
         {
@@ -172,7 +385,101 @@ static void parse_arguments(int argc, char *argv[], ParsedArgs *parsed_args)
             parsed_args->cmd = CMD_LATEST;
         }
 
-        if(opt != 'a' && opt != 'k' && opt != 'l')
+        if(opt == 'b')
+        {
+            parsed_args->backend = optarg;
+        }
+
+        if(opt == 'r')
+        {
+            parsed_args->cmd = CMD_ALL;
+            if(parse_range(optarg, parsed_args) != 0)
+            {
+                usage(argv[0], EXIT_FAILURE, "Option -r takes <start>:<end>, either of which may be left out.");
+            }
+        }
+
+        if(opt == 'p')
+        {
+            parsed_args->prefix = optarg;
+        }
+
+        if(opt == 's')
+        {
+            parsed_args->contains = optarg;
+        }
+
+        if(opt == 'o')
+        {
+            if(strcmp(optarg, "text") == 0)
+            {
+                parsed_args->format = FORMAT_TEXT;
+            }
+            else if(strcmp(optarg, "jsonl") == 0)
+            {
+                parsed_args->format = FORMAT_JSONL;
+            }
+            else if(strcmp(optarg, "csv") == 0)
+            {
+                parsed_args->format = FORMAT_CSV;
+            }
+            else
+            {
+                usage(argv[0], EXIT_FAILURE, "Option -o takes text, jsonl or csv.");
+            }
+        }
+
+        if((opt == OPT_LIMIT && parse_count(optarg, &parsed_args->limit) != 0) || (opt == OPT_OFFSET && parse_count(optarg, &parsed_args->offset) != 0))
+        {
+            usage(argv[0], EXIT_FAILURE, "Options --limit and --offset take a non-negative number.");
+        }
+
+        if((opt == OPT_SINCE && parse_time(optarg, &parsed_args->since_ms) != 0) || (opt == OPT_UNTIL && parse_time(optarg, &parsed_args->until_ms) != 0))
+        {
+            usage(argv[0], EXIT_FAILURE, "Options --since and --until take epoch seconds, YYYY-MM-DD[THH:MM:SS] or -<n>s|m|h|d.");
+        }
+
+        if(opt == OPT_SINCE || opt == OPT_UNTIL)
+        {
+            parsed_args->timed = 1;
+        }
+
+        if(opt == 'f')
+        {
+            parsed_args->follow = 1;
+        }
+
+        if(opt == 'z')
+        {
+            parsed_args->compress = 1;
+        }
+
+        if(opt == OPT_STATS)
+        {
+            parsed_args->stats = 1;
+        }
+
+        if(opt == OPT_HISTOGRAM)
+        {
+            parsed_args->histogram = 1;
+        }
+
+        if(opt == OPT_TOP && (parse_count(optarg, &parsed_args->top) != 0 || parsed_args->top == 0))
+        {
+            usage(argv[0], EXIT_FAILURE, "Option --top takes a positive number.");
+        }
+
+        if(opt == OPT_SAMPLE && parse_rate(optarg, &parsed_args->sample) != 0)
+        {
+            usage(argv[0], EXIT_FAILURE, "Option --sample takes a fraction above 0 and at most 1, such as 0.01.");
+        }
+
+        if(opt == 'j' && (parse_count(optarg, &parsed_args->jobs) != 0 || parsed_args->jobs == 0 || parsed_args->jobs > MAX_JOBS))
+        {
+            usage(argv[0], EXIT_FAILURE, "Option -j takes a number of readers from 1 to 64.");
+        }
+
+        if(opt == '?' || opt == ':')
         {
             usage(argv[0], EXIT_FAILURE, "Invalid option.");
         }
@@ -183,7 +490,33 @@ static void parse_arguments(int argc, char *argv[], ParsedArgs *parsed_args)
         usage(argv[0], EXIT_FAILURE, "Option -k requires a key argument.");
     }
 
-    if(parsed_args->cmd == CMD_NONE)
+    // getopt_long moves the words after the options
+    if(optind < argc && (strcmp(argv[optind], "export") == 0 || strcmp(argv[optind], "import") == 0))
+    {
+        parsed_args->cmd = strcmp(argv[optind], "export") == 0 ? CMD_EXPORT : CMD_IMPORT;
+        optind++;
+        if(optind < argc)
+        {
+            parsed_args->file = argv[optind++];
+        }
+    }
+
+    if(is_aggregating(parsed_args) && parsed_args->follow)
+    {
+        usage(argv[0], EXIT_FAILURE, "Option -f cannot be combined with --stats, --histogram or --top.");
+    }
+
+    if(is_aggregating(parsed_args) && parsed_args->jobs > 1 && (parsed_args->offset > 0 || parsed_args->limit < ULONG_MAX))
+    {
+        usage(argv[0], EXIT_FAILURE, "Options --offset and --limit cannot be combined with -j when aggregating.");
+    }
+
+    if(parsed_args->cmd == CMD_NONE && (parsed_args->timed || is_aggregating(parsed_args)))
+    {
+        parsed_args->cmd = CMD_ALL;
+    }
+
+    if(parsed_args->cmd == CMD_NONE && !parsed_args->follow)
     {
         usage(argv[0], EXIT_FAILURE, "No options provided.");
     }
@@ -194,6 +527,161 @@ static void parse_arguments(int argc, char *argv[], ParsedArgs *parsed_args)
     }
 }
 
+/*
+    Parses a non-negative decimal number
+
+    @param
+    str: The string
+    value: Set to the number
+
+    @return
+    0 on success, -1 if str is not a number
+ */
+static int parse_count(const char *str, unsigned long *value)
+{
+    char *endptr = NULL;
+
+    if(str[0] < '0' || str[0] > '9')
+    {
+        return -1;
+    }
+    errno  = 0;
+    *value = strtoul(str, &endptr, BASE_TEN);
+    return errno != 0 || *endptr != '\0' ? -1 : 0;
+}
+
+/*
+    Parses a sampling rate, a fraction above 0 and at most 1
+
+    @param
+    str: The string
+    rate: Set to the rate
+
+    @return
+    0 on success, -1 if str is not a valid rate
+ */
+static int parse_rate(const char *str, double *rate)
+{
+    char *endptr = NULL;
+
+    errno = 0;
+    *rate = strtod(str, &endptr);
+    return errno != 0 || endptr == str || *endptr != '\0' || !(*rate > 0 && *rate <= 1) ? -1 : 0;
+}
+
+/*
+    Parses a key range of the form start:end, both inclusive. A missing start means the
+    first key and a missing end the latest one.
+
+    @param
+    str: The range
+    parsed_args: Its first and last keys are set
+
+    @return
+    0 on success, -1 if the range is malformed
+ */
+static int parse_range(const char *str, ParsedArgs *parsed_args)
+{
+    const char *separator = strchr(str, RANGE_SEPARATOR);
+    char        start[STORAGE_KEY_LEN];
+    size_t      start_len;
+
+    if(separator == NULL)
+    {
+        return -1;
+    }
+
+    start_len = (size_t)(separator - str);
+    if(start_len >= sizeof(start))
+    {
+        return -1;
+    }
+    memcpy(start, str, start_len);
+    start[start_len] = '\0';
+
+    parsed_args->first = 0;
+    parsed_args->last  = ULONG_MAX;
+    if(start_len > 0 && parse_count(start, &parsed_args->first) != 0)
+    {
+        return -1;
+    }
+    if(separator[1] != '\0' && parse_count(separator + 1, &parsed_args->last) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Parses a time given as epoch seconds, a local date and time (YYYY-MM-DD, optionally
+    followed by THH:MM:SS or a space and HH:MM:SS) or an age such as -15m
+
+    @param
+    str: The time
+    time_ms: Set to milliseconds since the epoch
+
+    @return
+    0 on success, -1 if str is not a time
+ */
+static int parse_time(const char *str, int64_t *time_ms)
+{
+    static const char *const formats[] = {"%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S", "%Y-%m-%d"};
+    unsigned long            count;
+    char                    *endptr = NULL;
+
+    if(str[0] == '-')
+    {
+        long unit = 1;
+
+        errno = 0;
+        count = strtoul(str + 1, &endptr, BASE_TEN);
+        if(errno != 0 || endptr == str + 1 || (endptr[0] != '\0' && endptr[1] != '\0'))
+        {
+            return -1;
+        }
+        if(*endptr == 'm')
+        {
+            unit = SECONDS_PER_MINUTE;
+        }
+        else if(*endptr == 'h')
+        {
+            unit = SECONDS_PER_HOUR;
+        }
+        else if(*endptr == 'd')
+        {
+            unit = SECONDS_PER_DAY;
+        }
+        else if(*endptr != 's' && *endptr != '\0')
+        {
+            return -1;
+        }
+        *time_ms = time_index_now_ms() - (int64_t)count * unit * MS_PER_SEC;
+        return 0;
+    }
+
+    if(parse_count(str, &count) == 0)
+    {
+        *time_ms = (int64_t)count * MS_PER_SEC;
+        return 0;
+    }
+
+    for(size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        struct tm   tm;
+        const char *end;
+
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(str, formats[i], &tm);
+        if(end != NULL && *end == '\0')
+        {
+            tm.tm_isdst = -1;
+            *time_ms    = (int64_t)mktime(&tm) * MS_PER_SEC;
+            return 0;
+        }
+    }
+    return -1;
+}
+
 /*
     Prints usage information and exits the program
 
@@ -209,12 +697,33 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char
         fprintf(stderr, "%s\n", message);
     }
 
-    fprintf(stderr, "Usage: %s [-h] [-l] [-k <key>] [-a]\n", program_name);
+    fprintf(stderr, "Usage: %s [-h] [-l] [-k <key>] [-a] [-r <start>:<end>] [-p <prefix>] [-s <text>] [--limit <n>] [--offset <n>] [--since <time>] [--until <time>] [-f] [-j <n>] [--stats] [--histogram] [--top <n>] [--sample <rate>] [-o <format>] [-b <backend>]\n", program_name);
+    fprintf(stderr, "       %s [-b <backend>] [-z] export [<file>]\n", program_name);
+    fprintf(stderr, "       %s [-b <backend>] import [<file>]\n", program_name);
     fputs("Options:\n", stderr);
-    fputs("  -h         Display this help message\n", stderr);
-    fputs("  -l         Print the most recent entry\n", stderr);
-    fputs("  -k <key>   Print the value for the specified key\n", stderr);
-    fputs("  -a         Print all key-value pairs in the database\n", stderr);
+    fputs("  -h                Display this help message\n", stderr);
+    fputs("  -l                Print the most recent entry\n", stderr);
+    fputs("  -k <key>          Print the value for the specified key\n", stderr);
+    fputs("  -a                Print all key-value pairs in the database, oldest first\n", stderr);
+    fputs("  -r <start>:<end>  Print the entries with keys start to end, either may be left out\n", stderr);
+    fputs("  -p <prefix>       With -a or -r, only print values starting with prefix\n", stderr);
+    fputs("  -s <text>         With -a or -r, only print values containing text\n", stderr);
+    fputs("  --limit <n>       Print at most n entries\n", stderr);
+    fputs("  --offset <n>      Skip the first n matching entries\n", stderr);
+    fputs("  --since <time>    Print the entries stored at or after time: epoch seconds, YYYY-MM-DD[THH:MM:SS] or an age like -15m\n", stderr);
+    fputs("  --until <time>    Print the entries stored at or before time\n", stderr);
+    fputs("  -f                After the other output, keep printing entries as they are stored\n", stderr);
+    fputs("  -j <n>            With -a or -r, split the keys between n reader processes\n", stderr);
+    fputs("  --stats           Print the count, total, average, smallest and largest size of the values instead of the entries\n", stderr);
+    fputs("  --histogram       Print a histogram of the value sizes after the totals\n", stderr);
+    fputs("  --top <n>         Print the n most frequent values after the totals\n", stderr);
+    fputs("  --sample <rate>   With the above, only look at this fraction of the keys and scale the counts up\n", stderr);
+    fputs("  -o <format>       Output as text (default), jsonl or csv\n", stderr);
+    fputs("  -b <spec>         Storage backend the server was run with, ndbm (default) or log[,<setting>=<value>...]\n", stderr);
+    fputs("  -z                Gzip the exported snapshot\n", stderr);
+    fputs("Commands:\n", stderr);
+    fputs("  export [<file>]   Write every entry, the counter and the times to a snapshot, stdout if no file is given\n", stderr);
+    fputs("  import [<file>]   Rebuild the database from a snapshot, stdin if no file is given. Stop the server first.\n", stderr);
     exit(exit_code);
 }
 
@@ -222,50 +731,41 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char
     Retrieves the last inserted key from the database using the __counter__ value.
 
     @param
-    db: Open DBM database pointer
+    db: The open store
     key_out: Output buffer to store the last key
     buf_size: Size of the output buffer
 
     @return
     0 on success, -1 on failure
  */
-static int get_last_key(DBM *db, char *key_out, size_t buf_size)
+static int get_last_key(struct storage *db, char *key_out, size_t buf_size)
 {
-    datum counter_key;
-    datum counter_val;
-    char  counter_key_buf[BUFFER_SIZE];
-    int   counter;
-    char *endptr = NULL;
+    const char *counter_val;
+    size_t      counter_len;
+    long        counter;
+    char       *endptr = NULL;
 
-    strcpy(counter_key_buf, "__counter__");
-    counter_key.dptr  = counter_key_buf;
-    counter_key.dsize = strlen("__counter__") + 1;
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-    counter_val = dbm_fetch(db, counter_key);
-#pragma GCC diagnostic pop
-
-    if(!counter_val.dptr)
+    counter_val = (const char *)storage_fetch(db, STORAGE_COUNTER_KEY, &counter_len);
+    if(!counter_val)
     {
         fprintf(stderr, "No counter found in DB.\n");
         return -1;
     }
 
-    counter = (int)strtol(counter_val.dptr, &endptr, BASE_TEN);
+    counter = strtol(counter_val, &endptr, BASE_TEN);
 
-    if(endptr == counter_val.dptr || *endptr != '\0' || counter <= 0)
+    if(endptr == counter_val || *endptr != '\0' || counter <= 0)
     {
         fprintf(stderr, "Invalid or empty counter value.\n");
         return -1;
     }
 
-    snprintf(key_out, buf_size, "%d", counter - 1);
+    snprintf(key_out, buf_size, "%ld", counter - 1);
     return 0;
 }
 
 /*
-    Iterates over all key-value pairs in the DB and prints them.
+    Prints the key-value pairs in the requested key range that pass the filters, oldest first.
 
     @param
     ctx: The open DB context
@@ -275,53 +775,1021 @@ static int get_last_key(DBM *db, char *key_out, size_t buf_size)
  */
 static int fetch_all(DBContext *ctx)
 {
-    datum key;
-    datum value;
+    const ParsedArgs *args = ctx->args;
+    struct aggregate  agg;
+    int               result;
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-    key = dbm_firstkey(ctx->request_db);
-#pragma GCC diagnostic pop
+    if(!is_aggregating(args))
+    {
+        return fetch_entries(ctx);
+    }
 
-    if(key.dptr == NULL)
+    if(aggregate_init(&agg, args->top) != 0)
     {
-        printf("Database is empty.\n");
-        return EXIT_SUCCESS;
+        perror("aggregate_init");
+        return EXIT_FAILURE;
     }
+    ctx->agg = &agg;
 
-    while(key.dptr != NULL)
+    // Totals do not depend on order, so a whole-database pass takes the backend's own order
+    if(args->sample < 1 && !args->timed && args->jobs <= 1)
+    {
+        result = fetch_sampled(ctx);
+    }
+    else if(!args->timed && args->jobs <= 1 && args->first == 0 && args->last == ULONG_MAX && args->offset == 0 && args->limit == ULONG_MAX)
     {
-        // Skip internal counter key
-        if(strcmp(key.dptr, "__counter__") != 0)
+        result = storage_each(&ctx->request_db, print_entry, ctx) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        if(result != EXIT_SUCCESS)
         {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-            value = dbm_fetch(ctx->request_db, key);
-#pragma GCC diagnostic pop
-
-            if(value.dptr)
-            {
-                print_key_value(key.dptr, value.dptr);
-            }
+            fprintf(stderr, "Failed to read the database.\n");
         }
+    }
+    else
+    {
+        result = fetch_entries(ctx);
+    }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-        key = dbm_nextkey(ctx->request_db);
-#pragma GCC diagnostic pop
+    if(result == EXIT_SUCCESS)
+    {
+        print_aggregate(args, &agg);
     }
+    aggregate_free(&agg);
+    ctx->agg = NULL;
+    return result;
+}
+
+/*
+    Fetches only the keys in the sample, so a small --sample reads a small part of the database
+
+    @param
+    ctx: The DB context
+
+    @return
+    EXIT_SUCCESS: The sample was read
+ */
+static int fetch_sampled(DBContext *ctx)
+{
+    unsigned long count = key_count(&ctx->request_db);
+    unsigned long last  = ctx->args->last < count ? ctx->args->last : count - 1;
+
+    for(unsigned long k = ctx->args->first; count > 0 && k <= last; k++)
+    {
+        char        key[STORAGE_KEY_LEN];
+        size_t      key_len = (size_t)snprintf(key, sizeof(key), "%lu", k) + 1;
+        const void *value;
+        size_t      value_len;
 
+        if(!is_sampled(key, key_len, ctx->args->sample))
+        {
+            continue;
+        }
+        value = storage_fetch(&ctx->request_db, key, &value_len);
+        if(value != NULL && print_entry(key, key_len, value, value_len, ctx) != 0)
+        {
+            break;
+        }
+    }
     return EXIT_SUCCESS;
 }
 
 /*
-    Prints a key-value pair in a formatted style
+    Walks the entries -a or -r asked for, in key order unless --since or --until pick them
 
     @param
-    key: The key string
-    value: The associated value string
+    ctx: The DB context
+
+    @return
+    EXIT_SUCCESS: The entries were read
+    EXIT_FAILURE: The database could not be read
  */
-static void print_key_value(const char *key, const char *value)
+static int fetch_entries(DBContext *ctx)
 {
-    printf("Key:\t%s\nValue:\t%s\n\n", key, value);
+    if(ctx->args->timed)
+    {
+        return fetch_by_time(ctx);
+    }
+
+    if(ctx->args->jobs > 1)
+    {
+        return fetch_parallel(ctx);
+    }
+
+    if(storage_range(&ctx->request_db, ctx->args->first, ctx->args->last, print_entry, ctx) != 0)
+    {
+        fprintf(stderr, "Failed to read the database.\n");
+        return EXIT_FAILURE;
+    }
+
+    report_empty(ctx);
+    return EXIT_SUCCESS;
+}
+
+/*
+    Prints the entries stored between --since and --until, found by binary searching the time index
+
+    @param
+    ctx: The open DB context
+
+    @return
+    EXIT_SUCCESS
+ */
+static int fetch_by_time(DBContext *ctx)
+{
+    struct time_entry entries[TIME_BATCH];
+    size_t            position = time_index_lower_bound(&ctx->request_db.times, ctx->args->since_ms);
+    size_t            count;
+    int               done = 0;
+
+    while(!done && (count = time_index_read(&ctx->request_db.times, position, entries, TIME_BATCH)) > 0)
+    {
+        for(size_t i = 0; i < count && !done; i++)
+        {
+            done = entries[i].time_ms > ctx->args->until_ms || print_stored(ctx, &entries[i]) != 0;
+        }
+        position += count;
+    }
+
+    report_empty(ctx);
+    return EXIT_SUCCESS;
+}
+
+/*
+    Splits the key range into contiguous parts, one per reader process, and prints what
+    they found part by part so the output stays oldest first. Each reader formats its
+    own entries into a temporary file; --offset and --limit are applied across the
+    parts as they are copied out.
+
+    @param
+    ctx: The DB context
+
+    @return
+    EXIT_SUCCESS: Every part was read
+    EXIT_FAILURE: A reader could not be started or failed
+ */
+static int fetch_parallel(DBContext *ctx)
+{
+    ScanPart      parts[MAX_JOBS];
+    unsigned long count = key_count(&ctx->request_db);
+    unsigned long first = ctx->args->first;
+    unsigned long last  = ctx->args->last;
+    unsigned long skip  = ctx->args->offset;
+    unsigned long take  = ctx->args->limit;
+    unsigned long jobs  = ctx->args->jobs;
+    unsigned long span;
+    size_t        started = 0;
+    int           counted = ctx->agg == NULL && (ctx->args->offset > 0 || ctx->args->limit < ULONG_MAX);
+    int           result  = EXIT_SUCCESS;
+
+    if(count == 0 || first >= count || first > last)
+    {
+        report_empty(ctx);
+        return EXIT_SUCCESS;
+    }
+    if(last > count - 1)
+    {
+        last = count - 1;
+    }
+    span = last - first + 1;
+    if(jobs > span)
+    {
+        jobs = span;
+    }
+
+    fflush(stdout);    // The readers must not inherit anything still buffered
+    for(unsigned long i = 0; i < jobs; i++)
+    {
+        parts[i].first = first + i * (span / jobs) + (i < span % jobs ? i : span % jobs);
+        parts[i].last  = parts[i].first + span / jobs - (i < span % jobs ? 0 : 1);
+        if(start_part(ctx, &parts[i], counted) != 0)
+        {
+            perror("fork");
+            result = EXIT_FAILURE;
+            break;
+        }
+        started++;
+    }
+
+    for(size_t i = 0; i < started; i++)
+    {
+        int status;
+
+        if(waitpid(parts[i].pid, &status, 0) != parts[i].pid || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        {
+            result = EXIT_FAILURE;
+        }
+    }
+    if(result != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "Failed to read the database.\n");
+    }
+
+    for(size_t i = 0; i < started; i++)
+    {
+        if(result == EXIT_SUCCESS && ctx->agg != NULL)
+        {
+            rewind(parts[i].data);
+            if(aggregate_merge(ctx->agg, parts[i].data) != 0)
+            {
+                fprintf(stderr, "Failed to merge the totals of reader %zu.\n", i);
+                result = EXIT_FAILURE;
+            }
+        }
+        else if(result == EXIT_SUCCESS)
+        {
+            unsigned long before = take;
+
+            if(copy_part(&parts[i], &skip, &take) != 0)
+            {
+                result = EXIT_FAILURE;
+            }
+            // Without marks only whether a part printed anything is known
+            ctx->printed += counted ? before - take : (unsigned long)(ftell(parts[i].data) > 0);
+        }
+        fclose(parts[i].data);
+        if(parts[i].marks != NULL)
+        {
+            fclose(parts[i].marks);
+        }
+    }
+
+    ctx->next_key = last + 1;
+    if(result == EXIT_SUCCESS)
+    {
+        report_empty(ctx);
+    }
+    return result;
+}
+
+/*
+    Creates the temporary files of a part and forks its reader
+
+    @param
+    ctx: The DB context
+    part: The part, its key range set
+    counted: 1 if the entries have to be counted for --offset and --limit
+
+    @return
+    0: The reader is running
+    -1: A file could not be created or fork failed, the part's files are closed
+ */
+static int start_part(DBContext *ctx, ScanPart *part, int counted)
+{
+    int saved;
+
+    part->data  = tmpfile();
+    part->marks = counted ? tmpfile() : NULL;
+    if(part->data != NULL && (!counted || part->marks != NULL))
+    {
+        part->pid = fork();
+        if(part->pid == 0)
+        {
+            run_part(ctx, part);
+        }
+        if(part->pid > 0)
+        {
+            return 0;
+        }
+    }
+
+    // Only the parts that started are cleaned up by the caller, which reports errno
+    saved = errno;
+    if(part->data != NULL)
+    {
+        fclose(part->data);
+        part->data = NULL;
+    }
+    if(part->marks != NULL)
+    {
+        fclose(part->marks);
+        part->marks = NULL;
+    }
+    errno = saved;
+    return -1;
+}
+
+/*
+    Prints the entries of one part into its temporary file. Runs in the reader process,
+    which applies the value filters but not --offset, and stops once it has enough
+    entries to satisfy --offset and --limit on its own.
+
+    @param
+    ctx: The reader's copy of the DB context
+    part: The part
+ */
+_Noreturn static void run_part(DBContext *ctx, const ScanPart *part)
+{
+    ParsedArgs args = *ctx->args;
+    int        result;
+
+    args.limit   = args.limit > ULONG_MAX - args.offset ? ULONG_MAX : args.limit + args.offset;
+    args.offset  = 0;
+    ctx->args    = &args;
+    ctx->marks   = part->marks;
+    ctx->skipped = 0;
+    ctx->printed = 0;
+
+    if(dup2(fileno(part->data), STDOUT_FILENO) < 0)
+    {
+        _exit(EXIT_FAILURE);
+    }
+
+    // ndbm handles are not shared across fork, the log's index is inherited as it is
+    if(!ctx->request_db.ops->keep_open)
+    {
+        storage_close(&ctx->request_db);
+        if(storage_open(&ctx->request_db, &ctx->config, STORAGE_PATH, 0) != 0)
+        {
+            _exit(EXIT_FAILURE);
+        }
+    }
+
+    result = storage_range(&ctx->request_db, part->first, part->last, print_entry, ctx);
+    if(result == 0 && ctx->agg != NULL && aggregate_save(ctx->agg, stdout) != 0)
+    {
+        result = -1;
+    }
+    if(fflush(stdout) != 0 || (part->marks != NULL && (fflush(part->marks) != 0 || ferror(part->marks))))
+    {
+        result = -1;
+    }
+    _exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/*
+    Copies what a reader printed to stdout, less the entries still to be skipped and
+    those past the limit
+
+    @param
+    part: The part, its reader finished
+    skip: Entries still to skip, reduced by those skipped here
+    take: Entries still to print, reduced by those printed here
+
+    @return
+    0: Copied
+    -1: A temporary file could not be read
+ */
+static int copy_part(const ScanPart *part, unsigned long *skip, unsigned long *take)
+{
+    char          buffer[COPY_BUFFER_SIZE];
+    long          start = 0;
+    long          end;
+    unsigned long printed;
+
+    if(fseek(part->data, 0, SEEK_END) != 0 || (end = ftell(part->data)) < 0)
+    {
+        return -1;
+    }
+
+    if(part->marks != NULL)
+    {
+        unsigned long skipped;
+
+        if(fseek(part->marks, 0, SEEK_END) != 0)
+        {
+            return -1;
+        }
+        printed = (unsigned long)ftell(part->marks) / sizeof(long);
+        skipped = *skip < printed ? *skip : printed;
+        printed -= skipped;
+        printed = *take < printed ? *take : printed;
+        *skip -= skipped;
+        *take -= printed;
+
+        if(skipped > 0 && read_mark(part->marks, skipped - 1, &start) != 0)
+        {
+            return -1;
+        }
+        end = start;
+        if(printed > 0 && read_mark(part->marks, skipped + printed - 1, &end) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if(fseek(part->data, start, SEEK_SET) != 0)
+    {
+        return -1;
+    }
+    while(start < end)
+    {
+        size_t want = (size_t)(end - start) < sizeof(buffer) ? (size_t)(end - start) : sizeof(buffer);
+        size_t got  = fread(buffer, 1, want, part->data);
+
+        if(got == 0)
+        {
+            return -1;
+        }
+        fwrite(buffer, 1, got, stdout);
+        start += (long)got;
+    }
+    return 0;
+}
+
+/*
+    Reads the end offset of one entry a reader printed
+
+    @param
+    marks: The reader's marks
+    index: The entry
+    offset: Set to the offset
+
+    @return
+    0: Read
+    -1: It is not there
+ */
+static int read_mark(FILE *marks, unsigned long index, long *offset)
+{
+    if(fseek(marks, (long)(index * sizeof(long)), SEEK_SET) != 0 || fread(offset, sizeof(*offset), 1, marks) != 1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Reads the counter, which is one past the newest key
+
+    @param
+    db: The open database
+
+    @return
+    The counter, 0 if nothing was ever stored
+ */
+static unsigned long key_count(struct storage *db)
+{
+    size_t      counter_len;
+    const char *counter_val = (const char *)storage_fetch(db, STORAGE_COUNTER_KEY, &counter_len);
+
+    return counter_val != NULL ? strtoul(counter_val, NULL, BASE_TEN) : 0;
+}
+
+/*
+    Tells whether the entries are to be summed up rather than printed
+
+    @param
+    args: The parsed arguments
+
+    @return
+    1 with --stats, --histogram or --top, 0 otherwise
+ */
+static int is_aggregating(const ParsedArgs *args)
+{
+    return args->stats || args->histogram || args->top > 0;
+}
+
+/*
+    Picks keys for --sample by hashing them, so the same keys are picked on every run and
+    by every reader of -j
+
+    @param
+    key: The key
+    key_len: Its length
+    rate: Fraction of the keys to pick
+
+    @return
+    1 if the key is in the sample, 0 if not
+ */
+static int is_sampled(const char *key, size_t key_len, double rate)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for(size_t i = 0; i < key_len; i++)
+    {
+        hash ^= (unsigned char)key[i];
+        hash *= FNV_PRIME;
+    }
+    return (double)(hash >> SAMPLE_SHIFT) * SAMPLE_SCALE < rate;
+}
+
+/*
+    Prints what --stats, --histogram and --top asked for. Counts from a sample are scaled
+    up to estimates for the whole range.
+
+    @param
+    args: The parsed arguments
+    agg: The totals
+ */
+static void print_aggregate(const ParsedArgs *args, const struct aggregate *agg)
+{
+    double   scale    = 1 / args->sample;
+    uint64_t smallest = agg->count > 0 ? agg->smallest : 0;
+    double   average  = agg->count > 0 ? (double)agg->bytes / (double)agg->count : 0;
+
+    if(args->format == FORMAT_JSONL)
+    {
+        printf("{\"entries\":%.0f,\"bytes\":%.0f,\"average\":%.1f,\"smallest\":%llu,\"largest\":%llu,\"sample\":%g",
+               (double)agg->count * scale,
+               (double)agg->bytes * scale,
+               average,
+               (unsigned long long)smallest,
+               (unsigned long long)agg->largest,
+               args->sample);
+    }
+    else if(args->format == FORMAT_CSV)
+    {
+        fputs("stat,key,value\n", stdout);
+        printf("entries,,%.0f\nbytes,,%.0f\naverage,,%.1f\nsmallest,,%llu\nlargest,,%llu\nsample,,%g\n", (double)agg->count * scale, (double)agg->bytes * scale, average, (unsigned long long)smallest, (unsigned long long)agg->largest, args->sample);
+    }
+    else
+    {
+        if(args->sample < 1)
+        {
+            printf("Sampled %llu entries at a rate of %g, counts are estimates\n", (unsigned long long)agg->count, args->sample);
+        }
+        printf("Entries:        %.0f\n", (double)agg->count * scale);
+        printf("Total bytes:    %.0f\n", (double)agg->bytes * scale);
+        printf("Average bytes:  %.1f\n", average);
+        printf("Smallest:       %llu\n", (unsigned long long)smallest);
+        printf("Largest:        %llu\n", (unsigned long long)agg->largest);
+    }
+
+    if(args->histogram)
+    {
+        print_histogram(args, agg, scale);
+    }
+    if(args->top > 0)
+    {
+        print_top(args, agg, scale);
+    }
+    if(args->format == FORMAT_JSONL)
+    {
+        fputs("}\n", stdout);
+    }
+}
+
+/*
+    Prints the value sizes in power of two buckets, from the smallest to the largest bucket used
+
+    @param
+    args: The parsed arguments
+    agg: The totals
+    scale: What counts are multiplied by
+ */
+static void print_histogram(const ParsedArgs *args, const struct aggregate *agg, double scale)
+{
+    size_t   low     = 0;
+    size_t   high    = AGGREGATE_BUCKETS;
+    uint64_t tallest = 1;
+
+    while(low < AGGREGATE_BUCKETS && agg->histogram[low] == 0)
+    {
+        low++;
+    }
+    while(high > low && agg->histogram[high - 1] == 0)
+    {
+        high--;
+    }
+    for(size_t b = low; b < high; b++)
+    {
+        tallest = agg->histogram[b] > tallest ? agg->histogram[b] : tallest;
+    }
+
+    if(args->format == FORMAT_JSONL)
+    {
+        fputs(",\"histogram\":[", stdout);
+    }
+    else if(args->format == FORMAT_TEXT)
+    {
+        fputs("Histogram:\n", stdout);
+    }
+
+    for(size_t b = low; b < high; b++)
+    {
+        // Bucket b holds the sizes of bit length b
+        unsigned long long min   = b == 0 ? 0 : 1ULL << (b - 1);
+        unsigned long long max   = b == 0 ? 0 : (1ULL << (b - 1)) + ((1ULL << (b - 1)) - 1);
+        double             count = (double)agg->histogram[b] * scale;
+
+        if(args->format == FORMAT_JSONL)
+        {
+            printf("%s{\"min\":%llu,\"max\":%llu,\"count\":%.0f}", b == low ? "" : ",", min, max, count);
+        }
+        else if(args->format == FORMAT_CSV)
+        {
+            printf("histogram,%llu-%llu,%.0f\n", min, max, count);
+        }
+        else
+        {
+            int bar = (int)((agg->histogram[b] * HISTOGRAM_BAR_WIDTH + tallest - 1) / tallest);
+
+            printf("  %10llu - %-10llu %12.0f  %.*s\n", min, max, count, bar, "########################################");
+        }
+    }
+
+    if(args->format == FORMAT_JSONL)
+    {
+        putchar(']');
+    }
+}
+
+/*
+    Prints the most frequent values and how often each was stored
+
+    @param
+    args: The parsed arguments
+    agg: The totals, with values counted
+    scale: What counts are multiplied by
+ */
+static void print_top(const ParsedArgs *args, const struct aggregate *agg, double scale)
+{
+    struct value_count *sorted = aggregate_sorted(agg);
+    size_t              shown  = agg->distinct < args->top ? agg->distinct : (size_t)args->top;
+
+    if(sorted == NULL)
+    {
+        perror("aggregate_sorted");
+        return;
+    }
+
+    if(args->format == FORMAT_JSONL)
+    {
+        fputs(",\"top\":[", stdout);
+    }
+    else if(args->format == FORMAT_TEXT)
+    {
+        printf("Top %zu of %zu distinct values:\n", shown, agg->distinct);
+    }
+
+    for(size_t i = 0; i < shown; i++)
+    {
+        double count = (double)sorted[i].count * scale;
+
+        if(args->format == FORMAT_JSONL)
+        {
+            printf("%s{\"count\":%.0f,\"value\":", i == 0 ? "" : ",", count);
+            print_json_string(sorted[i].value);
+            putchar('}');
+        }
+        else if(args->format == FORMAT_CSV)
+        {
+            fputs("top,", stdout);
+            print_csv_field(sorted[i].value);
+            printf(",%.0f\n", count);
+        }
+        else
+        {
+            size_t width = strcspn(sorted[i].value, "\r\n");    // One line per value
+
+            width = width < TOP_VALUE_WIDTH ? width : TOP_VALUE_WIDTH;
+            printf("  %12.0f  %.*s%s\n", count, (int)width, sorted[i].value, width < sorted[i].len ? "..." : "");
+        }
+    }
+
+    if(args->format == FORMAT_JSONL)
+    {
+        putchar(']');
+    }
+    free(sorted);
+}
+
+/*
+    Says so in text output when nothing was printed
+
+    @param
+    ctx: The DB context
+ */
+static void report_empty(const DBContext *ctx)
+{
+    const ParsedArgs *args = ctx->args;
+    int               filtered;
+
+    if(ctx->printed > 0 || args->format != FORMAT_TEXT || ctx->agg != NULL)
+    {
+        return;
+    }
+    filtered = args->timed || args->first > 0 || args->last < ULONG_MAX || args->prefix != NULL || args->contains != NULL || args->offset > 0;
+    printf(filtered ? "No matching entries.\n" : "Database is empty.\n");
+}
+
+/*
+    Prints the value a time index entry refers to, if it passes the key range and filters
+
+    @param
+    ctx: The open DB context
+    entry: The time index entry
+
+    @return
+    0 to carry on, 1 once the limit is reached
+ */
+static int print_stored(DBContext *ctx, const struct time_entry *entry)
+{
+    char        key[STORAGE_KEY_LEN];
+    const void *value;
+    size_t      value_len;
+
+    if(entry->key < ctx->args->first || entry->key > ctx->args->last)
+    {
+        return 0;
+    }
+
+    snprintf(key, sizeof(key), "%llu", (unsigned long long)entry->key);
+    value = storage_fetch(&ctx->request_db, key, &value_len);
+    if(value == NULL)
+    {
+        return 0;
+    }
+    return print_entry(key, strlen(key) + 1, value, value_len, ctx);
+}
+
+/*
+    Streams entries as they are stored, reading only the time index entries added since
+    the last look. Waits on inotify where there is one and polls otherwise.
+
+    @param
+    ctx: The open DB context
+    position: Time index entries already accounted for
+
+    @return
+    EXIT_SUCCESS once the limit or --until is reached, EXIT_FAILURE if the store cannot be reopened
+ */
+static int follow(DBContext *ctx, size_t position)
+{
+    struct time_entry entries[TIME_BATCH];
+    int               watch = start_watch(ctx->request_db.times.path);
+
+    fflush(stdout);
+    for(;;)
+    {
+        size_t count = time_index_count(&ctx->request_db.times);
+
+        // ndbm readers only see what was stored before they opened the files
+        if(count > position && !ctx->request_db.ops->keep_open)
+        {
+            storage_close(&ctx->request_db);
+            if(storage_open(&ctx->request_db, &ctx->config, STORAGE_PATH, 0) != 0)
+            {
+                perror("storage_open");
+                return EXIT_FAILURE;
+            }
+        }
+
+        while(position < count)
+        {
+            size_t got = time_index_read(&ctx->request_db.times, position, entries, TIME_BATCH);
+
+            if(got == 0)
+            {
+                break;
+            }
+            for(size_t i = 0; i < got; i++)
+            {
+                if(entries[i].time_ms > ctx->args->until_ms || (entries[i].key >= ctx->next_key && entries[i].time_ms >= ctx->args->since_ms && print_stored(ctx, &entries[i]) != 0))
+                {
+                    return EXIT_SUCCESS;
+                }
+            }
+            position += got;
+        }
+
+        // Nothing stored from here on can fall inside --until
+        if(time_index_now_ms() > ctx->args->until_ms)
+        {
+            return EXIT_SUCCESS;
+        }
+        fflush(stdout);
+        wait_for_change(watch);
+    }
+}
+
+/*
+    Watches the directory holding the time index for changes
+
+    @param
+    path: Path of the time index
+
+    @return
+    An inotify descriptor, or -1 to poll instead, also when the directory's path does not fit PATH_MAX
+ */
+static int start_watch(const char *path)
+{
+#if defined(__linux__)
+    char        dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    size_t      len   = slash != NULL ? (size_t)(slash - path) : 0;
+    int         watch;
+
+    if(slash == NULL)
+    {
+        path = ".";
+        len  = 1;
+    }
+    else if(len == 0)
+    {
+        len = 1;    // A file in the root directory
+    }
+    if(len >= sizeof(dir))
+    {
+        fprintf(stderr, "Directory of %s is too long to watch, polling for changes instead.\n", path);
+        return -1;
+    }
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(watch >= 0 && inotify_add_watch(watch, dir, IN_MODIFY | IN_CREATE | IN_MOVED_TO) < 0)
+    {
+        close(watch);
+        watch = -1;
+    }
+    return watch;
+#else
+    (void)path;
+    return -1;
+#endif
+}
+
+/*
+    Waits until the watched directory changes, or FOLLOW_POLL_MS at most
+
+    @param
+    watch: Descriptor from start_watch, -1 to just sleep
+ */
+static void wait_for_change(int watch)
+{
+    struct pollfd pfd;
+    char          events[EVENT_BUFFER_SIZE];
+
+    if(watch < 0)
+    {
+        poll(NULL, 0, FOLLOW_POLL_MS);
+        return;
+    }
+
+    pfd.fd     = watch;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, FOLLOW_POLL_MS) > 0)
+    {
+        while(read(watch, events, sizeof(events)) > 0)
+        {
+        }
+    }
+}
+
+/*
+    Prints a key-value pair in the requested format
+
+    @param
+    format: Output format
+    key: The key string
+    value: The associated value string
+ */
+static void print_key_value(OutputFormat format, const char *key, const char *value)
+{
+    if(format == FORMAT_JSONL)
+    {
+        fputs("{\"key\":", stdout);
+        print_json_string(key);
+        fputs(",\"value\":", stdout);
+        print_json_string(value);
+        fputs("}\n", stdout);
+        return;
+    }
+
+    if(format == FORMAT_CSV)
+    {
+        print_csv_field(key);
+        putchar(',');
+        print_csv_field(value);
+        putchar('\n');
+        return;
+    }
+
+    printf("Key:\t%s\nValue:\t%s\n\n", key, value);
+}
+
+/*
+    Prints a string as a JSON string literal, copying runs that need no escaping in one go
+
+    @param
+    str: The string
+ */
+static void print_json_string(const char *str)
+{
+    const char *run = str;
+
+    putchar('"');
+    for(const char *c = str; *c != '\0'; c++)
+    {
+        char escape[JSON_ESCAPE_LEN];
+
+        if(*c != '"' && *c != '\\' && (unsigned char)*c >= JSON_CONTROL_LIMIT)
+        {
+            continue;
+        }
+
+        fwrite(run, 1, (size_t)(c - run), stdout);
+        run = c + 1;
+        if(*c == '"' || *c == '\\')
+        {
+            putchar('\\');
+            putchar(*c);
+            continue;
+        }
+        if(*c == '\n')
+        {
+            fputs("\\n", stdout);
+            continue;
+        }
+        snprintf(escape, sizeof(escape), "\\u%04x", (unsigned)(unsigned char)*c);
+        fputs(escape, stdout);
+    }
+    fputs(run, stdout);
+    putchar('"');
+}
+
+/*
+    Prints a CSV field, quoted (with quotes doubled) when it holds a separator, quote or line break
+
+    @param
+    str: The field
+ */
+static void print_csv_field(const char *str)
+{
+    if(strpbrk(str, ",\"\r\n") == NULL)
+    {
+        fputs(str, stdout);
+        return;
+    }
+
+    putchar('"');
+    for(const char *c = str; *c != '\0'; c++)
+    {
+        if(*c == '"')
+        {
+            putchar('"');
+        }
+        putchar(*c);
+    }
+    putchar('"');
+}
+
+/*
+    storage_range callback for fetch_all, applies the filters, offset and limit
+
+    @param
+    key: The key string
+    key_len: Length of the key, including its NUL
+    value: The value string
+    value_len: Length of the value, including its NUL
+    arg: The DB context
+
+    @return
+    0 to carry on, 1 once the limit is reached
+ */
+static int print_entry(const void *key, size_t key_len, const void *value, size_t value_len, void *arg)
+{
+    DBContext        *ctx    = (DBContext *)arg;
+    const ParsedArgs *args   = ctx->args;
+    unsigned long     number = strtoul((const char *)key, NULL, BASE_TEN);
+
+    if(number >= ctx->next_key)
+    {
+        ctx->next_key = number + 1;
+    }
+
+    if(args->sample < 1 && !is_sampled((const char *)key, key_len, args->sample))
+    {
+        return 0;
+    }
+
+    if(args->prefix != NULL && strncmp((const char *)value, args->prefix, strlen(args->prefix)) != 0)
+    {
+        return 0;
+    }
+
+    if(args->contains != NULL && strstr((const char *)value, args->contains) == NULL)
+    {
+        return 0;
+    }
+
+    if(ctx->skipped < args->offset)
+    {
+        ctx->skipped++;
+        return 0;
+    }
+
+    if(ctx->printed >= args->limit)
+    {
+        return 1;
+    }
+    if(ctx->agg != NULL)
+    {
+        // Values are stored with their NUL, which is not part of the body
+        size_t len = value_len > 0 && ((const char *)value)[value_len - 1] == '\0' ? value_len - 1 : value_len;
+
+        ctx->printed++;
+        return aggregate_add(ctx->agg, (const char *)value, len) != 0 ? -1 : ctx->printed >= args->limit;
+    }
+    print_key_value(args->format, (const char *)key, (const char *)value);
+    ctx->printed++;
+    if(ctx->marks != NULL)
+    {
+        long end = ftell(stdout);
+
+        if(end < 0 || fwrite(&end, sizeof(end), 1, ctx->marks) != 1)
+        {
+            return 1;    // The reader sees the error on the marks and fails
+        }
+    }
+    return ctx->printed >= args->limit;
 }
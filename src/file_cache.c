@@ -0,0 +1,469 @@
+#include "file_cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define DATA_ALIGN 64    // Each file starts on its own cache line
+#define PID_SHIFT 32
+#define STATE_MASK 0xffffffffULL
+#define STATUS(state, pid) ((uint64_t)(state) | ((uint64_t)(uint32_t)(pid) << PID_SHIFT))
+
+static uint64_t                hash_path(const char *path);
+static size_t                  preload_dir(struct file_cache *cache, char *path, size_t len);
+static struct file_cache_slot *find_slot(struct file_cache *cache, const char *path, uint64_t hash, int *claimed);
+static int                     read_version(const struct file_cache_slot *slot, struct file_cache_slot *copy);
+static void                    version_of(const struct stat *file_stat, struct file_cache_slot *version);
+static int                     same_version(const struct file_cache_slot *a, const struct file_cache_slot *b);
+static int                     take_fill(struct file_cache_slot *slot, uint64_t seen);
+static const char             *fill(struct file_cache *cache, struct file_cache_slot *slot, const char *path, const struct file_cache_slot *version);
+static int                     read_file(const char *path, char *dest, const struct file_cache_slot *version);
+static void                    publish(struct file_cache_slot *slot, const struct file_cache_slot *version, uint64_t offset, enum file_cache_state state);
+
+/*
+    Maps an empty cache that processes forked afterwards share. The pages of the data area
+    are only backed by memory once a file is read into them.
+
+    @param
+    budget: Most bytes of file content the cache holds
+
+    @return
+    The cache, or NULL if it could not be mapped
+ */
+struct file_cache *file_cache_create(size_t budget)
+{
+    struct file_cache *cache;
+
+    cache = (struct file_cache *)mmap(NULL, sizeof(struct file_cache) + budget, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(cache == MAP_FAILED)
+    {
+        perror("file cache (mmap)");
+        return NULL;
+    }
+    cache->budget = budget;
+    return cache;
+}
+
+/*
+    Unmaps the cache from this process
+
+    @param
+    cache: The cache, may be NULL
+ */
+void file_cache_destroy(struct file_cache *cache)
+{
+    if(cache != NULL)
+    {
+        munmap(cache, sizeof(struct file_cache) + cache->budget);
+    }
+}
+
+/*
+    Finds the bytes of a file in the cache. On a miss the first worker to ask reads the file
+    in while any other worker asking at the same time is sent to the disk, so a cold file is
+    read into the cache once however many workers want it.
+
+    @param
+    cache: The cache
+    path: Path the file was found at
+    file_stat: What stat said about the file, the cached copy has to be of this version
+
+    @return
+    file_stat->st_size bytes of the file, valid for the life of the cache, or NULL to serve it from disk
+ */
+const char *file_cache_get(struct file_cache *cache, const char *path, const struct stat *file_stat)
+{
+    uint64_t                hash = hash_path(path);
+    struct file_cache_slot *slot;
+    struct file_cache_slot  current;
+    struct file_cache_slot  seen;
+    int                     claimed = 0;
+
+    if(file_stat->st_size <= 0 || (uint64_t)file_stat->st_size > cache->budget || strlen(path) >= FILE_CACHE_PATH_LEN)
+    {
+        return NULL;
+    }
+    version_of(file_stat, &current);
+    slot = find_slot(cache, path, hash, &claimed);
+    if(claimed)
+    {
+        return fill(cache, slot, path, &current);
+    }
+    if(slot != NULL && read_version(slot, &seen) == 0)
+    {
+        uint64_t state = seen.status & STATE_MASK;
+
+        if(state == FILE_CACHE_READY && same_version(&seen, &current))
+        {
+            __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+            return cache->data + seen.offset;
+        }
+        if(!(state == FILE_CACHE_SKIPPED && same_version(&seen, &current)) && take_fill(slot, seen.status) == 0)
+        {
+            return fill(cache, slot, path, &current);
+        }
+    }
+    __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+    Reads every file under a directory into the cache, so the workers forked afterwards
+    find them there from their first request. Files are keyed by the same path a request
+    for them builds, and the ones past the budget are left to be served from disk.
+
+    @param
+    cache: The cache
+    dir: The directory, as requests name it
+
+    @return
+    Number of files now in the cache
+ */
+size_t file_cache_preload(struct file_cache *cache, const char *dir)
+{
+    char   path[FILE_CACHE_PATH_LEN];
+    size_t len = strlen(dir);
+
+    if(len >= sizeof(path))
+    {
+        return 0;
+    }
+    memcpy(path, dir, len + 1);
+    return preload_dir(cache, path, len);
+}
+
+/*
+    Reads the files of one directory into the cache and descends into its subdirectories
+
+    @param
+    cache: The cache
+    path: Buffer of FILE_CACHE_PATH_LEN bytes holding the directory, entry names are appended to it
+    len: Length of the directory in path
+
+    @return
+    Number of files cached under it
+ */
+static size_t preload_dir(struct file_cache *cache, char *path, size_t len)
+{
+    DIR           *dir    = opendir(path);
+    struct dirent *entry;
+    size_t         loaded = 0;
+
+    if(dir == NULL)
+    {
+        perror("file cache (opendir)");
+        return 0;
+    }
+    while((entry = readdir(dir)) != NULL)
+    {
+        size_t      name_len = strlen(entry->d_name);
+        struct stat file_stat;
+
+        if(entry->d_name[0] == '.' || len + 1 + name_len >= FILE_CACHE_PATH_LEN)
+        {
+            continue;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, entry->d_name, name_len + 1);
+        if(stat(path, &file_stat) != 0)
+        {
+            continue;
+        }
+        if(S_ISDIR(file_stat.st_mode))
+        {
+            loaded += preload_dir(cache, path, len + 1 + name_len);
+        }
+        else if(S_ISREG(file_stat.st_mode) && file_cache_get(cache, path, &file_stat) != NULL)
+        {
+            loaded++;
+        }
+    }
+    path[len] = '\0';
+    closedir(dir);
+    return loaded;
+}
+
+/*
+    FNV-1a over the path, never 0 since that marks a free slot
+
+    @param
+    path: The path
+
+    @return
+    The hash
+ */
+static uint64_t hash_path(const char *path)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for(const char *c = path; *c != '\0'; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= FNV_PRIME;
+    }
+    return hash | 1;
+}
+
+/*
+    Finds the slot of a path by linear probing, claiming a free one if it has none. The
+    claimer writes the path and becomes its filler before anyone else can match the slot.
+
+    @param
+    cache: The cache
+    path: The path
+    hash: Its hash
+    claimed: Set when the slot was claimed by this call, and this process fills it
+
+    @return
+    The slot, or NULL if the table is full or another worker is claiming a slot for the path
+ */
+static struct file_cache_slot *find_slot(struct file_cache *cache, const char *path, uint64_t hash, int *claimed)
+{
+    for(size_t n = 0; n < FILE_CACHE_SLOTS; n++)
+    {
+        struct file_cache_slot *slot  = &cache->slots[(hash + n) & (FILE_CACHE_SLOTS - 1)];
+        uint64_t                owner = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+
+        if(owner == 0)
+        {
+            uint64_t expected = 0;
+
+            if(__atomic_compare_exchange_n(&slot->hash, &expected, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                strcpy(slot->path, path);
+                __atomic_store_n(&slot->status, STATUS(FILE_CACHE_FILLING, getpid()), __ATOMIC_RELEASE);
+                *claimed = 1;
+                return slot;
+            }
+            owner = expected;
+        }
+        if(owner != hash)
+        {
+            continue;
+        }
+
+        // The path is there once the claimer has published a status
+        if(__atomic_load_n(&slot->status, __ATOMIC_ACQUIRE) == STATUS(FILE_CACHE_EMPTY, 0))
+        {
+            return NULL;
+        }
+        if(strcmp(slot->path, path) == 0)
+        {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Copies the status and version of a slot, retrying while the filler is publishing
+
+    @param
+    slot: The slot
+    copy: Where they are copied
+
+    @return
+    0: copy is consistent
+    -1: The filler kept changing the slot, treat it as busy
+ */
+static int read_version(const struct file_cache_slot *slot, struct file_cache_slot *copy)
+{
+    for(int attempt = 0; attempt < FILE_CACHE_SLOTS; attempt++)
+    {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if((seq & 1) != 0)
+        {
+            continue;
+        }
+        copy->status     = __atomic_load_n(&slot->status, __ATOMIC_RELAXED);
+        copy->device     = __atomic_load_n(&slot->device, __ATOMIC_RELAXED);
+        copy->inode      = __atomic_load_n(&slot->inode, __ATOMIC_RELAXED);
+        copy->size       = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+        copy->mtime_sec  = __atomic_load_n(&slot->mtime_sec, __ATOMIC_RELAXED);
+        copy->mtime_nsec = __atomic_load_n(&slot->mtime_nsec, __ATOMIC_RELAXED);
+        copy->offset     = __atomic_load_n(&slot->offset, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+    Takes the fields that tell one version of a file from another out of a stat
+
+    @param
+    file_stat: What stat said about the file
+    version: Where the fields go
+ */
+static void version_of(const struct stat *file_stat, struct file_cache_slot *version)
+{
+    version->device = (uint64_t)file_stat->st_dev;
+    version->inode  = (uint64_t)file_stat->st_ino;
+    version->size   = (uint64_t)file_stat->st_size;
+#if (defined(__APPLE__) && defined(__MACH__))
+    version->mtime_sec  = (int64_t)file_stat->st_mtimespec.tv_sec;
+    version->mtime_nsec = (int64_t)file_stat->st_mtimespec.tv_nsec;
+#else
+    version->mtime_sec  = (int64_t)file_stat->st_mtim.tv_sec;
+    version->mtime_nsec = (int64_t)file_stat->st_mtim.tv_nsec;
+#endif
+}
+
+/*
+    Tells whether two versions of a file are the same
+
+    @param
+    a: A version
+    b: Another
+
+    @return
+    1 if they are, 0 if the file changed in between
+ */
+static int same_version(const struct file_cache_slot *a, const struct file_cache_slot *b)
+{
+    return a->device == b->device && a->inode == b->inode && a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/*
+    Makes this process the one filler of a slot, in a single compare and swap of its status.
+    A slot being filled is only taken over when its filler died partway.
+
+    @param
+    slot: The slot
+    seen: Its status as last read
+
+    @return
+    0: This process fills the slot
+    -1: Another process does, or got there first
+ */
+static int take_fill(struct file_cache_slot *slot, uint64_t seen)
+{
+    pid_t filler = (pid_t)(seen >> PID_SHIFT);
+
+    if((seen & STATE_MASK) == FILE_CACHE_FILLING && (kill(filler, 0) == 0 || errno != ESRCH))
+    {
+        return -1;
+    }
+    return __atomic_compare_exchange_n(&slot->status, &seen, STATUS(FILE_CACHE_FILLING, getpid()), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+/*
+    Reads a file into new space of the data area and publishes it in its slot. A file that
+    does not fit what is left of the budget, or that changes while it is read, is marked
+    skipped for that version.
+
+    @param
+    cache: The cache
+    slot: The slot, filled by this process
+    path: Path of the file
+    version: The version to read
+
+    @return
+    The cached bytes, or NULL if the file was skipped
+ */
+static const char *fill(struct file_cache *cache, struct file_cache_slot *slot, const char *path, const struct file_cache_slot *version)
+{
+    uint64_t size   = (version->size + DATA_ALIGN - 1) & ~(uint64_t)(DATA_ALIGN - 1);
+    uint64_t offset = __atomic_load_n(&cache->used, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+    do
+    {
+        if(offset + size > cache->budget)
+        {
+            publish(slot, version, 0, FILE_CACHE_SKIPPED);
+            return NULL;
+        }
+    } while(!__atomic_compare_exchange_n(&cache->used, &offset, offset + size, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if(read_file(path, cache->data + offset, version) != 0)
+    {
+        publish(slot, version, 0, FILE_CACHE_SKIPPED);
+        return NULL;
+    }
+    publish(slot, version, offset, FILE_CACHE_READY);
+    __atomic_fetch_add(&cache->fills, 1, __ATOMIC_RELAXED);
+    return cache->data + offset;
+}
+
+/*
+    Reads the whole of a file, checking it is still the version that was asked for
+
+    @param
+    path: Path of the file
+    dest: Where its bytes go, version->size of them
+    version: The version expected
+
+    @return
+    0: dest holds that version
+    -1: The file could not be read or is another version now
+ */
+static int read_file(const char *path, char *dest, const struct file_cache_slot *version)
+{
+    struct file_cache_slot now;
+    struct stat            after;
+    size_t                 total = 0;
+    int                    fd    = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0)
+    {
+        return -1;
+    }
+    while(total < version->size)
+    {
+        ssize_t got = read(fd, dest + total, version->size - total);
+
+        if(got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(got <= 0)
+        {
+            break;
+        }
+        total += (size_t)got;
+    }
+    if(fstat(fd, &after) != 0)
+    {
+        total = 0;
+    }
+    close(fd);
+
+    version_of(&after, &now);
+    return total == version->size && same_version(&now, version) ? 0 : -1;
+}
+
+/*
+    Changes the version of a slot as readers see it, inside an odd seq, and lets go of the fill
+
+    @param
+    slot: The slot, filled by this process
+    version: The version
+    offset: Where its bytes start in the data area
+    state: FILE_CACHE_READY or FILE_CACHE_SKIPPED
+ */
+static void publish(struct file_cache_slot *slot, const struct file_cache_slot *version, uint64_t offset, enum file_cache_state state)
+{
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->device, version->device, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->inode, version->inode, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->size, version->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->mtime_sec, version->mtime_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->mtime_nsec, version->mtime_nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->offset, offset, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->status, STATUS(state, 0), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
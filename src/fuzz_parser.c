@@ -0,0 +1,382 @@
+/*
+    Fuzz target for the request parser.
+
+    Every input is copied into a zeroed BUFFER_SIZE heap buffer, the way handle_request reads a
+    request, and run through is_http_request and (when it accepts) set_request_path. Built with
+    sanitizers this finds out of bounds reads in the parser's scans.
+
+    When PARSER_CANDIDATE names a shared object exporting the same two functions (for example an
+    http.so built from a rewritten parser), every input is also run through it and the first input
+    on which the two disagree is printed before aborting.
+
+    Build with -DFUZZ_LIBFUZZER and -fsanitize=fuzzer for libFuzzer. Without it the file has its
+    own main that replays files and directories given as arguments, or reads one input from stdin
+    (in a persistent loop under afl-clang-fast), so the same target works with AFL. See fuzz.sh.
+ */
+#include "http.c"    // NOLINT(bugprone-suspicious-include)
+#include <dirent.h>
+#include <dlfcn.h>
+#include <stdint.h>
+
+#define CANDIDATE_ENV "PARSER_CANDIDATE"
+#define PATH_LEN 4096
+#define PRINTABLE_MIN 0x20
+#define PRINTABLE_MAX 0x7e
+#define STDIN_MAX (BUFFER_SIZE * 4)
+
+/*
+    The parser functions of one implementation
+ */
+struct parser
+{
+    const char *name;
+    int (*is_http)(const char *buffer);
+    void (*set_path)(char *req_path, const char *buffer);
+};
+
+/*
+    What a parser made of one input
+ */
+struct parse_result
+{
+    int  is_http;
+    char path[BUFFER_SIZE + 1];
+};
+
+int         LLVMFuzzerInitialize(const int *argc, char ***argv);
+int         LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+static int  load_candidate(struct parser *candidate);
+static void run_parser(const struct parser *parser, const char *buffer, struct parse_result *result);
+static void report_mismatch(const struct parser *candidate, const uint8_t *data, size_t size, const struct parse_result *expected, const struct parse_result *actual);
+static void print_escaped(const uint8_t *data, size_t size);
+
+static const struct parser current_parser = {"http.c", is_http_request, set_request_path};
+
+static struct parser candidate_parser;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int           candidate_loaded = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int           initialized      = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+    Silences the parser's debugging output and loads the candidate parser, if there is one
+
+    @param
+    argc: Unused
+    argv: Unused
+
+    @return
+    0
+ */
+int LLVMFuzzerInitialize(const int *argc, char ***argv)
+{
+    (void)argc;
+    (void)argv;
+
+    if(initialized)
+    {
+        return 0;
+    }
+    initialized = 1;
+
+    if(freopen("/dev/null", "w", stdout) == NULL)
+    {
+        perror("fuzz_parser (freopen)");
+    }
+
+    candidate_loaded = load_candidate(&candidate_parser) == 0;
+    return 0;
+}
+
+/*
+    Runs one input through the current parser and, if loaded, the candidate
+
+    @param
+    data: The input bytes
+    size: Number of input bytes
+
+    @return
+    0
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct parse_result expected;
+    struct parse_result actual;
+    char               *buffer;
+
+    LLVMFuzzerInitialize(NULL, NULL);
+
+    // Exactly what handle_request hands the parser: one read of at most BUFFER_SIZE bytes into a zeroed buffer
+    buffer = (char *)calloc(1, BUFFER_SIZE);
+    if(buffer == NULL)
+    {
+        return 0;
+    }
+    memcpy(buffer, data, size < BUFFER_SIZE ? size : BUFFER_SIZE);
+
+    run_parser(&current_parser, buffer, &expected);
+    if(candidate_loaded)
+    {
+        run_parser(&candidate_parser, buffer, &actual);
+        if(expected.is_http != actual.is_http || strcmp(expected.path, actual.path) != 0)
+        {
+            report_mismatch(&candidate_parser, data, size, &expected, &actual);
+            free(buffer);
+            abort();
+        }
+    }
+
+    free(buffer);
+    return 0;
+}
+
+/*
+    Loads the parser named by PARSER_CANDIDATE
+
+    @param
+    candidate: Output parser
+
+    @return
+    0: The candidate is loaded
+    -1: No candidate was given or it could not be loaded
+ */
+static int load_candidate(struct parser *candidate)
+{
+    const char *path = getenv(CANDIDATE_ENV);
+    void       *handle;
+
+    if(path == NULL || path[0] == '\0')
+    {
+        return -1;
+    }
+
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(handle == NULL)
+    {
+        fprintf(stderr, "fuzz_parser: dlopen failed: %s\n", dlerror());
+        return -1;
+    }
+
+    candidate->name                  = path;
+    *(void **)(&candidate->is_http)  = dlsym(handle, "is_http_request");
+    *(void **)(&candidate->set_path) = dlsym(handle, "set_request_path");
+    if(candidate->is_http == NULL || candidate->set_path == NULL)
+    {
+        fprintf(stderr, "fuzz_parser: %s does not export is_http_request and set_request_path\n", path);
+        dlclose(handle);
+        return -1;
+    }
+
+    fprintf(stderr, "fuzz_parser: comparing http.c with %s\n", path);
+    return 0;
+}
+
+/*
+    Parses one buffer the way handle_request does
+
+    @param
+    parser: The implementation to run
+    buffer: A BUFFER_SIZE request buffer
+    result: Output of the parse
+ */
+static void run_parser(const struct parser *parser, const char *buffer, struct parse_result *result)
+{
+    result->is_http = parser->is_http(buffer);
+    result->path[0] = '\0';
+
+    // handle_request only extracts the path from requests the parser accepted
+    if(result->is_http == 0)
+    {
+        parser->set_path(result->path, buffer);
+    }
+}
+
+/*
+    Prints the input the two parsers disagree on and what each of them made of it
+
+    @param
+    candidate: The candidate parser
+    data: The input bytes
+    size: Number of input bytes
+    expected: Result of the current parser
+    actual: Result of the candidate
+ */
+static void report_mismatch(const struct parser *candidate, const uint8_t *data, size_t size, const struct parse_result *expected, const struct parse_result *actual)
+{
+    fprintf(stderr, "fuzz_parser: parsers disagree on a %zu byte input:\n  ", size);
+    print_escaped(data, size < BUFFER_SIZE ? size : BUFFER_SIZE);
+    fprintf(stderr, "\n  %-24s is_http_request = %d, path = \"%s\"\n", current_parser.name, expected->is_http, expected->path);
+    fprintf(stderr, "  %-24s is_http_request = %d, path = \"%s\"\n", candidate->name, actual->is_http, actual->path);
+}
+
+/*
+    Prints bytes to stderr as a C string literal body
+
+    @param
+    data: The bytes
+    size: Number of bytes
+ */
+static void print_escaped(const uint8_t *data, size_t size)
+{
+    fputc('"', stderr);
+    for(size_t i = 0; i < size; i++)
+    {
+        if(data[i] == '\r')
+        {
+            fputs("\\r", stderr);
+        }
+        else if(data[i] == '\n')
+        {
+            fputs("\\n", stderr);
+        }
+        else if(data[i] == '"' || data[i] == '\\')
+        {
+            fprintf(stderr, "\\%c", data[i]);
+        }
+        else if(data[i] < PRINTABLE_MIN || data[i] > PRINTABLE_MAX)
+        {
+            fprintf(stderr, "\\x%02x", data[i]);
+        }
+        else
+        {
+            fputc(data[i], stderr);
+        }
+    }
+    fputc('"', stderr);
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+static int replay_path(const char *path);
+static int replay_file(const char *path);
+static int replay_stream(FILE *stream);
+
+/*
+    Replays inputs without libFuzzer
+
+    Usage: fuzz_parser [file or directory...]
+    With no arguments one input is read from stdin, which is how AFL runs the target.
+ */
+int main(int argc, char *argv[])
+{
+    int replayed = 0;
+
+    LLVMFuzzerInitialize(&argc, &argv);
+
+    if(argc < 2)
+    {
+    #ifdef __AFL_HAVE_MANUAL_CONTROL
+        // afl-clang-fast persistent mode: one process runs many inputs before AFL restarts it
+        #define AFL_PERSISTENT_RUNS 1000
+        while(__AFL_LOOP(AFL_PERSISTENT_RUNS))
+        {
+            replay_stream(stdin);
+        }
+        return EXIT_SUCCESS;
+    #else
+        return replay_stream(stdin) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    #endif
+    }
+
+    for(int i = 1; i < argc; i++)
+    {
+        int count = replay_path(argv[i]);
+
+        if(count < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        replayed += count;
+    }
+
+    fprintf(stderr, "fuzz_parser: replayed %d input(s)%s\n", replayed, candidate_loaded ? ", no disagreements" : "");
+    return EXIT_SUCCESS;
+}
+
+/*
+    Replays a file, or every file in a directory
+
+    @param
+    path: The file or directory
+
+    @return
+    Number of inputs replayed, or -1 on error
+ */
+static int replay_path(const char *path)
+{
+    DIR           *dir;
+    struct dirent *entry;
+    int            count = 0;
+
+    dir = opendir(path);
+    if(dir == NULL)
+    {
+        return replay_file(path) < 0 ? -1 : 1;
+    }
+
+    while((entry = readdir(dir)) != NULL)
+    {
+        char child[PATH_LEN];
+
+        if(entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if(replay_file(child) == 0)
+        {
+            count++;
+        }
+    }
+
+    closedir(dir);
+    return count;
+}
+
+/*
+    Replays one file
+
+    @param
+    path: The file
+
+    @return
+    0 on success, -1 if the file cannot be read
+ */
+static int replay_file(const char *path)
+{
+    FILE *file = fopen(path, "rbe");
+    int   result;
+
+    if(file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    result = replay_stream(file);
+    fclose(file);
+    return result;
+}
+
+/*
+    Reads one input from a stream and runs it
+
+    @param
+    stream: The stream
+
+    @return
+    0 on success, -1 on a read error
+ */
+static int replay_stream(FILE *stream)
+{
+    uint8_t data[STDIN_MAX];
+    size_t  size = fread(data, 1, sizeof(data), stream);
+
+    if(ferror(stream))
+    {
+        perror("fuzz_parser (fread)");
+        return -1;
+    }
+
+    LLVMFuzzerTestOneInput(data, size);
+    return 0;
+}
+
+#endif
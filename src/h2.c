@@ -0,0 +1,1261 @@
+#include "h2.h"
+#include "arena.h"
+#include "hpack.h"
+#include "http.h"
+#include "would_block.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define FRAME_HEADER_LEN 9
+#define DEFAULT_WINDOW 65535       // Flow-control window every connection and stream starts with
+#define DEFAULT_MAX_FRAME 16384    // Largest payload until the peer allows more, and the largest we accept
+#define MAX_FRAME_LIMIT 16777215
+#define MAX_WINDOW 2147483647
+#define MAX_STREAMS 100            // SETTINGS_MAX_CONCURRENT_STREAMS, the streams a worker serves at once
+#define HEADER_BLOCK_MAX 16384     // Largest request header block, HEADERS and CONTINUATION frames together
+#define OUTPUT_SIZE 65536          // Frames are gathered and written together up to this
+#define RESPONSE_BLOCK_MAX 256     // Room for the header block of a response
+#define LENGTH_DIGITS 24           // Room for a Content-Length value
+#define METHOD_LEN 16
+#define ALLOW_VALUE "GET, HEAD"
+#define STREAM_ID_MASK 0x7fffffff
+#define PADDED_LEN 1               // Pad length in front of a padded fragment
+#define PRIORITY_LEN 5
+#define SETTING_LEN 6
+#define PING_LEN 8
+#define WINDOW_UPDATE_LEN 4
+#define RST_STREAM_LEN 4
+#define GOAWAY_LEN 8
+#define SETTINGS_SENT 4            // Settings in the SETTINGS frame we open with
+#define BYTE_BITS 8
+#define BYTE_MASK 0xff
+#define MS_PER_SEC 1000
+#if defined(MSG_NOSIGNAL)
+    #define FRAME_SEND_FLAGS MSG_NOSIGNAL
+#else
+    #define FRAME_SEND_FLAGS 0
+#endif
+
+/*
+    Frame types, RFC 9113 section 6
+ */
+enum frame_type
+{
+    FRAME_DATA,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION
+};
+
+/*
+    Frame flags, each only means something on some of the types
+ */
+enum frame_flag
+{
+    FLAG_END_STREAM  = 0x01,    // Also ACK on SETTINGS and PING
+    FLAG_END_HEADERS = 0x04,
+    FLAG_PADDED      = 0x08,
+    FLAG_PRIORITY    = 0x20
+};
+
+/*
+    Settings we read or send
+ */
+enum setting
+{
+    SETTINGS_HEADER_TABLE_SIZE = 1,
+    SETTINGS_ENABLE_PUSH,
+    SETTINGS_MAX_CONCURRENT_STREAMS,
+    SETTINGS_INITIAL_WINDOW_SIZE,
+    SETTINGS_MAX_FRAME_SIZE,
+    SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+/*
+    Error codes of RST_STREAM and GOAWAY
+ */
+enum error_code
+{
+    NO_ERROR,
+    PROTOCOL_ERROR,
+    INTERNAL_ERROR,
+    FLOW_CONTROL_ERROR,
+    SETTINGS_TIMEOUT,
+    STREAM_CLOSED,
+    FRAME_SIZE_ERROR,
+    REFUSED_STREAM,
+    CANCEL,
+    COMPRESSION_ERROR,
+    CONNECT_ERROR,
+    ENHANCE_YOUR_CALM
+};
+
+/*
+    A stream whose response is being sent. Its request was answered as soon as its headers
+    arrived, so a stream only lives until the last DATA frame of the response.
+ */
+struct stream
+{
+    uint32_t        id;             // 0 while the slot is free
+    int             remote_open;    // The client has not ended its side, the stream is reset once the response is out
+    int64_t         window;         // Flow-control window for the DATA we send on it
+    unsigned long   sent;           // Body bytes sent
+    struct resource resource;
+};
+
+/*
+    The fields of a request header block the response depends on
+ */
+struct request
+{
+    struct arena *arena;
+    char          method[METHOD_LEN];
+    char         *path;      // In the arena, NULL if the block had none
+    int           failed;    // A field was too long or the arena full
+};
+
+/*
+    One HTTP/2 connection while a worker serves it
+ */
+struct connection
+{
+    int                  fd;
+    struct h2_state     *state;
+    struct h2_context   *context;
+    int                  preface;             // The client preface has not been read yet
+    int                  acked;               // The client acknowledged our settings
+    int                  goaway;              // The client sent GOAWAY, no stream is opened after it
+    int                  open;                // Streams in use
+    int                  next;                // Slot the next round of DATA starts at, so every stream gets its turn
+    enum h2_result       failed;              // Why a write failed, H2_IDLE while none did
+    uint32_t             block_stream;        // Stream whose header block is being gathered, 0 for none
+    int                  block_end_stream;    // Its HEADERS frame ended the request
+    size_t               block_len;
+    size_t               in_len;
+    size_t               out_len;
+    struct stream        streams[MAX_STREAMS];
+    struct hpack_decoder decoder;
+    uint8_t              in[FRAME_HEADER_LEN + DEFAULT_MAX_FRAME];
+    uint8_t              block[HEADER_BLOCK_MAX];
+    uint8_t              out[OUTPUT_SIZE];
+};
+
+static enum h2_result  run(struct connection *conn);
+static int             read_input(struct connection *conn, int wait, enum h2_result *result);
+static enum error_code process_input(struct connection *conn);
+static enum error_code handle_frame(struct connection *conn, uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length);
+static enum error_code on_data(struct connection *conn, uint8_t flags, uint32_t stream_id, size_t length);
+static enum error_code on_headers(struct connection *conn, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length);
+static enum error_code on_continuation(struct connection *conn, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length);
+static enum error_code on_settings(struct connection *conn, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length);
+static enum error_code on_window_update(struct connection *conn, uint32_t stream_id, const uint8_t *payload, size_t length);
+static enum error_code end_block(struct connection *conn);
+static int             collect_field(const char *name, size_t name_len, const char *value, size_t value_len, void *arg);
+static void            start_stream(struct connection *conn, uint32_t id, int request_ended, const struct request *request);
+static void            end_stream(struct connection *conn, struct stream *stream, enum error_code error);
+static struct stream  *find_stream(struct connection *conn, uint32_t id);
+static int             sendable(const struct connection *conn);
+static void            queue_data(struct connection *conn);
+static void            queue_frame(struct connection *conn, uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length);
+static void            queue_u32(struct connection *conn, uint8_t type, uint32_t stream_id, uint32_t value);
+static void            put_frame_header(uint8_t *out, size_t length, uint8_t type, uint8_t flags, uint32_t stream_id);
+static void            put_u32(uint8_t *out, uint32_t value);
+static uint32_t        get_u32(const uint8_t *in);
+static void            flush(struct connection *conn);
+
+/*
+    Tells whether a request starts like the HTTP/2 client preface
+
+    @param
+    buffer: The first bytes read from the connection
+    len: How many there are
+
+    @return
+    1 if they match the preface as far as they go, 0 otherwise
+ */
+int h2_is_preface(const char *buffer, size_t len)
+{
+    return len > 0 && memcmp(buffer, H2_PREFACE, len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN) == 0;
+}
+
+/*
+    Serves an HTTP/2 connection until no stream is open and the client has nothing more to
+    say for now. A new connection starts with its preface, which the worker may already
+    have read, and our settings; one given back earlier carries on from state. Requests
+    are answered from open_resource as soon as their headers are in, and the DATA of every
+    open stream is interleaved a frame at a time within the flow-control windows.
+
+    @param
+    fd: The connection, in plaintext
+    state: What is kept of the connection between workers, updated
+    early: Bytes already read from the connection
+    early_len: How many, at most the size of one frame
+    context: What the worker lends the connection
+
+    @return
+    Why the connection was given back
+ */
+enum h2_result h2_serve(int fd, struct h2_state *state, const char *early, size_t early_len, struct h2_context *context)
+{
+    struct connection *conn;
+    enum h2_result     result;
+
+    context->bytes_read = 0;
+    conn                = (struct connection *)calloc(1, sizeof(*conn));
+    if(conn == NULL || early_len > sizeof(conn->in))
+    {
+        perror("webserver (h2 connection)");
+        free(conn);
+        return H2_ERROR;
+    }
+    conn->fd      = fd;
+    conn->state   = state;
+    conn->context = context;
+    memcpy(conn->in, early, early_len);
+    conn->in_len = early_len;
+
+    // Sends stay blocking, a client that stops reading is caught by SO_SNDTIMEO
+    if(context->write_timeout > 0)
+    {
+        struct timeval send_timeout;
+
+        send_timeout.tv_sec  = context->write_timeout;
+        send_timeout.tv_usec = 0;
+        if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) != 0)
+        {
+            perror("webserver (setsockopt SO_SNDTIMEO)");
+        }
+    }
+
+    if(state->active)
+    {
+        // The client acknowledged a table size of 0 before the connection was given back
+        conn->acked = 1;
+        hpack_decoder_init(&conn->decoder, 0);
+    }
+    else
+    {
+        uint8_t settings[SETTINGS_SENT * SETTING_LEN];
+        int     one = 1;
+
+        // Every flush is a whole batch of frames, left to Nagle its tail waits for the client's delayed ACK.
+        // A TLS connection bridged through a socketpair has no TCP options, there it is a no-op failure.
+        (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        conn->preface = 1;
+        hpack_decoder_init(&conn->decoder, HPACK_TABLE_SIZE);
+
+        // The server preface, no dynamic table so the header tables never have to outlive this worker
+        settings[0] = 0;
+        settings[1] = SETTINGS_HEADER_TABLE_SIZE;
+        put_u32(settings + 2, 0);
+        settings[SETTING_LEN]     = 0;
+        settings[SETTING_LEN + 1] = SETTINGS_ENABLE_PUSH;
+        put_u32(settings + SETTING_LEN + 2, 0);
+        settings[2 * SETTING_LEN]     = 0;
+        settings[2 * SETTING_LEN + 1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+        put_u32(settings + 2 * SETTING_LEN + 2, MAX_STREAMS);
+        settings[3 * SETTING_LEN]     = 0;
+        settings[3 * SETTING_LEN + 1] = SETTINGS_MAX_HEADER_LIST_SIZE;
+        put_u32(settings + 3 * SETTING_LEN + 2, HEADER_BLOCK_MAX);
+        queue_frame(conn, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+    }
+
+    result = run(conn);
+
+    for(int i = 0; i < MAX_STREAMS; i++)
+    {
+        if(conn->streams[i].id != 0 && conn->streams[i].resource.fd >= 0)
+        {
+            close(conn->streams[i].resource.fd);
+        }
+    }
+    free(conn);
+    return result;
+}
+
+/*
+    Reads frames, answers them and sends the responses of the open streams until the
+    connection can be given back
+
+    @param
+    conn: The connection
+
+    @return
+    Why the connection was given back
+ */
+static enum h2_result run(struct connection *conn)
+{
+    while(1)
+    {
+        enum error_code error = process_input(conn);
+        enum h2_result  result;
+
+        if(error != NO_ERROR)
+        {
+            fprintf(stderr, "HTTP/2 connection error %u on fd %d\n", error, conn->fd);
+            conn->out_len = 0;
+            queue_u32(conn, FRAME_GOAWAY, conn->state->last_stream, error);
+            flush(conn);
+            return H2_ERROR;
+        }
+
+        queue_data(conn);
+        flush(conn);
+        if(conn->failed != H2_IDLE)
+        {
+            return conn->failed;
+        }
+
+        // Given back only once what already arrived was read, a held connection comes back because something did
+        if(conn->open == 0 && conn->block_stream == 0 && conn->in_len == 0 && !conn->preface)
+        {
+            if(conn->goaway)
+            {
+                return H2_CLOSED;
+            }
+            if(conn->acked)
+            {
+                if(read_input(conn, 0, &result) != 0)
+                {
+                    return result;
+                }
+                if(conn->in_len == 0)
+                {
+                    return H2_IDLE;
+                }
+                continue;
+            }
+        }
+
+        // With DATA to send only what already arrived is read, WINDOW_UPDATE and RST_STREAM among it
+        if(read_input(conn, !sendable(conn), &result) != 0)
+        {
+            return result;
+        }
+    }
+}
+
+/*
+    Reads what the client sent into the input buffer
+
+    @param
+    conn: The connection
+    wait: Wait for the client, with the write timeout while a stream waits for its window
+    and the header timeout otherwise, instead of taking only what already arrived
+    result: Set when the connection has to be given back
+
+    @return
+    0 if the connection goes on, -1 if it has to be given back
+ */
+static int read_input(struct connection *conn, int wait, enum h2_result *result)
+{
+    ssize_t got;
+
+    if(wait)
+    {
+        int           seconds = conn->open > 0 ? conn->context->write_timeout : conn->context->header_timeout;
+        struct pollfd pfd;
+        int           ready;
+
+        pfd.fd      = conn->fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        ready       = poll(&pfd, 1, seconds > 0 ? seconds * MS_PER_SEC : -1);
+        if(ready < 0 && errno == EINTR)
+        {
+            return 0;
+        }
+        if(ready == 0)
+        {
+            *result = conn->open > 0 ? H2_WRITE_TIMEOUT : H2_HEADER_TIMEOUT;
+            return -1;
+        }
+        if(ready < 0)
+        {
+            perror("webserver (h2 poll)");
+            *result = H2_CLOSED;
+            return -1;
+        }
+    }
+
+    got = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, MSG_DONTWAIT);
+    if(got < 0 && (would_block(errno) || errno == EINTR))
+    {
+        return 0;
+    }
+    if(got <= 0)
+    {
+        if(got < 0)
+        {
+            perror("webserver (h2 read)");
+        }
+        *result = H2_CLOSED;
+        return -1;
+    }
+    conn->in_len += (size_t)got;
+    conn->context->bytes_read += (uint64_t)got;
+    return 0;
+}
+
+/*
+    Handles every complete frame in the input buffer and keeps the rest for later. The
+    buffer holds the largest frame we accept, so a full buffer always has one to handle.
+
+    @param
+    conn: The connection
+
+    @return
+    NO_ERROR, or the error to end the connection with
+ */
+static enum error_code process_input(struct connection *conn)
+{
+    size_t          pos   = 0;
+    enum error_code error = NO_ERROR;
+
+    if(conn->preface)
+    {
+        if(memcmp(conn->in, H2_PREFACE, conn->in_len < H2_PREFACE_LEN ? conn->in_len : H2_PREFACE_LEN) != 0)
+        {
+            return PROTOCOL_ERROR;
+        }
+        if(conn->in_len < H2_PREFACE_LEN)
+        {
+            return NO_ERROR;
+        }
+        pos                         = H2_PREFACE_LEN;
+        conn->preface               = 0;
+        conn->state->active         = 1;
+        conn->state->last_stream    = 0;
+        conn->state->send_window    = DEFAULT_WINDOW;
+        conn->state->initial_window = DEFAULT_WINDOW;
+        conn->state->max_frame      = DEFAULT_MAX_FRAME;
+    }
+
+    while(error == NO_ERROR && conn->failed == H2_IDLE && conn->in_len - pos >= FRAME_HEADER_LEN)
+    {
+        const uint8_t *frame  = conn->in + pos;
+        size_t         length = (size_t)frame[0] << (2 * BYTE_BITS) | (size_t)frame[1] << BYTE_BITS | frame[2];
+
+        if(length > DEFAULT_MAX_FRAME)
+        {
+            error = FRAME_SIZE_ERROR;
+            break;
+        }
+        if(conn->in_len - pos < FRAME_HEADER_LEN + length)
+        {
+            break;
+        }
+        error = handle_frame(conn, frame[3], frame[4], get_u32(frame + FRAME_HEADER_LEN - 4) & STREAM_ID_MASK, frame + FRAME_HEADER_LEN, length);
+        pos += FRAME_HEADER_LEN + length;
+    }
+
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+    return error;
+}
+
+/*
+    Handles one frame
+
+    @param
+    conn: The connection
+    type: enum frame_type, other types are ignored
+    flags: Its flags
+    stream_id: The stream it belongs to, 0 for the connection
+    payload: Its payload
+    length: Length of the payload
+
+    @return
+    NO_ERROR, or the error to end the connection with
+ */
+static enum error_code handle_frame(struct connection *conn, uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length)
+{
+    // Nothing may come between the frames of a header block
+    if(conn->block_stream != 0 && type != FRAME_CONTINUATION)
+    {
+        return PROTOCOL_ERROR;
+    }
+
+    switch(type)
+    {
+        case FRAME_DATA:
+        {
+            return on_data(conn, flags, stream_id, length);
+        }
+        case FRAME_HEADERS:
+        {
+            return on_headers(conn, flags, stream_id, payload, length);
+        }
+        case FRAME_CONTINUATION:
+        {
+            return on_continuation(conn, flags, stream_id, payload, length);
+        }
+        case FRAME_PRIORITY:
+        {
+            // Every stream gets the same share anyway
+            if(stream_id == 0)
+            {
+                return PROTOCOL_ERROR;
+            }
+            return length == PRIORITY_LEN ? NO_ERROR : FRAME_SIZE_ERROR;
+        }
+        case FRAME_RST_STREAM:
+        {
+            struct stream *stream = find_stream(conn, stream_id);
+
+            if(stream_id == 0 || stream_id > conn->state->last_stream)
+            {
+                return PROTOCOL_ERROR;
+            }
+            if(length != RST_STREAM_LEN)
+            {
+                return FRAME_SIZE_ERROR;
+            }
+            if(stream != NULL)
+            {
+                stream->remote_open = 0;
+                end_stream(conn, stream, NO_ERROR);
+            }
+            return NO_ERROR;
+        }
+        case FRAME_SETTINGS:
+        {
+            return on_settings(conn, flags, stream_id, payload, length);
+        }
+        case FRAME_PING:
+        {
+            if(stream_id != 0)
+            {
+                return PROTOCOL_ERROR;
+            }
+            if(length != PING_LEN)
+            {
+                return FRAME_SIZE_ERROR;
+            }
+            if((flags & FLAG_END_STREAM) == 0)
+            {
+                queue_frame(conn, FRAME_PING, FLAG_END_STREAM, 0, payload, length);
+            }
+            return NO_ERROR;
+        }
+        case FRAME_GOAWAY:
+        {
+            // The streams already open are still answered
+            if(stream_id != 0)
+            {
+                return PROTOCOL_ERROR;
+            }
+            conn->goaway = 1;
+            return NO_ERROR;
+        }
+        case FRAME_WINDOW_UPDATE:
+        {
+            return on_window_update(conn, stream_id, payload, length);
+        }
+        case FRAME_PUSH_PROMISE:
+        {
+            // Only a server may push
+            return PROTOCOL_ERROR;
+        }
+        default:
+        {
+            return NO_ERROR;
+        }
+    }
+}
+
+/*
+    Handles a DATA frame. Request bodies are not read: GET and HEAD have none and any other
+    method was answered with 405 already, so the bytes are dropped and given back to the
+    connection window straight away.
+
+    @param
+    conn: The connection
+    flags: Its flags
+    stream_id: Its stream
+    length: Length of its payload, padding included
+
+    @return
+    NO_ERROR, or the error to end the connection with
+ */
+static enum error_code on_data(struct connection *conn, uint8_t flags, uint32_t stream_id, size_t length)
+{
+    struct stream *stream = find_stream(conn, stream_id);
+
+    if(stream_id == 0 || stream_id > conn->state->last_stream)
+    {
+        return PROTOCOL_ERROR;
+    }
+    if(length > 0)
+    {
+        queue_u32(conn, FRAME_WINDOW_UPDATE, 0, (uint32_t)length);
+    }
+    if(stream != NULL && (flags & FLAG_END_STREAM) != 0)
+    {
+        stream->remote_open = 0;
+    }
+    return NO_ERROR;
+}
+
+/*
+    Handles a HEADERS frame: opens a stream, or takes trailers for one that is open, and
+    starts gathering its header block
+
+    @param
+    conn: The connection
+    flags: Its flags
+    stream_id: Its stream
+    payload: Its payload
+    length: Length of the payload
+
+    @return
+    NO_ERROR, or the error to end the connection with
+ */
+static enum error_code on_headers(struct connection *conn, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length)
+{
+    size_t start   = 0;
+    size_t padding = 0;
+
+    if(stream_id == 0 || (stream_id % 2 == 0) || (stream_id <= conn->state->last_stream && find_stream(conn, stream_id) == NULL))
+    {
+        return PROTOCOL_ERROR;
+    }
+    if((flags & FLAG_PADDED) != 0)
+    {
+        if(length < PADDED_LEN)
+        {
+            return FRAME_SIZE_ERROR;
+        }
+        padding = payload[0];
+        start   = PADDED_LEN;
+    }
+    if((flags & FLAG_PRIORITY) != 0)
+    {
+        start += PRIORITY_LEN;
+    }
+    if(start + padding > length)
+    {
+        return PROTOCOL_ERROR;
+    }
+    if(stream_id > conn->state->last_stream)
+    {
+        conn->state->last_stream = stream_id;
+    }
+
+    conn->block_stream     = stream_id;
+    conn->block_end_stream = (flags & FLAG_END_STREAM) != 0;
+    conn->block_len        = 0;
+    return on_continuation(conn, flags, stream_id, payload + start, length - start - padding);
+}
+
+/*
+    Adds a fragment to the header block being gathered, and handles the block once it is whole
+
+    @param
+    conn: The connection
+    flags: Flags of the frame the fragment came in
+    stream_id: Its stream
+    fragment: The fragment
+    length: Its length
+
+    @return
+    NO_ERROR, or the error to end the connection with
+ */
+static enum error_code on_continuation(struct connection *conn, uint8_t flags, uint32_t stream_id, const uint8_t *fragment, size_t length)
+{
+    if(conn->block_stream == 0 || stream_id != conn->block_stream)
+    {
+        return PROTOCOL_ERROR;
+    }
+    if(length > sizeof(conn->block) - conn->block_len)
+    {
+        // Over the SETTINGS_MAX_HEADER_LIST_SIZE we sent, the block cannot be decoded and the table is lost with it
+        return ENHANCE_YOUR_CALM;
+    }
+    memcpy(conn->block + conn->block_len, fragment, length);
+    conn->block_len += length;
+    if((flags & FLAG_END_HEADERS) == 0)
+    {
+        return NO_ERROR;
+    }
+    return end_block(conn);
+}
+
+/*
+    Handles a SETTINGS frame, or the acknowledgement of ours
+
+    @param
+    conn: The connection
+    flags: Its flags
+    stream_id: Must be 0
+    payload: The settings
+    length: Length of the payload
+
+    @return
+    NO_ERROR, or the error to end the connection with
+ */
+static enum error_code on_settings(struct connection *conn, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length)
+{
+    if(stream_id != 0)
+    {
+        return PROTOCOL_ERROR;
+    }
+    if((flags & FLAG_END_STREAM) != 0)
+    {
+        if(length != 0)
+        {
+            return FRAME_SIZE_ERROR;
+        }
+
+        // From now on every header block of the client starts from an empty table
+        conn->acked = 1;
+        hpack_set_limit(&conn->decoder, 0);
+        return NO_ERROR;
+    }
+    if(length % SETTING_LEN != 0)
+    {
+        return FRAME_SIZE_ERROR;
+    }
+
+    for(size_t pos = 0; pos < length; pos += SETTING_LEN)
+    {
+        unsigned int id    = (unsigned int)payload[pos] << BYTE_BITS | payload[pos + 1];
+        uint32_t     value = get_u32(payload + pos + 2);
+
+        if(id == SETTINGS_INITIAL_WINDOW_SIZE)
+        {
+            int64_t delta = (int64_t)value - (int64_t)conn->state->initial_window;
+
+            if(value > MAX_WINDOW)
+            {
+                return FLOW_CONTROL_ERROR;
+            }
+
+            // Applies to the windows of the open streams as well
+            for(int i = 0; i < MAX_STREAMS; i++)
+            {
+                if(conn->streams[i].id != 0)
+                {
+                    conn->streams[i].window += delta;
+                    if(conn->streams[i].window > MAX_WINDOW)
+                    {
+                        return FLOW_CONTROL_ERROR;
+                    }
+                }
+            }
+            conn->state->initial_window = value;
+        }
+        else if(id == SETTINGS_MAX_FRAME_SIZE)
+        {
+            if(value < DEFAULT_MAX_FRAME || value > MAX_FRAME_LIMIT)
+            {
+                return PROTOCOL_ERROR;
+            }
+            conn->state->max_frame = value;
+        }
+        else if(id == SETTINGS_ENABLE_PUSH && value > 1)
+        {
+            return PROTOCOL_ERROR;
+        }
+    }
+    queue_frame(conn, FRAME_SETTINGS, FLAG_END_STREAM, 0, NULL, 0);
+    return NO_ERROR;
+}
+
+/*
+    Handles a WINDOW_UPDATE frame for the connection or one of its streams
+
+    @param
+    conn: The connection
+    stream_id: Its stream, 0 for the connection
+    payload: The increment
+    length: Length of the payload
+
+    @return
+    NO_ERROR, or the error to end the connection with
+ */
+static enum error_code on_window_update(struct connection *conn, uint32_t stream_id, const uint8_t *payload, size_t length)
+{
+    struct stream *stream;
+    uint32_t       increment;
+
+    if(length != WINDOW_UPDATE_LEN)
+    {
+        return FRAME_SIZE_ERROR;
+    }
+    increment = get_u32(payload) & STREAM_ID_MASK;
+    if(stream_id == 0)
+    {
+        if(increment == 0)
+        {
+            return PROTOCOL_ERROR;
+        }
+        conn->state->send_window += increment;
+        return conn->state->send_window > MAX_WINDOW ? FLOW_CONTROL_ERROR : NO_ERROR;
+    }
+    if(stream_id > conn->state->last_stream)
+    {
+        return PROTOCOL_ERROR;
+    }
+
+    // One for a stream that already ended is harmless
+    stream = find_stream(conn, stream_id);
+    if(stream == NULL)
+    {
+        return NO_ERROR;
+    }
+    if(increment == 0)
+    {
+        end_stream(conn, stream, PROTOCOL_ERROR);
+        return NO_ERROR;
+    }
+    stream->window += increment;
+    if(stream->window > MAX_WINDOW)
+    {
+        end_stream(conn, stream, FLOW_CONTROL_ERROR);
+    }
+    return NO_ERROR;
+}
+
+/*
+    Decodes a whole header block and answers the request it opens. Trailers of a stream
+    that is open are decoded to keep the table in step and otherwise ignored.
+
+    @param
+    conn: The connection
+
+    @return
+    NO_ERROR, or the error to end the connection with
+ */
+static enum error_code end_block(struct connection *conn)
+{
+    struct request request;
+    struct stream *stream = find_stream(conn, conn->block_stream);
+    uint32_t       id     = conn->block_stream;
+
+    request.arena      = conn->context->arena;
+    request.method[0]  = '\0';
+    request.path       = NULL;
+    request.failed     = 0;
+    conn->block_stream = 0;
+    if(hpack_decode(&conn->decoder, conn->block, conn->block_len, collect_field, &request) != 0)
+    {
+        return COMPRESSION_ERROR;
+    }
+
+    if(stream != NULL)
+    {
+        if(conn->block_end_stream)
+        {
+            stream->remote_open = 0;
+        }
+        return NO_ERROR;
+    }
+    if(conn->goaway)
+    {
+        queue_u32(conn, FRAME_RST_STREAM, id, REFUSED_STREAM);
+        return NO_ERROR;
+    }
+    start_stream(conn, id, conn->block_end_stream, &request);
+    return NO_ERROR;
+}
+
+/*
+    Keeps the fields of a request the response depends on, called by hpack_decode. It
+    never stops the decoding, the table has to see the whole block.
+
+    @param
+    name: Name of the field
+    name_len: Its length
+    value: Value of the field
+    value_len: Its length
+    arg: The struct request being filled
+
+    @return
+    0
+ */
+static int collect_field(const char *name, size_t name_len, const char *value, size_t value_len, void *arg)
+{
+    struct request *request = (struct request *)arg;
+
+    if(name_len == strlen(":method") && memcmp(name, ":method", name_len) == 0)
+    {
+        if(value_len >= sizeof(request->method))
+        {
+            request->failed = 1;
+            return 0;
+        }
+        memcpy(request->method, value, value_len);
+        request->method[value_len] = '\0';
+    }
+    else if(name_len == strlen(":path") && memcmp(name, ":path", name_len) == 0)
+    {
+        request->path = (char *)arena_alloc(request->arena, value_len + 1);
+        if(request->path == NULL)
+        {
+            request->failed = 1;
+            return 0;
+        }
+        memcpy(request->path, value, value_len);
+        request->path[value_len] = '\0';
+    }
+    return 0;
+}
+
+/*
+    Answers a request: resolves it, sends the headers of the response and, if it has a
+    body, leaves the stream open for queue_data to send it
+
+    @param
+    conn: The connection
+    id: The new stream
+    request_ended: The request has no body
+    request: Its fields
+ */
+static void start_stream(struct connection *conn, uint32_t id, int request_ended, const struct request *request)
+{
+    struct stream *stream = NULL;
+    uint8_t        block[RESPONSE_BLOCK_MAX];
+    char           length[LENGTH_DIGITS];
+    size_t         len;
+    int            is_get;
+    int            is_head;
+
+    for(int i = 0; i < MAX_STREAMS && stream == NULL; i++)
+    {
+        if(conn->streams[i].id == 0)
+        {
+            stream = &conn->streams[i];
+        }
+    }
+    if(stream == NULL)
+    {
+        // More than the SETTINGS_MAX_CONCURRENT_STREAMS we sent
+        queue_u32(conn, FRAME_RST_STREAM, id, REFUSED_STREAM);
+        return;
+    }
+    if(request->failed || request->method[0] == '\0' || request->path == NULL)
+    {
+        queue_u32(conn, FRAME_RST_STREAM, id, request->failed ? INTERNAL_ERROR : PROTOCOL_ERROR);
+        return;
+    }
+
+    is_get  = strcmp(request->method, "GET") == 0;
+    is_head = strcmp(request->method, "HEAD") == 0;
+    printf("HTTP/2 stream %" PRIu32 ": %s %s\n", id, request->method, request->path);
+    if(conn->context->open_resource(conn->context->arena, is_get || is_head ? request->path : "/405.txt", is_head ? 0 : -1, &stream->resource) != 0)
+    {
+        queue_u32(conn, FRAME_RST_STREAM, id, INTERNAL_ERROR);
+        return;
+    }
+    stream->id          = id;
+    stream->remote_open = !request_ended;
+    stream->window      = conn->state->initial_window;
+    stream->sent        = 0;
+    conn->open++;
+
+    snprintf(length, sizeof(length), "%lu", stream->resource.length);
+    len = hpack_encode_status(block, stream->resource.status);
+    len += hpack_encode_literal(block + len, sizeof(block) - len, HPACK_CONTENT_TYPE_INDEX, stream->resource.content_type, strlen(stream->resource.content_type));
+    len += hpack_encode_literal(block + len, sizeof(block) - len, HPACK_CONTENT_LENGTH_INDEX, length, strlen(length));
+    if(!is_get && !is_head)
+    {
+        len += hpack_encode_literal(block + len, sizeof(block) - len, HPACK_ALLOW_INDEX, ALLOW_VALUE, strlen(ALLOW_VALUE));
+    }
+
+    if(is_head || stream->resource.length == 0)
+    {
+        queue_frame(conn, FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, id, block, len);
+        end_stream(conn, stream, NO_ERROR);
+        return;
+    }
+    queue_frame(conn, FRAME_HEADERS, FLAG_END_HEADERS, id, block, len);
+}
+
+/*
+    Frees the slot of a stream whose response is done or that was reset. A client still
+    sending its request is told with RST_STREAM that the rest is not needed.
+
+    @param
+    conn: The connection
+    stream: The stream
+    error: The error to reset it with, NO_ERROR if the response is complete
+ */
+static void end_stream(struct connection *conn, struct stream *stream, enum error_code error)
+{
+    if(error != NO_ERROR || stream->remote_open)
+    {
+        queue_u32(conn, FRAME_RST_STREAM, stream->id, error);
+    }
+    if(stream->resource.fd >= 0)
+    {
+        close(stream->resource.fd);
+    }
+    stream->id = 0;
+    conn->open--;
+
+    // The paths and pages of the streams are all that is in the arena
+    if(conn->open == 0)
+    {
+        arena_reset(conn->context->arena);
+    }
+}
+
+/*
+    Finds an open stream
+
+    @param
+    conn: The connection
+    id: The stream
+
+    @return
+    The stream, or NULL if it is not open
+ */
+static struct stream *find_stream(struct connection *conn, uint32_t id)
+{
+    for(int i = 0; i < MAX_STREAMS && id != 0; i++)
+    {
+        if(conn->streams[i].id == id)
+        {
+            return &conn->streams[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+    Tells whether a stream could send DATA right now
+
+    @param
+    conn: The connection
+
+    @return
+    1 if one could, 0 if every open stream waits for a window
+ */
+static int sendable(const struct connection *conn)
+{
+    if(conn->state->send_window <= 0)
+    {
+        return 0;
+    }
+    for(int i = 0; i < MAX_STREAMS; i++)
+    {
+        if(conn->streams[i].id != 0 && conn->streams[i].window > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Fills the output buffer with DATA frames, a frame per stream at a time so that a large
+    file does not hold up the small ones opened with it
+
+    @param
+    conn: The connection
+ */
+static void queue_data(struct connection *conn)
+{
+    int progress = 1;
+
+    while(progress && conn->failed == H2_IDLE)
+    {
+        progress = 0;
+        for(int n = 0; n < MAX_STREAMS; n++)
+        {
+            int            index  = (conn->next + n) % MAX_STREAMS;
+            struct stream *stream = &conn->streams[index];
+            uint8_t       *frame;
+            size_t         chunk;
+            int            last;
+
+            if(stream->id == 0 || stream->window <= 0 || conn->state->send_window <= 0)
+            {
+                continue;
+            }
+            chunk = stream->resource.length - stream->sent;
+            chunk = chunk < conn->state->max_frame ? chunk : conn->state->max_frame;
+            chunk = chunk < DEFAULT_MAX_FRAME ? chunk : DEFAULT_MAX_FRAME;
+            chunk = (int64_t)chunk < stream->window ? chunk : (size_t)stream->window;
+            chunk = (int64_t)chunk < conn->state->send_window ? chunk : (size_t)conn->state->send_window;
+            if(conn->out_len + FRAME_HEADER_LEN + chunk > sizeof(conn->out))
+            {
+                // Full, the rest goes out after this is written
+                conn->next = index;
+                return;
+            }
+
+            frame = conn->out + conn->out_len;
+            if(stream->resource.data != NULL)
+            {
+                memcpy(frame + FRAME_HEADER_LEN, stream->resource.data + stream->sent, chunk);
+            }
+            else if(pread(stream->resource.fd, frame + FRAME_HEADER_LEN, chunk, (off_t)stream->sent) != (ssize_t)chunk)
+            {
+                perror("webserver (h2 read file)");
+                end_stream(conn, stream, INTERNAL_ERROR);
+                continue;
+            }
+            stream->sent += chunk;
+            last = stream->sent == stream->resource.length;
+            put_frame_header(frame, chunk, FRAME_DATA, last ? FLAG_END_STREAM : 0, stream->id);
+            conn->out_len += FRAME_HEADER_LEN + chunk;
+            stream->window -= (int64_t)chunk;
+            conn->state->send_window -= (int64_t)chunk;
+            progress = 1;
+            if(last)
+            {
+                end_stream(conn, stream, NO_ERROR);
+            }
+        }
+    }
+}
+
+/*
+    Adds a frame to the output buffer, writing out what is there first if it does not fit
+
+    @param
+    conn: The connection
+    type: enum frame_type
+    flags: Its flags
+    stream_id: Its stream, 0 for the connection
+    payload: Its payload, NULL if there is none
+    length: Length of the payload, at most DEFAULT_MAX_FRAME
+ */
+static void queue_frame(struct connection *conn, uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, size_t length)
+{
+    if(conn->out_len + FRAME_HEADER_LEN + length > sizeof(conn->out))
+    {
+        flush(conn);
+    }
+    if(conn->failed != H2_IDLE)
+    {
+        return;
+    }
+    put_frame_header(conn->out + conn->out_len, length, type, flags, stream_id);
+    if(length > 0)
+    {
+        memcpy(conn->out + conn->out_len + FRAME_HEADER_LEN, payload, length);
+    }
+    conn->out_len += FRAME_HEADER_LEN + length;
+}
+
+/*
+    Adds a frame whose payload is a 32-bit value, WINDOW_UPDATE and RST_STREAM, or GOAWAY
+    for which it is the error code after the last stream
+
+    @param
+    conn: The connection
+    type: FRAME_WINDOW_UPDATE, FRAME_RST_STREAM or FRAME_GOAWAY
+    stream_id: Its stream, the last stream opened for GOAWAY
+    value: The increment or error code
+ */
+static void queue_u32(struct connection *conn, uint8_t type, uint32_t stream_id, uint32_t value)
+{
+    uint8_t payload[GOAWAY_LEN];
+
+    if(type == FRAME_GOAWAY)
+    {
+        put_u32(payload, stream_id);
+        put_u32(payload + WINDOW_UPDATE_LEN, value);
+        queue_frame(conn, type, 0, 0, payload, GOAWAY_LEN);
+        return;
+    }
+    put_u32(payload, value);
+    queue_frame(conn, type, 0, stream_id, payload, WINDOW_UPDATE_LEN);
+}
+
+/*
+    Writes the 9 byte header of a frame
+
+    @param
+    out: Where it is written
+    length: Length of the payload
+    type: enum frame_type
+    flags: Its flags
+    stream_id: Its stream
+ */
+static void put_frame_header(uint8_t *out, size_t length, uint8_t type, uint8_t flags, uint32_t stream_id)
+{
+    out[0] = (uint8_t)(length >> (2 * BYTE_BITS) & BYTE_MASK);
+    out[1] = (uint8_t)(length >> BYTE_BITS & BYTE_MASK);
+    out[2] = (uint8_t)(length & BYTE_MASK);
+    out[3] = type;
+    out[4] = flags;
+    put_u32(out + FRAME_HEADER_LEN - 4, stream_id & STREAM_ID_MASK);
+}
+
+/*
+    Writes a 32-bit value in network order
+
+    @param
+    out: Where it is written
+    value: The value
+ */
+static void put_u32(uint8_t *out, uint32_t value)
+{
+    out[0] = (uint8_t)(value >> (3 * BYTE_BITS) & BYTE_MASK);
+    out[1] = (uint8_t)(value >> (2 * BYTE_BITS) & BYTE_MASK);
+    out[2] = (uint8_t)(value >> BYTE_BITS & BYTE_MASK);
+    out[3] = (uint8_t)(value & BYTE_MASK);
+}
+
+/*
+    Reads a 32-bit value in network order
+
+    @param
+    in: Where it is
+
+    @return
+    The value
+ */
+static uint32_t get_u32(const uint8_t *in)
+{
+    return (uint32_t)in[0] << (3 * BYTE_BITS) | (uint32_t)in[1] << (2 * BYTE_BITS) | (uint32_t)in[2] << BYTE_BITS | in[3];
+}
+
+/*
+    Writes out the output buffer. A send that fails, or hits SO_SNDTIMEO, marks the
+    connection as failed and drops whatever is queued after it.
+
+    @param
+    conn: The connection
+ */
+static void flush(struct connection *conn)
+{
+    size_t sent = 0;
+
+    while(sent < conn->out_len && conn->failed == H2_IDLE)
+    {
+        ssize_t written = send(conn->fd, conn->out + sent, conn->out_len - sent, FRAME_SEND_FLAGS);
+
+        if(written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(written < 0)
+        {
+            perror("webserver (h2 write)");
+            conn->failed = would_block(errno) ? H2_WRITE_TIMEOUT : H2_CLOSED;
+            break;
+        }
+        sent += (size_t)written;
+    }
+    conn->out_len = 0;
+}
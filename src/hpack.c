@@ -0,0 +1,625 @@
+#include "hpack.h"
+#include <string.h>
+
+#define STATIC_ENTRIES 61
+#define HUFFMAN_MAX_BITS 30      // Longest code of the table in RFC 7541 appendix B
+#define HUFFMAN_EOS 256
+#define HUFFMAN_PAD_BITS 8       // Padding after the last symbol is shorter than a byte
+#define BITS_PER_BYTE 8
+#define INDEXED_FLAG 0x80        // 1xxxxxxx: indexed field
+#define INDEXING_FLAG 0x40       // 01xxxxxx: literal added to the table
+#define SIZE_UPDATE_MASK 0xe0    // 001xxxxx: dynamic table size update
+#define SIZE_UPDATE_FLAG 0x20
+#define HUFFMAN_FLAG 0x80        // First bit of a string length
+#define INDEXED_PREFIX 7
+#define INDEXING_PREFIX 6
+#define SIZE_UPDATE_PREFIX 5
+#define LITERAL_PREFIX 4
+#define STRING_PREFIX 7
+#define CONTINUATION_BITS 7
+#define CONTINUATION_MASK 0x7f
+#define CONTINUATION_FLAG 0x80
+#define INTEGER_SHIFT_MAX 28     // Integers stay below 2^35, far above anything a valid block holds
+#define STATUS_DIGITS 3
+#define STATUS_MIN 100           // Status codes are three digits, anything else is clamped into range
+#define STATUS_MAX 999
+#define DECIMAL_BASE 10
+#define STATUS_LITERAL_LEN 2     // Bytes in front of the digits of a :status literal
+
+static int    decode_integer(const uint8_t **pos, const uint8_t *end, int prefix_bits, size_t *value);
+static int    decode_string(const uint8_t **pos, const uint8_t *end, char *scratch, const char **str, size_t *len);
+static int    huffman_decode(const uint8_t *in, size_t len, char *out, size_t size, size_t *out_len);
+static int    lookup(const struct hpack_decoder *decoder, size_t index, const char **name, size_t *name_len, const char **value, size_t *value_len);
+static void   insert(struct hpack_decoder *decoder, const char *name, size_t name_len, const char *value, size_t value_len);
+static void   evict(struct hpack_decoder *decoder, size_t target);
+static size_t encode_integer(uint8_t *out, size_t size, uint8_t flags, int prefix_bits, size_t value);
+
+/*
+    The static table of RFC 7541 appendix A, index 1 first
+ */
+static const char *const static_table[STATIC_ENTRIES][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static const int static_status[] = {200, 204, 206, 304, 400, 404, 500};    // :status values of static entries 8 to 14
+
+/*
+    The Huffman code of RFC 7541 appendix B is canonical: the codes of one length are
+    consecutive, so a code is found from its length, the first code of that length and
+    the symbols sorted by code.
+ */
+static const uint16_t huffman_symbols[HUFFMAN_EOS + 1] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256,
+};
+
+static const uint32_t huffman_first[HUFFMAN_MAX_BITS + 1] = {
+    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x14, 0x5c, 0xf8, 0x0, 0x3f8, 0x7fa, 0xffa, 0x1ff8, 0x3ffc, 0x7ffc,
+    0x0, 0x0, 0x0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8, 0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x0, 0x3ffffffc};
+
+static const uint16_t huffman_count[HUFFMAN_MAX_BITS + 1] = {0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4};
+
+static const uint16_t huffman_offset[HUFFMAN_MAX_BITS + 1] = {0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92, 0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253};
+
+/*
+    Starts the decoding side of a connection with an empty table
+
+    @param
+    decoder: The decoder
+    limit: The table size the peer may use, HPACK_TABLE_SIZE until it acknowledges a smaller one
+ */
+void hpack_decoder_init(struct hpack_decoder *decoder, size_t limit)
+{
+    decoder->limit    = limit < HPACK_TABLE_SIZE ? limit : HPACK_TABLE_SIZE;
+    decoder->max_size = decoder->limit;
+    decoder->size     = 0;
+    decoder->used     = 0;
+    decoder->count    = 0;
+}
+
+/*
+    Lowers the table size the peer may ask for once it acknowledged our settings. The peer
+    has to start its next block with a size update, until then the table stays as it is.
+
+    @param
+    decoder: The decoder
+    limit: The new SETTINGS_HEADER_TABLE_SIZE
+ */
+void hpack_set_limit(struct hpack_decoder *decoder, size_t limit)
+{
+    decoder->limit = limit < HPACK_TABLE_SIZE ? limit : HPACK_TABLE_SIZE;
+}
+
+/*
+    Decodes a whole header block, updating the dynamic table as it goes
+
+    @param
+    decoder: The decoding side of the connection
+    block: The block, the fragments of a HEADERS frame and its CONTINUATION frames put together
+    len: Its length
+    emit: Called for every field
+    arg: Passed to emit
+
+    @return
+    0: Every field was decoded
+    -1: The block is malformed, which breaks the table for the rest of the connection
+    What emit returned if it stopped the decoding
+ */
+int hpack_decode(struct hpack_decoder *decoder, const uint8_t *block, size_t len, hpack_header emit, void *arg)
+{
+    const uint8_t *pos    = block;
+    const uint8_t *end    = block + len;
+    int            fields = 0;
+
+    while(pos < end)
+    {
+        const char *name;
+        const char *value;
+        size_t      name_len;
+        size_t      value_len;
+        size_t      index;
+        int         result;
+
+        if((*pos & INDEXED_FLAG) != 0)
+        {
+            if(decode_integer(&pos, end, INDEXED_PREFIX, &index) != 0 || lookup(decoder, index, &name, &name_len, &value, &value_len) != 0)
+            {
+                return -1;
+            }
+        }
+        else if((*pos & SIZE_UPDATE_MASK) == SIZE_UPDATE_FLAG)
+        {
+            // Only allowed in front of the first field
+            if(fields > 0 || decode_integer(&pos, end, SIZE_UPDATE_PREFIX, &index) != 0 || index > decoder->limit)
+            {
+                return -1;
+            }
+            decoder->max_size = index;
+            evict(decoder, index);
+            continue;
+        }
+        else
+        {
+            int indexing = (*pos & INDEXING_FLAG) != 0;
+
+            if(decode_integer(&pos, end, indexing ? INDEXING_PREFIX : LITERAL_PREFIX, &index) != 0)
+            {
+                return -1;
+            }
+            if(index == 0)
+            {
+                if(decode_string(&pos, end, decoder->name, &name, &name_len) != 0)
+                {
+                    return -1;
+                }
+            }
+            else
+            {
+                const char *unused;
+                size_t      unused_len;
+
+                if(lookup(decoder, index, &name, &name_len, &unused, &unused_len) != 0)
+                {
+                    return -1;
+                }
+
+                // Adding the field may evict the entry its name points into
+                if(indexing && index > STATIC_ENTRIES)
+                {
+                    memcpy(decoder->name, name, name_len);
+                    name = decoder->name;
+                }
+            }
+            if(decode_string(&pos, end, decoder->value, &value, &value_len) != 0)
+            {
+                return -1;
+            }
+            if(indexing)
+            {
+                insert(decoder, name, name_len, value, value_len);
+            }
+        }
+
+        fields++;
+        result = emit(name, name_len, value, value_len, arg);
+        if(result != 0)
+        {
+            return result;
+        }
+    }
+    return 0;
+}
+
+/*
+    Encodes a :status field, indexed when the static table has it
+
+    @param
+    out: Room for at least HPACK_STATUS_MAX bytes
+    status: A status code, three digits
+
+    @return
+    The number of bytes written
+ */
+size_t hpack_encode_status(uint8_t *out, int status)
+{
+    for(size_t i = 0; i < sizeof(static_status) / sizeof(static_status[0]); i++)
+    {
+        if(static_status[i] == status)
+        {
+            out[0] = (uint8_t)(INDEXED_FLAG | (HPACK_STATUS_INDEX + i));
+            return 1;
+        }
+    }
+
+    // A literal with the name of entry 8, never added to the table
+    status = status < STATUS_MIN ? STATUS_MIN : status > STATUS_MAX ? STATUS_MAX : status;
+    out[0] = HPACK_STATUS_INDEX;
+    out[1] = STATUS_DIGITS;
+    for(int i = STATUS_DIGITS - 1; i >= 0; i--)
+    {
+        out[STATUS_LITERAL_LEN + i] = (uint8_t)('0' + status % DECIMAL_BASE);
+        status /= DECIMAL_BASE;
+    }
+    return STATUS_LITERAL_LEN + STATUS_DIGITS;
+}
+
+/*
+    Encodes a field with the name of a static entry as a literal that is not added to the
+    table and not Huffman coded, so the encoding side needs no state
+
+    @param
+    out: Where the field is written
+    size: Room in out
+    name_index: Static table index of the name
+    value: The value
+    value_len: Its length
+
+    @return
+    The number of bytes written, 0 if they do not fit
+ */
+size_t hpack_encode_literal(uint8_t *out, size_t size, unsigned int name_index, const char *value, size_t value_len)
+{
+    size_t name_bytes = encode_integer(out, size, 0, LITERAL_PREFIX, name_index);
+    size_t len_bytes;
+
+    if(name_bytes == 0)
+    {
+        return 0;
+    }
+    len_bytes = encode_integer(out + name_bytes, size - name_bytes, 0, STRING_PREFIX, value_len);
+    if(len_bytes == 0 || value_len > size - name_bytes - len_bytes)
+    {
+        return 0;
+    }
+    memcpy(out + name_bytes + len_bytes, value, value_len);
+    return name_bytes + len_bytes + value_len;
+}
+
+/*
+    Decodes an integer with an N-bit prefix, RFC 7541 section 5.1
+
+    @param
+    pos: Where the integer starts, moved past it
+    end: End of the block
+    prefix_bits: Bits of the first byte that belong to the integer
+    value: Output for the integer
+
+    @return
+    0 on success, -1 if it runs past the block or is too large
+ */
+static int decode_integer(const uint8_t **pos, const uint8_t *end, int prefix_bits, size_t *value)
+{
+    size_t max   = ((size_t)1 << prefix_bits) - 1;
+    int    shift = 0;
+
+    if(*pos >= end)
+    {
+        return -1;
+    }
+    *value = **pos & max;
+    (*pos)++;
+    if(*value < max)
+    {
+        return 0;
+    }
+    while(*pos < end && shift <= INTEGER_SHIFT_MAX)
+    {
+        uint8_t byte = **pos;
+
+        (*pos)++;
+        *value += (size_t)(byte & CONTINUATION_MASK) << shift;
+        shift += CONTINUATION_BITS;
+        if((byte & CONTINUATION_FLAG) == 0)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+    Decodes a string literal, RFC 7541 section 5.2. A plain string is left where it is in
+    the block, a Huffman coded one is decoded into scratch.
+
+    @param
+    pos: Where the string starts, moved past it
+    end: End of the block
+    scratch: HPACK_STRING_MAX bytes for a Huffman coded string
+    str: Output for the string
+    len: Output for its length
+
+    @return
+    0 on success, -1 if it is malformed or too long
+ */
+static int decode_string(const uint8_t **pos, const uint8_t *end, char *scratch, const char **str, size_t *len)
+{
+    int    huffman;
+    size_t length;
+
+    if(*pos >= end)
+    {
+        return -1;
+    }
+    huffman = (**pos & HUFFMAN_FLAG) != 0;
+    if(decode_integer(pos, end, STRING_PREFIX, &length) != 0 || length > (size_t)(end - *pos))
+    {
+        return -1;
+    }
+    if(huffman)
+    {
+        if(huffman_decode(*pos, length, scratch, HPACK_STRING_MAX, len) != 0)
+        {
+            return -1;
+        }
+        *str = scratch;
+    }
+    else
+    {
+        *str = (const char *)*pos;
+        *len = length;
+    }
+    *pos += length;
+    return 0;
+}
+
+/*
+    Decodes a Huffman coded string a bit at a time
+
+    @param
+    in: The coded bytes
+    len: How many there are
+    out: Where the decoded string is written
+    size: Room in out
+    out_len: Output for the length of the decoded string
+
+    @return
+    0 on success, -1 on a bad code, EOS, padding that is not a prefix of EOS, or no room
+ */
+static int huffman_decode(const uint8_t *in, size_t len, char *out, size_t size, size_t *out_len)
+{
+    uint32_t code = 0;
+    int      bits = 0;
+    size_t   n    = 0;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        for(int bit = BITS_PER_BYTE - 1; bit >= 0; bit--)
+        {
+            code = (code << 1) | ((uint32_t)(in[i] >> bit) & 1);
+            bits++;
+            if(bits > HUFFMAN_MAX_BITS)
+            {
+                return -1;
+            }
+            if(code >= huffman_first[bits] && code - huffman_first[bits] < huffman_count[bits])
+            {
+                uint16_t symbol = huffman_symbols[huffman_offset[bits] + code - huffman_first[bits]];
+
+                if(symbol == HUFFMAN_EOS || n >= size)
+                {
+                    return -1;
+                }
+                out[n++] = (char)symbol;
+                code     = 0;
+                bits     = 0;
+            }
+        }
+    }
+    if(bits >= HUFFMAN_PAD_BITS || code != ((uint32_t)1 << bits) - 1)
+    {
+        return -1;
+    }
+    *out_len = n;
+    return 0;
+}
+
+/*
+    Finds an entry of the static or dynamic table
+
+    @param
+    decoder: The decoder
+    index: 1 to 61 for the static table, the dynamic table follows newest first
+    name: Output for the name
+    name_len: Output for its length
+    value: Output for the value
+    value_len: Output for its length
+
+    @return
+    0 on success, -1 if there is no such entry
+ */
+static int lookup(const struct hpack_decoder *decoder, size_t index, const char **name, size_t *name_len, const char **value, size_t *value_len)
+{
+    const struct hpack_entry *entry;
+
+    if(index == 0)
+    {
+        return -1;
+    }
+    if(index <= STATIC_ENTRIES)
+    {
+        *name      = static_table[index - 1][0];
+        *name_len  = strlen(*name);
+        *value     = static_table[index - 1][1];
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= STATIC_ENTRIES;
+    if(index > (size_t)decoder->count)
+    {
+        return -1;
+    }
+    entry      = &decoder->entries[(size_t)decoder->count - index];
+    *name      = decoder->data + entry->offset;
+    *name_len  = entry->name_len;
+    *value     = *name + entry->name_len;
+    *value_len = entry->value_len;
+    return 0;
+}
+
+/*
+    Adds a field to the dynamic table, evicting the oldest entries to make room. A field
+    larger than the whole table empties it and is not added.
+
+    @param
+    decoder: The decoder
+    name: The name, not in the table
+    name_len: Its length
+    value: The value, not in the table
+    value_len: Its length
+ */
+static void insert(struct hpack_decoder *decoder, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    size_t entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+
+    if(entry_size > decoder->max_size)
+    {
+        evict(decoder, 0);
+        return;
+    }
+    evict(decoder, decoder->max_size - entry_size);
+
+    // The bytes in use stay below the table size, so they always fit data
+    memcpy(decoder->data + decoder->used, name, name_len);
+    memcpy(decoder->data + decoder->used + name_len, value, value_len);
+    decoder->entries[decoder->count].offset    = decoder->used;
+    decoder->entries[decoder->count].name_len  = name_len;
+    decoder->entries[decoder->count].value_len = value_len;
+    decoder->count++;
+    decoder->used += name_len + value_len;
+    decoder->size += entry_size;
+}
+
+/*
+    Evicts the oldest entries until the table is no larger than target
+
+    @param
+    decoder: The decoder
+    target: Table size to get down to
+ */
+static void evict(struct hpack_decoder *decoder, size_t target)
+{
+    int    gone  = 0;
+    size_t bytes = 0;
+
+    while(gone < decoder->count && decoder->size > target)
+    {
+        const struct hpack_entry *entry = &decoder->entries[gone];
+
+        decoder->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+        bytes += entry->name_len + entry->value_len;
+        gone++;
+    }
+    if(gone == 0)
+    {
+        return;
+    }
+    memmove(decoder->data, decoder->data + bytes, decoder->used - bytes);
+    memmove(decoder->entries, decoder->entries + gone, (size_t)(decoder->count - gone) * sizeof(decoder->entries[0]));
+    decoder->used -= bytes;
+    decoder->count -= gone;
+    for(int i = 0; i < decoder->count; i++)
+    {
+        decoder->entries[i].offset -= bytes;
+    }
+}
+
+/*
+    Encodes an integer with an N-bit prefix
+
+    @param
+    out: Where it is written
+    size: Room in out
+    flags: Bits of the first byte above the prefix
+    prefix_bits: Bits of the first byte the integer starts in
+    value: The integer
+
+    @return
+    The number of bytes written, 0 if they do not fit
+ */
+static size_t encode_integer(uint8_t *out, size_t size, uint8_t flags, int prefix_bits, size_t value)
+{
+    size_t max = ((size_t)1 << prefix_bits) - 1;
+    size_t n   = 0;
+
+    if(size == 0)
+    {
+        return 0;
+    }
+    if(value < max)
+    {
+        out[0] = (uint8_t)(flags | value);
+        return 1;
+    }
+    out[n++] = (uint8_t)(flags | max);
+    value -= max;
+    while(value > CONTINUATION_MASK)
+    {
+        if(n >= size)
+        {
+            return 0;
+        }
+        out[n++] = (uint8_t)((value & CONTINUATION_MASK) | CONTINUATION_FLAG);
+        value >>= CONTINUATION_BITS;
+    }
+    if(n >= size)
+    {
+        return 0;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
@@ -1,10 +1,18 @@
 #include "http.h"
+#include "chunked.h"
+#include "file_cache.h"
+#include "probes.h"
+#include "storage.h"
+#include "uring.h"
+#include "would_block.h"
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <ndbm.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -13,6 +21,7 @@
 #define HTTP_NOT_FOUND "HTTP/1.0 404 Not Found\r\n"
 #define HTTP_BAD_REQUEST "HTTP/1.0 400 Bad Request\r\n"
 #define HTTP_METHOD_NOT_ALLOWED "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET, HEAD\r\n"
+#define HTTP_OUT_OF_MEMORY "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n"    // The whole response when the arena runs out
 
 #define HTML_CONTENT_TYPE "Content-Type: text/html\r\n"
 #define TEXT_CONTENT_TYPE "Content-Type: text/plain\r\n"
@@ -28,8 +37,25 @@
 #define FILE_EXT_LEN 5
 #define SIZE_404_MSG 20
 #define FOUR 4
-#define DB_BUFFER 16
+#define BINARY_CHUNK_SIZE 65536
+#define BATCH_PREFIX_LEN 4    // Big-endian length in front of each length-prefixed record
+#define BATCH_RESPONSE_LEN 256
+#define BATCH_READ_SIZE 65536                                                     // Bytes of a batch body read at a time
+#define BATCH_BUFFER_SIZE (MAX_POST_BODY + BATCH_PREFIX_LEN + BATCH_READ_SIZE)    // A record and its prefix, with room left to read its end
+#define BITS_PER_BYTE 8
 #define BASE_TEN 10
+#define CONTENT_TYPE_HEADER "Content-Type:"
+#define STATUS_OK 200
+#define STATUS_BAD_REQUEST 400
+#define STATUS_NOT_FOUND 404
+#define STATUS_METHOD_NOT_ALLOWED 405
+#define CONTENT_LENGTH_HEADER "Content-Length:"
+#define LENGTH_PREFIXED_TYPE "application/octet-stream"
+#if defined(MSG_MORE)
+    #define HEADER_SEND_FLAGS MSG_MORE
+#else
+    #define HEADER_SEND_FLAGS 0
+#endif
 
 #define INDEX_FILE_PATH "/index.html"
 
@@ -43,17 +69,81 @@
 #define TXT_EXT "txt"
 #if (defined(__APPLE__) && defined(__MACH__))
     #define FILE_PATH_LEN 11
-typedef size_t datum_size;
 #endif
 
 #if defined(__linux__)
     #define FILE_PATH_LEN 12
-typedef int datum_size;
 #endif
 
-static void set_request_method(char *req_header, const char *buffer);
-static int  has_valid_first_line(const char *buffer);
-static int  has_valid_headers(const char *buffer);
+/*
+    Why a batch body stopped before its end
+ */
+enum batch_error
+{
+    BATCH_OK,
+    BATCH_MALFORMED,    // Bad chunked framing or a length prefix past the end
+    BATCH_TOO_LARGE,    // A record longer than MAX_POST_BODY
+    BATCH_SHORT,        // The client closed before the end of the body
+    BATCH_TIMEOUT,      // SO_RCVTIMEO fired
+    BATCH_READ,
+    BATCH_MEMORY
+};
+
+/*
+    A batched POST body read off the socket as it is stored. Decoded bytes not yet handed
+    out are kept in buffer from start to filled, and the current record is copied out with
+    a NUL after it. Both buffers come from the request's arena.
+ */
+struct batch_body
+{
+    int              client_fd;
+    const char      *early;    // Body bytes that arrived with the headers
+    size_t           early_len;
+    int              length_prefixed;    // 0 for one record per line
+    int              chunked;
+    struct chunked   decoder;
+    size_t           unread;    // Bytes of a Content-Length body not taken yet
+    int              ended;     // Every byte of the body is in buffer
+    char            *buffer;
+    size_t           start;
+    size_t           filled;
+    size_t           size;
+    size_t           bytes;    // Decoded bytes of the body so far
+    char            *copy;
+    enum batch_error error;
+};
+
+static void          set_request_method(char *req_header, const char *buffer);
+static int           has_valid_first_line(const char *buffer);
+static int           has_valid_headers(const char *buffer);
+static char         *resource_path(struct arena *arena, const char *request_path);
+static struct uring *get_ring(void);
+static int           read_file_uring(struct arena *arena, const char *request_path, char **content_string, unsigned long *length);
+static int           send_file_uring(struct arena *arena, int fd, const char *request_path);
+static int           find_file(struct arena *arena, const char *request_path, const char **path, struct stat *file_stat);
+static int           send_file_response(struct arena *arena, int newsockfd, const char *request_path, const char *cached, unsigned long length, int is_head);
+static int           send_cached_file(int newsockfd, const char *cached, unsigned long length);
+static int           respond(struct arena *arena, int newsockfd, const char *request_path, int is_head);
+static void          release_ring(void) __attribute__((destructor));
+static void          release_storage(void) __attribute__((destructor));
+static const char   *header_value(const char *request, const char *end, const char *name);
+static int           next_record(struct batch_body *body, const char **record, size_t *len);
+static int           fill_batch(struct batch_body *body);
+static int           refuse_batch(int client_fd, const struct batch_body *body, int stored);
+static int           next_batch_value(const void **value, size_t *value_len, void *arg);
+static int           send_batch_response(int client_fd, const char *status, const char *headers, const char *message);
+
+// The worker's io_uring. ring_state is 0 until the first file is served, then 1 if the ring is ready or -1 if it is unavailable or turned off
+static struct uring ring          = {.fd = -1};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int          ring_state    = 0;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int          write_timeout = 0;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// Files shared by every worker, mapped by the server before it forked. NULL when the cache is off
+static struct file_cache *file_cache = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// Where POST bodies go. Backends that allow it stay open across requests, ndbm is opened for each one
+static struct storage_config storage_config = {.ops = &ndbm_storage_ops};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct storage        post_store     = {.state = NULL};               // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 /*
     Test function to verify dynamic updates to shared library behavior.
@@ -114,25 +204,118 @@ void set_request_path(char *req_path, const char *buffer)
 }
 
 /*
-    Opens a file at the specified path and retrieves its file descriptor and metadata
+    Chooses how files are served. Called by the worker whenever it loads this library,
+    the io_uring itself is only set up by the first request that needs it.
 
     @param
-    request_path: The path of the file to open
-    file_fd: Stores the file descriptor of the file
-    file_state: Stores the file's metadata
+    use_uring: 1 to serve files through io_uring when the kernel supports it, 0 for read and write
+    timeout: Seconds a chunk of a file may take to send, 0 for no limit
+ */
+void set_io_options(int use_uring, int timeout)
+{
+    write_timeout = timeout;
+    if(!use_uring && ring_state == 1)
+    {
+        uring_destroy(&ring);
+    }
+    if(!use_uring)
+    {
+        ring_state = -1;
+    }
+}
+
+/*
+    Hands over the file cache the server mapped before forking. Called by the worker
+    whenever it loads this library.
+
+    @param
+    cache: The cache, or NULL to read every file from disk
+ */
+void set_file_cache(struct file_cache *cache)
+{
+    file_cache = cache;
+}
+
+/*
+    Chooses the storage backend POST bodies are stored with. Called by the server before it
+    forks and by a worker whenever it loads this library again, the store itself is opened
+    by prepare_storage or else by the first POST.
+
+    @param
+    spec: Backend spec accepted by storage_parse, already checked by the server
+
+    @return
+    0: The backend is set
+    -1: The spec is invalid, the backend is unchanged
  */
-static void open_file_at_path(const char *request_path, int *file_fd, struct stat *file_stat)
+int set_storage_backend(const char *spec)
 {
-    const char *base_path = "./resources";
+    struct storage_config config;
+
+    if(storage_parse(spec, &config) != 0)
+    {
+        return -1;
+    }
+    storage_close(&post_store);
+    storage_config = config;
+    return 0;
+}
+
+/*
+    Opens the POST store in the server before the workers are forked, so they start with
+    the log already indexed instead of each scanning it on its first POST. A backend that
+    cannot stay open in several processes is only opened once to create its files.
+
+    @return
+    0: The store is ready
+    -1: It could not be opened
+ */
+int prepare_storage(void)
+{
+    if(post_store.state == NULL && storage_open(&post_store, &storage_config, STORAGE_PATH, 1) != 0)
+    {
+        return -1;
+    }
+    if(!post_store.ops->keep_open)
+    {
+        storage_close(&post_store);
+    }
+    return 0;
+}
+
+/*
+    Takes over the store prepare_storage opened, in a worker that was forked with it
+
+    @return
+    0: The store can be used, or was not open
+    -1: It had to be closed, the first POST opens it again
+ */
+int adopt_storage(void)
+{
+    return storage_after_fork(&post_store);
+}
+
+/*
+    Builds the path of a requested file under ./resources
+
+    @param
+    arena: Per-request arena the full path is allocated from
+    request_path: The path of the file
+
+    @return
+    The full path, or NULL if the arena is exhausted
+ */
+static char *resource_path(struct arena *arena, const char *request_path)
+{
+    const char *base_path = RESOURCE_DIR;
     size_t      base_len  = strlen(base_path);
     size_t      total_len = base_len + strlen(request_path) + 1;
 
-    char *path = (char *)malloc(total_len);
+    char *path = (char *)arena_alloc(arena, total_len);
     if(path == NULL)
     {
-        perror("malloc failed for path");
-        *file_fd = -1;
-        return;
+        fprintf(stderr, "arena allocation failed for path\n");
+        return NULL;
     }
 
     // Build full path
@@ -141,9 +324,31 @@ static void open_file_at_path(const char *request_path, int *file_fd, struct sta
     strncat(path, request_path, total_len - strlen(path) - 1);
 
     printf("file path: %s\n", path);
+    return path;
+}
+
+/*
+    Opens a file at the specified path and retrieves its file descriptor and metadata
+
+    @param
+    arena: Per-request arena the full path is allocated from
+    request_path: The path of the file to open
+    file_fd: Stores the file descriptor of the file
+    file_state: Stores the file's metadata
+ */
+static void open_file_at_path(struct arena *arena, const char *request_path, int *file_fd, struct stat *file_stat)
+{
+    const char *path = resource_path(arena, request_path);
+
+    if(path == NULL)
+    {
+        *file_fd = -1;
+        return;
+    }
 
     *file_fd = open(path, O_RDONLY | O_CLOEXEC);
     stat(path, file_stat);
+    PROBE2(file_opened, *file_fd, file_stat->st_size);
 
 #if (defined(__APPLE__) && defined(__MACH__))
     printf("File size of %s: %lld bytes\n", path, file_stat->st_size);
@@ -154,15 +359,13 @@ static void open_file_at_path(const char *request_path, int *file_fd, struct sta
 #endif
 
     printf("File descriptor: %d\n", *file_fd);
-
-    // Free the allocated memory
-    free(path);
 }
 
 /*
     Reads the content of a file at the specified path and writes it to a string
 
     @param
+    arena: Per-request arena the path and content_string are allocated from
     content_string: Where the text content of a file will be stored
     length: Length of the content
     file_path: The path to the file being read
@@ -173,9 +376,8 @@ static void open_file_at_path(const char *request_path, int *file_fd, struct sta
     -2: The requested file was not found, 404 page loaded instead
     -3: Memory allocation failed while creating content_string
  */
-static int write_to_content_string(char **content_string, unsigned long *length, const char *file_path)
+static int write_to_content_string(struct arena *arena, char **content_string, unsigned long *length, const char *file_path)
 {
-    char         c;                                     // Temp character for read functions
     struct stat  file_stat;                             // Holds file metadata
     struct stat *fileStat = &file_stat;                 // Pointer to file metadata
     int          file_fd;                               // File descriptor for the file
@@ -187,10 +389,10 @@ static int write_to_content_string(char **content_string, unsigned long *length,
     if(strcmp(file_path, "/") == 0)
     {
         // Allocate memory for the index path
-        path = (char *)malloc(sizeof(char) * (FILE_PATH_LEN + 1));
+        path = (char *)arena_alloc(arena, sizeof(char) * (FILE_PATH_LEN + 1));
         if(path == NULL)
         {
-            perror("malloc");
+            fprintf(stderr, "arena_alloc failed\n");
             return -3;
         }
 
@@ -204,10 +406,10 @@ static int write_to_content_string(char **content_string, unsigned long *length,
     else
     {
         // Allocate memory for the requested file path
-        path = (char *)malloc(sizeof(char) * (strlen(file_path) + 1));
+        path = (char *)arena_alloc(arena, sizeof(char) * (strlen(file_path) + 1));
         if(path == NULL)
         {
-            perror("malloc");
+            fprintf(stderr, "arena_alloc failed\n");
             return -3;
         }
 
@@ -219,21 +421,31 @@ static int write_to_content_string(char **content_string, unsigned long *length,
         path[strlen(file_path)] = '\0';
     }
 
-    // Open the file at the specified path
-    open_file_at_path(path, &file_fd, fileStat);
-
-    // Free the allocated path memory
-    free(path);
+    if(get_ring() != NULL)
+    {
+        // Opened, sized and read in two submissions, only a missing file falls through to the 404 below
+        retval = read_file_uring(arena, path, content_string, length);
+        if(retval != -2)
+        {
+            return retval;
+        }
+        file_fd = -1;
+    }
+    else
+    {
+        // Open the file at the specified path
+        open_file_at_path(arena, path, &file_fd, fileStat);
+    }
 
     // If file could not be opened, served the 404 error page
     if(file_fd == -1)
     {
         // If the 404 file is missing, return an error message
         perror("webserver (open: 404 html msg file has been moved or deleted)");
-        *content_string = (char *)malloc((sizeof(char) * SIZE_404_MSG) + 1);
+        *content_string = (char *)arena_alloc(arena, (sizeof(char) * SIZE_404_MSG) + 1);
         if(*content_string == NULL)
         {
-            perror("webserver (malloc)");
+            fprintf(stderr, "webserver (arena_alloc) failed\n");
             close(file_fd);
             return -3;
         }
@@ -254,27 +466,29 @@ static int write_to_content_string(char **content_string, unsigned long *length,
 #endif
 
     // Allocate memory for the content string
-    *content_string = (char *)malloc(sizeof(char) * ((size_t)fileStat->st_size + 1));
+    *content_string = (char *)arena_alloc(arena, sizeof(char) * ((size_t)fileStat->st_size + 1));
     if(*content_string == NULL)
     {
-        perror("webserver (malloc)");
+        fprintf(stderr, "webserver (arena_alloc) failed\n");
         close(file_fd);
         return -3;
     }
 
-    // Read the contents of the file into content_string
-    for(int i = 0; i < fileStat->st_size; i++)
+    // Read the contents of the file into content_string, as much per call as the kernel returns
+    while(*length < (unsigned long)fileStat->st_size)
     {
-        ssize_t valread = read(file_fd, &c, sizeof(char));
+        ssize_t valread = read(file_fd, *content_string + *length, (size_t)fileStat->st_size - *length);
         if(valread < 0)
         {
             perror("webserver (read content string)");
             close(file_fd);
-            free(*content_string);
             return -1;
         }
-        (*content_string)[i] = c;
-        (*length)++;
+        if(valread == 0)
+        {
+            break;
+        }
+        *length += (unsigned long)valread;
     }
     (*content_string)[(*length)] = '\0';
     printf("content_string: %s\n", *content_string);
@@ -282,8 +496,7 @@ static int write_to_content_string(char **content_string, unsigned long *length,
     // Close the file descriptor
     close(file_fd);
 
-    // we don't want to free the content_string here because we need it to stay allocated
-    // in order to put it in the response_string in handle_client
+    // content_string lives in the arena until the worker resets it after the response is sent
 
     return retval;
 }
@@ -521,6 +734,7 @@ static int write_to_client(int newsockfd, const char *response_string)
 {
     ssize_t valwrite;
     valwrite = write(newsockfd, response_string, strlen(response_string));
+    PROBE2(response_written, probe_conn_id(newsockfd), valwrite);
     printf("valwrite: %zd\n", valwrite);
     fflush(stdout);
     if(valwrite < 0)
@@ -534,8 +748,10 @@ static int write_to_client(int newsockfd, const char *response_string)
 
 /*
     Reads the content of a file at the specified path and writes it as binary data to the specified file descriptor.
+    The file is copied through a fixed-size chunk so the memory used does not depend on the file size.
 
     @param
+    arena: Per-request arena the path and copy buffer are allocated from
     fd: The file descriptor to which the binary content will be written
     file_path: The path to the file being read
 
@@ -545,7 +761,7 @@ static int write_to_client(int newsockfd, const char *response_string)
     -2: The requested file was not found (404 error)
     -3: Memory allocation failed during processing
  */
-static int write_to_content_binary(int fd, const char *file_path)
+static int write_to_content_binary(struct arena *arena, int fd, const char *file_path)
 {
     struct stat  file_stat;                // Holds file metadata
     struct stat *fileStat = &file_stat;    // Pointer to file metadata
@@ -560,10 +776,10 @@ static int write_to_content_binary(int fd, const char *file_path)
     if(strcmp(file_path, "/") == 0)
     {
         // Allocate memory for the index path
-        path = (char *)malloc(sizeof(char) * (FILE_PATH_LEN + 1));
+        path = (char *)arena_alloc(arena, sizeof(char) * (FILE_PATH_LEN + 1));
         if(path == NULL)
         {
-            perror("malloc");
+            fprintf(stderr, "arena_alloc failed\n");
             return -3;
         }
 
@@ -574,10 +790,10 @@ static int write_to_content_binary(int fd, const char *file_path)
     else
     {
         // Allocate memory for the requested file path
-        path = (char *)malloc(sizeof(char) * (strlen(file_path) + 1));
+        path = (char *)arena_alloc(arena, sizeof(char) * (strlen(file_path) + 1));
         if(path == NULL)
         {
-            perror("malloc");
+            fprintf(stderr, "arena_alloc failed\n");
             return -3;
         }
 
@@ -586,11 +802,13 @@ static int write_to_content_binary(int fd, const char *file_path)
         path[strlen(file_path)] = '\0';
     }
 
-    // Open the file at the specified path
-    open_file_at_path(path, &file_fd, fileStat);
+    if(get_ring() != NULL)
+    {
+        return send_file_uring(arena, fd, path);
+    }
 
-    // Free the allocated path memory
-    free(path);
+    // Open the file at the specified path
+    open_file_at_path(arena, path, &file_fd, fileStat);
 
     // If file could not be opened, serve the 404 error page (returning -2 signals this)
     if(file_fd == -1)
@@ -607,41 +825,169 @@ static int write_to_content_binary(int fd, const char *file_path)
     printf("File size: %ld bytes\n", fileStat->st_size);
 #endif
 
-    // Allocate memory for the binary content
-    buffer = (char *)malloc((size_t)fileStat->st_size);
-
+    // Allocate the copy buffer
+    buffer = (char *)arena_alloc(arena, BINARY_CHUNK_SIZE);
     if(buffer == NULL)
     {
-        perror("webserver (malloc)");
+        fprintf(stderr, "webserver (arena_alloc) failed\n");
         close(file_fd);
         return -3;
     }
 
-    // Read the entire file into buffer
-    bytes_read = read(file_fd, buffer, (size_t)fileStat->st_size);
+    // Copy the file to the client one chunk at a time
+    while((bytes_read = read(file_fd, buffer, BINARY_CHUNK_SIZE)) > 0)
+    {
+        ssize_t offset = 0;
+
+        while(offset < bytes_read)
+        {
+            bytes_written = write(fd, buffer + offset, (size_t)(bytes_read - offset));
+            if(bytes_written < 0)
+            {
+                perror("Error writing to destination socket");
+                close(fd);
+                close(file_fd);
+                return -1;
+            }
+            offset += bytes_written;
+        }
+    }
+
     if(bytes_read < 0)
     {
         perror("webserver (read binary file)");
-        free(buffer);
         close(file_fd);
         return -1;
     }
 
-    bytes_written = write(fd, buffer, (size_t)fileStat->st_size);
-    if(bytes_written < 0)
+    // Close the file descriptor, the buffer is released when the arena is reset
+    close(file_fd);
+    PROBE2(body_written, probe_conn_id(fd), fileStat->st_size);
+    printf("Succesfully wrote binary file to client\n");
+    return retval;    // Success
+}
+
+/*
+    Sets up this worker's io_uring the first time a file is served
+
+    @return
+    The ring, or NULL if files are served with read and write
+ */
+static struct uring *get_ring(void)
+{
+    if(ring_state == 0)
     {
-        perror("Error writing to destination socket");
-        free(buffer);
-        close(fd);
-        close(file_fd);
+        ring_state = uring_init(&ring) == 0 ? 1 : -1;
+        printf("Serving files with %s\n", ring_state == 1 ? "io_uring" : "read and write (io_uring unavailable)");
+    }
+    return ring_state == 1 ? &ring : NULL;
+}
+
+/*
+    Closes the ring when the library is unloaded, so a reload does not leak it
+ */
+static void release_ring(void)
+{
+    if(ring_state == 1)
+    {
+        uring_destroy(&ring);
+    }
+    ring_state = 0;
+}
+
+/*
+    Closes the POST store when the library is unloaded
+ */
+static void release_storage(void)
+{
+    storage_close(&post_store);
+}
+
+/*
+    Reads a whole file into an arena string through the worker's io_uring
+
+    @param
+    arena: Per-request arena the path and content_string are allocated from
+    request_path: The path of the file being read
+    content_string: Where the content of the file will be stored
+    length: Length of the content
+
+    @return
+    0: File was read successfully and stored in content_string
+    -1: An error occurred while reading the file
+    -2: The file could not be opened
+    -3: Memory allocation failed
+ */
+static int read_file_uring(struct arena *arena, const char *request_path, char **content_string, unsigned long *length)
+{
+    const char *path = resource_path(arena, request_path);
+    off_t       size;
+
+    if(path == NULL)
+    {
+        return -3;
+    }
+    if(uring_open_file(&ring, path, &size) != 0)
+    {
+        perror("webserver (io_uring open)");
+        return -2;
+    }
+    PROBE2(file_opened, -1, size);
+
+    *content_string = (char *)arena_alloc(arena, (size_t)size + 1);
+    if(*content_string == NULL)
+    {
+        fprintf(stderr, "webserver (arena_alloc) failed\n");
+        return -3;
+    }
+    if(uring_read_file(&ring, *content_string, (size_t)size) != 0)
+    {
+        perror("webserver (io_uring read content string)");
         return -1;
     }
+    *length                     = (unsigned long)size;
+    (*content_string)[*length] = '\0';
+    return 0;
+}
 
-    // Close the file descriptors and free dynamic memory
-    close(file_fd);
-    free(buffer);
+/*
+    Sends a file to the client through the worker's io_uring and its registered buffer
+
+    @param
+    arena: Per-request arena the path is allocated from
+    fd: The client socket
+    request_path: The path of the file being sent
+
+    @return
+    0: The file was sent
+    -1: An error occurred while reading or sending the file
+    -2: The file could not be opened
+    -3: Memory allocation failed
+ */
+static int send_file_uring(struct arena *arena, int fd, const char *request_path)
+{
+    const char *path = resource_path(arena, request_path);
+    off_t       size;
+
+    if(path == NULL)
+    {
+        return -3;
+    }
+    if(uring_open_file(&ring, path, &size) != 0)
+    {
+        perror("webserver (io_uring open)");
+        return -2;
+    }
+    PROBE2(file_opened, -1, size);
+
+    if(uring_send_file(&ring, fd, size, write_timeout) != 0)
+    {
+        perror("Error sending file through io_uring");
+        return -1;
+    }
+    PROBE2(body_written, probe_conn_id(fd), size);
     printf("Succesfully wrote binary file to client\n");
-    return retval;    // Success
+    return 0;
 }
 
 /*
@@ -649,32 +995,73 @@ static int write_to_content_binary(int fd, const char *file_path)
     and sending it back to the client
 
     @param
+    arena: Per-request arena every buffer for the response is allocated from
     newsockfd: socket fd for the client
     request_path: file path requested by the client
     is_head: flag indicating whether the HTTP request is a HEAD request
-    is_img: flag indicating that the HTTP request is for an image
+    is_img: flag indicating that the HTTP request is for an image, images and text are both sent straight from the file
+
+    @return
+    0: The HTTP response was successfully sent to the client
+    -1: An error occurred while generating the HTTP response body
+    -2: The requested file was not found
+    -3: The arena ran out before anything was sent, the client got a 500
+ */
+int handle_client(struct arena *arena, int newsockfd, const char *request_path, int is_head, int is_img)
+{
+    int result;
+
+    (void)is_img;
+
+    result = respond(arena, newsockfd, request_path, is_head);
+    if(result == -3)
+    {
+        write_to_client(newsockfd, HTTP_OUT_OF_MEMORY);
+    }
+    return result;
+}
+
+/*
+    Builds and sends the response of handle_client
+
+    @param
+    arena: Per-request arena every buffer for the response is allocated from
+    newsockfd: socket fd for the client
+    request_path: file path requested by the client
+    is_head: flag indicating if the HTTP request is a HEAD request (0) or not (non-zero)
 
     @return
     0: The HTTP response was successfully sent to the client
     -1: An error occurred while generating the HTTP response body
     -2: The requested file was not found
-    -3: Memory allocatio for the response failed
+    -3: The arena ran out, nothing was sent
  */
-int handle_client(int newsockfd, const char *request_path, int is_head, int is_img)
+static int respond(struct arena *arena, int newsockfd, const char *request_path, int is_head)
 {
     char  *response_string;                     // The Full HTTP response
     char  *content_string = {0};                // HTTP response body
-    char **content_ptr    = &content_string;    // Pointer to dynamically allocated resources
+    char **content_ptr    = &content_string;    // Pointer to the arena allocated body
     // TODO: malloc content_type_line
     char          content_type_line[BUFFER_SIZE] = {0};    // Content-type header
     int           valread;                                 // Result of file read operation
     unsigned long length          = 0;                     // Length of response body
     unsigned long response_length = 0;                     // Total length of HTTP response
-    int           result;
+    const char   *path;                                    // Where the file is under ./resources
+    struct stat   file_stat;                               // What stat says about it
+
+    // A file that is there is never read into the arena, its headers go out first and then the file from the cache or disk
+    if(strcmp(request_path, "/405.txt") != 0 && strcmp(request_path, "/400.txt") != 0 && find_file(arena, request_path, &path, &file_stat) == 0)
+    {
+        const char *cached = file_cache != NULL && is_head != 0 ? file_cache_get(file_cache, path, &file_stat) : NULL;
+
+        return send_file_response(arena, newsockfd, request_path, cached, (unsigned long)file_stat.st_size, is_head);
+    }
 
-    // we malloc the content_string in this function
+    // Error pages and the 404 message are built whole
+    // we allocate the content_string from the arena in this function
     // length also gets set to the length of the body in this function
-    valread = write_to_content_string(content_ptr, &length, request_path);
+    length  = 0;
+    valread = write_to_content_string(arena, content_ptr, &length, request_path);
 
     if(valread == -1)
     {
@@ -682,6 +1069,11 @@ int handle_client(int newsockfd, const char *request_path, int is_head, int is_i
         return -1;
     }
 
+    if(valread == -3)
+    {
+        return -3;
+    }
+
     // set content type
     if(valread == -2)
     {
@@ -697,11 +1089,10 @@ int handle_client(int newsockfd, const char *request_path, int is_head, int is_i
     {
         // The method is unsupported
         response_length = strlen(HTTP_METHOD_NOT_ALLOWED) + strlen(content_type_line) + CONTENT_LEN_BUF + length;
-        response_string = (char *)malloc(sizeof(char) * (response_length + 1));
+        response_string = (char *)arena_alloc(arena, sizeof(char) * (response_length + 1));
         if(response_string == NULL)
         {
-            perror("webserver (malloc)");
-            free(content_string);
+            fprintf(stderr, "webserver (arena_alloc) failed\n");
             return -3;
         }
         append_msg_to_response_string(response_string, HTTP_METHOD_NOT_ALLOWED);
@@ -711,8 +1102,6 @@ int handle_client(int newsockfd, const char *request_path, int is_head, int is_i
 
         printf("writing 405 content to response: %s\n", response_string);
         write_to_client(newsockfd, response_string);    // Send 405 response
-        free(content_string);
-        free(response_string);
         return 0;
     }
     // length of response_string = (HTTP HEADER LEN) + content length string length + body length
@@ -720,14 +1109,10 @@ int handle_client(int newsockfd, const char *request_path, int is_head, int is_i
     {
         // Serve 404 response
         response_length = strlen(HTTP_NOT_FOUND) + strlen(content_type_line) + CONTENT_LEN_BUF + length;
-        response_string = (char *)malloc(sizeof(char) * (response_length + 1));
+        response_string = (char *)arena_alloc(arena, sizeof(char) * (response_length + 1));
         if(response_string == NULL)
         {
-            perror("webserver (malloc)");
-            if(is_img == -1)
-            {
-                free(content_string);
-            }
+            fprintf(stderr, "webserver (arena_alloc) failed\n");
             return -3;
         }
         append_msg_to_response_string(response_string, HTTP_NOT_FOUND);
@@ -735,8 +1120,6 @@ int handle_client(int newsockfd, const char *request_path, int is_head, int is_i
         append_content_length_msg(response_string, length);
         append_body(response_string, *content_ptr, length);
         write_to_client(newsockfd, response_string);    // Send 404 response
-        free(content_string);
-        free(response_string);
         return -2;
     }
 
@@ -744,105 +1127,230 @@ int handle_client(int newsockfd, const char *request_path, int is_head, int is_i
     {
         // The request is bad
         response_length = strlen(HTTP_BAD_REQUEST) + strlen(content_type_line) + CONTENT_LEN_BUF + length;
-        response_string = (char *)malloc(sizeof(char) * (response_length + 1));
+        response_string = (char *)arena_alloc(arena, sizeof(char) * (response_length + 1));
         if(response_string == NULL)
         {
-            perror("webserver (malloc)");
-            free(content_string);
+            fprintf(stderr, "webserver (arena_alloc) failed\n");
             return -3;
         }
         append_msg_to_response_string(response_string, HTTP_BAD_REQUEST);
         strncat(response_string, content_type_line, strlen(content_type_line) + 1);
         append_content_length_msg(response_string, length);
         write_to_client(newsockfd, response_string);    // Send 400 response
-        free(content_string);
-        free(response_string);
         return -1;
     }
-    // if it's an image we write directly to the socket
-    if(is_img == 0 && is_head == -1)
+    // The file showed up after find_file looked for it
+    return send_file_response(arena, newsockfd, request_path, NULL, length, is_head);
+}
+
+/*
+    Resolves a request the way handle_client answers it, for a protocol that frames the
+    response itself: the status, the type and size of the body and where its bytes are.
+    A file that is there is left in the cache or on disk, only error pages are read in.
+
+    @param
+    arena: Per-request arena the path and an error page are allocated from
+    request_path: file path requested by the client, /405.txt or /400.txt for those errors
+    is_head: 0 for a HEAD request, whose body is never opened
+    resource: Output for the response, a file it opened is closed by the caller
+
+    @return
+    0: resource describes the response
+    -1: The file could not be read
+    -3: Memory allocation failed
+ */
+int open_resource(struct arena *arena, const char *request_path, int is_head, struct resource *resource)
+{
+    char          content_type_line[BUFFER_SIZE] = {0};
+    const char   *path;
+    struct stat   file_stat;
+    char         *content = NULL;
+    unsigned long length  = 0;
+    const char   *type;
+    size_t        type_len;
+
+    resource->data = NULL;
+    resource->fd   = -1;
+    if(strcmp(request_path, "/405.txt") != 0 && strcmp(request_path, "/400.txt") != 0 && find_file(arena, request_path, &path, &file_stat) == 0)
     {
-        int retval   = 0;
-        int writeval = 0;
-        // printf("it's an image!!!\n");
-        response_length = strlen(HTTP_OK) + strlen(content_type_line) + CONTENT_LEN_BUF + length;
-        response_string = (char *)malloc(sizeof(char) * (response_length + 1));
-        if(response_string == NULL)
+        resource->status = STATUS_OK;
+        resource->length = (unsigned long)file_stat.st_size;
+        set_content_type_from_file_extension(request_path, content_type_line);
+        if(is_head != 0 && resource->length > 0)
         {
-            perror("webserver (malloc)");
-            free(content_string);
-            return -3;
+            resource->data = file_cache != NULL ? file_cache_get(file_cache, path, &file_stat) : NULL;
+            if(resource->data == NULL)
+            {
+                resource->fd = open(path, O_RDONLY | O_CLOEXEC);
+                if(resource->fd < 0)
+                {
+                    perror("webserver (open resource)");
+                    return -1;
+                }
+            }
         }
+    }
+    else
+    {
+        int valread = write_to_content_string(arena, &content, &length, request_path);
 
-        append_msg_to_response_string(response_string, HTTP_OK);
-        strncat(response_string, content_type_line, strlen(content_type_line) + 1);
-        append_content_length_msg(response_string, length);
-        printf("newsockfd: %d\n", newsockfd);
-        writeval = write_to_client(newsockfd, response_string);
-        printf("writeval: %d\n", writeval);
-        if(writeval < 0)
-        {
-            perror("Error writing to client");
-            retval = -1;
-            goto cleanup;
-        }
-        printf("writing to content binary\n");
-        if(write_to_content_binary(newsockfd, request_path) < 0)
+        if(valread == -1 || valread == -3)
         {
-            perror("Error writing content to client");
-            retval = -1;
-            goto cleanup;
+            return valread;
         }
-
-    cleanup:
-        if(response_string)
+        if(valread == -2)
         {
-            free(response_string);
+            // The 404 message is not counted by write_to_content_string
+            resource->status = STATUS_NOT_FOUND;
+            length           = strlen(content);
+            set_content_type_from_file_extension(".html", content_type_line);
         }
-        if(content_string)
+        else
         {
-            free(content_string);
+            // Or the file showed up after find_file looked for it
+            resource->status = strcmp(request_path, "/405.txt") == 0 ? STATUS_METHOD_NOT_ALLOWED : strcmp(request_path, "/400.txt") == 0 ? STATUS_BAD_REQUEST : STATUS_OK;
+            set_content_type_from_file_extension(request_path, content_type_line);
         }
-        return retval;
+        resource->data   = is_head != 0 ? content : NULL;
+        resource->length = length;
+    }
+
+    // Only the value of the header line
+    type     = content_type_line + strlen(CONTENT_TYPE_HEADER) + 1;
+    type_len = strcspn(type, "\r");
+    if(type_len >= RESOURCE_TYPE_LEN)
+    {
+        type_len = RESOURCE_TYPE_LEN - 1;
+    }
+    memcpy(resource->content_type, type, type_len);
+    resource->content_type[type_len] = '\0';
+    return 0;
+}
+
+/*
+    Finds a requested file without opening it
+
+    @param
+    arena: Per-request arena the full path is allocated from
+    request_path: The path of the file, / for the index page
+    path: Set to where the file is
+    file_stat: Set to what stat says about it
+
+    @return
+    0: The file is there
+    -2: There is no regular file at the path
+    -3: Memory allocation failed
+ */
+static int find_file(struct arena *arena, const char *request_path, const char **path, struct stat *file_stat)
+{
+    *path = resource_path(arena, strcmp(request_path, "/") == 0 ? INDEX_FILE_PATH : request_path);
+    if(*path == NULL)
+    {
+        return -3;
+    }
+    if(stat(*path, file_stat) != 0 || !S_ISREG(file_stat->st_mode))
+    {
+        return -2;
     }
-    // Request was successful
-    // printf("request was successful");
-    response_length = strlen(HTTP_OK) + strlen(content_type_line) + CONTENT_LEN_BUF + length;
-    response_string = (char *)malloc(sizeof(char) * (response_length + 1));
+    return 0;
+}
+
+/*
+    Sends a 200 response for a file: the headers with the size, then the file from the
+    shared cache, or copied from disk a chunk at a time or through the ring, so the memory
+    used does not depend on its size
+
+    @param
+    arena: Per-request arena the headers and the copy buffer are allocated from
+    newsockfd: socket fd for the client
+    request_path: file path requested by the client
+    cached: The bytes of the file in the shared cache, NULL to read it from disk
+    length: Size of the file
+    is_head: 0 for a HEAD request, which gets only the headers
+
+    @return
+    0: The response was sent
+    -1: It could not be sent
+    -3: Memory allocation failed
+ */
+static int send_file_response(struct arena *arena, int newsockfd, const char *request_path, const char *cached, unsigned long length, int is_head)
+{
+    char    content_type_line[BUFFER_SIZE] = {0};
+    char   *response_string;
+    ssize_t sent;
+
+    set_content_type_from_file_extension(request_path, content_type_line);
+    response_string = (char *)arena_alloc(arena, strlen(HTTP_OK) + strlen(content_type_line) + CONTENT_LEN_BUF + 1);
     if(response_string == NULL)
     {
-        perror("webserver (malloc)");
-        free(content_string);
+        fprintf(stderr, "webserver (arena_alloc) failed\n");
         return -3;
     }
     append_msg_to_response_string(response_string, HTTP_OK);
-
-    // Append the content-type header
     strncat(response_string, content_type_line, strlen(content_type_line) + 1);
-
-    // append content length section (can only do this once we have the body)
-    // but must be appended before the body
     append_content_length_msg(response_string, length);
+    if(is_head == 0 || length == 0)
+    {
+        return write_to_client(newsockfd, response_string);
+    }
 
-    // append body section, only if not a HEAD request
-    if(is_head == -1)
+    // Held back until the file follows, so a small file still leaves in one segment
+    sent = send(newsockfd, response_string, strlen(response_string), HEADER_SEND_FLAGS);
+    PROBE2(response_written, probe_conn_id(newsockfd), sent);
+    if(sent < 0)
     {
-        append_body(response_string, *content_ptr, length);
+        perror("webserver (send headers)");
+        return -1;
+    }
+    if(cached != NULL)
+    {
+        return send_cached_file(newsockfd, cached, length);
+    }
+    if(write_to_content_binary(arena, newsockfd, request_path) < 0)
+    {
+        perror("Error writing content to client");
+        return -1;
     }
+    return 0;
+}
 
-    // free allocated memory for the body
-    free(content_string);
+/*
+    Writes a file straight from the shared cache to the client
 
-    printf("\n\n\n newsockfd: %d response_string: %s\n", newsockfd, response_string);
-    result = write_to_client(newsockfd, response_string);
-    free(response_string);
+    @param
+    newsockfd: socket fd for the client
+    cached: The bytes of the file
+    length: How many there are
 
-    // write to client
-    return result;
+    @return
+    0: The file was sent
+    -1: An error occurred while writing to the socket
+ */
+static int send_cached_file(int newsockfd, const char *cached, unsigned long length)
+{
+    unsigned long sent = 0;
+
+    while(sent < length)
+    {
+        ssize_t valwrite = write(newsockfd, cached + sent, length - sent);
+
+        if(valwrite < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(valwrite < 0)
+        {
+            perror("Error writing cached file to client");
+            return -1;
+        }
+        sent += (unsigned long)valwrite;
+    }
+    PROBE2(body_written, probe_conn_id(newsockfd), length);
+    return 0;
 }
 
 /*
-    Handles POST requests by extracting the body and storing it in an ndbm database.
+    Handles POST requests by extracting the body and storing it with the configured storage backend.
     Sends an appropriate HTTP response back to the client.
 
     @param
@@ -851,23 +1359,10 @@ int handle_client(int newsockfd, const char *request_path, int is_head, int is_i
  */
 __attribute__((visibility("default"))) int handle_post_request(const char *buffer, int client_fd)
 {
-    DBM        *db;
-    datum       key;
-    datum       value;
-    datum       counter_key;
-    datum       counter_val;
-    datum       new_counter_val;
-    char        db_name[DB_BUFFER];
-    char        key_str[DB_BUFFER];
-    char        counter_buf[DB_BUFFER];
-    char        counter_key_buf[DB_BUFFER];
+    char        key_str[STORAGE_KEY_LEN];
     char       *body;
     const char *response;
-    int         counter = 0;
-
-    strcpy(db_name, "requests_db");
-    strcpy(key_str, "post_data");
-    strcpy(counter_key_buf, "__counter__");
+    int         stored;
 
     // Extract POST body
     body = strstr(buffer, "\r\n\r\n");
@@ -887,11 +1382,10 @@ __attribute__((visibility("default"))) int handle_post_request(const char *buffe
         return 1;
     }
 
-    // Open DB
-    db = dbm_open(db_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if(!db)
+    // Open the store, unless it is still open from an earlier request
+    if(post_store.state == NULL && storage_open(&post_store, &storage_config, STORAGE_PATH, 1) != 0)
     {
-        perror("dbm_open");
+        perror("storage_open");
         response = "HTTP/1.0 500 Internal Server Error\r\n"
                    "Content-Type: text/plain\r\n"
                    "Content-Length: 25\r\n"
@@ -901,46 +1395,18 @@ __attribute__((visibility("default"))) int handle_post_request(const char *buffe
         return 1;
     }
 
-    // Setup counter key
-    counter_key.dptr  = counter_key_buf;
-    counter_key.dsize = strlen("__counter__") + 1;
-
-// Fetch existing counter
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-    counter_val = dbm_fetch(db, counter_key);
-#pragma GCC diagnostic pop
-    if(counter_val.dptr != NULL)
+    // Store data under the next counter key
+    stored = storage_append(&post_store, body, key_str, sizeof(key_str));
+    if(stored != 0)
     {
-        char *endptr = NULL;
-        counter      = (int)strtol(counter_val.dptr, &endptr, BASE_TEN);
-        if(endptr == counter_val.dptr || *endptr != '\0')
-        {
-#if (defined(__APPLE__) && defined(__MACH__))
-            fprintf(stderr, "Invalid counter value in DB: %s\n", (char *)counter_val.dptr);
-#endif
-
-#if defined(__linux__)
-            fprintf(stderr, "Invalid counter value in DB: %s\n", counter_val.dptr);
-#endif
-
-            counter = 0;
-        }
+        perror("storage_append");
     }
-
-    // Generate new key using counter
-    snprintf(key_str, DB_BUFFER, "%d", counter);
-
-    // Store data
-    key.dptr    = key_str;
-    key.dsize   = (datum_size)strlen(key_str) + 1;
-    value.dptr  = body;
-    value.dsize = (datum_size)strlen(body) + 1;
-
-    if(dbm_store(db, key, value, DBM_REPLACE) != 0)
+    if(stored != 0 || !post_store.ops->keep_open)
+    {
+        storage_close(&post_store);
+    }
+    if(stored != 0)
     {
-        perror("dbm_store");
-        dbm_close(db);
         response = "HTTP/1.0 500 Internal Server Error\r\n"
                    "Content-Type: text/plain\r\n"
                    "Content-Length: 28\r\n"
@@ -951,14 +1417,7 @@ __attribute__((visibility("default"))) int handle_post_request(const char *buffe
     }
 
     printf("Stored POST Data under Key: %s\n", key_str);
-
-    // Update counter
-    snprintf(counter_buf, DB_BUFFER, "%d", counter + 1);
-    new_counter_val.dptr  = counter_buf;
-    new_counter_val.dsize = (datum_size)strlen(counter_buf) + 1;
-    dbm_store(db, counter_key, new_counter_val, DBM_REPLACE);
-
-    dbm_close(db);
+    PROBE2(post_stored, probe_conn_id(client_fd), strlen(body) + 1);
 
     // Send 200 OK
     response = "HTTP/1.0 200 OK\r\n"
@@ -973,6 +1432,439 @@ __attribute__((visibility("default"))) int handle_post_request(const char *buffe
     return 0;
 }
 
+/*
+    Handles POST /batch: stores every record of the body under consecutive keys with one
+    hold of the store, then answers with the range. The body holds one record per line,
+    or with Content-Type application/octet-stream records each preceded by a 4 byte
+    big-endian length. Empty lines are skipped and a CR before a newline is dropped.
+    Records are stored NUL-terminated like single POST bodies.
+
+    The body is sent with a Content-Length or Transfer-Encoding: chunked and is read off
+    the socket while it is stored, so it has no size limit and only the record being
+    stored has to fit in memory. If the body turns out bad partway through the counter
+    is left alone and none of the batch is kept.
+
+    @param
+    arena: Per-request arena the body and record buffers are allocated from
+    request: The request line, the headers and the start of the body
+    length: Bytes of the request read, the body may contain NULs
+    client_fd: File descriptor for the client connection, the rest of the body is read from it
+
+    @return
+    0: The batch is stored
+    1: It was refused or could not be stored, an error response was sent
+    BODY_TIMED_OUT: The body stopped arriving, nothing was sent
+ */
+__attribute__((visibility("default"))) int handle_batch_request(struct arena *arena, const char *request, size_t length, int client_fd)
+{
+    struct batch_body body;
+    const char       *end = strstr(request, "\r\n\r\n");
+    const char       *value;
+    unsigned long     first;
+    unsigned long     count;
+    int               stored;
+    char              range[BATCH_RESPONSE_LEN];
+    char              message[BATCH_RESPONSE_LEN];
+
+    if(end == NULL)
+    {
+        return send_batch_response(client_fd, "400 Bad Request", "", "Bad Request\n");
+    }
+    end += FOUR;
+
+    memset(&body, 0, sizeof(body));
+    body.client_fd = client_fd;
+    body.early     = end;
+    body.early_len = length - (size_t)(end - request);
+    body.chunked   = is_chunked(request, end);
+    value          = header_value(request, end, CONTENT_LENGTH_HEADER);
+    if(body.chunked)
+    {
+        chunked_init(&body.decoder);
+    }
+    else if(value != NULL)
+    {
+        body.unread = (size_t)strtoull(value, NULL, BASE_TEN);
+        body.ended  = body.unread == 0;
+    }
+    else
+    {
+        return send_batch_response(client_fd, "411 Length Required", "", "A batch needs a Content-Length or chunked encoding.\n");
+    }
+    value                = header_value(request, end, CONTENT_TYPE_HEADER);
+    body.length_prefixed = value != NULL && strncasecmp(value, LENGTH_PREFIXED_TYPE, strlen(LENGTH_PREFIXED_TYPE)) == 0;
+
+    // Only the pages the body reaches are touched, a batch of short records stays small
+    body.buffer = (char *)arena_alloc(arena, BATCH_BUFFER_SIZE);
+    body.copy   = (char *)arena_alloc(arena, MAX_POST_BODY + 1);
+    if(body.buffer == NULL || body.copy == NULL)
+    {
+        body.error = BATCH_MEMORY;
+        return refuse_batch(client_fd, &body, 1);
+    }
+    body.size = BATCH_BUFFER_SIZE;
+
+    if(post_store.state == NULL && storage_open(&post_store, &storage_config, STORAGE_PATH, 1) != 0)
+    {
+        perror("storage_open");
+        body.error = BATCH_MEMORY;
+        return refuse_batch(client_fd, &body, 0);
+    }
+    stored = storage_append_batch(&post_store, next_batch_value, &body, &first, &count);
+    if(stored != 0 && body.error == BATCH_OK)
+    {
+        perror("storage_append_batch");
+    }
+    if(stored != 0 || !post_store.ops->keep_open)
+    {
+        storage_close(&post_store);
+    }
+    if(stored != 0 || count == 0)
+    {
+        return refuse_batch(client_fd, &body, stored == 0 ? 0 : 1);
+    }
+
+    printf("Stored %lu batched records under keys %lu-%lu\n", count, first, first + count - 1);
+    PROBE2(post_stored, probe_conn_id(client_fd), body.bytes);
+
+    snprintf(range, sizeof(range), "X-Key-Range: %lu-%lu\r\n", first, first + count - 1);
+    snprintf(message, sizeof(message), "Stored %lu records under keys %lu-%lu.\n", count, first, first + count - 1);
+    send_batch_response(client_fd, "200 OK", range, message);
+    return 0;
+}
+
+/*
+    Answers a batch that was not stored. A client that is still sending the body is cut
+    off, otherwise the rest of it would be read as the next request.
+
+    @param
+    client_fd: File descriptor for the client connection
+    body: The body, its error says why the batch stopped
+    stored: Nonzero if storing failed, 0 if the body had no records
+
+    @return
+    BODY_TIMED_OUT if the body stopped arriving, 1 otherwise
+ */
+static int refuse_batch(int client_fd, const struct batch_body *body, int stored)
+{
+    switch(body->error)
+    {
+        case BATCH_MALFORMED:
+        {
+            send_batch_response(client_fd, "400 Bad Request", "", "The batch body is malformed.\n");
+            break;
+        }
+        case BATCH_TOO_LARGE:
+        {
+            send_batch_response(client_fd, "413 Payload Too Large", "", "A record of the batch is too large.\n");
+            break;
+        }
+        case BATCH_SHORT:
+        {
+            send_batch_response(client_fd, "400 Bad Request", "", "The body ended early.\n");
+            break;
+        }
+        case BATCH_TIMEOUT:
+        {
+            shutdown(client_fd, SHUT_RDWR);
+            return BODY_TIMED_OUT;
+        }
+        case BATCH_READ:
+        {
+            break;
+        }
+        case BATCH_OK:
+        case BATCH_MEMORY:
+        default:
+        {
+            if(stored != 0 || body->error == BATCH_MEMORY)
+            {
+                send_batch_response(client_fd, "500 Internal Server Error", "", "Failed to store the batch.\n");
+            }
+            else
+            {
+                send_batch_response(client_fd, "400 Bad Request", "", "The batch has no records.\n");
+            }
+            break;
+        }
+    }
+    if(!body->ended)
+    {
+        shutdown(client_fd, SHUT_RDWR);
+    }
+    return 1;
+}
+
+/*
+    Finds a header among the headers of a request
+
+    @param
+    request: The request
+    end: End of the headers
+    name: The header name with its colon, matched without regard to case
+
+    @return
+    The start of its value, or NULL if the request does not have it
+ */
+static const char *header_value(const char *request, const char *end, const char *name)
+{
+    size_t      name_len = strlen(name);
+    const char *line     = strstr(request, "\r\n");
+
+    while(line != NULL && line + 2 < end)
+    {
+        line += 2;
+        if(strncasecmp(line, name, name_len) == 0)
+        {
+            line += name_len;
+            while(*line == ' ' || *line == '\t')
+            {
+                line++;
+            }
+            return line;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+/*
+    Takes the next record off the decoded bytes of a batch body
+
+    @param
+    body: The body
+    record: Set to the start of the record, valid until the body is filled again
+    len: Set to its length
+
+    @return
+    1: A record was taken
+    0: No whole record is buffered, or none is left if the body ended
+    -1: A length prefix runs past the end of the body, or a record is over MAX_POST_BODY
+ */
+static int next_record(struct batch_body *body, const char **record, size_t *len)
+{
+    if(body->length_prefixed)
+    {
+        const unsigned char *prefix = (const unsigned char *)body->buffer + body->start;
+        size_t               left   = body->filled - body->start;
+        size_t               size   = 0;
+
+        if(left < BATCH_PREFIX_LEN)
+        {
+            body->error = body->ended && left > 0 ? BATCH_MALFORMED : BATCH_OK;
+            return body->error == BATCH_OK ? 0 : -1;
+        }
+        for(int i = 0; i < BATCH_PREFIX_LEN; i++)
+        {
+            size = (size << BITS_PER_BYTE) | prefix[i];
+        }
+        if(size > MAX_POST_BODY)
+        {
+            body->error = BATCH_TOO_LARGE;
+            return -1;
+        }
+        if(size > left - BATCH_PREFIX_LEN)
+        {
+            body->error = body->ended ? BATCH_MALFORMED : BATCH_OK;
+            return body->error == BATCH_OK ? 0 : -1;
+        }
+        *record     = body->buffer + body->start + BATCH_PREFIX_LEN;
+        *len        = size;
+        body->start += BATCH_PREFIX_LEN + size;
+        return 1;
+    }
+
+    while(body->start < body->filled)
+    {
+        const char *next    = body->buffer + body->start;
+        const char *newline = (const char *)memchr(next, '\n', body->filled - body->start);
+
+        if(newline == NULL && !body->ended)
+        {
+            body->error = body->filled - body->start > MAX_POST_BODY ? BATCH_TOO_LARGE : BATCH_OK;
+            return body->error == BATCH_OK ? 0 : -1;
+        }
+        *record     = next;
+        *len        = newline != NULL ? (size_t)(newline - next) : body->filled - body->start;
+        body->start += *len + (newline != NULL ? 1 : 0);
+        if(*len > 0 && (*record)[*len - 1] == '\r')
+        {
+            (*len)--;
+        }
+        if(*len > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Reads more of a batch body into its buffer, after the bytes not yet handed out. Body
+    bytes that came with the headers are used first, then the socket is read and chunked
+    framing is taken off in place.
+
+    @param
+    body: The body, not ended, marked ended when its last byte arrives
+
+    @return
+    0: More bytes were added, or the body ended
+    -1: A record is too long for the buffer, or the read failed, body->error says which
+ */
+static int fill_batch(struct batch_body *body)
+{
+    size_t  want;
+    ssize_t got;
+
+    if(body->start > 0)
+    {
+        memmove(body->buffer, body->buffer + body->start, body->filled - body->start);
+        body->filled -= body->start;
+        body->start   = 0;
+    }
+    if(body->filled == body->size)
+    {
+        body->error = BATCH_TOO_LARGE;
+        return -1;
+    }
+
+    want = body->size - body->filled;
+    if(want > BATCH_READ_SIZE)
+    {
+        want = BATCH_READ_SIZE;
+    }
+    if(body->early_len > 0)
+    {
+        got = (ssize_t)(want < body->early_len ? want : body->early_len);
+        memcpy(body->buffer + body->filled, body->early, (size_t)got);
+        body->early += got;
+        body->early_len -= (size_t)got;
+    }
+    else
+    {
+        if(!body->chunked && want > body->unread)
+        {
+            want = body->unread;
+        }
+        do
+        {
+            got = read(body->client_fd, body->buffer + body->filled, want);
+        } while(got < 0 && errno == EINTR);
+        if(got <= 0)
+        {
+            body->error = got == 0 ? BATCH_SHORT : would_block(errno) ? BATCH_TIMEOUT : BATCH_READ;
+            if(body->error == BATCH_READ)
+            {
+                perror("read batch");
+            }
+            return -1;
+        }
+    }
+
+    if(body->chunked)
+    {
+        size_t used;
+
+        got = chunked_decode(&body->decoder, body->buffer + body->filled, (size_t)got, &used);
+        if(got < 0)
+        {
+            body->error = BATCH_MALFORMED;
+            return -1;
+        }
+        body->ended = chunked_done(&body->decoder);
+    }
+    else
+    {
+        // Bytes past the Content-Length belong to whatever the client sends next
+        got = (size_t)got < body->unread ? got : (ssize_t)body->unread;
+        body->unread -= (size_t)got;
+        body->ended   = body->unread == 0;
+    }
+    body->filled += (size_t)got;
+    body->bytes += (size_t)got;
+    return 0;
+}
+
+/*
+    storage_value_source handing out the records of a batch body as they arrive, each
+    copied with a NUL after it
+
+    @param
+    value: Set to the copy of the next record
+    value_len: Set to its length with the NUL
+    arg: The batch_body
+
+    @return
+    1: A record was handed out
+    0: There are no more
+    -1: The body is bad or could not be read
+ */
+static int next_batch_value(const void **value, size_t *value_len, void *arg)
+{
+    struct batch_body *body = (struct batch_body *)arg;
+    const char        *record;
+    size_t             len;
+    int                found;
+
+    while((found = next_record(body, &record, &len)) == 0 && !body->ended)
+    {
+        if(fill_batch(body) != 0)
+        {
+            return -1;
+        }
+    }
+    if(found <= 0)
+    {
+        return found;
+    }
+    if(len > MAX_POST_BODY)
+    {
+        body->error = BATCH_TOO_LARGE;
+        return -1;
+    }
+    memcpy(body->copy, record, len);
+    body->copy[len] = '\0';
+    *value          = body->copy;
+    *value_len      = len + 1;
+    return 1;
+}
+
+/*
+    Sends a short plain text response to a batched POST
+
+    @param
+    client_fd: File descriptor for the client connection
+    status: Status code and reason
+    headers: Extra header lines, each ending in \r\n
+    message: The body
+
+    @return
+    1, so error paths can return it
+ */
+static int send_batch_response(int client_fd, const char *status, const char *headers, const char *message)
+{
+    char response[BATCH_RESPONSE_LEN * 2];
+    int  len;
+
+    len = snprintf(response,
+                   sizeof(response),
+                   "HTTP/1.0 %s\r\n"
+                   "Content-Type: text/plain\r\n"
+                   "Content-Length: %zu\r\n"
+                   "%s"
+                   "\r\n"
+                   "%s",
+                   status,
+                   strlen(message),
+                   headers,
+                   message);
+    if(len > 0 && (size_t)len < sizeof(response))
+    {
+        write(client_fd, response, (size_t)len);
+    }
+    return 1;
+}
+
 /*
     Checks if the HTTP request is for an image
 
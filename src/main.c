@@ -1,4 +1,14 @@
 #include "../include/http.h"
+#include "../include/affinity.h"
+#include "../include/chunked.h"
+#include "../include/file_cache.h"
+#include "../include/h2.h"
+#include "../include/probes.h"
+#include "../include/registry.h"
+#include "../include/storage.h"
+#include "../include/timer_wheel.h"
+#include "../include/tls.h"
+#include "../include/would_block.h"
 #include <arpa/inet.h>
 #include <dlfcn.h>
 #include <errno.h>
@@ -6,10 +16,12 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <ndbm.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -31,48 +43,328 @@
 #define FIVE 5
 #define BASE_TEN 10
 #define RELOAD_MSG 60
+#define REQUEST_ARENA_SIZE (3 * MAX_POST_BODY)          // Hard cap on the scratch memory of one request, a batch holds two MAX_POST_BODY buffers
+#define DEFAULT_IDLE_TIMEOUT 30                         // Seconds a worker may sit idle before the pool shrinks
+#define SCALE_INTERVAL 1                                // Seconds between pool size evaluations in the monitor
+#define DRAIN_TIMEOUT 30                                // Seconds an old generation waits for in-flight requests
+#define LISTEN_FD_ENV "WEBSERVER_LISTEN_FD"             // Listening socket handed to a re-executed server
+#define TLS_LISTEN_FD_ENV "WEBSERVER_TLS_LISTEN_FD"     // Its TLS listening socket, when it has one
+#define PARENT_PID_ENV "WEBSERVER_PARENT_PID"           // Old generation to drain once the new one is ready
+#define PID_STR_LEN 16
+#define DEFAULT_WORKER_QUEUE 32                         // Connections a worker may have queued before new ones are shed
+#define DEFAULT_RETRY_AFTER 1                           // Seconds a shed client is asked to wait before retrying
+#define SHED_RESPONSE_LEN 256
+#define SHED_DRAIN_READS 4                              // Reads of an already sent request before a shed connection is closed
+#define FD_TAG_DONE '\0'                                // Payload byte of an fd a worker is done with
+#define FD_TAG_SHED 'S'                                 // Payload byte of an fd the monitor could not place on any worker
+#define FD_TAG_CLOSE 'C'                                // Payload byte of an fd a worker gave up on after a timeout or a refusal
+#define FD_TAG_CRASH 'X'                                // Payload byte of an fd whose worker died while serving it
+#define FD_TAG_BUSY 'B'                                 // Payload byte of a copy of an fd a live worker still has, sent so it is not taken for lost
+#define CLIENT_CAPACITY FD_SETSIZE                      // Connections the listener tracks, it selects on the idle ones
+#define DEFAULT_KEEPALIVE_TIMEOUT 5                     // Seconds an idle kept-alive connection is held
+#define CLIENT_LOST_TIMEOUT 60                          // Seconds without word from the monitor before a connection no worker returned is forgotten
+#define CLIENT_REMIND_INTERVAL 30                       // Seconds between the monitor's reminders that a worker still has a connection, well inside CLIENT_LOST_TIMEOUT
+#define CRASH_LOOP_WINDOW 10                            // Seconds between two crashes of a worker for them to count as a streak
+#define CRASH_LOOP_LIMIT 5                              // Crashes in a streak reported as a crash loop
+#define MAX_RESTART_BACKOFF 30                          // Longest a worker that keeps crashing waits to be restarted, in seconds
+#define DEFAULT_HEADER_TIMEOUT 10                       // Seconds a client has to send the headers of a request
+#define DEFAULT_BODY_TIMEOUT 30                         // Seconds a client has to send the body of a request
+#define DEFAULT_WRITE_TIMEOUT 30                        // Seconds a response may take to be sent
+#define DEFAULT_FILE_CACHE_MB 64                        // MiB of static files the workers share
+#define BYTES_PER_MB ((size_t)1024 * 1024)
+#define MAX_SELECT_WAIT_MS 1000                         // Longest the listener sleeps, so it notices the signal flags
+#define MS_PER_SEC 1000
+#define US_PER_MS 1000
+#define CONTENT_LENGTH_HEADER "Content-Length:"
+#define BATCH_REQUEST_LINE "POST " BATCH_PATH " "
+#define REFUSAL_LEN 128
+#if defined(MSG_NOSIGNAL)
+    #define SHED_SEND_FLAGS (MSG_DONTWAIT | MSG_NOSIGNAL)
+#else
+    #define SHED_SEND_FLAGS MSG_DONTWAIT
+#endif
+
+/*
+    What a connection's timer closes it for, in the listener and in the workers
+ */
+enum timeout_kind
+{
+    TIMEOUT_NONE,
+    TIMEOUT_HEADER,    // The request headers did not arrive in time
+    TIMEOUT_BODY,      // The request body did not arrive in time
+    TIMEOUT_IDLE,      // A kept-alive connection sent no new request
+    TIMEOUT_WRITE,     // The response could not be sent in time
+    TIMEOUT_LOST,      // A worker never returned the connection
+    TIMEOUT_KINDS
+};
+
+/*
+    What travels with a client fd between the listener, the monitor and the workers
+ */
+struct fd_note
+{
+    uint64_t        client;     // Registry handle of the connection in the listener
+    uint64_t        bytes;      // Request bytes the worker read
+    int             worker;     // Id of the worker that served the connection, -1 on the way there
+    int             timeout;    // The timeout_kind a worker closed it for, with FD_TAG_CLOSE
+    int             tls;        // The worker has to run the TLS handshake before reading the request
+    struct h2_state h2;         // Where an HTTP/2 connection left off, h2.active is 0 for HTTP/1
+    char            tag;        // FD_TAG_DONE, FD_TAG_SHED, FD_TAG_CLOSE, FD_TAG_CRASH or FD_TAG_BUSY
+};
+
+/*
+    Seconds a worker allows for each phase of a request, 0 for no limit
+ */
+struct request_timeouts
+{
+    int header;
+    int body;
+    int write;
+};
+
+/*
+    Reading and answering one request in a worker, timed by the worker's wheel
+ */
+struct request_io
+{
+    struct timer_wheel            *wheel;
+    struct timer                   timer;         // Header, body or write timeout of the current phase
+    const struct request_timeouts *timeouts;
+    size_t                         bytes_read;    // Request bytes read from the client
+    int                            expired;       // The timeout_kind that fired, TIMEOUT_NONE if none did
+    int                            refused;       // The request was answered with Connection: close, the rest of it is still unread
+};
+
+/*
+    The monitor's copy of a client fd it dispatched, kept until the worker returns it
+ */
+struct held_client
+{
+    uint64_t client;      // Registry handle of the connection in the listener
+    int      fd;
+    time_t   reminded;    // When the listener was last told a worker still has it
+};
+
+/*
+    One prefork worker as seen by the monitor. The monitor holds on to both ends of the
+    socket pair and to a copy of every fd in flight, so when the worker dies it can still
+    read back the fds the worker never received and answer the one it was serving.
+ */
+struct worker
+{
+    pid_t               pid;              // -1 while a dead worker waits to be restarted
+    int                 id;               // Kept across restarts and moves, the pool index is not, pins the worker and names it in logs
+    int                 sockets[2];       // [0] is the monitor's end, [1] the worker's end
+    int                 in_flight;        // Client fds dispatched to this worker and not yet returned
+    int                 draining;         // Set when the worker is being retired, no new fds are dispatched to it
+    time_t              idle_since;       // When in_flight last dropped to zero
+    struct held_client *held;             // Copies of the in-flight fds, in the order they were dispatched
+    int                 held_count;
+    int                 held_capacity;
+    int                 restarts;         // Times this worker died and was started again
+    int                 crash_streak;     // Crashes less than CRASH_LOOP_WINDOW apart
+    time_t              last_crash;
+    time_t              restart_at;       // When a dead worker is started again
+};
+
+/*
+    The functions of http.so the server calls, looked up once every time it is loaded
+    instead of on every request
+ */
+struct plugin
+{
+    int  (*handle_client)(struct arena *, int, const char *, int, int);
+    int  (*open_resource)(struct arena *, const char *, int, struct resource *);
+    void (*set_request_path)(const char *, const char *);
+    int  (*is_http_request)(const char *);
+    int  (*handle_post_request)(const char *, int);
+    int  (*handle_batch_request)(struct arena *, const char *, size_t, int);
+    void (*set_io_options)(int, int);
+    int  (*set_storage_backend)(const char *);
+    void (*set_file_cache)(struct file_cache *);
+    int  (*prepare_storage)(void);
+    int  (*adopt_storage)(void);
+};
+
+/*
+    The growable set of workers owned by the monitor
+ */
+struct worker_pool
+{
+    struct worker          *workers;
+    int                     count;
+    int                     capacity;
+    int                     min_workers;
+    int                     max_workers;
+    int                     idle_timeout;
+    int                     worker_queue;    // Most in-flight fds per worker, 0 for no limit
+    int                     next;            // Where the search for the least loaded worker starts
+    const struct cpu_plan  *cpu_plan;        // Where new workers are pinned
+    struct request_timeouts timeouts;        // Handed to every worker
+    int                     use_uring;       // Workers serve files through io_uring when the kernel supports it
+    const char             *storage;         // Backend spec POST bodies are stored with
+    struct file_cache      *file_cache;      // Shared by every worker, NULL when it is off
+    struct tls_server      *tls;             // Shared by every worker, NULL when TLS is off
+    unsigned long           restarts;        // Workers restarted after dying, over the whole pool
+    struct plugin           plugin;          // Resolved before the fork, a worker resolves its own after a reload
+};
+
+/*
+    Settings taken from the command line
+ */
+struct server_config
+{
+    int         children;
+    int         min_workers;
+    int         max_workers;
+    int         idle_timeout;
+    int         max_in_flight;    // Most connections handed to the monitor at once, 0 for no limit
+    int         worker_queue;
+    int         retry_after;
+    int         keepalive_timeout;
+    int         header_timeout;
+    int         body_timeout;
+    int         write_timeout;
+    int         use_uring;
+    int         file_cache_mb;
+    const char *storage;
+    const char *tls_cert;    // NULL when the server speaks plaintext only
+    const char *tls_key;
+};
+
+/*
+    Raw command-line option values before they are validated
+ */
+struct server_args
+{
+    char *children;
+    char *min_workers;
+    char *max_workers;
+    char *idle_timeout;
+    char *affinity;
+    char *max_in_flight;
+    char *worker_queue;
+    char *retry_after;
+    char *keepalive_timeout;
+    char *header_timeout;
+    char *body_timeout;
+    char *write_timeout;
+    char *io_backend;
+    char *file_cache_mb;
+    char *storage;
+    char *tls_cert;
+    char *tls_key;
+};
 
 static void           setup_signal_handler(void);
 static void           sigint_handler(int signum);
-static int            handle_request(struct sockaddr_in client_addr, int client_fd, void *handle);
-static int            recv_fd(int socket);
-static int            send_fd(int socket, int fd);
+static void           sigusr2_handler(int signum);
+static void           sigquit_handler(int signum);
+static void           sigchld_handler(int signum);
+static void           watch_children(sigset_t *wait_mask);
+static int            inherit_listener(const char *env);
+static int            open_listener(int port);
+static pid_t          reexec_server(char *argv[], int server_fd, int tls_fd, const int dsfd[2], const struct client_registry *clients);
+static int            handle_request(struct sockaddr_in client_addr, int client_fd, const struct plugin *plugin, struct arena *arena, struct request_io *io, struct h2_state *h2);
+static int            serve_h2(int client_fd, const struct plugin *plugin, struct arena *arena, struct request_io *io, struct h2_state *h2, const char *early, size_t early_len);
+static ssize_t        read_request(int client_fd, char *buffer, size_t size, struct request_io *io);
+static long           request_body_length(const char *buffer);
+static int            read_post_body(int client_fd, struct arena *arena, char **request, size_t *length, struct request_io *io);
+static int            read_chunked_body(int client_fd, struct arena *arena, char **request, size_t *length, struct request_io *io);
+static ssize_t        read_some(int client_fd, char *buffer, size_t size, struct request_io *io);
+static int            refuse_request(int client_fd, struct request_io *io, const char *status);
+static int            wait_readable(int fd, struct request_io *io);
+static int            recv_fd(int socket, struct fd_note *note);
+static int            send_fd(int socket, int fd, const struct fd_note *note);
+static int            hand_off(int monitor_socket, struct client_registry *clients, struct client_slot *slot, int fd);
+static void           forget_client(struct client_registry *clients, struct timer_wheel *wheel, struct client_slot *slot);
+static void           arm_client_timer(struct timer_wheel *wheel, struct client_slot *slot, int kind, int seconds);
+static int            expire_clients(struct client_registry *clients, struct timer_wheel *wheel, unsigned long timed_out[TIMEOUT_KINDS]);
+static size_t         build_shed_response(char *response, size_t size, int retry_after);
+static void           shed_connection(int fd, const char *response, size_t length);
 static time_t         get_last_modified_time(const char *path);
 static void           format_timestamp(time_t timestamp, char *buffer, size_t buffer_size);
-static int            worker_loop(time_t last_time, void *handle, int i, int client_sockets[], int **worker_sockets);
-static void           check_for_dead_children(time_t last_time, void *handle, int client_sockets[], int **worker_sockets, int child_pids[], int children);
-static void           clean_up_worker_sockets(int **worker_sockets, int children);
-static int            call_handle_client(int (*handle_c)(int, const char *, int, int), void *handle, int client_fd, char *req_path, int is_head, int is_img);
-static int            call_set_request_path(void (*set_req_path)(const char *, const char *), void *handle, char *req_path, char *buffer);
-static int            call_is_http(int (*is_http)(const char *), void *handle, char *buffer);
+static int            worker_loop(time_t last_time, void *handle, int id, struct client_registry *clients, int worker_socket, const struct worker_pool *pool);
+static void           run_monitor(struct worker_pool *pool, int server_socket, time_t last_time, void *handle, struct client_registry *clients);
+static int            spawn_worker(struct worker_pool *pool, int index, time_t last_time, void *handle, struct client_registry *clients);
+static int            add_worker(struct worker_pool *pool, time_t last_time, void *handle, struct client_registry *clients);
+static int            free_worker_id(const struct worker_pool *pool);
+static int            pick_worker(struct worker_pool *pool);
+static void           drain_worker(struct worker_pool *pool, int index);
+static void           scale_pool(struct worker_pool *pool, int pending, time_t last_time, void *handle, struct client_registry *clients);
+static void           dispatch_client(struct worker_pool *pool, int server_socket, int client_fd, struct fd_note *note);
+static void           return_client(struct worker_pool *pool, int index, int server_socket, int fd, struct fd_note *note);
+static int            hold_client(struct worker *worker, uint64_t client, int fd);
+static void           release_client(struct worker *worker, uint64_t client);
+static void           remind_listener(struct worker_pool *pool, int server_socket);
+static int            clients_held(const struct worker_pool *pool);
+static int            recover_clients(struct worker_pool *pool, int index, int server_socket);
+static void           requeue_clients(struct worker_pool *pool, int index, int server_socket);
+static void           report_exit(pid_t pid, int status, int orphaned);
+static void           schedule_restart(struct worker_pool *pool, int index);
+static int            restart_pending(const struct worker_pool *pool);
+static void           restart_worker(struct worker_pool *pool, int index, time_t last_time, void *handle, struct client_registry *clients);
+static void           check_for_dead_children(time_t last_time, void *handle, struct client_registry *clients, struct worker_pool *pool, int server_socket);
+static void           clean_up_worker_pool(struct worker_pool *pool);
+static int            load_plugin(void *handle, struct plugin *plugin);
+static int            resolve_symbol(void *handle, const char *name, void **symbol);
+static void           warm_up(const struct plugin *plugin, const struct server_config *config, struct file_cache *file_cache);
+static int            call_handle_client(const struct plugin *plugin, struct arena *arena, int client_fd, char *req_path, int is_head, int is_img);
+static int            call_set_request_path(const struct plugin *plugin, char *req_path, char *buffer);
+static int            call_is_http(const struct plugin *plugin, char *buffer);
+static void           call_set_io_options(const struct plugin *plugin, int use_uring, int write_timeout);
+static void           call_set_storage_backend(const struct plugin *plugin, const char *spec);
+static void           call_set_file_cache(const struct plugin *plugin, struct file_cache *cache);
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
 static int            parse_positive_int(const char *binary_name, const char *str);
-static void           handle_arguments(const char *binary_name, const char *children_str, int *children);
-static void           parse_arguments(int argc, char *argv[], char **children);
+static void           handle_arguments(const char *binary_name, const struct server_args *args, struct server_config *config);
+static void           parse_arguments(int argc, char *argv[], struct server_args *args);
 
-// this variable should not be moved to a .h file
-static volatile sig_atomic_t exit_flag = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+// these variables should not be moved to a .h file
+static volatile sig_atomic_t exit_flag   = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t reexec_flag = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t drain_flag  = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 int main(int argc, char *argv[])
 {
-    void              *handle;
-    fd_set             readfds;                                        // Set of file descriptors for select
-    size_t             max_clients;                                    // Maximum number of clients that can connect
-    struct sockaddr_in host_addr;                                      // Server's address structure
-    unsigned int       host_addrlen;                                   // Length of the server address
-    int               *client_sockets = (int *)malloc(sizeof(int));    // Array of active client sockets
-    int                sd             = 0;                             // Temp variable for socket descriptor
-    int                max_fd;                                         // Maximum file descriptor for select
-    int                dsfd[2];                                        // the domain socket for server->monitor
-    int              **worker_sockets;                                 // Stores UNIX socket pairs for each worker
-    pid_t             *child_pids;
-    pid_t              monitor;
-    int                server_fd;
-    time_t             last_modified;
-    char               time_str[TIME_SIZE];
-    char               cwd[BUFFER_SIZE];
-    char              *children_str = NULL;
-    int                children;
+    void                  *handle;
+    fd_set                 readfds;               // Set of file descriptors for select
+    struct sockaddr_in     host_addr;             // Server's address structure
+    unsigned int           host_addrlen;          // Length of the server address
+    struct client_registry clients;               // Every connection the listener is tracking
+    int                    max_fd;                // Maximum file descriptor for select
+    int                    dsfd[2];               // the domain socket for server->monitor
+    pid_t                  monitor;
+    int                    server_fd;
+    int                    tls_fd = -1;           // Listening socket of TLS_PORT, -1 without a certificate
+    time_t                 last_modified;
+    char                   time_str[TIME_SIZE];
+    char                   cwd[BUFFER_SIZE];
+    struct server_args     args = {0};
+    struct server_config   config;
+    char                   ready;                 // Readiness byte from the monitor
+    int                    in_flight   = 0;       // Client fds handed to the monitor and not yet returned
+    int                    draining    = 0;       // Set once this generation stops accepting
+    time_t                 drain_start = 0;       // When draining started
+    pid_t                  successor   = -1;      // Re-executed server started by SIGUSR2
+    const char            *old_master  = NULL;    // Previous generation to drain once we are ready
+    struct cpu_plan        cpu_plan    = {0};     // CPU placement of the listener, monitor and workers
+    char                   shed_response[SHED_RESPONSE_LEN];
+    size_t                 shed_length;
+    unsigned long          timed_out[TIMEOUT_KINDS];
+    unsigned long          shed_count = 0;        // Connections turned away with a 503
+    unsigned long          crashed    = 0;        // Connections answered with a 500 because their worker died
+    static const char      crash_response[] = "HTTP/1.0 500 Internal Server Error\r\n"
+                                              "Content-Type: text/plain\r\n"
+                                              "Content-Length: 22\r\n"
+                                              "Connection: close\r\n"
+                                              "\r\n"
+                                              "Internal Server Error\n";
+    struct client_slot    *slot;                  // Connection a descriptor or note belongs to
+    struct timer_wheel     wheel;                 // Header, keep-alive and lost timeouts of the connections
+    struct file_cache     *file_cache = NULL;     // Static files shared by the workers
+    struct plugin          plugin;                // Functions of http.so, resolved once before the fork
+    struct tls_server     *tls = NULL;            // Certificate, session cache and ticket keys of every worker
 
     if(getcwd(cwd, sizeof(cwd)) != NULL)
     {
@@ -83,23 +375,34 @@ int main(int argc, char *argv[])
         perror("getcwd() error");
     }
 
-    parse_arguments(argc, argv, &children_str);
-    handle_arguments(argv[0], children_str, &children);
+    parse_arguments(argc, argv, &args);
+    handle_arguments(argv[0], &args, &config);
 
-    child_pids = (pid_t *)malloc((size_t)children * sizeof(pid_t));
-    if(child_pids == NULL)
+    if(args.affinity != NULL && cpu_plan_init(&cpu_plan, args.affinity) != 0)
     {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+        usage(argv[0], EXIT_FAILURE, "Error: -a takes \"auto\" or a CPU list such as 0-3,8");
+    }
+
+    // Built once so turning a connection away costs the listener a single send
+    shed_length = build_shed_response(shed_response, sizeof(shed_response), config.retry_after);
+
+    // Mapped before any fork, so the workers share one copy of each file instead of warming one each
+    if(config.file_cache_mb > 0)
+    {
+        file_cache = file_cache_create((size_t)config.file_cache_mb * BYTES_PER_MB);
+    }
+
+    if(registry_init(&clients, CLIENT_CAPACITY) != 0)
+    {
+        return 1;
     }
 
     // initialize shared library
     handle = dlopen("./http.so", RTLD_NOW);
     if(!handle)
     {
-        free((void *)client_sockets);
+        registry_destroy(&clients);
         fprintf(stderr, "dlopen failed: %s\n", dlerror());
-        free(child_pids);
         return 1;
     }
 
@@ -108,177 +411,131 @@ int main(int argc, char *argv[])
     format_timestamp(last_modified, time_str, sizeof(time_str));     // Convert to human readable
     printf("http.so last modified time on init: %s\n", time_str);    // Testing
 
-    // create domain socket for server -> monitor
-    if(socketpair(AF_UNIX, SOCK_STREAM, 0, dsfd) == -1)
+    if(load_plugin(handle, &plugin) != 0)
     {
-        perror("webserver (socketpair)");
-        free(client_sockets);
+        registry_destroy(&clients);
         dlclose(handle);
-        free(child_pids);
         return 1;
     }
 
-    // create domain socket for monitor -> worker
-    // this is my solution for making sure only one child gets a fd from the monitor
-    worker_sockets = (int **)malloc(sizeof(int *) * (size_t)children);
-    if(!worker_sockets)
-    {
-        perror("malloc failed");
-        free(child_pids);
-        exit(EXIT_FAILURE);
-    }
-    for(int i = 0; i < children; i++)
+    // Everything done here is inherited by the monitor and every worker it forks, restarted ones included
+    warm_up(&plugin, &config, file_cache);
+    if(config.tls_cert != NULL)
     {
-        worker_sockets[i] = (int *)malloc(sizeof(int) * 2);
-        if(!worker_sockets[i])
+        tls = tls_server_create(config.tls_cert, config.tls_key);
+        if(tls == NULL)
         {
-            perror("malloc failed");
-            free(child_pids);
-            exit(EXIT_FAILURE);
-        }
-        if(socketpair(AF_UNIX, SOCK_STREAM, 0, worker_sockets[i]) == -1)
-        {
-            perror("webserver (socketpair)");
-            free(client_sockets);
+            registry_destroy(&clients);
             dlclose(handle);
-            for(int j = i; j >= 0; j--)
-            {
-                free(worker_sockets[j]);
-            }
-            free((void *)worker_sockets);
-            free(child_pids);
-
             return 1;
         }
     }
 
+    // create domain socket for server -> monitor
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, dsfd) == -1)
+    {
+        perror("webserver (socketpair)");
+        registry_destroy(&clients);
+        dlclose(handle);
+        return 1;
+    }
+
+    // Use the listening sockets of the previous generation if we were re-executed
+    server_fd = inherit_listener(LISTEN_FD_ENV);
+    if(tls != NULL)
+    {
+        tls_fd = inherit_listener(TLS_LISTEN_FD_ENV);
+    }
+
     // fork the monitor
     monitor = fork();
     if(monitor == -1)
     {
         perror("fork");
-        free(child_pids);
         exit(EXIT_FAILURE);
     }
     if(monitor == 0)
     {
-        int worker_index = 0;    // Replace with actual worker selection logic
+        struct worker_pool pool = {0};
 
         // close the end of ds we're going to monitor for in select
         close(dsfd[0]);
 
-        // pre-fork children
-        for(int i = 0; i < children; i++)
+        // only the server accepts on the listening sockets
+        if(server_fd >= 0)
+        {
+            close(server_fd);
+        }
+        if(tls_fd >= 0)
+        {
+            close(tls_fd);
+        }
+
+        pool.min_workers      = config.min_workers;
+        pool.max_workers      = config.max_workers;
+        pool.idle_timeout     = config.idle_timeout;
+        pool.worker_queue     = config.worker_queue;
+        pool.cpu_plan         = &cpu_plan;
+        pool.timeouts.header  = config.header_timeout;
+        pool.timeouts.body    = config.body_timeout;
+        pool.timeouts.write   = config.write_timeout;
+        pool.use_uring        = config.use_uring;
+        pool.storage          = config.storage;
+        pool.file_cache       = file_cache;
+        pool.tls              = tls;
+        pool.plugin           = plugin;
+
+        cpu_plan_pin_monitor(&cpu_plan);
+
+        // pre-fork children, the monitor owns the monitor -> worker domain sockets
+        for(int i = 0; i < config.children; i++)
         {
-            pid_t pid = fork();
-            if(pid < 0)
+            if(add_worker(&pool, last_modified, handle, &clients) != 0)
             {
                 perror("webserver (fork)");
                 dlclose(handle);
-                free(client_sockets);
-                clean_up_worker_sockets(worker_sockets, children);
-                free(child_pids);
+                registry_destroy(&clients);
+                clean_up_worker_pool(&pool);
                 return 1;
             }
-            if(pid == 0)
-            {
-                // Get last time http.so was modified
-                time_t last_time = get_last_modified_time("./http.so");
-
-                int result = worker_loop(last_time, handle, i, client_sockets, worker_sockets);
-                if(result != 0)
-                {
-                    perror("webserver (worker loop)");
-                    free(child_pids);
-                    exit(EXIT_FAILURE);
-                }
-            }
-            else
-            {
-                child_pids[i] = pid;
-                close(worker_sockets[i][1]);    // Close worker's end in monitor
-            }
         }
 
-        // monitor code
-        while(1)
+        // Tell the server the workers are up
+        if(write(dsfd[1], "R", 1) != 1)
         {
-            fd_set monitor_read_fds;
-            int    max_monitor_fd = dsfd[1];
-            int    monitor_activity;
-
-            memset(&monitor_read_fds, 0, sizeof(monitor_read_fds));
-
-            // Listen for new client FDs from server
-            FD_SET(dsfd[1], &monitor_read_fds);
-
-            // Listen for worker responses
-            for(int i = 0; i < children; i++)
-            {
-                FD_SET(worker_sockets[i][0], &monitor_read_fds);
-                if(worker_sockets[i][0] > max_monitor_fd)
-                {
-                    max_monitor_fd = worker_sockets[i][0];
-                }
-            }
-
-            // Wait for an event on any socket
-            monitor_activity = select(max_monitor_fd + 1, &monitor_read_fds, NULL, NULL, NULL);
-            if(monitor_activity < 0)
-            {
-                perror("select error in monitor");
-                continue;
-            }
-
-            // Receive client FD from server
-            if(FD_ISSET(dsfd[1], &monitor_read_fds))
-            {
-                int client_fd_monitor = recv_fd(dsfd[1]);
-                if(client_fd_monitor > 0)
-                {
-                    // printf("Monitor received client FD %d from server\n", client_fd_monitor);
-
-                    // Send the FD to a worker (Round-robin or first available)
-                    send_fd(worker_sockets[worker_index][0], client_fd_monitor);
-                    // printf("Monitor sent client FD %d to worker %d\n", client_fd_monitor, worker_index);
-                    close(client_fd_monitor);
-                    worker_index++;
-                    if(worker_index == children)
-                    {
-                        worker_index = 0;
-                    }
-                }
-            }
-
-            // Receive processed FDs from workers
-            for(int i = 0; i < children; i++)
-            {
-                if(FD_ISSET(worker_sockets[i][0], &monitor_read_fds))
-                {
-                    int returned_fd = recv_fd(worker_sockets[i][0]);
-                    if(returned_fd > 0)
-                    {
-                        // printf("Monitor received processed FD %d from worker %d\n", returned_fd, i);
-                        send_fd(dsfd[1], returned_fd);
-                        // printf("Monitor sent fd %d back to server\n", returned_fd);
-                        close(returned_fd);    // Clean up after worker has finished
-                    }
-                }
-            }
-            check_for_dead_children(last_modified, handle, client_sockets, worker_sockets, child_pids, children);
+            perror("webserver (monitor ready)");
         }
+
+        run_monitor(&pool, dsfd[1], last_modified, handle, &clients);
+        clean_up_worker_pool(&pool);
+        exit(EXIT_SUCCESS);
     }
-    // Create a TCP socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);    // NOLINT(android-cloexec-socket)
+
     if(server_fd == -1)
     {
-        perror("webserver (socket)");
-        free(client_sockets);
-        clean_up_worker_sockets(worker_sockets, children);
-        free(child_pids);
+        server_fd = open_listener(PORT);
+    }
+    else
+    {
+        old_master = getenv(PARENT_PID_ENV);
+    }
+    if(tls != NULL && tls_fd == -1)
+    {
+        tls_fd = open_listener(TLS_PORT);
+    }
+    if(server_fd == -1 || (tls != NULL && tls_fd == -1))
+    {
+        if(server_fd >= 0)
+        {
+            close(server_fd);
+        }
+        registry_destroy(&clients);
+        dlclose(handle);
         return 1;
     }
 
+    cpu_plan_pin_listener(&cpu_plan);
+
     // (Debugging) Print program arguments
     // printf("program arg: %d\n", argc);
     // printf("program argv[0]: %s\n", argv[0]);
@@ -286,85 +543,126 @@ int main(int argc, char *argv[])
     // Set up Signal Handler
     setup_signal_handler();
 
-    // Initialize client socket, address and number as zero or null
-    //    client_sockets = NULL;
-    max_clients = 0;
-
-    // Create the address to bind the socket to
-    // Initialize the server address structure
+    // Where accept() stores the address of each client
     host_addrlen = sizeof(host_addr);
 
-    // Use IPv4 to set the server port and bind to available network interface
-    host_addr.sin_family      = AF_INET;
-    host_addr.sin_port        = htons(PORT);
-    host_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    // Bind the socket to the server address
-    if(bind(server_fd, (struct sockaddr *)&host_addr, host_addrlen) != 0)
+    // Wait until the monitor has forked its workers before taking over from an old generation
+    if(read(dsfd[0], &ready, 1) != 1)
     {
-        perror("webserver (bind)");
-        close(server_fd);
-        free(client_sockets);
-        dlclose(handle);
-        clean_up_worker_sockets(worker_sockets, children);
-        free(child_pids);
-        return 1;
+        perror("webserver (waiting for monitor)");
+    }
+    printf("Server listening for connections\n\n");
+    if(tls_fd >= 0)
+    {
+        printf("Server listening for TLS connections on port %d\n\n", TLS_PORT);
     }
-    // printf("Socket successfully bound to address\n");
+    timer_wheel_init(&wheel, timer_now_ms());
+    memset(timed_out, 0, sizeof(timed_out));
 
-    // Listen for incoming connections
-    if(listen(server_fd, SOMAXCONN) != 0)
+    if(old_master != NULL)
     {
-        perror("webserver (listen)");
-        close(server_fd);
-        free(client_sockets);
-        dlclose(handle);
-        clean_up_worker_sockets(worker_sockets, children);
-        free(child_pids);
-        return 1;
+        pid_t old_pid = (pid_t)strtol(old_master, NULL, BASE_TEN);
+
+        printf("Taking over from server %d, telling it to drain\n", old_pid);
+        if(old_pid > 0 && kill(old_pid, SIGQUIT) != 0)
+        {
+            perror("webserver (kill old generation)");
+        }
+        unsetenv(LISTEN_FD_ENV);
+        unsetenv(TLS_LISTEN_FD_ENV);
+        unsetenv(PARENT_PID_ENV);
     }
-    printf("Server listening for connections\n\n");
 
-    // Clear the socket set
-#ifndef __clang_analyzer__
-    memset(&readfds, 0, sizeof(readfds));
+    // printf("entering loop\n\n");
+    while(!exit_flag)
+    {
+        int            activity;    // Number of ready file descriptors
+        struct timeval timeout;
+        int            wait_ms;
+
+        // SIGUSR2: start a new generation of the server on the same listening socket
+        if(reexec_flag)
+        {
+            reexec_flag = 0;
+            if(!draining && successor <= 0)
+            {
+                successor = reexec_server(argv, server_fd, tls_fd, dsfd, &clients);
+            }
+        }
+
+        // A successor that failed to start is reaped so SIGUSR2 can be retried
+        if(successor > 0 && waitpid(successor, NULL, WNOHANG) == successor)
+        {
+            fprintf(stderr, "New server %d exited before taking over\n", successor);
+            successor = -1;
+        }
+
+        // SIGQUIT: stop accepting and exit once every in-flight request has been returned
+        if(drain_flag && !draining)
+        {
+            draining    = 1;
+            drain_start = time(NULL);
+            close(server_fd);
+            server_fd = -1;
+            if(tls_fd >= 0)
+            {
+                close(tls_fd);
+                tls_fd = -1;
+            }
+            printf("Draining %d in-flight requests before exiting\n", in_flight);
+        }
+        if(draining && (in_flight <= 0 || time(NULL) - drain_start >= DRAIN_TIMEOUT))
+        {
+            break;
+        }
+
+        in_flight -= expire_clients(&clients, &wheel, timed_out);
 
+        // Rebuild the socket set, select leaves only the ready descriptors in it
+#ifndef __clang_analyzer__
+        memset(&readfds, 0, sizeof(readfds));
 #endif
+        max_fd = dsfd[0];
 
 #if defined(__FreeBSD__) && defined(__GNUC__)
     #pragma GCC diagnostic push
     #pragma GCC diagnostic ignored "-Wsign-conversion"
 #endif
-    // Add the server socket to the set
-    FD_SET(server_fd, &readfds);
-    // Add the domain socket to the set (for when worker is done with client fd and sends it back)
-    FD_SET(dsfd[0], &readfds);
+        // Add the server sockets to the set
+        if(server_fd >= 0)
+        {
+            FD_SET(server_fd, &readfds);
+            if(server_fd > max_fd)
+            {
+                max_fd = server_fd;
+            }
+        }
+        if(tls_fd >= 0)
+        {
+            FD_SET(tls_fd, &readfds);
+            if(tls_fd > max_fd)
+            {
+                max_fd = tls_fd;
+            }
+        }
+        // Add the domain socket to the set (for when worker is done with client fd and sends it back)
+        FD_SET(dsfd[0], &readfds);
 #if defined(__FreeBSD__) && defined(__GNUC__)
     #pragma GCC diagnostic pop
 #endif
-    max_fd = server_fd;
-
-    // printf("entering loop\n\n");
-    while(!exit_flag)
-    {
-        int activity;    // Number of ready file descriptors
 
-        // printf("adding client sockets\n");
-        //  Add the client sockets to the set
-        for(size_t i = 0; i < max_clients; i++)
+        // Add the connections held between requests, the in-flight ones belong to the workers
+        for(int i = clients.idle.head; i >= 0; i = clients.slots[i].next)
         {
-            sd = client_sockets[i];
-            if(sd > 0)
-            {
+            int sd = clients.slots[i].fd;
 #if defined(__FreeBSD__) && defined(__GNUC__)
     #pragma GCC diagnostic push
     #pragma GCC diagnostic ignored "-Wsign-conversion"
 #endif
-                FD_SET(sd, &readfds);
+            FD_SET(sd, &readfds);
 #if defined(__FreeBSD__) && defined(__GNUC__)
     #pragma GCC diagnostic pop
 #endif
-            }
             if(sd > max_fd)
             {
                 max_fd = sd;
@@ -373,120 +671,227 @@ int main(int argc, char *argv[])
 
         // printf("maxfd: %d\n", max_fd);
 
-        // Wait for activity on one of the monitored sockets
-        activity = select(max_fd + 1, &readfds, NULL, NULL, NULL);
+        // Wait for activity on one of the monitored sockets or the next timeout, waking up regularly to check the signal flags
+        wait_ms = timer_wheel_timeout_ms(&wheel, timer_now_ms());
+        if(wait_ms < 0 || wait_ms > MAX_SELECT_WAIT_MS)
+        {
+            wait_ms = MAX_SELECT_WAIT_MS;
+        }
+        timeout.tv_sec  = wait_ms / MS_PER_SEC;
+        timeout.tv_usec = (wait_ms % MS_PER_SEC) * US_PER_MS;
+        activity        = select(max_fd + 1, &readfds, NULL, NULL, &timeout);
         if(activity < 0)
         {
-            perror("Select error");
+            if(errno != EINTR)
+            {
+                perror("Select error");
+            }
             continue;
         }
 
         // printf("select ok\n\n");
 
-        if(FD_ISSET(server_fd, &readfds))
+        // Accept incoming connections, on both ports when TLS is on
+        for(int tls_port = 0; tls_port < 2; tls_port++)
         {
-            int *temp;
-            // Accept incoming connections
-            int newsockfd = accept(server_fd, (struct sockaddr *)&host_addr, (socklen_t *)&host_addrlen);
+            int listen_fd = tls_port ? tls_fd : server_fd;
+            int newsockfd;
+
+            if(listen_fd < 0 || !FD_ISSET(listen_fd, &readfds))
+            {
+                continue;
+            }
+            newsockfd = accept(listen_fd, (struct sockaddr *)&host_addr, (socklen_t *)&host_addrlen);
             if(newsockfd < 0)
             {
                 perror("webserver (accept)");
                 continue;
             }
             printf("Connection Accepted\n");
+            PROBE2(accept, probe_conn_id(newsockfd), newsockfd);
 
-            // Increase the size of the client_sockets array
-            max_clients++;
-            temp = (int *)realloc(client_sockets, sizeof(int) * max_clients);
-
-            if(temp == NULL)
+            // Over the limit, or with no free slot, the client gets a 503 now instead of waiting behind every queued request
+            slot = NULL;
+            if((config.max_in_flight == 0 || in_flight < config.max_in_flight) && newsockfd < FD_SETSIZE)
             {
-                perror("realloc");
-                free(client_sockets);
-                free(child_pids);
-                exit(EXIT_FAILURE);
+                slot = registry_add(&clients, newsockfd, time(NULL));
             }
-            else
+            if(slot == NULL)
             {
-                client_sockets                  = temp;
-                client_sockets[max_clients - 1] = newsockfd;
+                PROBE2(shed, probe_conn_id(newsockfd), in_flight);
+                shed_connection(newsockfd, tls_port ? NULL : shed_response, shed_length);
+                shed_count++;
+                continue;
             }
-            // printf("Sending client fd %d\n", newsockfd);
-            send_fd(dsfd[0], newsockfd);
-            close(newsockfd);
 
-#if defined(__FreeBSD__) && defined(__GNUC__)
-    #pragma GCC diagnostic push
-    #pragma GCC diagnostic ignored "-Wsign-conversion"
-#endif
-            FD_CLR(newsockfd, &readfds);    // Remove the closed socket from the set
-#if defined(__FreeBSD__) && defined(__GNUC__)
-    #pragma GCC diagnostic pop
-#endif
-            client_sockets[max_clients - 1] = -1;
+            // Held here until the request starts arriving, so a client that sends nothing never occupies a worker
+            slot->tls = tls_port;
+            arm_client_timer(&wheel, slot, TIMEOUT_HEADER, config.header_timeout);
         }
 
         if(FD_ISSET(dsfd[0], &readfds))
         {
-            int fd_from_monitor;
-            int added = 0;
-
-            // printf("received fd from monitor on domain socket\n");
-            fd_from_monitor = recv_fd(dsfd[0]);
-            // printf("received fd from monitor: %d\n", fd_from_monitor);
+            struct fd_note note;
+            int            fd_from_monitor;
 
-// Add the FD back to readfds after getting it from the worker
-#if (defined(__APPLE__) && defined(__MACH__))
-            FD_SET(fd_from_monitor, &readfds);
-#endif
+            fd_from_monitor = recv_fd(dsfd[0], &note);
+            if(fd_from_monitor == -2)
+            {
+                fprintf(stderr, "Monitor exited, shutting down\n");
+                break;
+            }
 
-#if defined(__linux__)
-            if(fd_from_monitor >= 0)
+            slot = fd_from_monitor >= 0 ? registry_lookup(&clients, note.client) : NULL;
+            if(fd_from_monitor >= 0 && (slot == NULL || slot->state != CLIENT_IN_FLIGHT))
+            {
+                // Already given up on as lost, its slot may belong to another connection by now
+                close(fd_from_monitor);
+            }
+            else if(fd_from_monitor >= 0 && note.tag == FD_TAG_BUSY)
+            {
+                // A worker is still serving it, only the copy came back
+                close(fd_from_monitor);
+                arm_client_timer(&wheel, slot, TIMEOUT_LOST, CLIENT_LOST_TIMEOUT);
+            }
+            else if(fd_from_monitor >= 0)
             {
-                FD_SET(fd_from_monitor, &readfds);
-                if(fd_from_monitor > max_fd)
+                PROBE2(fd_returned, probe_conn_id(fd_from_monitor), fd_from_monitor);
+                in_flight--;
+                slot->owner = note.worker;
+                slot->bytes += note.bytes;
+
+                if(note.tag == FD_TAG_SHED)
+                {
+                    // Every worker was at its queue limit
+                    PROBE2(shed, probe_conn_id(fd_from_monitor), in_flight);
+                    shed_connection(fd_from_monitor, slot->tls || slot->h2.active ? NULL : shed_response, shed_length);
+                    forget_client(&clients, &wheel, slot);
+                    shed_count++;
+                }
+                else if(note.tag == FD_TAG_CRASH)
+                {
+                    // The worker died mid-request, whatever it already sent may come before this
+                    shed_connection(fd_from_monitor, slot->tls || slot->h2.active ? NULL : crash_response, sizeof(crash_response) - 1);
+                    forget_client(&clients, &wheel, slot);
+                    crashed++;
+                }
+                else if(note.tag == FD_TAG_CLOSE)
+                {
+                    // The worker ran out of time reading the request or writing the response, or refused the request
+                    if(note.timeout > TIMEOUT_NONE && note.timeout < TIMEOUT_KINDS)
+                    {
+                        timed_out[note.timeout]++;
+                    }
+                    close(fd_from_monitor);
+                    forget_client(&clients, &wheel, slot);
+                }
+                else if(fd_from_monitor >= FD_SETSIZE)
+                {
+                    fprintf(stderr, "Closing returned client FD %d, too high to select on\n", fd_from_monitor);
+                    close(fd_from_monitor);
+                    forget_client(&clients, &wheel, slot);
+                }
+                else
                 {
-                    max_fd = fd_from_monitor;
+                    // Held until the client sends its next request or the keep-alive timeout, after the handshake it carries plaintext
+                    slot->tls = 0;
+                    slot->h2  = note.h2;
+                    registry_set_idle(&clients, slot, fd_from_monitor, time(NULL));
+                    arm_client_timer(&wheel, slot, TIMEOUT_IDLE, config.keepalive_timeout);
                 }
             }
             else
             {
                 fprintf(stderr, "Warning: fd_from_monitor was negative: %d\n", fd_from_monitor);
             }
+        }
 
-#endif
+        // A held connection became readable: either its next request or the client closing it
+        for(int i = clients.idle.head; i >= 0;)
+        {
+            int  next = clients.slots[i].next;
+            int  sd   = clients.slots[i].fd;
+            char peek;
 
-            if(fd_from_monitor > max_fd)
+            slot = &clients.slots[i];
+            i    = next;
+            if(!FD_ISSET(sd, &readfds))
             {
-                max_fd = fd_from_monitor;
+                continue;
             }
 
-            // Add it back to client_sockets
-            for(size_t i = 0; i < max_clients; i++)
+            if(recv(sd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) <= 0)
             {
-                if(client_sockets[i] <= 0)
-                {
-                    client_sockets[i] = fd_from_monitor;
-                    added             = 1;
-                    break;
-                }
+                close(sd);
+                forget_client(&clients, &wheel, slot);
+            }
+            else if(config.max_in_flight > 0 && in_flight >= config.max_in_flight)
+            {
+                PROBE2(shed, probe_conn_id(sd), in_flight);
+                shed_connection(sd, slot->tls || slot->h2.active ? NULL : shed_response, shed_length);
+                forget_client(&clients, &wheel, slot);
+                shed_count++;
             }
-            if(!added)
+            else if(hand_off(dsfd[0], &clients, slot, sd) == 0)
             {
-                printf("No space in client_sockets to re-add fd %d\n", fd_from_monitor);
+                // The worker times the rest of the request, the listener only notices a worker that never returns it
+                PROBE2(handoff, probe_conn_id(sd), sd);
+                in_flight++;
+                close(sd);
+                arm_client_timer(&wheel, slot, TIMEOUT_LOST, CLIENT_LOST_TIMEOUT);
             }
         }
     }
-    close(server_fd);
+    if(server_fd >= 0)
+    {
+        close(server_fd);
+    }
+    if(tls_fd >= 0)
+    {
+        close(tls_fd);
+    }
+    tls_server_destroy(tls);
     dlclose(handle);    // close shared library handle
-    free((void *)client_sockets);
+
+    // Close the connections we are holding
+    for(int i = clients.idle.head; i >= 0; i = clients.slots[i].next)
+    {
+        close(clients.slots[i].fd);
+    }
+    registry_destroy(&clients);
+
+    if(shed_count > 0)
+    {
+        printf("Shed %lu connections with 503 Service Unavailable\n", shed_count);
+    }
+    if(crashed > 0)
+    {
+        printf("Answered %lu connections with 500 Internal Server Error after their worker died\n", crashed);
+    }
+    printf("Timed out %lu connections waiting for headers, %lu reading bodies, %lu idle, %lu writing responses, %lu lost by a worker\n",
+           timed_out[TIMEOUT_HEADER],
+           timed_out[TIMEOUT_BODY],
+           timed_out[TIMEOUT_IDLE],
+           timed_out[TIMEOUT_WRITE],
+           timed_out[TIMEOUT_LOST]);
+    if(file_cache != NULL)
+    {
+        printf("File cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " files read in, %" PRIu64 " of %zu bytes used\n",
+               __atomic_load_n(&file_cache->hits, __ATOMIC_RELAXED),
+               __atomic_load_n(&file_cache->misses, __ATOMIC_RELAXED),
+               __atomic_load_n(&file_cache->fills, __ATOMIC_RELAXED),
+               __atomic_load_n(&file_cache->used, __ATOMIC_RELAXED),
+               file_cache->budget);
+        file_cache_destroy(file_cache);
+    }
 
     // close domain socket fds
     close(dsfd[0]);
     close(dsfd[1]);
 
-    clean_up_worker_sockets(worker_sockets, children);
-    free(child_pids);
+    // The monitor's exit closes the worker sockets, which makes idle workers exit too
+    kill(monitor, SIGTERM);
+    waitpid(monitor, NULL, 0);
 
     return EXIT_SUCCESS;
 }
@@ -503,10 +908,14 @@ static void setup_signal_handler(void)
     #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
 #endif
     sa.sa_handler = sigint_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = sigusr2_handler;
+    sigaction(SIGUSR2, &sa, NULL);
+    sa.sa_handler = sigquit_handler;
+    sigaction(SIGQUIT, &sa, NULL);
 #if defined(__clang__)
     #pragma clang diagnostic pop
 #endif
-    sigaction(SIGINT, &sa, NULL);
 }
 
 /*
@@ -521,47 +930,286 @@ static void sigint_handler(int signum)
 }
 
 /*
-    Processes an HTTP request from the client and sends the appropriate response.
+    Requests a re-exec of the server binary upon receiving SIGUSR2
 
-    @param
-    client_addr: Client address info
-    client_fd: File descriptor for the client connection
-    handle: Handle to the shared library for dynamic function calls
+    @param signum: The signal number received
  */
-static int handle_request(struct sockaddr_in client_addr, int client_fd, void *handle)
+static void sigusr2_handler(int signum)
 {
-    int (*handle_c)(int, const char *, int, int)     = NULL;    // function pointer for handle_client
-    void (*set_req_path)(const char *, const char *) = NULL;    // function pointer for set_request_path
-    int (*is_http_req)(const char *)                 = NULL;    // function pointer for set_request_path
+    (void)signum;
+    reexec_flag = 1;
+}
 
-    char buffer[BUFFER_SIZE] = {0};    // Buffer for storing incoming data
-    int  is_http;
-    int  is_head;
+/*
+    Requests a graceful shutdown upon receiving SIGQUIT: stop accepting and drain in-flight requests
+
+    @param signum: The signal number received
+ */
+static void sigquit_handler(int signum)
+{
+    (void)signum;
+    drain_flag = 1;
+}
+
+/*
+    Signal handler for SIGCHLD in the monitor, it only has to interrupt pselect
+
+    @param
+    signum: The signal number
+ */
+static void sigchld_handler(int signum)
+{
+    (void)signum;
+}
+
+/*
+    Makes a worker's death wake the monitor up. SIGCHLD stays blocked except while the
+    monitor waits in pselect, so one that arrives between two waits is not missed.
+
+    @param
+    wait_mask: Output for the signal mask to wait with
+ */
+static void watch_children(sigset_t *wait_mask)
+{
+    struct sigaction sa;
+    sigset_t         blocked;
+
+    memset(&sa, 0, sizeof(sa));
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = sigchld_handler;
+    sigaction(SIGCHLD, &sa, NULL);
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, wait_mask);
+    sigdelset(wait_mask, SIGCHLD);
+}
+
+/*
+    Picks up a listening socket passed down by a previous generation of the server
+
+    @param
+    env: The environment variable naming it
+
+    @return
+    The inherited listening socket, or -1 if the server was not re-executed
+ */
+static int inherit_listener(const char *env)
+{
+    const char *fd_str = getenv(env);
+    char       *endptr = NULL;
+    long        fd;
+    int         type;
+    socklen_t   type_len = sizeof(type);
+
+    if(fd_str == NULL)
+    {
+        return -1;
+    }
+
+    fd = strtol(fd_str, &endptr, BASE_TEN);
+    if(endptr == fd_str || *endptr != '\0' || fd < 0 || fd > INT_MAX)
+    {
+        fprintf(stderr, "Ignoring invalid %s: %s\n", env, fd_str);
+        return -1;
+    }
+
+    // Make sure the fd really is a stream socket before using it
+    if(getsockopt((int)fd, SOL_SOCKET, SO_TYPE, &type, &type_len) != 0 || type != SOCK_STREAM)
+    {
+        fprintf(stderr, "Inherited fd %ld is not a stream socket\n", fd);
+        return -1;
+    }
+
+    printf("Inherited listening socket %ld\n", fd);
+    return (int)fd;
+}
+
+/*
+    Creates a socket listening on a port of every interface
+
+    @param
+    port: The port
+
+    @return
+    The listening socket, or -1 if it could not be set up
+ */
+static int open_listener(int port)
+{
+    struct sockaddr_in host_addr;
+    int                fd = socket(AF_INET, SOCK_STREAM, 0);    // NOLINT(android-cloexec-socket)
+
+    if(fd == -1)
+    {
+        perror("webserver (socket)");
+        return -1;
+    }
+
+    // Use IPv4 to set the server port and bind to available network interface
+    memset(&host_addr, 0, sizeof(host_addr));
+    host_addr.sin_family      = AF_INET;
+    host_addr.sin_port        = htons((uint16_t)port);
+    host_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if(bind(fd, (struct sockaddr *)&host_addr, sizeof(host_addr)) != 0)
+    {
+        perror("webserver (bind)");
+        close(fd);
+        return -1;
+    }
+    if(listen(fd, SOMAXCONN) != 0)
+    {
+        perror("webserver (listen)");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+    Starts a new generation of the server that shares our listening sockets.
+    The new server drains this one with SIGQUIT once its own monitor and workers are ready.
+
+    @param
+    argv: Argument vector this server was started with
+    server_fd: The listening socket to hand down
+    tls_fd: The TLS listening socket to hand down, -1 if there is none
+    dsfd: The server <-> monitor domain socket pair
+    clients: Connections held by the server
+
+    @return
+    The pid of the new server, or -1 if it could not be started
+ */
+static pid_t reexec_server(char *argv[], int server_fd, int tls_fd, const int dsfd[2], const struct client_registry *clients)
+{
+    pid_t pid;
+    char  fd_str[PID_STR_LEN];
+    char  tls_fd_str[PID_STR_LEN];
+    char  pid_str[PID_STR_LEN];
+
+    snprintf(fd_str, sizeof(fd_str), "%d", server_fd);
+    snprintf(tls_fd_str, sizeof(tls_fd_str), "%d", tls_fd);
+    snprintf(pid_str, sizeof(pid_str), "%d", getpid());
+
+    pid = fork();
+    if(pid < 0)
+    {
+        perror("webserver (fork for re-exec)");
+        return -1;
+    }
+
+    if(pid > 0)
+    {
+        printf("Started new server %d on listening socket %d\n", pid, server_fd);
+        return pid;
+    }
+
+    // Only the listening sockets survive the exec
+    close(dsfd[0]);
+    close(dsfd[1]);
+    for(int i = clients->idle.head; i >= 0; i = clients->slots[i].next)
+    {
+        close(clients->slots[i].fd);
+    }
+
+    if(fcntl(server_fd, F_SETFD, 0) == -1 || setenv(LISTEN_FD_ENV, fd_str, 1) != 0 || setenv(PARENT_PID_ENV, pid_str, 1) != 0)
+    {
+        perror("webserver (re-exec setup)");
+        _exit(EXIT_FAILURE);
+    }
+    if(tls_fd >= 0 && (fcntl(tls_fd, F_SETFD, 0) == -1 || setenv(TLS_LISTEN_FD_ENV, tls_fd_str, 1) != 0))
+    {
+        perror("webserver (re-exec setup)");
+        _exit(EXIT_FAILURE);
+    }
+
+    execvp(argv[0], argv);
+    perror("webserver (execvp)");
+    _exit(EXIT_FAILURE);
+}
+
+/*
+    Processes an HTTP request from the client and sends the appropriate response.
+
+    @param
+    client_addr: Client address info
+    client_fd: File descriptor for the client connection
+    plugin: Functions of the shared library
+    arena: Per-request arena handed to the shared library handlers
+    io: Timeouts of the request, records the bytes read and the timeout that fired if one did
+    h2: Set up when the request turns out to be the preface of an HTTP/2 connection
+ */
+static int handle_request(struct sockaddr_in client_addr, int client_fd, const struct plugin *plugin, struct arena *arena, struct request_io *io, struct h2_state *h2)
+{
+    char buffer[BUFFER_SIZE] = {0};    // Buffer for storing incoming data
+    int  is_http;
+    int  is_head;
     int  is_img;
     char req_path[BUFFER_SIZE];    // Path of the requested file
     int  retval;
 
     ssize_t valread;
+    char   *request;           // The request with all of a POST body, buffer unless the body did not fit
+    size_t  request_length;
     printf("[%s:%u]\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
     // Read client request
-    valread = read(client_fd, buffer, BUFFER_SIZE);
+    valread = read_request(client_fd, buffer, sizeof(buffer), io);
     if(valread < 0)
     {
-        perror("webserver (read)");
         return 1;
     }
 
-    is_http = call_is_http(is_http_req, handle, buffer);
+    // With prior knowledge or after ALPN picked h2, the connection is HTTP/2 from here on
+    if(h2_is_preface(buffer, (size_t)valread))
+    {
+        return serve_h2(client_fd, plugin, arena, io, h2, buffer, (size_t)valread);
+    }
+
+    request        = buffer;
+    request_length = (size_t)valread;
+    if(strncmp(buffer, "POST ", FIVE) == 0 && read_post_body(client_fd, arena, &request, &request_length, io) != 0)
+    {
+        return 1;
+    }
+
+    // The writes happen inside http.so, so the write timeout is enforced on the socket itself
+    if(io->timeouts->write > 0)
+    {
+        struct timeval send_timeout;
+
+        send_timeout.tv_sec  = io->timeouts->write;
+        send_timeout.tv_usec = 0;
+        if(setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) != 0)
+        {
+            perror("webserver (setsockopt SO_SNDTIMEO)");
+        }
+
+        // A batch is still being read while it is answered, only its reads and sends are timed
+        if(strncmp(buffer, BATCH_REQUEST_LINE, sizeof(BATCH_REQUEST_LINE) - 1) != 0)
+        {
+            io->timer.kind = TIMEOUT_WRITE;
+            timer_add(io->wheel, &io->timer, timer_now_ms(), (uint64_t)io->timeouts->write * MS_PER_SEC);
+        }
+    }
+    errno = 0;    // So a send that hit SO_SNDTIMEO can be told apart afterwards
+
+    is_http = call_is_http(plugin, buffer);
+    PROBE3(parse_done, probe_conn_id(client_fd), valread, is_http);
     if(is_http < 0)
     {
         printf("gets 400 file path and isn't proper http request\n");
         strncpy(req_path, "/400.txt", LEN_405);
         req_path[TEN] = '\0';
-        return call_handle_client(handle_c, handle, client_fd, req_path, -1, -1);
+        return call_handle_client(plugin, arena, client_fd, req_path, -1, -1);
     }
 
-    retval = call_set_request_path(set_req_path, handle, req_path, buffer);
+    retval = call_set_request_path(plugin, req_path, buffer);
     if(retval == 1)
     {
         printf("could not call set request path from library\n");
@@ -571,19 +1219,21 @@ static int handle_request(struct sockaddr_in client_addr, int client_fd, void *h
     // printf("\nrequest path generated: %s\n", req_path);
 
     // Detect HTTP Method
-    if(strncmp(buffer, "POST ", FIVE) == 0)
+    if(strncmp(buffer, "POST ", FIVE) == 0 && strcmp(req_path, BATCH_PATH) == 0)
     {
-        int (*handle_post_lib)(const char *, int) = NULL;
-
-        *(void **)(&handle_post_lib) = dlsym(handle, "handle_post_request");
-        if(!handle_post_lib)
+        printf("Batched POST request detected\n");
+        retval = plugin->handle_batch_request(arena, request, request_length, client_fd);
+        if(retval == BODY_TIMED_OUT)
         {
-            fprintf(stderr, "dlsym failed (handle_post_request): %s\n", dlerror());
-            return 1;
+            io->expired = TIMEOUT_BODY;
+            retval      = 1;
         }
-
+        return retval;
+    }
+    if(strncmp(buffer, "POST ", FIVE) == 0)
+    {
         printf("POST request detected\n");
-        return handle_post_lib(buffer, client_fd);
+        return plugin->handle_post_request(request, client_fd);
     }
     if(strncmp(buffer, "HEAD ", FIVE) == 0)
     {
@@ -592,7 +1242,7 @@ static int handle_request(struct sockaddr_in client_addr, int client_fd, void *h
 
         printf("HEAD request detected\n");
 
-        return call_handle_client(handle_c, handle, client_fd, req_path, is_head, is_img);
+        return call_handle_client(plugin, arena, client_fd, req_path, is_head, is_img);
     }
     if(strncmp(buffer, "GET ", FOUR) == 0)
     {
@@ -607,7 +1257,7 @@ static int handle_request(struct sockaddr_in client_addr, int client_fd, void *h
 
         printf("GET request detected\n");
 
-        return call_handle_client(handle_c, handle, client_fd, req_path, is_head, is_img);
+        return call_handle_client(plugin, arena, client_fd, req_path, is_head, is_img);
     }
     if(strncmp(buffer, "HEAD ", FIVE) != 0 && strncmp(buffer, "GET ", FOUR) != 0 && strncmp(buffer, "POST ", FIVE) != 0)
     {
@@ -615,107 +1265,734 @@ static int handle_request(struct sockaddr_in client_addr, int client_fd, void *h
         is_img  = -1;
         strncpy(req_path, "/405.txt", LEN_405);
         req_path[TEN] = '\0';
-        return call_handle_client(handle_c, handle, client_fd, req_path, is_head, is_img);
+        return call_handle_client(plugin, arena, client_fd, req_path, is_head, is_img);
     }
 
     return 0;
 }
 
 /*
-    Receives a file descriptor sent over a UNIX domain socket
+    Serves an HTTP/2 connection until it has no open stream, the same way handle_request
+    serves one HTTP/1 request. A connection that ends or breaks is shut down, so the
+    listener closes it instead of holding it.
 
     @param
-    socket: The socket to receive the file descriptor from
+    client_fd: File descriptor for the client connection
+    plugin: Functions of the shared library
+    arena: Per-request arena, reset by the connection whenever no stream is open
+    io: Timeouts of the connection, records the bytes read and the timeout that fired if one did
+    h2: Where the connection left off, updated
+    early: What handle_request already read, NULL for a connection the listener held
+    early_len: How many bytes that is
 
     @return
-    The received file descriptor, or -1 on error
+    0: The connection can be held until the client sends more
+    1: It ended on an error or a timeout
  */
-int recv_fd(int socket)
+static int serve_h2(int client_fd, const struct plugin *plugin, struct arena *arena, struct request_io *io, struct h2_state *h2, const char *early, size_t early_len)
 {
-    struct msghdr   msg = {0};
-    struct iovec    io  = {0};
-    char            buf[1];
-    struct cmsghdr *cmsg;
-    char            control[CMSG_SPACE(sizeof(int))];
-    int             fd;
+    struct h2_context context;
+    enum h2_result    result;
+
+    context.arena          = arena;
+    context.open_resource  = plugin->open_resource;
+    context.header_timeout = io->timeouts->header;
+    context.write_timeout  = io->timeouts->write;
+    result                 = h2_serve(client_fd, h2, early, early_len, &context);
+    io->bytes_read         = early_len + context.bytes_read;
+    io->expired            = TIMEOUT_NONE;
+    io->refused            = 0;
+
+    switch(result)
+    {
+        case H2_IDLE:
+        {
+            return 0;
+        }
+        case H2_HEADER_TIMEOUT:
+        {
+            io->expired = TIMEOUT_HEADER;
+            return 1;
+        }
+        case H2_WRITE_TIMEOUT:
+        {
+            io->expired = TIMEOUT_WRITE;
+            return 1;
+        }
+        case H2_ERROR:
+        {
+            shutdown(client_fd, SHUT_RDWR);
+            return 1;
+        }
+        case H2_CLOSED:
+        default:
+        {
+            shutdown(client_fd, SHUT_RDWR);
+            return 0;
+        }
+    }
+}
 
-    io.iov_base    = buf;
-    io.iov_len     = sizeof(buf);
-    msg.msg_iov    = &io;
-    msg.msg_iovlen = 1;
+/*
+    Reads a request until the end of its headers and of the body they announce, the buffer
+    is full or the client stops sending. The headers and the body each have their own timeout.
 
-    msg.msg_control    = control;
-    msg.msg_controllen = sizeof(control);
+    @param
+    client_fd: File descriptor for the client connection
+    buffer: Zeroed output buffer, left NUL-terminated
+    size: Size of the buffer
+    io: Timeouts of the request, records the bytes read and the timeout that fired if one did
 
-    if(recvmsg(socket, &msg, 0) < 0)
+    @return
+    The number of bytes read, or -1 on a read error or timeout
+ */
+static ssize_t read_request(int client_fd, char *buffer, size_t size, struct request_io *io)
+{
+    size_t total = 0;
+    long   body  = -1;    // Length of the body, known once the headers are complete
+
+    io->bytes_read = 0;
+    io->expired    = TIMEOUT_NONE;
+    io->refused    = 0;
+    if(io->timeouts->header > 0)
     {
-        perror("recvmsg");
-        close(socket);
-        return -1;
+        io->timer.kind = TIMEOUT_HEADER;
+        timer_add(io->wheel, &io->timer, timer_now_ms(), (uint64_t)io->timeouts->header * MS_PER_SEC);
     }
-    cmsg = CMSG_FIRSTHDR(&msg);
 
-    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    while(total < size - 1)
     {
-        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
-        return fd;
+        ssize_t     valread;
+        const char *end = body < 0 ? strstr(buffer, "\r\n\r\n") : NULL;
+
+        if(end != NULL)
+        {
+            body = request_body_length(buffer) + (long)(end + FOUR - buffer);
+
+            // The rest of the request is timed as a body
+            timer_cancel(io->wheel, &io->timer);
+            if(io->timeouts->body > 0)
+            {
+                io->timer.kind = TIMEOUT_BODY;
+                timer_add(io->wheel, &io->timer, timer_now_ms(), (uint64_t)io->timeouts->body * MS_PER_SEC);
+            }
+        }
+        if(body >= 0 && (long)total >= body)
+        {
+            break;
+        }
+
+        if(wait_readable(client_fd, io) != 0)
+        {
+            return -1;
+        }
+
+        valread = read(client_fd, buffer + total, size - 1 - total);
+        if(valread < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN)
+            {
+                continue;
+            }
+            perror("webserver (read)");
+            timer_cancel(io->wheel, &io->timer);
+            return -1;
+        }
+        if(valread == 0)
+        {
+            break;
+        }
+        total += (size_t)valread;
+        io->bytes_read = total;
     }
-    return -1;
+
+    timer_cancel(io->wheel, &io->timer);
+    buffer[total] = '\0';
+    return (ssize_t)total;
 }
 
 /*
-    Sends a file descriptor over a UNIX domain socket
+    Reads the rest of a POST body that did not fit the request buffer into the arena. A
+    body announced as larger than MAX_POST_BODY gets a 413, and one the arena has no room
+    for a 500, both without reading it. A chunked body is decoded as it arrives. A batch is left on the socket: its handler
+    stores the records as they arrive, timed by SO_RCVTIMEO.
 
     @param
-    socket: The socket to send the file descriptor through
-    fd: The file descriptor to send
+    client_fd: File descriptor for the client connection
+    arena: Per-request arena the whole request is copied into
+    request: The request read so far, replaced by the whole request when more was read
+    length: Bytes of the request, updated with the bytes read
+    io: Timeouts of the request, the rest of the body gets a new body timeout
 
     @return
-    0 on success, -1 on error
+    0: *request holds all the client sent of the body, or as much as will be read
+    -1: A read error or timeout, or the body was refused
  */
-int send_fd(int socket, int fd)
+static int read_post_body(int client_fd, struct arena *arena, char **request, size_t *length, struct request_io *io)
 {
-    struct msghdr   msg    = {0};
-    struct iovec    io     = {0};
-    char            buf[1] = {0};
-    struct cmsghdr *cmsg;
-    char            control[CMSG_SPACE(sizeof(int))];
+    const char *end = strstr(*request, "\r\n\r\n");
+    size_t      body;
+    size_t      need;
+    size_t      total = *length;
+    char       *whole;
 
-    io.iov_base        = buf;
-    io.iov_len         = sizeof(buf);
-    msg.msg_iov        = &io;
-    msg.msg_iovlen     = 1;
-    msg.msg_control    = control;
-    msg.msg_controllen = sizeof(control);
+    if(end == NULL)
+    {
+        return 0;
+    }
+    if(strncmp(*request, BATCH_REQUEST_LINE, sizeof(BATCH_REQUEST_LINE) - 1) == 0)
+    {
+        struct timeval receive_timeout;
 
-    cmsg             = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type  = SCM_RIGHTS;
-    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+        receive_timeout.tv_sec  = io->timeouts->body;
+        receive_timeout.tv_usec = 0;
+        if(setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout)) != 0)
+        {
+            perror("webserver (setsockopt SO_RCVTIMEO)");
+        }
+        return 0;
+    }
+    if(is_chunked(*request, end))
+    {
+        return read_chunked_body(client_fd, arena, request, length, io);
+    }
 
-    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    body = (size_t)request_body_length(*request);
+    need = (size_t)(end + FOUR - *request) + body;
+    if(body > MAX_POST_BODY)
+    {
+        return refuse_request(client_fd, io, "413 Payload Too Large");
+    }
+    if(need <= total)
+    {
+        return 0;
+    }
+    whole = (char *)arena_alloc(arena, need + 1);
+    if(whole == NULL)
+    {
+        return refuse_request(client_fd, io, "500 Internal Server Error");
+    }
+    memcpy(whole, *request, total);
 
-    if(sendmsg(socket, &msg, 0) < 0)
+    if(io->timeouts->body > 0)
     {
-        perror("sendmsg");
-        close(socket);
-        return -1;
+        io->timer.kind = TIMEOUT_BODY;
+        timer_add(io->wheel, &io->timer, timer_now_ms(), (uint64_t)io->timeouts->body * MS_PER_SEC);
+    }
+    while(total < need)
+    {
+        ssize_t valread = read_some(client_fd, whole + total, need - total, io);
+
+        if(valread < 0)
+        {
+            return -1;
+        }
+        if(valread == 0)
+        {
+            break;
+        }
+        total += (size_t)valread;
+        io->bytes_read = total;
     }
+    timer_cancel(io->wheel, &io->timer);
+
+    whole[total] = '\0';
+    *request     = whole;
+    *length      = total;
     return 0;
 }
 
 /*
-    Retrieves the last modified time of a file
+    Reads a chunked POST body into the arena, decoding each read in place, so the handler
+    sees the headers followed by the plain body. A body that decodes to more than
+    MAX_POST_BODY gets a 413, bad framing a 400, and no room in the arena a 500.
 
     @param
-    path: Path to the file
+    client_fd: File descriptor for the client connection
+    arena: Per-request arena the whole request is copied into
+    request: The request read so far, replaced by the decoded request
+    length: Bytes of the request, set to the length of the decoded request
+    io: Timeouts of the request, the rest of the body gets a new body timeout
 
     @return
-    Last modified time on success, 0 on failure
+    0: *request holds the decoded request
+    -1: A read error or timeout, or the body was refused
  */
-time_t get_last_modified_time(const char *path)
+static int read_chunked_body(int client_fd, struct arena *arena, char **request, size_t *length, struct request_io *io)
 {
-    struct stat attr;
+    size_t         header_len = (size_t)(strstr(*request, "\r\n\r\n") + FOUR - *request);
+    size_t         limit      = header_len + MAX_POST_BODY;
+    size_t         decoded    = header_len;
+    size_t         pending    = *length - header_len;
+    struct chunked decoder;
+    char          *whole;
+    int            result = 0;
+
+    whole = (char *)arena_alloc(arena, limit + 1);
+    if(whole == NULL)
+    {
+        return refuse_request(client_fd, io, "500 Internal Server Error");
+    }
+    memcpy(whole, *request, *length);
+    chunked_init(&decoder);
+
+    if(io->timeouts->body > 0)
+    {
+        io->timer.kind = TIMEOUT_BODY;
+        timer_add(io->wheel, &io->timer, timer_now_ms(), (uint64_t)io->timeouts->body * MS_PER_SEC);
+    }
+    while(result == 0)
+    {
+        size_t  used;
+        ssize_t valread;
+        ssize_t out = chunked_decode(&decoder, whole + decoded, pending, &used);
+
+        if(out < 0)
+        {
+            result = refuse_request(client_fd, io, "400 Bad Request");
+            break;
+        }
+        decoded += (size_t)out;
+        if(chunked_done(&decoder))
+        {
+            break;
+        }
+        if(decoded == limit)
+        {
+            result = refuse_request(client_fd, io, "413 Payload Too Large");
+            break;
+        }
+
+        // Raw bytes go where the decoded ones end, decoding never moves data forward
+        valread = read_some(client_fd, whole + decoded, limit - decoded, io);
+        if(valread <= 0)
+        {
+            result = -1;
+            break;
+        }
+        pending = (size_t)valread;
+        io->bytes_read += (size_t)valread;
+    }
+    timer_cancel(io->wheel, &io->timer);
+
+    whole[decoded] = '\0';
+    *request       = whole;
+    *length        = decoded;
+    return result;
+}
+
+/*
+    Waits for and reads whatever the client sent next, within the current timeout
+
+    @param
+    client_fd: File descriptor for the client connection
+    buffer: Where the bytes go
+    size: Most bytes to read
+    io: The request, io->expired is set if its timeout fires
+
+    @return
+    The number of bytes read, 0 when the client closed its side, or -1 on a read error or timeout
+ */
+static ssize_t read_some(int client_fd, char *buffer, size_t size, struct request_io *io)
+{
+    while(1)
+    {
+        ssize_t valread;
+
+        if(wait_readable(client_fd, io) != 0)
+        {
+            return -1;
+        }
+        valread = read(client_fd, buffer, size);
+        if(valread >= 0)
+        {
+            return valread;
+        }
+        if(errno != EINTR && errno != EAGAIN)
+        {
+            perror("webserver (read)");
+            timer_cancel(io->wheel, &io->timer);
+            return -1;
+        }
+    }
+}
+
+/*
+    Answers a request whose body the server will not read and ends the connection, since
+    the rest of the body would otherwise be taken for the next request
+
+    @param
+    client_fd: File descriptor for the client connection
+    io: The request, marked refused so the worker hands the connection back to be closed
+    status: Status code and reason
+
+    @return
+    -1, so callers can return it
+ */
+static int refuse_request(int client_fd, struct request_io *io, const char *status)
+{
+    char response[REFUSAL_LEN];
+    int  len;
+
+    len = snprintf(response, sizeof(response), "HTTP/1.0 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+    if(len > 0 && (size_t)len < sizeof(response) && write(client_fd, response, (size_t)len) < 0)
+    {
+        perror("webserver (write refusal)");
+    }
+    shutdown(client_fd, SHUT_RDWR);
+    io->refused = 1;
+    return -1;
+}
+
+/*
+    Finds the Content-Length of a request whose headers are complete
+
+    @param
+    buffer: The request, NUL-terminated
+
+    @return
+    The announced body length, 0 if there is none or it cannot be parsed
+ */
+static long request_body_length(const char *buffer)
+{
+    const char *line = strstr(buffer, "\r\n");
+
+    while(line != NULL && strncmp(line, "\r\n\r\n", FOUR) != 0)
+    {
+        line += 2;
+        if(strncasecmp(line, CONTENT_LENGTH_HEADER, sizeof(CONTENT_LENGTH_HEADER) - 1) == 0)
+        {
+            long length = strtol(line + sizeof(CONTENT_LENGTH_HEADER) - 1, NULL, BASE_TEN);
+
+            return length > 0 ? length : 0;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return 0;
+}
+
+/*
+    Waits until the client has sent something, or the current timeout of the request fires
+
+    @param
+    fd: File descriptor for the client connection
+    io: The request, io->expired is set if its timeout fires
+
+    @return
+    0: The connection is readable
+    -1: A timeout fired or poll failed
+ */
+static int wait_readable(int fd, struct request_io *io)
+{
+    while(1)
+    {
+        struct pollfd pfd;
+        struct timer *timer;
+        uint64_t      now = timer_now_ms();
+        int           ready;
+
+        timer = timer_wheel_expire(io->wheel, now);
+        if(timer != NULL)
+        {
+            io->expired = timer->kind;
+            return -1;
+        }
+
+        pfd.fd      = fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        ready       = poll(&pfd, 1, timer_wheel_timeout_ms(io->wheel, now));
+        if(ready > 0)
+        {
+            return 0;
+        }
+        if(ready < 0 && errno != EINTR)
+        {
+            perror("webserver (poll)");
+            return -1;
+        }
+    }
+}
+
+/*
+    Receives a file descriptor sent over a UNIX domain socket, with the note sent along with it
+
+    @param
+    socket: The socket to receive the file descriptor from
+    note: Output for the note
+
+    @return
+    The received file descriptor, -1 on error, or -2 if the peer closed the socket
+ */
+int recv_fd(int socket, struct fd_note *note)
+{
+    struct msghdr   msg = {0};
+    struct iovec    io  = {0};
+    struct cmsghdr *cmsg;
+    char            control[CMSG_SPACE(sizeof(int))];
+    int             fd;
+    ssize_t         received;
+
+    io.iov_base    = note;
+    io.iov_len     = sizeof(*note);
+    msg.msg_iov    = &io;
+    msg.msg_iovlen = 1;
+
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    received = recvmsg(socket, &msg, 0);
+    if(received < 0)
+    {
+        perror("recvmsg");
+        close(socket);
+        return -1;
+    }
+    if(received == 0)
+    {
+        return -2;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        if((size_t)received < sizeof(*note))
+        {
+            fprintf(stderr, "recvmsg: short note with FD %d\n", fd);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    return -1;
+}
+
+/*
+    Sends a file descriptor over a UNIX domain socket
+
+    @param
+    socket: The socket to send the file descriptor through
+    fd: The file descriptor to send
+    note: Sent along with the fd so the receiver knows which connection it is and what to do with it
+
+    @return
+    0 on success, -1 on error
+ */
+int send_fd(int socket, int fd, const struct fd_note *note)
+{
+    struct msghdr   msg = {0};
+    struct iovec    io  = {0};
+    struct fd_note  copy;
+    struct cmsghdr *cmsg;
+    char            control[CMSG_SPACE(sizeof(int))];
+
+    copy               = *note;
+    io.iov_base        = &copy;
+    io.iov_len         = sizeof(copy);
+    msg.msg_iov        = &io;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg             = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if(sendmsg(socket, &msg, 0) < 0)
+    {
+        perror("sendmsg");
+        close(socket);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Passes a connection to the monitor and marks it as in flight
+
+    @param
+    monitor_socket: The listener's end of the listener <-> monitor socket
+    clients: The connection registry
+    slot: The connection
+    fd: The listener's descriptor for it, still to be closed by the caller
+
+    @return
+    0 on success, -1 if the fd could not be sent
+ */
+static int hand_off(int monitor_socket, struct client_registry *clients, struct client_slot *slot, int fd)
+{
+    struct fd_note note = {0};
+
+    note.client = registry_handle(clients, slot);
+    note.worker = -1;
+    note.tls    = slot->tls;
+    note.h2     = slot->h2;
+    note.tag    = FD_TAG_DONE;
+    if(send_fd(monitor_socket, fd, &note) != 0)
+    {
+        return -1;
+    }
+
+    registry_set_in_flight(clients, slot, time(NULL));
+    return 0;
+}
+
+/*
+    Stops the timer of a connection and returns its slot, the caller closes its descriptor
+
+    @param
+    clients: The connection registry
+    wheel: The listener's timer wheel
+    slot: The connection
+ */
+static void forget_client(struct client_registry *clients, struct timer_wheel *wheel, struct client_slot *slot)
+{
+    timer_cancel(wheel, &slot->timer);
+    registry_remove(clients, slot);
+}
+
+/*
+    Starts the timeout of a connection's current state, replacing the one it had
+
+    @param
+    wheel: The listener's timer wheel
+    slot: The connection
+    kind: The timeout_kind it is closed for when the timer fires
+    seconds: The timeout, 0 for none
+ */
+static void arm_client_timer(struct timer_wheel *wheel, struct client_slot *slot, int kind, int seconds)
+{
+    timer_cancel(wheel, &slot->timer);
+    if(seconds > 0)
+    {
+        slot->timer.kind = kind;
+        timer_add(wheel, &slot->timer, timer_now_ms(), (uint64_t)seconds * MS_PER_SEC);
+    }
+}
+
+/*
+    Closes the held connections whose timeout fired and forgets the in-flight ones a worker
+    never returned (the worker most likely died with them)
+
+    @param
+    clients: The connection registry
+    wheel: The listener's timer wheel
+    timed_out: Connections closed by each kind of timeout, incremented for every one closed
+
+    @return
+    The number of in-flight connections forgotten
+ */
+static int expire_clients(struct client_registry *clients, struct timer_wheel *wheel, unsigned long timed_out[TIMEOUT_KINDS])
+{
+    struct timer *timer;
+    uint64_t      now  = timer_now_ms();
+    int           lost = 0;
+
+    while((timer = timer_wheel_expire(wheel, now)) != NULL)
+    {
+        struct client_slot *slot = (struct client_slot *)timer->data;
+
+        if(slot->state == CLIENT_IN_FLIGHT)
+        {
+            fprintf(stderr, "Connection accepted %lds ago was never returned by a worker\n", (long)(time(NULL) - slot->accepted));
+            lost++;
+        }
+        else
+        {
+            close(slot->fd);
+        }
+        timed_out[timer->kind]++;
+        registry_remove(clients, slot);
+    }
+    return lost;
+}
+
+/*
+    Formats the 503 response sent to connections over the admission limits
+
+    @param
+    response: Output buffer
+    size: Size of the output buffer
+    retry_after: Seconds to put in the Retry-After header
+
+    @return
+    Length of the response
+ */
+static size_t build_shed_response(char *response, size_t size, int retry_after)
+{
+    const char *body = "Service Unavailable\n";
+    int         length;
+
+    length = snprintf(response,
+                      size,
+                      "HTTP/1.0 503 Service Unavailable\r\n"
+                      "Content-Type: text/plain\r\n"
+                      "Content-Length: %zu\r\n"
+                      "Retry-After: %d\r\n"
+                      "Connection: close\r\n"
+                      "\r\n"
+                      "%s",
+                      strlen(body),
+                      retry_after,
+                      body);
+    if(length < 0 || (size_t)length >= size)
+    {
+        return 0;
+    }
+    return (size_t)length;
+}
+
+/*
+    Answers a connection with a pre-built response and closes it without ever blocking the listener
+
+    @param
+    fd: The client connection
+    response: The 503 or 500 response, NULL to only close a connection still waiting for
+    its TLS handshake or one speaking HTTP/2, which an HTTP/1 response would mean nothing to
+    length: Length of the response
+ */
+static void shed_connection(int fd, const char *response, size_t length)
+{
+    char discard[BUFFER_SIZE];
+
+    if(response == NULL)
+    {
+        close(fd);
+        return;
+    }
+    if(send(fd, response, length, SHED_SEND_FLAGS) < 0)
+    {
+        perror("webserver (send refusal)");
+    }
+    shutdown(fd, SHUT_WR);
+
+    // Closing with the request still unread would reset the connection and could lose the 503
+    for(int i = 0; i < SHED_DRAIN_READS; i++)
+    {
+        if(recv(fd, discard, sizeof(discard), MSG_DONTWAIT) <= 0)
+        {
+            break;
+        }
+    }
+    close(fd);
+}
+
+/*
+    Retrieves the last modified time of a file
+
+    @param
+    path: Path to the file
+
+    @return
+    Last modified time on success, 0 on failure
+ */
+time_t get_last_modified_time(const char *path)
+{
+    struct stat attr;
 
     // On success, return last time file was modified
     if(stat(path, &attr) == 0)
@@ -736,81 +2013,850 @@ time_t get_last_modified_time(const char *path)
     buffer: Destination buffer for the formatted string
     buffer_size: Size of the destination buffer
  */
-void format_timestamp(time_t timestamp, char *buffer, size_t buffer_size)
+void format_timestamp(time_t timestamp, char *buffer, size_t buffer_size)
+{
+    struct tm tm_info;
+    if(localtime_r(&timestamp, &tm_info))
+    {
+        strftime(buffer, buffer_size, "%Y-%m-%d %H:%M:%S", &tm_info);
+    }
+    else
+    {
+        perror("Unknown time");
+    }
+}
+
+/*
+    Runs the monitor: hands client fds from the server to the least loaded worker,
+    passes fds returned by workers back to the server and resizes the pool
+
+    @param
+    pool: The worker pool owned by the monitor
+    server_socket: The monitor's end of the server <-> monitor domain socket
+    last_time: Timestamp of the last shared library update
+    handle: Handle to the shared library
+    clients: Connection registry of the listener, children only free it
+ */
+static void run_monitor(struct worker_pool *pool, int server_socket, time_t last_time, void *handle, struct client_registry *clients)
+{
+    sigset_t wait_mask;
+
+    watch_children(&wait_mask);
+    while(1)
+    {
+        fd_set           monitor_read_fds;
+        int              max_monitor_fd = server_socket;
+        int              monitor_activity;
+        struct timespec  timeout;
+        struct timespec *timeout_ptr = NULL;
+
+        check_for_dead_children(last_time, handle, clients, pool, server_socket);
+        memset(&monitor_read_fds, 0, sizeof(monitor_read_fds));
+
+        // Listen for new client FDs from server
+        FD_SET(server_socket, &monitor_read_fds);
+
+        // Listen for worker responses
+        for(int i = 0; i < pool->count; i++)
+        {
+            if(pool->workers[i].sockets[0] < 0)
+            {
+                continue;
+            }
+            FD_SET(pool->workers[i].sockets[0], &monitor_read_fds);
+            if(pool->workers[i].sockets[0] > max_monitor_fd)
+            {
+                max_monitor_fd = pool->workers[i].sockets[0];
+            }
+        }
+
+        // Wake up periodically to resize the pool when it is allowed to change size, to restart a worker that is backing off, or to remind the listener of the connections being served
+        if(pool->min_workers < pool->max_workers || restart_pending(pool) || clients_held(pool))
+        {
+            timeout.tv_sec  = SCALE_INTERVAL;
+            timeout.tv_nsec = 0;
+            timeout_ptr     = &timeout;
+        }
+
+        // Wait for an event on any socket or a worker dying
+        monitor_activity = pselect(max_monitor_fd + 1, &monitor_read_fds, NULL, NULL, timeout_ptr, &wait_mask);
+        if(monitor_activity < 0)
+        {
+            if(errno != EINTR)
+            {
+                perror("select error in monitor");
+            }
+            continue;
+        }
+
+        // Receive client FD from server
+        if(FD_ISSET(server_socket, &monitor_read_fds))
+        {
+            struct fd_note note;
+            int            client_fd_monitor = recv_fd(server_socket, &note);
+            if(client_fd_monitor > 0)
+            {
+                // Grow before dispatching if every worker is already busy
+                scale_pool(pool, 1, last_time, handle, clients);
+                dispatch_client(pool, server_socket, client_fd_monitor, &note);
+            }
+        }
+
+        // Receive processed FDs from workers
+        for(int i = 0; i < pool->count; i++)
+        {
+            struct worker *worker = &pool->workers[i];
+
+            if(worker->sockets[0] >= 0 && FD_ISSET(worker->sockets[0], &monitor_read_fds))
+            {
+                struct fd_note note;
+                int            returned_fd = recv_fd(worker->sockets[0], &note);
+                if(returned_fd > 0)
+                {
+                    return_client(pool, i, server_socket, returned_fd, &note);
+                }
+            }
+        }
+        scale_pool(pool, 0, last_time, handle, clients);
+        remind_listener(pool, server_socket);
+    }
+}
+
+/*
+    Sends a client fd to the least loaded worker, or back to the listener to be shed when
+    every worker is at its queue limit. The monitor keeps its copy of a dispatched fd until
+    the worker returns it.
+
+    @param
+    pool: The worker pool
+    server_socket: The monitor's end of the server <-> monitor domain socket
+    client_fd: The monitor's descriptor for the connection
+    note: The note that came with it from the listener
+ */
+static void dispatch_client(struct worker_pool *pool, int server_socket, int client_fd, struct fd_note *note)
+{
+    int worker_index = pick_worker(pool);
+
+    if(worker_index >= 0 && pool->worker_queue > 0 && pool->workers[worker_index].in_flight >= pool->worker_queue)
+    {
+        worker_index = -1;
+    }
+    if(worker_index >= 0 && send_fd(pool->workers[worker_index].sockets[0], client_fd, note) == 0)
+    {
+        PROBE3(dispatch, probe_conn_id(client_fd), client_fd, pool->workers[worker_index].id);
+        pool->workers[worker_index].in_flight++;
+        if(hold_client(&pool->workers[worker_index], note->client, client_fd) != 0)
+        {
+            // Still served, only a crash of the worker would lose it without a response
+            close(client_fd);
+        }
+        return;
+    }
+
+    // Sent back for the listener to answer with a 503
+    note->tag = FD_TAG_SHED;
+    if(send_fd(server_socket, client_fd, note) != 0)
+    {
+        fprintf(stderr, "Monitor could not dispatch client FD %d\n", client_fd);
+    }
+    close(client_fd);
+}
+
+/*
+    Passes a client fd a worker is done with back to the listener
+
+    @param
+    pool: The worker pool
+    index: Index of the worker that returned it
+    server_socket: The monitor's end of the server <-> monitor domain socket
+    fd: The returned fd
+    note: The note the worker sent with it
+ */
+static void return_client(struct worker_pool *pool, int index, int server_socket, int fd, struct fd_note *note)
+{
+    struct worker *worker = &pool->workers[index];
+
+    note->worker = worker->id;
+    send_fd(server_socket, fd, note);
+    close(fd);    // Clean up after worker has finished
+    release_client(worker, note->client);
+
+    if(worker->in_flight > 0)
+    {
+        worker->in_flight--;
+    }
+    if(worker->in_flight == 0)
+    {
+        worker->idle_since = time(NULL);
+        if(worker->draining)
+        {
+            // The last request of a retiring worker is done, let it exit
+            drain_worker(pool, index);
+        }
+    }
+}
+
+/*
+    Keeps the monitor's copy of a client fd dispatched to a worker
+
+    @param
+    worker: The worker the fd was sent to
+    client: Registry handle of the connection
+    fd: The monitor's descriptor for it
+
+    @return
+    0: Held until the worker returns it
+    -1: Out of memory, the caller closes fd
+ */
+static int hold_client(struct worker *worker, uint64_t client, int fd)
+{
+    if(worker->held_count == worker->held_capacity)
+    {
+        int                 new_capacity = worker->held_capacity == 0 ? DEFAULT_WORKER_QUEUE : worker->held_capacity * 2;
+        struct held_client *temp         = (struct held_client *)realloc(worker->held, sizeof(struct held_client) * (size_t)new_capacity);
+
+        if(temp == NULL)
+        {
+            perror("realloc");
+            return -1;
+        }
+        worker->held          = temp;
+        worker->held_capacity = new_capacity;
+    }
+    worker->held[worker->held_count].client   = client;
+    worker->held[worker->held_count].fd       = fd;
+    worker->held[worker->held_count].reminded = time(NULL);
+    worker->held_count++;
+    return 0;
+}
+
+/*
+    Closes the monitor's copy of a client fd once the worker no longer has it
+
+    @param
+    worker: The worker the fd was dispatched to
+    client: Registry handle of the connection
+ */
+static void release_client(struct worker *worker, uint64_t client)
+{
+    // Workers serve their fds in order, so it is almost always the first one
+    for(int i = 0; i < worker->held_count; i++)
+    {
+        if(worker->held[i].client == client)
+        {
+            close(worker->held[i].fd);
+            memmove(&worker->held[i], &worker->held[i + 1], sizeof(struct held_client) * (size_t)(worker->held_count - i - 1));
+            worker->held_count--;
+            return;
+        }
+    }
+}
+
+/*
+    Sends the listener a copy of every connection a live worker has had for a while, so it
+    does not give up on one that is only slow, like a long batch upload or a busy HTTP/2
+    connection. The listener only forgets a connection it has not heard of for
+    CLIENT_LOST_TIMEOUT, which leaves the ones the monitor lost track of.
+
+    @param
+    pool: The worker pool
+    server_socket: The monitor's end of the server <-> monitor domain socket
+ */
+static void remind_listener(struct worker_pool *pool, int server_socket)
+{
+    time_t now = time(NULL);
+
+    for(int i = 0; i < pool->count; i++)
+    {
+        struct worker *worker = &pool->workers[i];
+
+        // The connections of a dead worker are sent back by check_for_dead_children
+        if(worker->pid < 0)
+        {
+            continue;
+        }
+        for(int k = 0; k < worker->held_count; k++)
+        {
+            struct held_client *held = &worker->held[k];
+            struct fd_note      note;
+
+            if(now - held->reminded < CLIENT_REMIND_INTERVAL)
+            {
+                continue;
+            }
+            memset(&note, 0, sizeof(note));
+            note.client = held->client;
+            note.worker = worker->id;
+            note.tag    = FD_TAG_BUSY;
+            if(send_fd(server_socket, held->fd, &note) == 0)
+            {
+                held->reminded = now;
+            }
+        }
+    }
+}
+
+/*
+    Tells whether any worker has connections the listener has to be reminded of
+
+    @param
+    pool: The worker pool
+
+    @return
+    1 if a worker holds a connection, 0 otherwise
+ */
+static int clients_held(const struct worker_pool *pool)
+{
+    for(int i = 0; i < pool->count; i++)
+    {
+        if(pool->workers[i].held_count > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Saves the connections of a worker that died. The ones it finished go back to the
+    listener as usual and the one it was serving is sent back to be answered with a 500.
+    The ones still queued on its socket were never read, they stay held to be dispatched
+    again by requeue_clients.
+
+    @param
+    pool: The worker pool
+    index: Index of the dead worker
+    server_socket: The monitor's end of the server <-> monitor domain socket
+
+    @return
+    Number of connections the worker was serving when it died
+ */
+static int recover_clients(struct worker_pool *pool, int index, int server_socket)
+{
+    struct worker *worker = &pool->workers[index];
+    struct fd_note note;
+    struct pollfd  returned;
+    int            fd;
+    int            unread = 0;
+    int            orphaned;
+
+    if(worker->sockets[0] >= 0)
+    {
+        returned.fd     = worker->sockets[0];
+        returned.events = POLLIN;
+        while(poll(&returned, 1, 0) > 0 && (returned.revents & POLLIN) && (fd = recv_fd(worker->sockets[0], &note)) >= 0)
+        {
+            return_client(pool, index, server_socket, fd, &note);
+        }
+        close(worker->sockets[0]);
+        worker->sockets[0] = -1;
+    }
+
+    // With the monitor's end closed the worker's end reads as EOF once its queue is empty
+    if(worker->sockets[1] >= 0)
+    {
+        while((fd = recv_fd(worker->sockets[1], &note)) >= 0)
+        {
+            close(fd);    // The held copy is the one dispatched again
+            unread++;
+        }
+        close(worker->sockets[1]);
+        worker->sockets[1] = -1;
+    }
+
+    // The worker takes its fds in the order they were sent, so the unread ones are the last held
+    orphaned = worker->held_count - unread;
+    for(int i = 0; i < orphaned; i++)
+    {
+        note.client  = worker->held[i].client;
+        note.bytes   = 0;
+        note.worker  = worker->id;
+        note.timeout = TIMEOUT_NONE;
+        note.tag     = FD_TAG_CRASH;
+        if(send_fd(server_socket, worker->held[i].fd, &note) != 0)
+        {
+            fprintf(stderr, "Monitor could not return client FD %d of a dead worker\n", worker->held[i].fd);
+        }
+        close(worker->held[i].fd);
+    }
+    memmove(worker->held, worker->held + orphaned, sizeof(struct held_client) * (size_t)unread);
+    worker->held_count = unread;
+    worker->in_flight  = 0;
+    worker->idle_since = time(NULL);
+    return orphaned;
+}
+
+/*
+    Dispatches again the connections a dead worker never read, once it was restarted or
+    left waiting for its backoff, so they can even go back to the same slot
+
+    @param
+    pool: The worker pool
+    index: Index of the dead worker
+    server_socket: The monitor's end of the server <-> monitor domain socket
+ */
+static void requeue_clients(struct worker_pool *pool, int index, int server_socket)
+{
+    struct held_client *unread = pool->workers[index].held;
+    int                 count  = pool->workers[index].held_count;
+
+    pool->workers[index].held          = NULL;
+    pool->workers[index].held_count    = 0;
+    pool->workers[index].held_capacity = 0;
+    for(int i = 0; i < count; i++)
+    {
+        struct fd_note note = {0};
+
+        note.client = unread[i].client;
+        note.worker = -1;
+        note.tag    = FD_TAG_DONE;
+        dispatch_client(pool, server_socket, unread[i].fd, &note);
+    }
+    free(unread);
+}
+
+/*
+    Starts a dead worker again, or tries again a second later when it cannot be forked
+
+    @param
+    pool: The worker pool
+    index: Index of the worker
+    last_time: Timestamp of the last shared library update
+    handle: Handle to the shared library
+    clients: Connection registry of the listener, children only free it
+ */
+static void restart_worker(struct worker_pool *pool, int index, time_t last_time, void *handle, struct client_registry *clients)
+{
+    struct worker *worker = &pool->workers[index];
+
+    if(spawn_worker(pool, index, last_time, handle, clients) != 0)
+    {
+        perror("Failed to restart worker");
+        worker->pid        = -1;
+        worker->restart_at = time(NULL) + SCALE_INTERVAL;
+        return;
+    }
+    worker->restarts++;
+    pool->restarts++;
+    printf("Worker %d restarted as %d, %d restarts of this worker and %lu in the pool\n", worker->id, worker->pid, worker->restarts, pool->restarts);
+}
+
+/*
+    Logs why a worker died
+
+    @param
+    pid: The worker
+    status: Its status from waitpid
+    orphaned: Connections it was serving when it died
+ */
+static void report_exit(pid_t pid, int status, int orphaned)
+{
+    if(WIFSIGNALED(status))
+    {
+        fprintf(stderr, "Worker %d killed by signal %d (%s)", pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
+    }
+    else
+    {
+        fprintf(stderr, "Worker %d exited with status %d", pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    }
+    fprintf(stderr, " while serving %d connections\n", orphaned);
+}
+
+/*
+    Decides when a dead worker is started again: right away after a single crash, then
+    after a delay that doubles with every crash of the streak
+
+    @param
+    pool: The worker pool
+    index: Index of the dead worker
+ */
+static void schedule_restart(struct worker_pool *pool, int index)
+{
+    struct worker *worker = &pool->workers[index];
+    time_t         now    = time(NULL);
+    int            delay  = 0;
+
+    worker->crash_streak = worker->last_crash != 0 && now - worker->last_crash < CRASH_LOOP_WINDOW ? worker->crash_streak + 1 : 1;
+    worker->last_crash   = now;
+    for(int i = 1; i < worker->crash_streak && delay < MAX_RESTART_BACKOFF; i++)
+    {
+        delay = delay == 0 ? 1 : delay * 2;
+    }
+    delay = delay < MAX_RESTART_BACKOFF ? delay : MAX_RESTART_BACKOFF;
+    if(worker->crash_streak >= CRASH_LOOP_LIMIT)
+    {
+        fprintf(stderr, "Worker %d is crash looping, %d crashes in a row\n", index, worker->crash_streak);
+    }
+    if(delay > 0)
+    {
+        fprintf(stderr, "Restarting worker %d in %d seconds\n", index, delay);
+    }
+
+    worker->pid        = -1;
+    worker->restart_at = now + delay;
+}
+
+/*
+    Tells whether a dead worker is waiting for its backoff to run out
+
+    @param
+    pool: The worker pool
+
+    @return
+    1: At least one worker is waiting to be restarted
+    0: None is
+ */
+static int restart_pending(const struct worker_pool *pool)
+{
+    for(int i = 0; i < pool->count; i++)
+    {
+        if(pool->workers[i].pid < 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Creates the monitor <-> worker domain socket and forks the worker at the given pool index
+
+    @param
+    pool: The worker pool
+    index: Index of the worker to start
+    last_time: Timestamp of the last shared library update
+    handle: Handle to the shared library
+    clients: Connection registry of the listener, children only free it
+
+    @return
+    0: The worker was started
+    -1: The socket pair or the fork failed
+ */
+static int spawn_worker(struct worker_pool *pool, int index, time_t last_time, void *handle, struct client_registry *clients)
+{
+    struct worker *worker = &pool->workers[index];
+    pid_t          pid;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, worker->sockets) == -1)
+    {
+        perror("Failed to create worker socket pair");
+        worker->sockets[0] = -1;
+        worker->sockets[1] = -1;
+        return -1;
+    }
+    if(worker->sockets[0] >= FD_SETSIZE)
+    {
+        // The monitor selects on its end
+        fprintf(stderr, "Worker socket FD %d is too high to select on\n", worker->sockets[0]);
+        close(worker->sockets[0]);
+        close(worker->sockets[1]);
+        worker->sockets[0] = -1;
+        worker->sockets[1] = -1;
+        return -1;
+    }
+
+    pid = fork();
+    if(pid < 0)
+    {
+        perror("webserver (fork)");
+        close(worker->sockets[0]);
+        close(worker->sockets[1]);
+        worker->sockets[0] = -1;
+        worker->sockets[1] = -1;
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        int      result;
+        sigset_t child_signals;
+
+        // Drop the monitor's end of every socket pair so a closed pair reaches its worker as EOF
+        for(int j = 0; j < pool->count; j++)
+        {
+            if(pool->workers[j].sockets[0] >= 0)
+            {
+                close(pool->workers[j].sockets[0]);
+            }
+            if(j != index && pool->workers[j].sockets[1] >= 0)
+            {
+                close(pool->workers[j].sockets[1]);
+            }
+
+            // A copy of another worker's connection here would keep it open after that worker closes it
+            for(int k = 0; k < pool->workers[j].held_count; k++)
+            {
+                close(pool->workers[j].held[k].fd);
+            }
+        }
+
+        // Blocked by the monitor for its own use
+        sigemptyset(&child_signals);
+        sigaddset(&child_signals, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &child_signals, NULL);
+        signal(SIGCHLD, SIG_DFL);
+
+        cpu_plan_pin_worker(pool->cpu_plan, worker->id);
+
+        result = worker_loop(last_time, handle, worker->id, clients, worker->sockets[1], pool);
+        if(result != 0)
+        {
+            perror("webserver (worker loop)");
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    // The worker's end stays open in the monitor too, to take back what a dead worker never read
+    worker->pid        = pid;
+    worker->in_flight  = 0;
+    worker->draining   = 0;
+    worker->idle_since = time(NULL);
+    return 0;
+}
+
+/*
+    Appends a new worker to the pool, growing the worker array when it is full
+
+    @param
+    pool: The worker pool
+    last_time: Timestamp of the last shared library update
+    handle: Handle to the shared library
+    clients: Connection registry of the listener, children only free it
+
+    @return
+    0: The worker was added
+    -1: The worker could not be added
+ */
+static int add_worker(struct worker_pool *pool, time_t last_time, void *handle, struct client_registry *clients)
+{
+    if(pool->count == pool->capacity)
+    {
+        int            new_capacity = pool->capacity == 0 ? pool->max_workers : pool->capacity * 2;
+        struct worker *temp         = (struct worker *)realloc(pool->workers, sizeof(struct worker) * (size_t)new_capacity);
+
+        if(temp == NULL)
+        {
+            perror("realloc");
+            return -1;
+        }
+        pool->workers  = temp;
+        pool->capacity = new_capacity;
+    }
+
+    memset(&pool->workers[pool->count], 0, sizeof(struct worker));
+    pool->workers[pool->count].id         = free_worker_id(pool);
+    pool->workers[pool->count].sockets[0] = -1;
+    pool->workers[pool->count].sockets[1] = -1;
+    pool->count++;
+
+    if(spawn_worker(pool, pool->count - 1, last_time, handle, clients) != 0)
+    {
+        pool->count--;
+        return -1;
+    }
+
+    printf("Worker %d started, pool size is now %d\n", pool->workers[pool->count - 1].pid, pool->count);
+    return 0;
+}
+
+/*
+    Finds the lowest id no worker in the pool has, so a new worker takes the CPU of one that was removed
+
+    @param
+    pool: The worker pool
+
+    @return
+    The id for a new worker
+ */
+static int free_worker_id(const struct worker_pool *pool)
+{
+    for(int id = 0;; id++)
+    {
+        int taken = 0;
+
+        for(int i = 0; i < pool->count && !taken; i++)
+        {
+            taken = pool->workers[i].id == id;
+        }
+        if(!taken)
+        {
+            return id;
+        }
+    }
+}
+
+/*
+    Chooses the worker that should receive the next client fd
+
+    @param
+    pool: The worker pool
+
+    @return
+    Index of the non-draining worker with the fewest in-flight requests, or -1 if there is none
+ */
+static int pick_worker(struct worker_pool *pool)
+{
+    int best = -1;
+
+    if(pool->count == 0)
+    {
+        return -1;
+    }
+
+    for(int n = 0; n < pool->count; n++)
+    {
+        int i = (pool->next + n) % pool->count;
+
+        if(pool->workers[i].draining || pool->workers[i].sockets[0] < 0)
+        {
+            continue;
+        }
+        if(best == -1 || pool->workers[i].in_flight < pool->workers[best].in_flight)
+        {
+            best = i;
+        }
+    }
+
+    if(best >= 0)
+    {
+        pool->next = (best + 1) % pool->count;
+    }
+    return best;
+}
+
+/*
+    Retires a worker: it stops receiving new fds and is told to exit once its in-flight requests are done
+
+    @param
+    pool: The worker pool
+    index: Index of the worker to retire
+ */
+static void drain_worker(struct worker_pool *pool, int index)
+{
+    struct worker *worker = &pool->workers[index];
+
+    worker->draining = 1;
+    if(worker->in_flight == 0 && worker->sockets[0] >= 0)
+    {
+        // Closing our end makes the worker's recv_fd see EOF and exit cleanly
+        close(worker->sockets[0]);
+        worker->sockets[0] = -1;
+        printf("Worker %d drained, shutting it down\n", worker->pid);
+    }
+}
+
+/*
+    Grows the pool when new work would have to queue behind a busy worker and
+    shrinks it when a worker has been idle for longer than the idle timeout
+
+    @param
+    pool: The worker pool
+    pending: Number of client fds about to be dispatched
+    last_time: Timestamp of the last shared library update
+    handle: Handle to the shared library
+    clients: Connection registry of the listener, children only free it
+ */
+static void scale_pool(struct worker_pool *pool, int pending, time_t last_time, void *handle, struct client_registry *clients)
 {
-    struct tm tm_info;
-    if(localtime_r(&timestamp, &tm_info))
+    int    active    = 0;
+    int    in_flight = 0;
+    int    idle      = -1;
+    time_t now       = time(NULL);
+
+    for(int i = 0; i < pool->count; i++)
     {
-        strftime(buffer, buffer_size, "%Y-%m-%d %H:%M:%S", &tm_info);
+        if(pool->workers[i].draining)
+        {
+            continue;
+        }
+        active++;
+        in_flight += pool->workers[i].in_flight;
+        // A worker waiting to be restarted still counts, so a crash loop does not make the pool grow around it
+        if(pool->workers[i].pid > 0 && pool->workers[i].in_flight == 0 && (idle == -1 || pool->workers[i].idle_since < pool->workers[idle].idle_since))
+        {
+            idle = i;
+        }
     }
-    else
+
+    // Backlog: the pending fds would wait behind requests already in flight, add one more worker
+    if(pending > 0 && in_flight + pending > active && active < pool->max_workers)
     {
-        perror("Unknown time");
+        if(add_worker(pool, last_time, handle, clients) != 0)
+        {
+            fprintf(stderr, "Monitor could not grow the worker pool\n");
+        }
+        return;
+    }
+
+    // Shrink by retiring the worker that has been idle the longest
+    if(idle >= 0 && active > pool->min_workers && now - pool->workers[idle].idle_since >= pool->idle_timeout)
+    {
+        printf("Worker %d idle for %d seconds, retiring it\n", pool->workers[idle].pid, pool->idle_timeout);
+        drain_worker(pool, idle);
     }
 }
 
 /*
-    Checks for terminated worker processes and restarts them if needed
+    Checks for terminated worker processes, restarts the ones that died and removes the ones that were drained
 
     @param
     last_time: Timestamp of the last shared library update
     handle: Handle to the shared library
-    client_sockets: Array of client socket FDs
-    worker_sockets: 2D array of monitor-worker socket pairs
-    child_pids: Array of worker process IDs
-    children: Total number of worker processes
+    clients: Connection registry of the listener, children only free it
+    pool: The worker pool
+    server_socket: The monitor's end of the server <-> monitor domain socket, where a dead worker's connections go
  */
-static void check_for_dead_children(time_t last_time, void *handle, int client_sockets[], int **worker_sockets, int child_pids[], int children)
+static void check_for_dead_children(time_t last_time, void *handle, struct client_registry *clients, struct worker_pool *pool, int server_socket)
 {
     int dead_worker;
     int status;
     while((dead_worker = waitpid(-1, &status, WNOHANG)) > 0)
     {
-        printf("Worker %d died, restarting...\n", dead_worker);
-
         // Find the corresponding worker index
-        for(int i = 0; i < children; i++)
+        for(int i = 0; i < pool->count; i++)
         {
-            if(child_pids[i] == dead_worker)
-            {
-                pid_t new_pid;
-                // Restart the worker
-                close(worker_sockets[i][0]);
-                close(worker_sockets[i][1]);
+            struct worker *worker = &pool->workers[i];
+            int            orphaned;
 
-                // Recreate the socket pair
-                if(socketpair(AF_UNIX, SOCK_STREAM, 0, worker_sockets[i]) == -1)
-                {
-                    perror("Failed to create worker socket pair");
-                    continue;
-                }
+            if(worker->pid != dead_worker)
+            {
+                continue;
+            }
 
-                new_pid = fork();
-                if(new_pid == 0)
-                {
-                    int result;
-                    // Worker process
-                    close(worker_sockets[i][0]);                                                   // Close monitor’s end
-                    result = worker_loop(last_time, handle, i, client_sockets, worker_sockets);    // Start worker loop
-                    if(result != 0)
-                    {
-                        perror("webserver (worker_loop) failed");
-                        exit(1);
-                    }
-                    exit(EXIT_SUCCESS);
-                }
-                else if(new_pid > 0)
-                {
-                    // Monitor process
-                    child_pids[i] = new_pid;
-                    close(worker_sockets[i][1]);    // Close worker’s end in monitor
-                }
-                else
+            orphaned = recover_clients(pool, i, server_socket);
+            if(worker->draining)
+            {
+                // Retired on purpose, remove it from the pool even if it did not go quietly
+                if(orphaned > 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
                 {
-                    perror("Failed to restart worker");
+                    report_exit(dead_worker, status, orphaned);
                 }
+                printf("Worker %d exited after draining\n", dead_worker);
+                requeue_clients(pool, i, server_socket);
+                // The last worker moves into the slot, it keeps its id
+                pool->workers[i] = pool->workers[pool->count - 1];
+                pool->count--;
                 break;
             }
+
+            report_exit(dead_worker, status, orphaned);
+            schedule_restart(pool, i);
+            if(worker->restart_at <= time(NULL))
+            {
+                restart_worker(pool, i, last_time, handle, clients);
+            }
+            requeue_clients(pool, i, server_socket);
+            break;
+        }
+    }
+
+    // Workers whose restart backoff ran out
+    for(int i = 0; i < pool->count; i++)
+    {
+        if(pool->workers[i].pid < 0 && pool->workers[i].restart_at <= time(NULL))
+        {
+            restart_worker(pool, i, last_time, handle, clients);
         }
     }
 }
@@ -821,49 +2867,81 @@ static void check_for_dead_children(time_t last_time, void *handle, int client_s
     @param
     last_time: Last known modification time of the shared library
     handle: Handle to the shared library
-    i: Index of the worker process
-    client_sockets: Array of client socket FDs
-    worker_sockets: 2D array of monitor-worker socket pairs
+    id: Id of the worker, see struct worker
+    clients: Connection registry of the listener, children only free it
+    worker_socket: The worker's end of its monitor-worker socket pair
+    pool: The monitor's pool, for the functions of http.so, the timeouts of each request, how files are served and where POST bodies are stored
 
     @return
-    0: Worker loop executed successfully
+    0: Worker loop executed successfully, or the monitor retired the worker
     1: An error occurred
  */
-static int worker_loop(time_t last_time, void *handle, int i, int client_sockets[], int **worker_sockets)
+static int worker_loop(time_t last_time, void *handle, int id, struct client_registry *clients, int worker_socket, const struct worker_pool *pool)
 {
-    time_t new_time;
-    char   last_time_str[TIME_SIZE];
-    char   new_time_str[TIME_SIZE];
+    const struct request_timeouts *timeouts = &pool->timeouts;
+    struct plugin                  plugin   = pool->plugin;
+    time_t                         new_time;
+    char                           last_time_str[TIME_SIZE];
+    char                           new_time_str[TIME_SIZE];
+    struct arena                   arena;    // Scratch memory for one request, reset after the fd goes back to the monitor
+    struct timer_wheel             wheel;    // Times the phases of the request being served
+    struct request_io              io;
+
+    timer_wheel_init(&wheel, timer_now_ms());
+    timer_init(&io.timer, TIMEOUT_NONE, NULL);
+    io.wheel    = &wheel;
+    io.timeouts = timeouts;
+    // The library was set up and the store opened before the fork, only the store's locks have to be this worker's own
+    if(plugin.adopt_storage() != 0)
+    {
+        perror("webserver: worker (adopt storage)");
+    }
+
+    if(arena_init(&arena, REQUEST_ARENA_SIZE) != 0)
+    {
+        dlclose(handle);
+        registry_destroy(clients);
+        return 1;
+    }
 
     // Check if http.so has been updated
     new_time = get_last_modified_time("./http.so");
     // Testing
     format_timestamp(last_time, last_time_str, sizeof(last_time_str));
     format_timestamp(new_time, new_time_str, sizeof(new_time_str));
-    printf("[Worker %d] Checking http.so timestamps\n", i);
+    printf("[Worker %d] Checking http.so timestamps\n", id);
     printf("Last: %s | New: %s\n\n", last_time_str, new_time_str);
 
     while(!exit_flag)
     {
-        int sockn;
-        int handle_result;
-        int fd;
+        int            sockn;
+        int            handle_result;
+        int            fd;
+        int            reloaded;
+        struct fd_note note;
         void (*my_func)(const char *);
         // Create client address
         struct sockaddr_in client_addr;
         unsigned int       client_addrlen = sizeof(client_addr);
         memset(&client_addr, 0, sizeof(client_addr));
 
-        fd = recv_fd(worker_sockets[i][1]);    // recv_fd from monitor
+        fd = recv_fd(worker_socket, &note);    // recv_fd from monitor
+        if(fd == -2)
+        {
+            // The monitor closed our socket: the pool is shrinking
+            printf("[Worker %d] Drained by the monitor, exiting\n", id);
+            break;
+        }
         if(fd == -1)
         {
             perror("webserver: worker (recv_fd)");
             dlclose(handle);
-            free(client_sockets);
+            registry_destroy(clients);
+            arena_destroy(&arena);
             return 1;
         }
 
-        // printf("Received client fd in child: %d\n", fd);
+        PROBE2(worker_recv, probe_conn_id(fd), fd);
 
         // Check if http.so has been updated
         new_time = get_last_modified_time("./http.so");
@@ -871,10 +2949,11 @@ static int worker_loop(time_t last_time, void *handle, int i, int client_sockets
         // Testing
         format_timestamp(last_time, last_time_str, sizeof(last_time_str));
         format_timestamp(new_time, new_time_str, sizeof(new_time_str));
-        printf("[Worker %d] Checking http.so timestamps\n", i);
+        printf("[Worker %d] Checking http.so timestamps\n", id);
         printf("Last: %s | New: %s\n\n", last_time_str, new_time_str);
 
-        if(new_time > last_time)
+        reloaded = new_time > last_time;
+        if(reloaded)
         {
             char reload_msg[RELOAD_MSG];
 
@@ -889,7 +2968,8 @@ static int worker_loop(time_t last_time, void *handle, int i, int client_sockets
             if(!handle)
             {
                 perror("Failed to load shared library");
-                free(client_sockets);
+                registry_destroy(clients);
+                arena_destroy(&arena);
                 return 1;
             }
 
@@ -898,7 +2978,16 @@ static int worker_loop(time_t last_time, void *handle, int i, int client_sockets
             {
                 perror("dlsym failed");
                 dlclose(handle);
-                free(client_sockets);
+                registry_destroy(clients);
+                arena_destroy(&arena);
+                return 1;
+            }
+
+            if(load_plugin(handle, &plugin) != 0)
+            {
+                dlclose(handle);
+                registry_destroy(clients);
+                arena_destroy(&arena);
                 return 1;
             }
 
@@ -906,14 +2995,30 @@ static int worker_loop(time_t last_time, void *handle, int i, int client_sockets
             strcpy(reload_msg, "Shared library updated! Reloading and matching case...");
             my_func(reload_msg);
             printf("\n\n");
+            call_set_io_options(&plugin, pool->use_uring, timeouts->write);
+            call_set_storage_backend(&plugin, pool->storage);
+            call_set_file_cache(&plugin, pool->file_cache);
 
             last_time = new_time;
         }
+        PROBE2(reload_check, probe_conn_id(fd), reloaded);
 
-        // **note** For Test 36 only
-        if(i == 0)
+        // A new TLS connection: from here on the request travels in plaintext on the descriptor the handshake gives back
+        if(note.tls && pool->tls != NULL)
         {
-            exit(TIME_SIZE);    // Non-zero to indicate failure
+            int plain = tls_accept(pool->tls, fd, timeouts->header);
+
+            if(plain < 0)
+            {
+                note.tag     = FD_TAG_CLOSE;
+                note.timeout = errno == EAGAIN ? TIMEOUT_HEADER : TIMEOUT_NONE;
+                note.bytes   = 0;
+                send_fd(worker_socket, fd, &note);
+                close(fd);
+                continue;
+            }
+            close(fd);
+            fd = plain;
         }
 
         // Get client address
@@ -923,46 +3028,178 @@ static int worker_loop(time_t last_time, void *handle, int i, int client_sockets
             perror("webserver (getsockname)");
             continue;
         }
-        // handle_request()
-        handle_result = handle_request(client_addr, fd, handle);
+        // handle_request(), or the next requests of an HTTP/2 connection the listener held
+        if(note.h2.active)
+        {
+            handle_result = serve_h2(fd, &plugin, &arena, &io, &note.h2, NULL, 0);
+        }
+        else
+        {
+            handle_result = handle_request(client_addr, fd, &plugin, &arena, &io, &note.h2);
+        }
         if(handle_result == 1)
         {
             // todo: kill this process ?
             printf("handle request failed in a child worker\n");
         }
+
+        // A response that outlived the write timeout, or a send that hit SO_SNDTIMEO, closes the connection
+        if(timer_pending(&io.timer))
+        {
+            if(timer_wheel_expire(&wheel, timer_now_ms()) != NULL)
+            {
+                io.expired = TIMEOUT_WRITE;
+            }
+            timer_cancel(&wheel, &io.timer);
+        }
+        if(handle_result == 1 && io.expired == TIMEOUT_NONE && timeouts->write > 0 && would_block(errno))
+        {
+            io.expired = TIMEOUT_WRITE;
+        }
+
         // printf("fd before sending back to monitor: %d\n", fd);
         //  sendmsg: send the fd back to the monitor
-        send_fd(worker_sockets[i][1], fd);
+        note.bytes   = io.bytes_read;
+        note.timeout = io.expired;
+        if(io.expired != TIMEOUT_NONE)
+        {
+            printf("[Worker %d] Closing connection after a timeout\n", id);
+            note.tag = FD_TAG_CLOSE;
+        }
+        else if(io.refused)
+        {
+            printf("[Worker %d] Closing connection after refusing the request\n", id);
+            note.tag = FD_TAG_CLOSE;
+        }
+        send_fd(worker_socket, fd, &note);
+        PROBE2(worker_return, probe_conn_id(fd), fd);
         printf("sent client fd back to monitor: %d\n", fd);
         close(fd);
+
+        // Everything the request allocated is released at once
+        arena_reset(&arena);
     }
+
+    // Connections whose TLS this worker carries die with it, give them time to finish
+    if(!exit_flag && pool->tls != NULL)
+    {
+        tls_wait(DRAIN_TIMEOUT);
+    }
+    arena_destroy(&arena);
     return 0;
 }
 
 /*
-    Closes and frees all worker socket pairs
+    Closes both ends of every worker socket pair and the held client fds, and frees the pool
+
+    @param
+    pool: The worker pool
+ */
+static void clean_up_worker_pool(struct worker_pool *pool)
+{
+    for(int i = 0; i < pool->count; i++)
+    {
+        for(int j = 0; j < 2; j++)
+        {
+            if(pool->workers[i].sockets[j] >= 0)
+            {
+                close(pool->workers[i].sockets[j]);
+            }
+        }
+        for(int k = 0; k < pool->workers[i].held_count; k++)
+        {
+            close(pool->workers[i].held[k].fd);
+        }
+        free(pool->workers[i].held);
+    }
+    free(pool->workers);
+    pool->workers  = NULL;
+    pool->count    = 0;
+    pool->capacity = 0;
+}
+
+/*
+    Looks up every function of the shared library the server calls
 
     @param
-    worker_sockets: 2D array of monitor-worker socket pairs
-    children: Number of worker processes
+    handle: Handle to the shared library
+    plugin: Output for the functions
+
+    @return
+    0: Every function was found
+    -1: The library lacks one of them
  */
-static void clean_up_worker_sockets(int **worker_sockets, int children)
+static int load_plugin(void *handle, struct plugin *plugin)
 {
-    for(int i = 0; i < children; i++)
+    if(resolve_symbol(handle, "handle_client", (void **)&plugin->handle_client) != 0 || resolve_symbol(handle, "open_resource", (void **)&plugin->open_resource) != 0 ||
+       resolve_symbol(handle, "set_request_path", (void **)&plugin->set_request_path) != 0 ||
+       resolve_symbol(handle, "is_http_request", (void **)&plugin->is_http_request) != 0 || resolve_symbol(handle, "handle_post_request", (void **)&plugin->handle_post_request) != 0 ||
+       resolve_symbol(handle, "handle_batch_request", (void **)&plugin->handle_batch_request) != 0 || resolve_symbol(handle, "set_io_options", (void **)&plugin->set_io_options) != 0 ||
+       resolve_symbol(handle, "set_storage_backend", (void **)&plugin->set_storage_backend) != 0 || resolve_symbol(handle, "set_file_cache", (void **)&plugin->set_file_cache) != 0 ||
+       resolve_symbol(handle, "prepare_storage", (void **)&plugin->prepare_storage) != 0 || resolve_symbol(handle, "adopt_storage", (void **)&plugin->adopt_storage) != 0)
     {
-        close(worker_sockets[i][0]);
-        close(worker_sockets[i][1]);
-        free(worker_sockets[i]);
+        return -1;
     }
-    free((void *)worker_sockets);
+    return 0;
 }
 
 /*
-    Loads and calls the handle_client function from the shared library
+    Looks up one function of the shared library
 
     @param
-    handle_c: Function pointer for handle_client
     handle: Handle to the shared library
+    name: Name of the function
+    symbol: Output for its address
+
+    @return
+    0: Found
+    -1: The library does not export it
+ */
+static int resolve_symbol(void *handle, const char *name, void **symbol)
+{
+    *symbol = dlsym(handle, name);
+    if(*symbol == NULL)
+    {
+        fprintf(stderr, "dlsym failed (%s): %s\n", name, dlerror());
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Gets the state every worker needs ready in the server, before anything is forked, so
+    the workers and any worker restarted later inherit it instead of each building it on
+    its first requests: the library's settings, the files under RESOURCE_DIR in the shared
+    cache and the open POST store
+
+    @param
+    plugin: Functions of the shared library
+    config: Settings from the command line
+    file_cache: The shared file cache, NULL when it is off
+ */
+static void warm_up(const struct plugin *plugin, const struct server_config *config, struct file_cache *file_cache)
+{
+    call_set_io_options(plugin, config->use_uring, config->write_timeout);
+    call_set_storage_backend(plugin, config->storage);
+    call_set_file_cache(plugin, file_cache);
+
+    if(file_cache != NULL)
+    {
+        printf("Preloaded %zu files from %s into the file cache\n", file_cache_preload(file_cache, RESOURCE_DIR), RESOURCE_DIR);
+    }
+    if(plugin->prepare_storage() != 0)
+    {
+        perror("webserver (prepare storage)");
+        fprintf(stderr, "The store is opened by the first POST instead\n");
+    }
+}
+
+/*
+    Calls the handle_client function of the shared library
+
+    @param
+    plugin: Functions of the shared library
+    arena: Per-request arena the response is built in
     client_fd: File descriptor for the client connection
     req_path: Requested file path
     is_head: 0 if HEAD request, -1 otherwise
@@ -972,24 +3209,14 @@ static void clean_up_worker_sockets(int **worker_sockets, int children)
     0: Success
     1: Error occurred
  */
-static int call_handle_client(int (*handle_c)(int, const char *, int, int), void *handle, int client_fd, char *req_path, int is_head, int is_img)
+static int call_handle_client(const struct plugin *plugin, struct arena *arena, int client_fd, char *req_path, int is_head, int is_img)
 {
     ssize_t valwrite;
-    // Retrieve function from shared library
-    // printf("retrieving func from shared library\n\n");
-    // retrieving symbol (the function name in the lib is my_function)
-    *(void **)(&handle_c) = dlsym(handle, "handle_client");
-    if(!handle_c)
-    {
-        fprintf(stderr, "dlsym failed: %s\n", dlerror());
-        dlclose(handle);
-        return 1;
-    }
 
     // Process and send HTTP response
     // printf("calling func %p\n", *(void **)(&handle_c));
     printf("\n");
-    valwrite = handle_c(client_fd, req_path, is_head, is_img);
+    valwrite = plugin->handle_client(arena, client_fd, req_path, is_head, is_img);
     if(valwrite < 0)
     {
         return 1;
@@ -998,65 +3225,80 @@ static int call_handle_client(int (*handle_c)(int, const char *, int, int), void
 }
 
 /*
-    Loads and calls the set_request_path function from the shared library
+    Calls the set_request_path function of the shared library
 
     @param
-    set_req_path: Function pointer for set_request_path
-    handle: Handle to the shared library
+    plugin: Functions of the shared library
     req_path: Output buffer to store the extracted request path
     buffer: HTTP request buffer
 
     @return
     0: Success
-    1: An Error occurred
  */
-static int call_set_request_path(void (*set_req_path)(const char *, const char *), void *handle, char *req_path, char *buffer)
+static int call_set_request_path(const struct plugin *plugin, char *req_path, char *buffer)
 {
-    // Retrieve function from shared library
-    //    printf("retrieving func from shared library\n\n");
-    // retrieving symbol (the function name in the lib is my_function)
-    *(void **)(&set_req_path) = dlsym(handle, "set_request_path");
-    if(!set_req_path)
-    {
-        fprintf(stderr, "dlsym failed: %s\n", dlerror());
-        dlclose(handle);
-        return 1;
-    }
-
-    printf("calling func set_request_path from shared lib %p\n", *(void **)(&set_req_path));
+    printf("calling func set_request_path from shared lib %p\n", *(void *const *)(&plugin->set_request_path));
     printf("\n");
-    set_req_path(req_path, buffer);
+    plugin->set_request_path(req_path, buffer);
     return 0;
 }
 
 /*
-    Loads and calls the is_http_request function from the shared library
+    Calls the is_http_request function of the shared library
 
     @param
-    is_http: Function pointer for is_http_request
-    handle: Handle to the shared library
+    plugin: Functions of the shared library
     buffer: HTTP request buffer
 
     @return
     0: Valid HTTP request
     1: Error occurred or invalid request
  */
-static int call_is_http(int (*is_http)(const char *), void *handle, char *buffer)
+static int call_is_http(const struct plugin *plugin, char *buffer)
+{
+    printf("calling func set_request_path from shared lib %p\n", *(void *const *)(&plugin->is_http_request));
+    printf("\n");
+    return plugin->is_http_request(buffer);
+}
+
+/*
+    Tells the shared library how to serve files, after every time it is loaded
+
+    @param
+    plugin: Functions of the shared library
+    use_uring: 1 to serve files through io_uring when the kernel supports it, 0 for read and write
+    write_timeout: Seconds a chunk of a file may take to send, 0 for no limit
+ */
+static void call_set_io_options(const struct plugin *plugin, int use_uring, int write_timeout)
+{
+    plugin->set_io_options(use_uring, write_timeout);
+}
+
+/*
+    Tells the shared library where POST bodies are stored, after every time it is loaded
+
+    @param
+    plugin: Functions of the shared library
+    spec: Storage backend spec, checked when the arguments were parsed
+ */
+static void call_set_storage_backend(const struct plugin *plugin, const char *spec)
 {
-    // Retrieve function from shared library
-    //    printf("retrieving func from shared library\n\n");
-    // retrieving symbol (the function name in the lib is my_function)
-    *(void **)(&is_http) = dlsym(handle, "is_http_request");
-    if(!is_http)
+    if(plugin->set_storage_backend(spec) != 0)
     {
-        fprintf(stderr, "dlsym failed: %s\n", dlerror());
-        dlclose(handle);
-        return 1;
+        fprintf(stderr, "The shared library rejected storage backend \"%s\"\n", spec);
     }
+}
 
-    printf("calling func set_request_path from shared lib %p\n", *(void **)(&is_http));
-    printf("\n");
-    return is_http(buffer);
+/*
+    Tells the shared library where the shared file cache is, after every time it is loaded
+
+    @param
+    plugin: Functions of the shared library
+    cache: The cache mapped before the fork, or NULL when it is off
+ */
+static void call_set_file_cache(const struct plugin *plugin, struct file_cache *cache)
+{
+    plugin->set_file_cache(cache);
 }
 
 /*
@@ -1065,22 +3307,102 @@ static int call_is_http(int (*is_http)(const char *), void *handle, char *buffer
     @param
     argc: Argument count
     argv: Argument vector
-    children: Output pointer to store the number of child processes (as a string)
+    args: Output struct storing the raw option values (as strings)
 
  */
-static void parse_arguments(int argc, char *argv[], char **children)
+static void parse_arguments(int argc, char *argv[], struct server_args *args)
 {
     int opt;
 
     opterr = 0;
 
-    while((opt = getopt(argc, argv, "hc:")) != -1)
+    while((opt = getopt(argc, argv, "hc:m:M:i:a:l:q:r:k:E:B:W:I:C:b:T:K:")) != -1)
     {
         switch(opt)
         {
             case 'c':
             {
-                *children = optarg;
+                args->children = optarg;
+                break;
+            }
+            case 'm':
+            {
+                args->min_workers = optarg;
+                break;
+            }
+            case 'M':
+            {
+                args->max_workers = optarg;
+                break;
+            }
+            case 'i':
+            {
+                args->idle_timeout = optarg;
+                break;
+            }
+            case 'a':
+            {
+                args->affinity = optarg;
+                break;
+            }
+            case 'l':
+            {
+                args->max_in_flight = optarg;
+                break;
+            }
+            case 'q':
+            {
+                args->worker_queue = optarg;
+                break;
+            }
+            case 'r':
+            {
+                args->retry_after = optarg;
+                break;
+            }
+            case 'k':
+            {
+                args->keepalive_timeout = optarg;
+                break;
+            }
+            case 'E':
+            {
+                args->header_timeout = optarg;
+                break;
+            }
+            case 'B':
+            {
+                args->body_timeout = optarg;
+                break;
+            }
+            case 'W':
+            {
+                args->write_timeout = optarg;
+                break;
+            }
+            case 'I':
+            {
+                args->io_backend = optarg;
+                break;
+            }
+            case 'C':
+            {
+                args->file_cache_mb = optarg;
+                break;
+            }
+            case 'b':
+            {
+                args->storage = optarg;
+                break;
+            }
+            case 'T':
+            {
+                args->tls_cert = optarg;
+                break;
+            }
+            case 'K':
+            {
+                args->tls_key = optarg;
                 break;
             }
             case 'h':
@@ -1095,7 +3417,7 @@ static void parse_arguments(int argc, char *argv[], char **children)
         }
     }
 
-    if(*children == NULL || *children[0] == '0')
+    if(args->children == NULL || args->children[0] == '0')
     {
         usage(argv[0], EXIT_FAILURE, "Error: please specify a nonzero number of children to fork");
     }
@@ -1122,24 +3444,140 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char
         fprintf(stderr, "%s\n", message);
     }
 
-    fprintf(stderr, "Usage: %s [-h] -c <children>\n", program_name);
+    fprintf(stderr, "Usage: %s [-h] -c <children> [-a <cpus>] [-m <min>] [-M <max>] [-i <seconds>] [-l <connections>] [-q <connections>] [-r <seconds>] [-k <seconds>] [-E <seconds>] [-B <seconds>] [-W <seconds>] [-I <io>] [-C <MiB>] [-b <backend>] [-T <cert> [-K <key>]]\n", program_name);
     fputs("Options:\n", stderr);
     fputs("  -h  Display this help message\n", stderr);
     fputs("  -c <children> the number of children to fork\n", stderr);
+    fputs("  -a <cpus> pin the listener, monitor and workers to CPUs (\"auto\" or a list such as 0-3,8)\n", stderr);
+    fputs("  -m <min> the fewest workers the pool shrinks to when idle (default: children)\n", stderr);
+    fputs("  -M <max> the most workers the pool grows to under load (default: children)\n", stderr);
+    fputs("  -i <seconds> how long a worker may stay idle before it is retired (default: 30)\n", stderr);
+    fputs("  -l <connections> the most connections in flight at once, more get a 503 (default: 0, no limit)\n", stderr);
+    fputs("  -q <connections> the most connections queued on one worker, more get a 503 (default: 32, 0 for no limit)\n", stderr);
+    fputs("  -r <seconds> the Retry-After sent with a 503 (default: 1)\n", stderr);
+    fputs("  -k <seconds> how long a connection is held for its next request (default: 5, 0 to hold it until the client closes)\n", stderr);
+    fputs("  -E <seconds> how long a client has to send the request headers (default: 10, 0 for no limit)\n", stderr);
+    fputs("  -B <seconds> how long a client has to send the request body (default: 30, 0 for no limit)\n", stderr);
+    fputs("  -W <seconds> how long a response may take to send (default: 30, 0 for no limit)\n", stderr);
+    fputs("  -I <io> how workers serve files: \"uring\" for io_uring, falling back when the kernel lacks it, or \"posix\" (default: uring)\n", stderr);
+    fputs("  -C <MiB> memory for static files cached once and shared by every worker (default: 64, 0 to read every file from disk)\n", stderr);
+    fputs("  -b <backend> where POST bodies are stored: \"ndbm\", or \"log\" with optional settings such as log,fsync=always,segment=<bytes>,compact=<segments> (default: ndbm)\n", stderr);
+    fputs("  -T <cert> also accept TLS connections on port 8443, with this PEM certificate chain\n", stderr);
+    fputs("  -K <key> the PEM private key of the certificate (default: the -T file)\n", stderr);
     exit(exit_code);
 }
 
 /*
-    Converts the children argument string to an integer
+    Converts the argument strings to integers and checks that they are consistent
 
     @param
     binary_name: Name of the executable (used for error reporting)
-    children_str: String representing number of child processes
-    children: Output pointer to store parsed integer value
+    args: Raw option values
+    config: Output struct to store the parsed values
  */
-static void handle_arguments(const char *binary_name, const char *children_str, int *children)
+static void handle_arguments(const char *binary_name, const struct server_args *args, struct server_config *config)
 {
-    *children = parse_positive_int(binary_name, children_str);
+    config->children          = parse_positive_int(binary_name, args->children);
+    config->min_workers       = config->children;
+    config->max_workers       = config->children;
+    config->idle_timeout      = DEFAULT_IDLE_TIMEOUT;
+    config->max_in_flight     = 0;
+    config->worker_queue      = DEFAULT_WORKER_QUEUE;
+    config->retry_after       = DEFAULT_RETRY_AFTER;
+    config->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+    config->header_timeout    = DEFAULT_HEADER_TIMEOUT;
+    config->body_timeout      = DEFAULT_BODY_TIMEOUT;
+    config->write_timeout     = DEFAULT_WRITE_TIMEOUT;
+    config->use_uring         = 1;
+    config->file_cache_mb     = DEFAULT_FILE_CACHE_MB;
+    config->storage           = STORAGE_DEFAULT_SPEC;
+    config->tls_cert          = args->tls_cert;
+    config->tls_key           = args->tls_key != NULL ? args->tls_key : args->tls_cert;
+
+    if(args->min_workers != NULL)
+    {
+        config->min_workers = parse_positive_int(binary_name, args->min_workers);
+    }
+
+    if(args->max_workers != NULL)
+    {
+        config->max_workers = parse_positive_int(binary_name, args->max_workers);
+    }
+
+    if(args->idle_timeout != NULL)
+    {
+        config->idle_timeout = parse_positive_int(binary_name, args->idle_timeout);
+    }
+
+    if(args->max_in_flight != NULL)
+    {
+        config->max_in_flight = parse_positive_int(binary_name, args->max_in_flight);
+    }
+
+    if(args->worker_queue != NULL)
+    {
+        config->worker_queue = parse_positive_int(binary_name, args->worker_queue);
+    }
+
+    if(args->retry_after != NULL)
+    {
+        config->retry_after = parse_positive_int(binary_name, args->retry_after);
+    }
+
+    if(args->keepalive_timeout != NULL)
+    {
+        config->keepalive_timeout = parse_positive_int(binary_name, args->keepalive_timeout);
+    }
+
+    if(args->header_timeout != NULL)
+    {
+        config->header_timeout = parse_positive_int(binary_name, args->header_timeout);
+    }
+
+    if(args->body_timeout != NULL)
+    {
+        config->body_timeout = parse_positive_int(binary_name, args->body_timeout);
+    }
+
+    if(args->write_timeout != NULL)
+    {
+        config->write_timeout = parse_positive_int(binary_name, args->write_timeout);
+    }
+
+    if(args->io_backend != NULL)
+    {
+        if(strcmp(args->io_backend, "uring") != 0 && strcmp(args->io_backend, "posix") != 0)
+        {
+            usage(binary_name, EXIT_FAILURE, "Error: -I takes \"uring\" or \"posix\".");
+        }
+        config->use_uring = strcmp(args->io_backend, "uring") == 0;
+    }
+
+    if(args->file_cache_mb != NULL)
+    {
+        config->file_cache_mb = parse_positive_int(binary_name, args->file_cache_mb);
+    }
+
+    if(args->storage != NULL)
+    {
+        struct storage_config storage;
+
+        if(storage_parse(args->storage, &storage) != 0)
+        {
+            usage(binary_name, EXIT_FAILURE, "Error: -b takes \"ndbm\" or \"log\" followed by fsync=none|always|<ms>, segment=<bytes> or compact=<segments>.");
+        }
+        config->storage = args->storage;
+    }
+
+    if(args->tls_key != NULL && args->tls_cert == NULL)
+    {
+        usage(binary_name, EXIT_FAILURE, "Error: -K needs a certificate given with -T.");
+    }
+
+    if(config->min_workers == 0 || config->min_workers > config->children || config->children > config->max_workers)
+    {
+        usage(binary_name, EXIT_FAILURE, "Error: the worker limits must satisfy 0 < min <= children <= max.");
+    }
 }
 
 /*
@@ -0,0 +1,843 @@
+/*
+    Microbenchmarks for the request parser and response formatter in http.c.
+    http.c is compiled into this file so its static helpers can be timed directly.
+ */
+#include "http.c"    // NOLINT(bugprone-suspicious-include)
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__linux__)
+    #include <linux/perf_event.h>
+    #include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+
+#define CORPUS_LEN (BUFFER_SIZE * 2)    // Zero padding past BUFFER_SIZE keeps the parser's bounded scans inside the buffer
+#define NAME_LEN 64
+#define BASE_TEN 10
+#define MAX_RESULTS 256
+#define LINE_LEN 256
+#define DEFAULT_REPEATS 5
+#define DEFAULT_TARGET_MS 20
+#define DEFAULT_THRESHOLD 10
+#define CALIBRATE_NS (2 * NS_PER_MS)
+#define NS_PER_MS ((uint64_t)1000000)
+#define NS_PER_SEC ((uint64_t)1000000000)
+#define PERCENT 100.0
+#define LONG_URI_LEN 900
+#define MANY_HEADERS 30
+#define HEADER_FILL "X-Padding: aaaaaaaaaaaaaaaaaaaa\r\n"
+
+/*
+    One input of a corpus
+ */
+struct corpus_entry
+{
+    const char *name;
+    char        buffer[CORPUS_LEN];
+    int         valid;    // is_http_request accepts it, so the server would go on to call set_request_path
+};
+
+/*
+    What a benchmark measured for one input
+ */
+struct result
+{
+    char     name[NAME_LEN];
+    double   ns_per_op;
+    double   cycles_per_op;    // Negative when no cycle counter is available
+    double   allocs_per_op;    // Negative when allocations cannot be counted
+    uint64_t iterations;
+};
+
+/*
+    Raw command-line option values before they are validated
+ */
+struct microbench_args
+{
+    const char *filter;
+    const char *save_path;
+    const char *baseline_path;
+    char       *repeats;
+    char       *target_ms;
+    char       *threshold;
+};
+
+/*
+    Settings taken from the command line
+ */
+struct microbench_config
+{
+    const char *filter;
+    const char *save_path;
+    const char *baseline_path;
+    int         repeats;
+    int         target_ms;
+    int         threshold;    // Percent slowdown against the baseline that counts as a regression
+};
+
+typedef void (*bench_fn)(const void *input);
+
+static void                build_corpus(struct corpus_entry *corpus, size_t *count);
+static void                add_entry(struct corpus_entry *corpus, size_t *count, const char *name, const char *request);
+static void                run_benchmarks(const struct microbench_config *config, const struct corpus_entry *corpus, size_t corpus_count, struct result *results, size_t *result_count);
+static void                measure(const struct microbench_config *config, const char *function, const char *input_name, bench_fn fn, const void *input, struct result *results, size_t *result_count);
+static uint64_t            run_batch(bench_fn fn, const void *input, uint64_t iterations, uint64_t *cycles, uint64_t *allocs);
+static void                bench_is_http_request(const void *input);
+static void                bench_has_valid_first_line(const void *input);
+static void                bench_has_valid_headers(const void *input);
+static void                bench_set_request_path(const void *input);
+static void                bench_is_img_request(const void *input);
+static void                bench_set_content_type(const void *input);
+static void                bench_int_to_string(const void *input);
+static void                bench_append_content_length(const void *input);
+static int                 open_cycle_counter(void);
+static uint64_t            read_cycles(void);
+static uint64_t            now_ns(void);
+static int                 compare_doubles(const void *a, const void *b);
+static void                print_results(FILE *out, const struct result *results, size_t count);
+static int                 save_results(const char *path, const struct result *results, size_t count);
+static int                 compare_with_baseline(FILE *out, const char *path, const struct result *results, size_t count, int threshold);
+_Noreturn static void      usage(const char *program_name, int exit_code, const char *message);
+static int                 parse_positive_int(const char *binary_name, const char *str);
+static void                handle_arguments(const char *binary_name, const struct microbench_args *args, struct microbench_config *config);
+static void                parse_arguments(int argc, char *argv[], struct microbench_args *args);
+
+// Counters shared with the allocator hooks and the cycle counter, set up once in main
+static uint64_t    allocation_count = 0;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int         cycle_fd         = -1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static const char *cycle_source     = "-";   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile int sink            = 0;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+#if defined(__GLIBC__)
+    #define COUNTS_ALLOCATIONS 1
+// Every heap allocation made by the code under test goes through these, so allocs/op can be reported
+void *__libc_malloc(size_t size);                 // NOLINT(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+void *__libc_calloc(size_t count, size_t size);   // NOLINT(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+void *__libc_realloc(void *ptr, size_t size);     // NOLINT(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+
+void *malloc(size_t size)
+{
+    allocation_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    allocation_count++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocation_count++;
+    return __libc_realloc(ptr, size);
+}
+#else
+    #define COUNTS_ALLOCATIONS 0
+#endif
+
+static const char *const content_type_paths[] = {"/index.html", "/kittens.png", "/A-Cat.jpg", "/styles.css", "/script.js", "/test.txt", "/no-extension", "/gallery/2024/cats/photo.jpeg"};
+static const unsigned long content_lengths[]  = {0, 7, 611, 65536, 4294967295UL};
+
+int main(int argc, char *argv[])
+{
+    struct microbench_args   args = {0};
+    struct microbench_config config;
+    struct corpus_entry     *corpus;
+    struct result           *results;
+    size_t                   corpus_count = 0;
+    size_t                   result_count = 0;
+    FILE                    *out;
+    int                      devnull;
+    int                      status = EXIT_SUCCESS;
+
+    parse_arguments(argc, argv, &args);
+    handle_arguments(argv[0], &args, &config);
+
+    corpus  = (struct corpus_entry *)calloc(MAX_RESULTS, sizeof(*corpus));
+    results = (struct result *)calloc(MAX_RESULTS, sizeof(*results));
+    if(corpus == NULL || results == NULL)
+    {
+        perror("calloc");
+        free(corpus);
+        free(results);
+        return EXIT_FAILURE;
+    }
+
+    // The functions under test print debugging output; keep it out of the report but still pay for it
+    out     = fdopen(dup(STDOUT_FILENO), "w");
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if(out == NULL || devnull < 0 || dup2(devnull, STDOUT_FILENO) < 0)
+    {
+        perror("redirecting stdout");
+        free(corpus);
+        free(results);
+        return EXIT_FAILURE;
+    }
+    close(devnull);
+
+    cycle_fd = open_cycle_counter();
+    build_corpus(corpus, &corpus_count);
+    run_benchmarks(&config, corpus, corpus_count, results, &result_count);
+    fflush(stdout);
+
+    print_results(out, results, result_count);
+
+    if(config.save_path != NULL && save_results(config.save_path, results, result_count) != 0)
+    {
+        status = EXIT_FAILURE;
+    }
+
+    if(config.baseline_path != NULL && compare_with_baseline(out, config.baseline_path, results, result_count, config.threshold) != 0)
+    {
+        status = EXIT_FAILURE;
+    }
+
+    if(cycle_fd >= 0)
+    {
+        close(cycle_fd);
+    }
+    fclose(out);
+    free(corpus);
+    free(results);
+    return status;
+}
+
+/*
+    Fills the corpus with requests the server sees every day and ones built to stress the parser's scans.
+    Inputs without a '\r' after the version are left out: has_valid_first_line scans for one without a bound.
+
+    @param
+    corpus: Output array with room for MAX_RESULTS entries
+    count: Number of entries written
+ */
+static void build_corpus(struct corpus_entry *corpus, size_t *count)
+{
+    char request[CORPUS_LEN];
+    int  len;
+
+    // Realistic
+    add_entry(corpus, count, "curl-get", "GET /index.html HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n");
+    add_entry(corpus,
+              count,
+              "browser-get",
+              "GET /styles.css HTTP/1.1\r\n"
+              "Host: localhost:8080\r\n"
+              "Connection: keep-alive\r\n"
+              "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+              "sec-ch-ua-mobile: ?0\r\n"
+              "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+              "sec-ch-ua-platform: \"Linux\"\r\n"
+              "Accept: text/css,*/*;q=0.1\r\n"
+              "Sec-Fetch-Site: same-origin\r\n"
+              "Sec-Fetch-Mode: no-cors\r\n"
+              "Sec-Fetch-Dest: style\r\n"
+              "Referer: http://localhost:8080/index.html\r\n"
+              "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+              "Accept-Language: en-US,en;q=0.9\r\n"
+              "\r\n");
+    add_entry(corpus, count, "image-get", "GET /kittens.png HTTP/1.1\r\nHost: localhost:8080\r\nAccept: image/avif,image/webp,image/png,*/*;q=0.8\r\n\r\n");
+    add_entry(corpus, count, "head", "HEAD /index.html HTTP/1.1\r\nHost: localhost:8080\r\n\r\n");
+    add_entry(corpus, count, "post", "POST /submit HTTP/1.1\r\nHost: localhost:8080\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: 26\r\n\r\nsource=bench&payload=hello");
+
+    // Adversarial
+    add_entry(corpus, count, "empty", "");
+    add_entry(corpus, count, "bad-method", "BREW /pot HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    add_entry(corpus, count, "no-version", "GET /index.html\r\nHost: localhost\r\n\r\n");
+    add_entry(corpus, count, "no-colon", "GET /index.html HTTP/1.1\r\nHost localhost\r\n\r\n");
+    add_entry(corpus, count, "truncated", "GET /index.html HTTP/1.1\r\nHost: loc");
+
+    len = snprintf(request, sizeof(request), "GET /");
+    memset(request + len, 'a', LONG_URI_LEN);
+    snprintf(request + len + LONG_URI_LEN, sizeof(request) - (size_t)len - LONG_URI_LEN, ".html HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    add_entry(corpus, count, "long-uri", request);
+
+    len = snprintf(request, sizeof(request), "GET /index.html HTTP/1.1\r\nHost: localhost\r\n");
+    for(int i = 0; i < MANY_HEADERS; i++)
+    {
+        len += snprintf(request + len, sizeof(request) - (size_t)len, HEADER_FILL);
+    }
+    snprintf(request + len, sizeof(request) - (size_t)len, "\r\n");
+    add_entry(corpus, count, "many-headers", request);
+
+    // A full read with no terminating CRLF and no NUL inside BUFFER_SIZE, as the worker's read can leave it
+    len = snprintf(request, sizeof(request), "GET /index.html HTTP/1.1\r\n");
+    while((size_t)len + strlen(HEADER_FILL) < BUFFER_SIZE)
+    {
+        len += snprintf(request + len, sizeof(request) - (size_t)len, HEADER_FILL);
+    }
+    memset(request + len, 'b', BUFFER_SIZE - (size_t)len);
+    request[BUFFER_SIZE] = '\0';
+    add_entry(corpus, count, "full-buffer", request);
+}
+
+/*
+    Copies a request into the corpus and records whether the parser accepts it
+
+    @param
+    corpus: The corpus
+    count: Number of entries, incremented
+    name: Name of the input in the report
+    request: The request bytes
+ */
+static void add_entry(struct corpus_entry *corpus, size_t *count, const char *name, const char *request)
+{
+    struct corpus_entry *entry = &corpus[*count];
+
+    memset(entry->buffer, 0, sizeof(entry->buffer));
+    strncpy(entry->buffer, request, BUFFER_SIZE);
+    entry->name  = name;
+    entry->valid = is_http_request(entry->buffer) == 0;
+    (*count)++;
+}
+
+/*
+    Runs every benchmark whose name matches the filter
+
+    @param
+    config: The run's settings
+    corpus: Request buffers
+    corpus_count: Number of request buffers
+    results: Output array
+    result_count: Number of results written
+ */
+static void run_benchmarks(const struct microbench_config *config, const struct corpus_entry *corpus, size_t corpus_count, struct result *results, size_t *result_count)
+{
+    for(size_t i = 0; i < corpus_count; i++)
+    {
+        const struct corpus_entry *entry = &corpus[i];
+
+        measure(config, "is_http_request", entry->name, bench_is_http_request, entry, results, result_count);
+        measure(config, "is_img_request", entry->name, bench_is_img_request, entry, results, result_count);
+
+        // The server only runs these once the method is known to be valid and the request well formed
+        if(entry->valid)
+        {
+            measure(config, "has_valid_first_line", entry->name, bench_has_valid_first_line, entry, results, result_count);
+            measure(config, "has_valid_headers", entry->name, bench_has_valid_headers, entry, results, result_count);
+            measure(config, "set_request_path", entry->name, bench_set_request_path, entry, results, result_count);
+        }
+    }
+
+    for(size_t i = 0; i < sizeof(content_type_paths) / sizeof(content_type_paths[0]); i++)
+    {
+        measure(config, "set_content_type", content_type_paths[i], bench_set_content_type, content_type_paths[i], results, result_count);
+    }
+
+    for(size_t i = 0; i < sizeof(content_lengths) / sizeof(content_lengths[0]); i++)
+    {
+        char name[NAME_LEN];
+
+        snprintf(name, sizeof(name), "%lu", content_lengths[i]);
+        measure(config, "int_to_string", name, bench_int_to_string, &content_lengths[i], results, result_count);
+        measure(config, "append_content_length", name, bench_append_content_length, &content_lengths[i], results, result_count);
+    }
+}
+
+/*
+    Times one function on one input.
+    The iteration count is calibrated first, then the batch is repeated and the median is kept.
+
+    @param
+    config: The run's settings
+    function: Name of the function under test
+    input_name: Name of the input
+    fn: Wrapper that calls the function once
+    input: Argument for the wrapper
+    results: Output array
+    result_count: Number of results, incremented
+ */
+static void measure(const struct microbench_config *config, const char *function, const char *input_name, bench_fn fn, const void *input, struct result *results, size_t *result_count)
+{
+    struct result *result = &results[*result_count];
+    double         ns[MAX_RESULTS];
+    double         cycles[MAX_RESULTS];
+    double         allocs[MAX_RESULTS];
+    uint64_t       iterations = 1;
+    uint64_t       elapsed;
+    uint64_t       cycle_count;
+    uint64_t       alloc_count;
+
+    snprintf(result->name, sizeof(result->name), "%s/%s", function, input_name);
+    if((config->filter != NULL && strstr(result->name, config->filter) == NULL) || *result_count >= MAX_RESULTS)
+    {
+        return;
+    }
+
+    // Grow the batch until it is long enough for the clock, then scale it to the target duration
+    while((elapsed = run_batch(fn, input, iterations, &cycle_count, &alloc_count)) < CALIBRATE_NS)
+    {
+        iterations *= 2;
+    }
+    iterations = iterations * ((uint64_t)config->target_ms * NS_PER_MS) / elapsed + 1;
+
+    for(int r = 0; r < config->repeats; r++)
+    {
+        elapsed   = run_batch(fn, input, iterations, &cycle_count, &alloc_count);
+        ns[r]     = (double)elapsed / (double)iterations;
+        cycles[r] = cycle_source[0] == '-' ? -1.0 : (double)cycle_count / (double)iterations;
+        allocs[r] = COUNTS_ALLOCATIONS ? (double)alloc_count / (double)iterations : -1.0;
+    }
+
+    qsort(ns, (size_t)config->repeats, sizeof(double), compare_doubles);
+    qsort(cycles, (size_t)config->repeats, sizeof(double), compare_doubles);
+    qsort(allocs, (size_t)config->repeats, sizeof(double), compare_doubles);
+    result->ns_per_op     = ns[config->repeats / 2];
+    result->cycles_per_op = cycles[config->repeats / 2];
+    result->allocs_per_op = allocs[config->repeats / 2];
+    result->iterations    = iterations;
+    (*result_count)++;
+}
+
+/*
+    Calls a benchmark wrapper in a loop
+
+    @param
+    fn: The wrapper
+    input: Argument for the wrapper
+    iterations: Number of calls
+    cycles: Output cycles spent in the loop
+    allocs: Output allocations made in the loop
+
+    @return
+    Nanoseconds spent in the loop
+ */
+static uint64_t run_batch(bench_fn fn, const void *input, uint64_t iterations, uint64_t *cycles, uint64_t *allocs)
+{
+    uint64_t start_allocs = allocation_count;
+    uint64_t start_cycles = read_cycles();
+    uint64_t start        = now_ns();
+    uint64_t end;
+
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        fn(input);
+    }
+
+    end     = now_ns();
+    *cycles = read_cycles() - start_cycles;
+    *allocs = allocation_count - start_allocs;
+    return end - start;
+}
+
+static void bench_is_http_request(const void *input)
+{
+    sink = is_http_request(((const struct corpus_entry *)input)->buffer);
+}
+
+static void bench_has_valid_first_line(const void *input)
+{
+    sink = has_valid_first_line(((const struct corpus_entry *)input)->buffer);
+}
+
+static void bench_has_valid_headers(const void *input)
+{
+    sink = has_valid_headers(((const struct corpus_entry *)input)->buffer);
+}
+
+static void bench_set_request_path(const void *input)
+{
+    char req_path[BUFFER_SIZE + 1];
+
+    set_request_path(req_path, ((const struct corpus_entry *)input)->buffer);
+    sink = req_path[0];
+}
+
+static void bench_is_img_request(const void *input)
+{
+    sink = is_img_request(((const struct corpus_entry *)input)->buffer);
+}
+
+static void bench_set_content_type(const void *input)
+{
+    char content_type[BUFFER_SIZE];
+
+    set_content_type_from_file_extension((const char *)input, content_type);
+    sink = content_type[0];
+}
+
+static void bench_int_to_string(const void *input)
+{
+    char string[TEN + 1];
+
+    int_to_string(string, *(const unsigned long *)input);
+    sink = string[0];
+}
+
+static void bench_append_content_length(const void *input)
+{
+    char response[BUFFER_SIZE] = HTTP_OK;
+
+    append_content_length_msg(response, *(const unsigned long *)input);
+    sink = response[0];
+}
+
+/*
+    Opens a hardware cycle counter for this process, falling back to the TSC on x86
+
+    @return
+    The perf event fd, or -1 if the TSC or nothing is used instead
+ */
+static int open_cycle_counter(void)
+{
+#if defined(__linux__)
+    struct perf_event_attr attr;
+    long                   fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if(fd >= 0)
+    {
+        cycle_source = "perf";
+        return (int)fd;
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    cycle_source = "tsc";
+#endif
+    return -1;
+}
+
+/*
+    Reads the cycle counter chosen by open_cycle_counter
+
+    @return
+    The counter value, or 0 if there is no counter
+ */
+static uint64_t read_cycles(void)
+{
+    if(cycle_fd >= 0)
+    {
+        uint64_t value = 0;
+
+        if(read(cycle_fd, &value, sizeof(value)) != (ssize_t)sizeof(value))
+        {
+            return 0;
+        }
+        return value;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+    Reads the monotonic clock
+
+    @return
+    Nanoseconds since an arbitrary point
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/*
+    qsort comparator for doubles
+ */
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+    Prints the results table
+
+    @param
+    out: Where to print
+    results: The results
+    count: Number of results
+ */
+static void print_results(FILE *out, const struct result *results, size_t count)
+{
+    fprintf(out, "%-48s %12s %12s %10s %12s\n", "benchmark", "ns/op", "cycles/op", "allocs/op", "iterations");
+    for(size_t i = 0; i < count; i++)
+    {
+        const struct result *result = &results[i];
+
+        fprintf(out, "%-48s %12.1f ", result->name, result->ns_per_op);
+        if(result->cycles_per_op < 0)
+        {
+            fprintf(out, "%12s ", "-");
+        }
+        else
+        {
+            fprintf(out, "%12.1f ", result->cycles_per_op);
+        }
+        if(result->allocs_per_op < 0)
+        {
+            fprintf(out, "%10s ", "-");
+        }
+        else
+        {
+            fprintf(out, "%10.2f ", result->allocs_per_op);
+        }
+        fprintf(out, "%12" PRIu64 "\n", result->iterations);
+    }
+    fprintf(out, "cycles from: %s\n", cycle_source);
+}
+
+/*
+    Writes the results in the format compare_with_baseline reads
+
+    @param
+    path: The baseline file
+    results: The results
+    count: Number of results
+
+    @return
+    0 on success, -1 on failure
+ */
+static int save_results(const char *path, const struct result *results, size_t count)
+{
+    FILE *file = fopen(path, "we");
+
+    if(file == NULL)
+    {
+        perror("microbench (save baseline)");
+        return -1;
+    }
+
+    for(size_t i = 0; i < count; i++)
+    {
+        fprintf(file, "%s %.3f %.3f %.3f\n", results[i].name, results[i].ns_per_op, results[i].cycles_per_op, results[i].allocs_per_op);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/*
+    Compares the results with a saved baseline and reports every benchmark that got slower
+    than the threshold or started allocating more
+
+    @param
+    out: Where to print
+    path: The baseline file
+    results: The results
+    count: Number of results
+    threshold: Percent slowdown that counts as a regression
+
+    @return
+    0 if nothing regressed, -1 if something did or the baseline cannot be read
+ */
+static int compare_with_baseline(FILE *out, const char *path, const struct result *results, size_t count, int threshold)
+{
+    FILE *file = fopen(path, "re");
+    char  line[LINE_LEN];
+    int   regressions = 0;
+
+    if(file == NULL)
+    {
+        perror("microbench (read baseline)");
+        return -1;
+    }
+
+    fprintf(out, "\n%-48s %12s %12s %9s\n", "compared with baseline", "before", "after", "change");
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        char   name[NAME_LEN];
+        double ns;
+        double cycles;
+        double allocs;
+
+        if(sscanf(line, "%63s %lf %lf %lf", name, &ns, &cycles, &allocs) != FOUR)
+        {
+            continue;
+        }
+
+        for(size_t i = 0; i < count; i++)
+        {
+            const struct result *result = &results[i];
+            double               change;
+            int                  regressed;
+
+            if(strcmp(result->name, name) != 0)
+            {
+                continue;
+            }
+
+            change    = ns > 0 ? (result->ns_per_op - ns) / ns * PERCENT : 0.0;
+            regressed = change > threshold || result->allocs_per_op > allocs;
+            regressions += regressed;
+            fprintf(out, "%-48s %12.1f %12.1f %+8.1f%%%s\n", name, ns, result->ns_per_op, change, regressed ? "  REGRESSION" : "");
+        }
+    }
+
+    fclose(file);
+    fprintf(out, "%d regression(s) over %d%%\n", regressions, threshold);
+    return regressions > 0 ? -1 : 0;
+}
+
+/*
+    Parses command-line arguments for program options
+
+    @param
+    argc: Argument count
+    argv: Argument vector
+    args: Output struct storing the raw option values (as strings)
+ */
+static void parse_arguments(int argc, char *argv[], struct microbench_args *args)
+{
+    int opt;
+
+    opterr = 0;
+
+    while((opt = getopt(argc, argv, "hf:o:b:r:d:t:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'f':
+            {
+                args->filter = optarg;
+                break;
+            }
+            case 'o':
+            {
+                args->save_path = optarg;
+                break;
+            }
+            case 'b':
+            {
+                args->baseline_path = optarg;
+                break;
+            }
+            case 'r':
+            {
+                args->repeats = optarg;
+                break;
+            }
+            case 'd':
+            {
+                args->target_ms = optarg;
+                break;
+            }
+            case 't':
+            {
+                args->threshold = optarg;
+                break;
+            }
+            case 'h':
+            {
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            }
+
+            default:
+            {
+                usage(argv[0], EXIT_FAILURE, NULL);
+            }
+        }
+    }
+
+    if(optind < argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "Error: Too many arguments.");
+    }
+}
+
+/*
+    Prints usage information and exits the program
+
+    @param
+    program_name: Name of the executable
+    exit_code: Exit status code
+    message: Optional error or help message to display
+ */
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-f <filter>] [-o <file>] [-b <file>] [-r <repeats>] [-d <ms>] [-t <percent>]\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h  Display this help message\n", stderr);
+    fputs("  -f <filter> only run benchmarks whose name contains this string\n", stderr);
+    fputs("  -o <file> save the results as a baseline\n", stderr);
+    fputs("  -b <file> compare the results with a saved baseline, exit with failure on a regression\n", stderr);
+    fputs("  -r <repeats> measurements per benchmark, the median is reported (default: 5)\n", stderr);
+    fputs("  -d <ms> length of one measurement (default: 20)\n", stderr);
+    fputs("  -t <percent> slowdown that counts as a regression (default: 10)\n", stderr);
+    exit(exit_code);
+}
+
+/*
+    Converts the argument strings to integers and checks that they are consistent
+
+    @param
+    binary_name: Name of the executable (used for error reporting)
+    args: Raw option values
+    config: Output struct to store the parsed values
+ */
+static void handle_arguments(const char *binary_name, const struct microbench_args *args, struct microbench_config *config)
+{
+    config->filter        = args->filter;
+    config->save_path     = args->save_path;
+    config->baseline_path = args->baseline_path;
+    config->repeats       = args->repeats != NULL ? parse_positive_int(binary_name, args->repeats) : DEFAULT_REPEATS;
+    config->target_ms     = args->target_ms != NULL ? parse_positive_int(binary_name, args->target_ms) : DEFAULT_TARGET_MS;
+    config->threshold     = args->threshold != NULL ? parse_positive_int(binary_name, args->threshold) : DEFAULT_THRESHOLD;
+
+    if(config->repeats == 0 || config->repeats > MAX_RESULTS || config->target_ms == 0)
+    {
+        usage(binary_name, EXIT_FAILURE, "Error: repeats and duration must be nonzero.");
+    }
+}
+
+/*
+    Parses a string as a positive integer with error handling
+
+    @param
+    binary_name: Name of the executable (used for error reporting)
+    str: String to parse
+
+    @return
+    Parsed positive integer value, exits on error
+ */
+static int parse_positive_int(const char *binary_name, const char *str)
+{
+    char    *endptr;
+    intmax_t parsed_value;
+
+    errno        = 0;
+    parsed_value = strtoimax(str, &endptr, BASE_TEN);
+
+    if(errno != 0)
+    {
+        usage(binary_name, EXIT_FAILURE, "Error parsing integer.");
+    }
+
+    // Check if there are any non-numeric characters in the input string
+    if(*endptr != '\0')
+    {
+        usage(binary_name, EXIT_FAILURE, "Invalid characters in input.");
+    }
+
+    // Check if the parsed value is non-negative
+    if(parsed_value < 0 || parsed_value > INT_MAX)
+    {
+        usage(binary_name, EXIT_FAILURE, "Integer out of range or negative.");
+    }
+
+    return (int)parsed_value;
+}
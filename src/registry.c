@@ -0,0 +1,297 @@
+#include "registry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HANDLE_SLOT_BITS 32
+#define HANDLE_SLOT_MASK 0xffffffffU
+
+static void                list_push(struct client_registry *registry, struct client_list *list, int index);
+static void                list_unlink(struct client_registry *registry, struct client_list *list, int index);
+static struct client_list *list_of(struct client_registry *registry, enum client_state state);
+
+/*
+    Allocates every slot up front and chains them onto the free list
+
+    @param
+    registry: The registry to set up
+    capacity: Most connections the registry can hold
+
+    @return
+    0: The registry is ready
+    -1: The slots could not be allocated
+ */
+int registry_init(struct client_registry *registry, int capacity)
+{
+    registry->slots = (struct client_slot *)calloc((size_t)capacity, sizeof(struct client_slot));
+    if(registry->slots == NULL)
+    {
+        perror("registry (calloc)");
+        return -1;
+    }
+
+    registry->capacity       = capacity;
+    registry->count          = 0;
+    registry->free_head      = 0;
+    registry->in_flight.head = -1;
+    registry->in_flight.tail = -1;
+    registry->idle.head      = -1;
+    registry->idle.tail      = -1;
+
+    for(int i = 0; i < capacity; i++)
+    {
+        registry->slots[i].fd    = -1;
+        registry->slots[i].state = CLIENT_FREE;
+        registry->slots[i].prev  = -1;
+        registry->slots[i].next  = i + 1 < capacity ? i + 1 : -1;
+    }
+    return 0;
+}
+
+/*
+    Frees the slots, the caller closes any descriptors still held
+
+    @param
+    registry: The registry
+ */
+void registry_destroy(struct client_registry *registry)
+{
+    free(registry->slots);
+    registry->slots     = NULL;
+    registry->capacity  = 0;
+    registry->count     = 0;
+    registry->free_head = -1;
+}
+
+/*
+    Takes a slot off the free list for a newly accepted connection, held until it sends its request
+
+    @param
+    registry: The registry
+    fd: The accepted connection
+    now: Current time
+
+    @return
+    The new slot, or NULL if every slot is in use
+ */
+struct client_slot *registry_add(struct client_registry *registry, int fd, time_t now)
+{
+    int                 index = registry->free_head;
+    struct client_slot *slot;
+
+    if(index < 0)
+    {
+        return NULL;
+    }
+
+    slot                = &registry->slots[index];
+    registry->free_head = slot->next;
+    registry->count++;
+
+    slot->fd       = fd;
+    slot->accepted = now;
+    slot->bytes    = 0;
+    slot->owner    = -1;
+    slot->tls      = 0;
+    memset(&slot->h2, 0, sizeof(slot->h2));
+    slot->state    = CLIENT_IDLE;
+    slot->since    = now;
+    timer_init(&slot->timer, 0, slot);
+    list_push(registry, &registry->idle, index);
+    return slot;
+}
+
+/*
+    Finds the slot a handle refers to
+
+    @param
+    registry: The registry
+    handle: Handle returned by registry_handle
+
+    @return
+    The slot, or NULL if the handle is out of range or the slot has been freed since
+ */
+struct client_slot *registry_lookup(struct client_registry *registry, uint64_t handle)
+{
+    uint64_t            index      = handle & HANDLE_SLOT_MASK;
+    uint32_t            generation = (uint32_t)(handle >> HANDLE_SLOT_BITS);
+    struct client_slot *slot;
+
+    if(index >= (uint64_t)registry->capacity)
+    {
+        return NULL;
+    }
+
+    slot = &registry->slots[index];
+    if(slot->state == CLIENT_FREE || slot->generation != generation)
+    {
+        return NULL;
+    }
+    return slot;
+}
+
+/*
+    Packs the slot index and generation of a slot into the handle sent along with its fd
+
+    @param
+    registry: The registry
+    slot: A slot in use
+
+    @return
+    The handle
+ */
+uint64_t registry_handle(const struct client_registry *registry, const struct client_slot *slot)
+{
+    return ((uint64_t)slot->generation << HANDLE_SLOT_BITS) | (uint64_t)(slot - registry->slots);
+}
+
+/*
+    Marks a connection as handed to the monitor, the listener no longer holds its fd
+
+    @param
+    registry: The registry
+    slot: The connection
+    now: Current time
+ */
+void registry_set_in_flight(struct client_registry *registry, struct client_slot *slot, time_t now)
+{
+    int index = (int)(slot - registry->slots);
+
+    list_unlink(registry, list_of(registry, slot->state), index);
+    slot->fd    = -1;
+    slot->state = CLIENT_IN_FLIGHT;
+    slot->since = now;
+    list_push(registry, &registry->in_flight, index);
+}
+
+/*
+    Marks a connection as back from its worker and held by the listener
+
+    @param
+    registry: The registry
+    slot: The connection
+    fd: The listener's descriptor for it
+    now: Current time
+ */
+void registry_set_idle(struct client_registry *registry, struct client_slot *slot, int fd, time_t now)
+{
+    int index = (int)(slot - registry->slots);
+
+    list_unlink(registry, list_of(registry, slot->state), index);
+    slot->fd    = fd;
+    slot->state = CLIENT_IDLE;
+    slot->since = now;
+    list_push(registry, &registry->idle, index);
+}
+
+/*
+    Returns a slot to the free list, the caller closes its descriptor and cancels its timer
+
+    @param
+    registry: The registry
+    slot: The connection
+ */
+void registry_remove(struct client_registry *registry, struct client_slot *slot)
+{
+    int index = (int)(slot - registry->slots);
+
+    if(slot->state == CLIENT_FREE)
+    {
+        return;
+    }
+
+    list_unlink(registry, list_of(registry, slot->state), index);
+    slot->fd    = -1;
+    slot->state = CLIENT_FREE;
+    slot->generation++;    // Handles still travelling with an old fd no longer match
+    slot->next          = registry->free_head;
+    registry->free_head = index;
+    registry->count--;
+}
+
+/*
+    Appends a slot to the tail of a list
+
+    @param
+    registry: The registry
+    list: The list
+    index: Index of the slot
+ */
+static void list_push(struct client_registry *registry, struct client_list *list, int index)
+{
+    struct client_slot *slot = &registry->slots[index];
+
+    slot->prev = list->tail;
+    slot->next = -1;
+    if(list->tail >= 0)
+    {
+        registry->slots[list->tail].next = index;
+    }
+    else
+    {
+        list->head = index;
+    }
+    list->tail = index;
+}
+
+/*
+    Takes a slot off a list
+
+    @param
+    registry: The registry
+    list: The list the slot is on
+    index: Index of the slot
+ */
+static void list_unlink(struct client_registry *registry, struct client_list *list, int index)
+{
+    struct client_slot *slot = &registry->slots[index];
+
+    if(list == NULL)
+    {
+        return;
+    }
+
+    if(slot->prev >= 0)
+    {
+        registry->slots[slot->prev].next = slot->next;
+    }
+    else
+    {
+        list->head = slot->next;
+    }
+
+    if(slot->next >= 0)
+    {
+        registry->slots[slot->next].prev = slot->prev;
+    }
+    else
+    {
+        list->tail = slot->prev;
+    }
+
+    slot->prev = -1;
+    slot->next = -1;
+}
+
+/*
+    Finds the list the slots of a state are kept on
+
+    @param
+    registry: The registry
+    state: The state
+
+    @return
+    The list, or NULL for free slots (the free list is singly linked through next)
+ */
+static struct client_list *list_of(struct client_registry *registry, enum client_state state)
+{
+    if(state == CLIENT_IN_FLIGHT)
+    {
+        return &registry->in_flight;
+    }
+    if(state == CLIENT_IDLE)
+    {
+        return &registry->idle;
+    }
+    return NULL;
+}
@@ -0,0 +1,2213 @@
+#include "storage.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+    #include <sys/syscall.h>
+#endif
+
+#define LOG_DIR_SUFFIX ".log"
+#define SEGMENT_SUFFIX ".seg"
+#define SEGMENT_DIGITS 8
+#define LOCK_NAME "LOCK"
+#define COMPACT_LOCK_NAME "COMPACT"
+#define COMPACT_TMP_NAME "compact.tmp"
+#define LOG_DIR_LEN 448
+#define LOG_PATH_LEN 512    // Room for the directory and any file name in it
+#define LOG_DIR_MODE (S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)
+#define LOG_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+#define RECORD_HEADER_SIZE 12                  // crc32, key length, value length
+#define RECORD_LENGTHS_OFFSET 4                // The checksum covers everything after itself
+#define MAX_RECORD_PART ((uint32_t)1 << 30)    // Lengths above this are treated as corruption
+#define SCAN_BUFFER_SIZE 65536
+#define LOAD_BUFFER_SIZE ((size_t)1 << 20)    // Records log_load gathers before a write
+#define INDEX_INITIAL_CAPACITY 1024
+#define INDEX_MAX_LOAD 70    // Percent of buckets used before the index doubles
+#define PERCENT 100
+#define SEGMENTS_INITIAL_CAPACITY 16
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define CRC32_POLYNOMIAL 0xEDB88320U
+#define CRC32_TABLE_SIZE 256
+#define BITS_PER_BYTE 8
+#define BYTE_MASK 0xFFU
+#define BASE_TEN 10
+#define MS_PER_SEC 1000
+#define NS_PER_MS 1000000
+#define FIRST_FD 3    // After stdin, stdout and stderr
+
+#if defined(__linux__)
+    #define sync_file fdatasync
+#else
+    #define sync_file fsync
+#endif
+
+/*
+    Where the newest record of a key is. key is NULL for an empty bucket.
+ */
+struct log_entry
+{
+    uint64_t hash;
+    char    *key;
+    uint32_t key_len;
+    uint32_t segment;
+    uint64_t offset;    // Of the record header
+    uint32_t size;      // Of the whole record
+};
+
+/*
+    A record as found by a scan, pointing into the scan buffer
+ */
+struct log_record
+{
+    const char *key;
+    uint32_t    key_len;
+    const char *value;
+    uint32_t    value_len;
+    uint64_t    offset;
+    uint32_t    size;
+};
+
+/*
+    Sequential reader over one segment
+ */
+struct log_scan
+{
+    int      fd;
+    char    *buffer;
+    size_t   capacity;
+    size_t   len;
+    size_t   pos;
+    uint64_t end;    // File offset of buffer[len]
+};
+
+/*
+    The caller of log_each or log_range and its argument. ranged limits the walk to counter keys first to last.
+ */
+struct log_walk
+{
+    storage_visit visit;
+    void         *arg;
+    int           ranged;
+    unsigned long first;
+    unsigned long last;
+};
+
+/*
+    Buffered output of a compaction
+ */
+struct log_output
+{
+    int      fd;
+    char    *buffer;
+    size_t   len;
+    uint64_t written;
+};
+
+/*
+    An open segment log.
+
+    The store is a directory of numbered segment files holding checksummed
+    [crc32][key length][value length][key][value] records, only ever appended to. Each
+    process keeps a hash index from key to the newest record of that key, built by
+    scanning the segments when the log is opened and brought up to date by scanning
+    whatever other processes appended since. Appends are serialised across processes
+    with flock on LOCK, which also makes the counter safe to share between workers.
+
+    Once the newest segment reaches segment_size it is sealed and a new one started.
+    When compact_segments segments are sealed a forked child copies the records that
+    are still the newest for their key into one segment and deletes the rest. Lengths
+    are stored in host byte order.
+ */
+struct seglog
+{
+    char              dir[LOG_DIR_LEN];
+    int               lock_fd;    // -1 when opened read-only
+    struct log_entry *entries;
+    size_t            capacity;
+    size_t            count;
+    uint32_t         *segments;    // Ids of the indexed segments, oldest first
+    size_t            segment_count;
+    size_t            segment_capacity;
+    uint64_t          indexed;    // Bytes of the newest segment indexed so far
+    int               active_fd;
+    uint32_t          active_segment;
+    int               read_fd;
+    uint32_t          read_segment;
+    char             *scratch;
+    size_t            scratch_size;
+    long long         synced_ms;
+    pid_t             compactor;
+};
+
+/*
+    Called for each intact record a scan finds, a nonzero return stops the scan
+ */
+typedef int (*record_visit)(struct seglog *log, uint32_t segment, const struct log_record *record, void *arg);
+
+static int               log_open(struct storage *store, const char *path, int writable);
+static void              log_close(struct storage *store);
+static int               log_after_fork(struct storage *store);
+static const void       *log_fetch(struct storage *store, const void *key, size_t key_len, size_t *value_len);
+static int               log_append(struct storage *store, const void *value, size_t value_len, char *key_out, size_t key_size);
+static int               append_locked(struct storage *store, const void *value, size_t value_len, char *key_out, size_t key_size);
+static int               begin_append(struct storage *store, long *counter);
+static int               log_append_batch(struct storage *store, storage_value_source next, void *arg, unsigned long *first, unsigned long *count);
+static int               batch_locked(struct storage *store, storage_value_source next, void *arg, unsigned long *first, unsigned long *count);
+static int               log_each(struct storage *store, storage_visit visit, void *arg);
+static int               log_range(struct storage *store, unsigned long first, unsigned long last, storage_visit visit, void *arg);
+static int               log_load(struct storage *store, storage_source next, void *arg);
+static int               load_locked(struct storage *store, storage_source next, void *arg);
+static int               load_record(struct seglog *log, struct log_output *output, const struct log_record *record, const void *value, size_t segment_size);
+static int               flush_load(struct seglog *log, struct log_output *output);
+static void              undo_batch(struct seglog *log, size_t segment_count, uint64_t offset);
+static int               log_destroy(const char *path);
+static int               log_move(const char *from, const char *to);
+static int               log_dir_name(char *dir, const char *path);
+static int               walk_segments(struct seglog *log, struct log_walk *walk, uint32_t segment, uint64_t offset);
+static int               parse_counter_key(const struct log_record *record, unsigned long *number);
+static uint32_t          crc32_update(uint32_t crc, const char *data, size_t len);
+static uint64_t          hash_key(const char *key, size_t key_len);
+static long long         now_ms(void);
+static void              segment_path(const struct seglog *log, uint32_t segment, char *path);
+static int               parse_segment_name(const char *name, uint32_t *segment);
+static int               compare_segments(const void *a, const void *b);
+static int               list_segments(struct seglog *log);
+static int               push_segment(struct seglog *log, uint32_t segment);
+static struct log_entry *index_slot(struct seglog *log, const char *key, size_t key_len, uint64_t hash);
+static int               index_grow(struct seglog *log);
+static int               index_put(struct seglog *log, const struct log_record *record, uint32_t segment);
+static void              index_clear(struct seglog *log);
+static int               index_record(struct seglog *log, uint32_t segment, const struct log_record *record, void *arg);
+static int               scan_fill(struct log_scan *scan, size_t need);
+static int               scan_next(struct log_scan *scan, struct log_record *record);
+static int               scan_segment(struct seglog *log, uint32_t segment, uint64_t from, record_visit visit, void *arg, uint64_t *end);
+static int               rebuild_index(struct seglog *log);
+static int               index_is_stale(const struct seglog *log);
+static int               catch_up(struct seglog *log);
+static int               open_active(struct seglog *log);
+static int               roll_segment(struct seglog *log);
+static size_t            encode_record(char *dest, const char *key, size_t key_len, const char *value, size_t value_len);
+static int               write_all(int fd, const char *data, size_t len);
+static int               reserve_scratch(struct seglog *log, size_t size);
+static int               read_record(struct seglog *log, const struct log_entry *entry, const char *key, size_t key_len);
+static void              sync_policy(struct seglog *log, enum storage_fsync fsync, int interval_ms);
+static void              reap_compactor(struct seglog *log);
+static void              start_compaction(struct seglog *log);
+static void              close_inherited_fds(void);
+static int               compact(struct seglog *log);
+static int               is_live(struct seglog *log, uint32_t segment, const struct log_record *record);
+static int               visit_live_record(struct seglog *log, uint32_t segment, const struct log_record *record, void *arg);
+static int               copy_live_record(struct seglog *log, uint32_t segment, const struct log_record *record, void *arg);
+static int               flush_output(struct log_output *output);
+
+const struct storage_ops log_storage_ops = {
+    "log", 1, log_open, log_close, log_fetch, log_append, log_append_batch, log_each, log_range, log_load, log_destroy, log_move, log_after_fork,
+};
+
+/*
+    Opens the segment directory and indexes every segment in it. A writer also creates
+    the directory and first segment if needed and cuts off a record torn by a crash.
+
+    @param
+    store: The store
+    path: Base name, the segments live in <path>.log/
+    writable: 1 to append
+
+    @return
+    0: Open
+    -1: The directory or a segment could not be opened, errno is set
+ */
+static int log_open(struct storage *store, const char *path, int writable)
+{
+    struct seglog *log;
+    char           lock_path[LOG_PATH_LEN];
+
+    log = (struct seglog *)calloc(1, sizeof(struct seglog));
+    if(log == NULL)
+    {
+        return -1;
+    }
+    log->lock_fd   = -1;
+    log->active_fd = -1;
+    log->read_fd   = -1;
+    store->state   = log;
+
+    if(log_dir_name(log->dir, path) != 0)
+    {
+        log_close(store);
+        return -1;
+    }
+
+    if(writable)
+    {
+        if(mkdir(log->dir, LOG_DIR_MODE) != 0 && errno != EEXIST)
+        {
+            log_close(store);
+            return -1;
+        }
+        snprintf(lock_path, sizeof(lock_path), "%s/" LOCK_NAME, log->dir);
+        log->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, LOG_FILE_MODE);
+        if(log->lock_fd < 0 || flock(log->lock_fd, LOCK_EX) != 0)
+        {
+            log_close(store);
+            return -1;
+        }
+    }
+
+    if(rebuild_index(log) != 0 || (writable && open_active(log) != 0))
+    {
+        log_close(store);
+        return -1;
+    }
+
+    if(writable)
+    {
+        flock(log->lock_fd, LOCK_UN);
+    }
+    log->synced_ms = now_ms();
+    return 0;
+}
+
+/*
+    Flushes and closes the log. A compaction still running is left to finish on its own.
+
+    @param
+    store: The store
+ */
+static void log_close(struct storage *store)
+{
+    struct seglog *log = (struct seglog *)store->state;
+
+    if(log->active_fd >= 0)
+    {
+        if(store->config.fsync != STORAGE_FSYNC_NONE)
+        {
+            sync_file(log->active_fd);
+        }
+        close(log->active_fd);
+    }
+    if(log->read_fd >= 0)
+    {
+        close(log->read_fd);
+    }
+    if(log->lock_fd >= 0)
+    {
+        close(log->lock_fd);
+    }
+    reap_compactor(log);
+    index_clear(log);
+    free(log->entries);
+    free(log->segments);
+    free(log->scratch);
+    free(log);
+    store->state = NULL;
+}
+
+/*
+    Opens the lock file again in a process forked with the log open. The lock belongs to
+    the open file, so while parent and child shared one neither would keep the other out.
+
+    @param
+    store: The store
+
+    @return
+    0: The lock is this process's own
+    -1: The lock file could not be opened
+ */
+static int log_after_fork(struct storage *store)
+{
+    struct seglog *log = (struct seglog *)store->state;
+    char           lock_path[LOG_PATH_LEN];
+    int            lock_fd;
+
+    log->compactor = 0;    // A child of the parent, only it can reap it
+    if(log->lock_fd < 0)
+    {
+        return 0;
+    }
+    snprintf(lock_path, sizeof(lock_path), "%s/" LOCK_NAME, log->dir);
+    lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, LOG_FILE_MODE);
+    if(lock_fd < 0)
+    {
+        return -1;
+    }
+    close(log->lock_fd);
+    log->lock_fd = lock_fd;
+    return 0;
+}
+
+/*
+    Looks a key up in the index and reads its newest record. A key this process has not
+    seen may have been appended by another one, so a miss first catches up with the log.
+
+    @param
+    store: The store
+    key: The key
+    key_len: Length of the key
+    value_len: Set to the length of the value
+
+    @return
+    The value in the log's scratch buffer, or NULL if the key is not stored
+ */
+static const void *log_fetch(struct storage *store, const void *key, size_t key_len, size_t *value_len)
+{
+    struct seglog    *log  = (struct seglog *)store->state;
+    uint64_t          hash = hash_key((const char *)key, key_len);
+    struct log_entry *entry;
+
+    entry = index_slot(log, (const char *)key, key_len, hash);
+    if(entry->key == NULL)
+    {
+        catch_up(log);
+        entry = index_slot(log, (const char *)key, key_len, hash);
+    }
+    if(entry->key == NULL)
+    {
+        return NULL;
+    }
+
+    if(read_record(log, entry, (const char *)key, key_len) != 0)
+    {
+        // The record moved under a compaction, or the segment was damaged
+        if(rebuild_index(log) != 0)
+        {
+            return NULL;
+        }
+        entry = index_slot(log, (const char *)key, key_len, hash);
+        if(entry->key == NULL || read_record(log, entry, (const char *)key, key_len) != 0)
+        {
+            return NULL;
+        }
+    }
+
+    *value_len = entry->size - RECORD_HEADER_SIZE - key_len;
+    return log->scratch + RECORD_HEADER_SIZE + key_len;
+}
+
+/*
+    Appends a value under the next counter key, and the advanced counter, as one write
+    while holding the log lock
+
+    @param
+    store: The store
+    value: The value
+    value_len: Length of the value
+    key_out: Set to the key the value was stored under
+    key_size: Size of key_out
+
+    @return
+    0: Both records are in the log
+    -1: The log could not be locked, read or written
+ */
+static int log_append(struct storage *store, const void *value, size_t value_len, char *key_out, size_t key_size)
+{
+    struct seglog *log = (struct seglog *)store->state;
+    int            result;
+
+    if(log->lock_fd < 0 || value_len > MAX_RECORD_PART)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    reap_compactor(log);
+    if(flock(log->lock_fd, LOCK_EX) != 0)
+    {
+        return -1;
+    }
+    result = append_locked(store, value, value_len, key_out, key_size);
+    flock(log->lock_fd, LOCK_UN);
+
+    if(result == 0 && store->config.compact_segments > 0 && log->segment_count > (size_t)store->config.compact_segments)
+    {
+        start_compaction(log);
+    }
+    return result;
+}
+
+/*
+    The body of log_append, run with the log lock held: catches up with the other
+    writers, reads the counter and writes both records
+
+    @param
+    store: The store
+    value: The value
+    value_len: Length of the value
+    key_out: Set to the key the value was stored under
+    key_size: Size of key_out
+
+    @return
+    0: Both records are in the log
+    -1: The log could not be read or written
+ */
+static int append_locked(struct storage *store, const void *value, size_t value_len, char *key_out, size_t key_size)
+{
+    struct seglog    *log           = (struct seglog *)store->state;
+    const char        counter_key[] = STORAGE_COUNTER_KEY;
+    char              counter_buf[STORAGE_KEY_LEN];
+    size_t            key_len;
+    size_t            total;
+    struct log_record record;
+    long              counter;
+
+    if(begin_append(store, &counter) != 0)
+    {
+        return -1;
+    }
+    snprintf(key_out, key_size, "%ld", counter);
+    snprintf(counter_buf, sizeof(counter_buf), "%ld", counter + 1);
+    key_len = strlen(key_out) + 1;
+
+    total = RECORD_HEADER_SIZE + key_len + value_len + RECORD_HEADER_SIZE + sizeof(counter_key) + strlen(counter_buf) + 1;
+    if(log->indexed > 0 && log->indexed + total > store->config.segment_size && roll_segment(log) != 0)
+    {
+        return -1;
+    }
+    if(reserve_scratch(log, total) != 0)
+    {
+        return -1;
+    }
+
+    record.offset  = log->indexed;
+    record.size    = (uint32_t)encode_record(log->scratch, key_out, key_len, (const char *)value, value_len);
+    record.key     = key_out;
+    record.key_len = (uint32_t)key_len;
+    encode_record(log->scratch + record.size, counter_key, sizeof(counter_key), counter_buf, strlen(counter_buf) + 1);
+
+    if(write_all(log->active_fd, log->scratch, total) != 0)
+    {
+        ftruncate(log->active_fd, (off_t)log->indexed);    // Leave no partial record behind
+        return -1;
+    }
+
+    index_put(log, &record, log->active_segment);
+    record.offset += record.size;
+    record.size    = (uint32_t)(total - record.size);
+    record.key     = counter_key;
+    record.key_len = sizeof(counter_key);
+    index_put(log, &record, log->active_segment);
+    log->indexed += total;
+
+    sync_policy(log, store->config.fsync, store->config.fsync_interval_ms);
+    return 0;
+}
+
+/*
+    Gets a locked log ready for appending: catches up with the other writers, cuts off a
+    torn tail and reads the counter
+
+    @param
+    store: The store
+    counter: Set to the key the next value gets
+
+    @return
+    0: Ready
+    -1: The log could not be read or truncated
+ */
+static int begin_append(struct storage *store, long *counter)
+{
+    struct seglog *log = (struct seglog *)store->state;
+    const char    *counter_val;
+    size_t         counter_len;
+    struct stat    st;
+
+    if(catch_up(log) != 0 || open_active(log) != 0)
+    {
+        return -1;
+    }
+
+    // A writer that died mid-record left a tail no scan can get past
+    if(fstat(log->active_fd, &st) == 0 && (uint64_t)st.st_size > log->indexed)
+    {
+        fprintf(stderr, "Discarding %llu torn bytes at the end of %s segment %u\n", (unsigned long long)((uint64_t)st.st_size - log->indexed), log->dir, log->active_segment);
+        if(ftruncate(log->active_fd, (off_t)log->indexed) != 0)
+        {
+            return -1;
+        }
+    }
+
+    *counter    = 0;
+    counter_val = (const char *)log_fetch(store, STORAGE_COUNTER_KEY, sizeof(STORAGE_COUNTER_KEY), &counter_len);
+    if(counter_val != NULL)
+    {
+        char *endptr = NULL;
+        *counter     = strtol(counter_val, &endptr, BASE_TEN);
+        if(endptr == counter_val || *endptr != '\0' || *counter < 0)
+        {
+            fprintf(stderr, "Invalid counter value in DB: %s\n", counter_val);
+            *counter = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+    Appends values under consecutive keys with one hold of the log lock, gathering the
+    records into large writes the way log_load does
+
+    @param
+    store: The store
+    next: Hands out the values
+    arg: Passed to next
+    first: Set to the key of the first value
+    count: Set to the number of values stored
+
+    @return
+    0: Every value and the counter are in the log
+    -1: next failed or the log could not be locked, read or written
+ */
+static int log_append_batch(struct storage *store, storage_value_source next, void *arg, unsigned long *first, unsigned long *count)
+{
+    struct seglog *log = (struct seglog *)store->state;
+    int            result;
+
+    if(log->lock_fd < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    reap_compactor(log);
+    if(flock(log->lock_fd, LOCK_EX) != 0)
+    {
+        return -1;
+    }
+    result = batch_locked(store, next, arg, first, count);
+    flock(log->lock_fd, LOCK_UN);
+
+    if(result == 0 && store->config.compact_segments > 0 && log->segment_count > (size_t)store->config.compact_segments)
+    {
+        start_compaction(log);
+    }
+    return result;
+}
+
+/*
+    The body of log_append_batch, run with the log lock held. The counter record goes
+    last. A batch that fails partway, because next failed or a write did, is cut back
+    out of the log, so none of it is kept.
+
+    @param
+    store: The store
+    next: Hands out the values
+    arg: Passed to next
+    first: Set to the key of the first value
+    count: Set to the number of values stored
+
+    @return
+    0: Every value and the counter are in the log
+    -1: next failed or the log could not be read or written, nothing was added
+ */
+static int batch_locked(struct storage *store, storage_value_source next, void *arg, unsigned long *first, unsigned long *count)
+{
+    struct seglog    *log = (struct seglog *)store->state;
+    struct log_output output;
+    struct log_record record;
+    char              key[STORAGE_KEY_LEN];
+    const void       *value;
+    size_t            value_len;
+    long              counter;
+    size_t            segment_count;
+    uint64_t          offset;
+    unsigned long     stored = 0;
+    int               more   = 0;
+    int               result = 0;
+
+    if(begin_append(store, &counter) != 0)
+    {
+        return -1;
+    }
+    segment_count = log->segment_count;
+    offset        = log->indexed;
+
+    output.fd      = log->active_fd;
+    output.buffer  = (char *)malloc(LOAD_BUFFER_SIZE);
+    output.len     = 0;
+    output.written = 0;
+    if(output.buffer == NULL)
+    {
+        return -1;
+    }
+
+    while(result == 0 && (more = next(&value, &value_len, arg)) > 0)
+    {
+        if(value_len > MAX_RECORD_PART)
+        {
+            errno  = EINVAL;
+            result = -1;
+            break;
+        }
+        record.key       = key;
+        record.key_len   = (uint32_t)snprintf(key, sizeof(key), "%lu", (unsigned long)counter + stored) + 1;
+        record.value_len = (uint32_t)value_len;
+        record.size      = (uint32_t)(RECORD_HEADER_SIZE + record.key_len + value_len);
+        result           = load_record(log, &output, &record, value, store->config.segment_size);
+        stored++;
+    }
+    if(result == 0 && more < 0)
+    {
+        result = -1;
+    }
+    if(result == 0 && stored > 0)
+    {
+        char counter_buf[STORAGE_KEY_LEN];
+
+        record.key       = STORAGE_COUNTER_KEY;
+        record.key_len   = sizeof(STORAGE_COUNTER_KEY);
+        record.value_len = (uint32_t)snprintf(counter_buf, sizeof(counter_buf), "%lu", (unsigned long)counter + stored) + 1;
+        record.size      = (uint32_t)(RECORD_HEADER_SIZE + record.key_len + record.value_len);
+        result           = load_record(log, &output, &record, counter_buf, store->config.segment_size);
+    }
+    if(result == 0 && flush_load(log, &output) != 0)
+    {
+        result = -1;
+    }
+    free(output.buffer);
+
+    if(result != 0)
+    {
+        undo_batch(log, segment_count, offset);
+        return -1;
+    }
+    *first = (unsigned long)counter;
+    *count = stored;
+    sync_policy(log, store->config.fsync, store->config.fsync_interval_ms);
+    return 0;
+}
+
+/*
+    Visits the newest record of every key, in the order they were appended
+
+    @param
+    store: The store
+    visit: Called with each key and value
+    arg: Passed to visit
+
+    @return
+    0: The walk finished or was stopped by visit
+    -1: The log could not be read
+ */
+static int log_each(struct storage *store, storage_visit visit, void *arg)
+{
+    struct seglog  *log = (struct seglog *)store->state;
+    struct log_walk walk;
+
+    walk.visit  = visit;
+    walk.arg    = arg;
+    walk.ranged = 0;
+
+    if(catch_up(log) != 0 || log->segment_count == 0)
+    {
+        return log->segment_count == 0 ? 0 : -1;
+    }
+    return walk_segments(log, &walk, log->segments[0], 0);
+}
+
+/*
+    Visits counter keys first to last. Keys are appended in counter order, so the walk
+    starts at the record of first when the index has it and stops at the first key past last.
+
+    @param
+    store: The store
+    first: First key
+    last: Last key
+    visit: Called with each key and value
+    arg: Passed to visit
+
+    @return
+    0: The walk finished or was stopped by visit
+    -1: The log could not be read
+ */
+static int log_range(struct storage *store, unsigned long first, unsigned long last, storage_visit visit, void *arg)
+{
+    struct seglog          *log = (struct seglog *)store->state;
+    struct log_walk         walk;
+    char                    key[STORAGE_KEY_LEN];
+    size_t                  key_len;
+    const struct log_entry *entry;
+
+    walk.visit  = visit;
+    walk.arg    = arg;
+    walk.ranged = 1;
+    walk.first  = first;
+    walk.last   = last;
+
+    if(catch_up(log) != 0 || log->segment_count == 0)
+    {
+        return log->segment_count == 0 ? 0 : -1;
+    }
+
+    key_len = (size_t)snprintf(key, sizeof(key), "%lu", first) + 1;
+    entry   = index_slot(log, key, key_len, hash_key(key, key_len));
+    if(entry->key != NULL)
+    {
+        return walk_segments(log, &walk, entry->segment, entry->offset);
+    }
+    return walk_segments(log, &walk, log->segments[0], 0);
+}
+
+/*
+    Appends many pairs under one hold of the log lock, gathering records into large
+    writes instead of one write per append
+
+    @param
+    store: The store
+    next: Hands out the pairs
+    arg: Passed to next
+
+    @return
+    0: Every pair is in the log
+    -1: next failed or the log could not be written
+ */
+static int log_load(struct storage *store, storage_source next, void *arg)
+{
+    struct seglog *log = (struct seglog *)store->state;
+    int            result;
+
+    if(log->lock_fd < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    reap_compactor(log);
+    if(flock(log->lock_fd, LOCK_EX) != 0)
+    {
+        return -1;
+    }
+    result = load_locked(store, next, arg);
+    flock(log->lock_fd, LOCK_UN);
+
+    if(result == 0 && store->config.compact_segments > 0 && log->segment_count > (size_t)store->config.compact_segments)
+    {
+        start_compaction(log);
+    }
+    return result;
+}
+
+/*
+    The body of log_load, run with the log lock held. Records are indexed as they are
+    gathered, at the offsets they will have once written.
+
+    @param
+    store: The store
+    next: Hands out the pairs
+    arg: Passed to next
+
+    @return
+    0: Every pair is in the log
+    -1: next failed or the log could not be written
+ */
+static int load_locked(struct storage *store, storage_source next, void *arg)
+{
+    struct seglog    *log = (struct seglog *)store->state;
+    struct log_output output;
+    struct log_record record;
+    const void       *key;
+    const void       *value;
+    size_t            key_len;
+    size_t            value_len;
+    int               more   = 0;
+    int               result = 0;
+
+    if(catch_up(log) != 0 || open_active(log) != 0)
+    {
+        return -1;
+    }
+
+    output.fd      = log->active_fd;
+    output.buffer  = (char *)malloc(LOAD_BUFFER_SIZE);
+    output.len     = 0;
+    output.written = 0;
+    if(output.buffer == NULL)
+    {
+        return -1;
+    }
+
+    while(result == 0 && (more = next(&key, &key_len, &value, &value_len, arg)) > 0)
+    {
+        if(key_len == 0 || key_len > MAX_RECORD_PART || value_len > MAX_RECORD_PART)
+        {
+            errno  = EINVAL;
+            result = -1;
+            break;
+        }
+        record.key       = (const char *)key;
+        record.key_len   = (uint32_t)key_len;
+        record.value_len = (uint32_t)value_len;
+        record.size      = (uint32_t)(RECORD_HEADER_SIZE + key_len + value_len);
+        result           = load_record(log, &output, &record, value, store->config.segment_size);
+    }
+    if(result == 0 && more < 0)
+    {
+        result = -1;
+    }
+    if(flush_load(log, &output) != 0)
+    {
+        result = -1;
+    }
+    free(output.buffer);
+
+    if(result != 0)
+    {
+        ftruncate(log->active_fd, (off_t)log->indexed);    // Leave no partial record behind
+        return -1;
+    }
+    sync_policy(log, store->config.fsync, store->config.fsync_interval_ms);
+    return 0;
+}
+
+/*
+    Adds one record to a load, rolling the segment when it would grow past segment_size
+
+    @param
+    log: The log
+    output: Records gathered so far for the active segment
+    record: Key and sizes of the record, its offset is filled in
+    value: The value
+    segment_size: Size at which segments are sealed
+
+    @return
+    0: Gathered and indexed
+    -1: The log could not be written or the index grown
+ */
+static int load_record(struct seglog *log, struct log_output *output, const struct log_record *record, const void *value, size_t segment_size)
+{
+    struct log_record placed = *record;
+
+    if(log->indexed + output->len > 0 && log->indexed + output->len + record->size > segment_size && (flush_load(log, output) != 0 || roll_segment(log) != 0))
+    {
+        return -1;
+    }
+    output->fd = log->active_fd;
+
+    if(output->len + record->size > LOAD_BUFFER_SIZE && flush_load(log, output) != 0)
+    {
+        return -1;
+    }
+
+    placed.offset = log->indexed + output->len;
+    if(record->size > LOAD_BUFFER_SIZE)
+    {
+        if(reserve_scratch(log, record->size) != 0)
+        {
+            return -1;
+        }
+        encode_record(log->scratch, record->key, record->key_len, (const char *)value, record->value_len);
+        if(write_all(log->active_fd, log->scratch, record->size) != 0)
+        {
+            return -1;
+        }
+        log->indexed += record->size;
+    }
+    else
+    {
+        output->len += encode_record(output->buffer + output->len, record->key, record->key_len, (const char *)value, record->value_len);
+    }
+    return index_put(log, &placed, log->active_segment);
+}
+
+/*
+    Writes out what a load has gathered and counts it as indexed
+
+    @param
+    log: The log
+    output: The gathered records
+
+    @return
+    0: Written
+    -1: write failed
+ */
+static int flush_load(struct seglog *log, struct log_output *output)
+{
+    if(flush_output(output) != 0)
+    {
+        return -1;
+    }
+    log->indexed += output->written;
+    output->written = 0;
+    return 0;
+}
+
+/*
+    Cuts a failed batch back out of the log: deletes the segments it rolled into and
+    truncates the segment it started in, then indexes what is left
+
+    @param
+    log: The log, with the lock held
+    segment_count: Segments there were when the batch started
+    offset: Bytes of the newest of them then
+ */
+static void undo_batch(struct seglog *log, size_t segment_count, uint64_t offset)
+{
+    char path[LOG_PATH_LEN];
+
+    // Segments the batch rolled into hold nothing but its records
+    for(size_t i = segment_count; i < log->segment_count; i++)
+    {
+        segment_path(log, log->segments[i], path);
+        unlink(path);
+    }
+    log->segment_count = segment_count;
+    if(open_active(log) == 0 && ftruncate(log->active_fd, (off_t)offset) != 0)
+    {
+        perror("Failed to cut a batch out of the log");
+    }
+
+    // The index already points at the batch's records
+    rebuild_index(log);
+}
+
+/*
+    Deletes the segment directory and everything in it
+
+    @param
+    path: Base name, the segments live in <path>.log/
+
+    @return
+    0: The directory is gone or never existed
+    -1: Something in it could not be deleted
+ */
+static int log_destroy(const char *path)
+{
+    char                 dir_name[LOG_DIR_LEN];
+    DIR                 *dir;
+    const struct dirent *entry;
+    int                  result = 0;
+
+    if(log_dir_name(dir_name, path) != 0)
+    {
+        return -1;
+    }
+    dir = opendir(dir_name);
+    if(dir == NULL)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        // Relative to the open directory, so no path is built that could be cut short
+        if(unlinkat(dirfd(dir), entry->d_name, 0) != 0)
+        {
+            result = -1;
+        }
+    }
+    closedir(dir);
+    return result == 0 && rmdir(dir_name) == 0 ? 0 : -1;
+}
+
+/*
+    Moves the segment directory to another base name, deleting any log already there
+
+    @param
+    from: Base name the log has now
+    to: Base name it gets
+
+    @return
+    0: Moved
+    -1: The old log could not be deleted or the directory renamed
+ */
+static int log_move(const char *from, const char *to)
+{
+    char from_dir[LOG_DIR_LEN];
+    char to_dir[LOG_DIR_LEN];
+
+    if(log_dir_name(from_dir, from) != 0 || log_dir_name(to_dir, to) != 0 || log_destroy(to) != 0)
+    {
+        return -1;
+    }
+    return rename(from_dir, to_dir);
+}
+
+/*
+    Builds the name of the segment directory of a base name
+
+    @param
+    dir: Where to put it, LOG_DIR_LEN bytes
+    path: The base name
+
+    @return
+    0: Built
+    -1: It does not fit, errno is ENAMETOOLONG
+ */
+static int log_dir_name(char *dir, const char *path)
+{
+    if((size_t)snprintf(dir, LOG_DIR_LEN, "%s" LOG_DIR_SUFFIX, path) >= LOG_DIR_LEN)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Scans the segments from a record onwards, handing the newest record of each key to a walk
+
+    @param
+    log: The log
+    walk: The walk
+    segment: Segment to start in
+    offset: Record to start at
+
+    @return
+    0: The walk finished or was stopped
+    -1: A segment could not be read
+ */
+static int walk_segments(struct seglog *log, struct log_walk *walk, uint32_t segment, uint64_t offset)
+{
+    for(size_t i = 0; i < log->segment_count; i++)
+    {
+        uint64_t end;
+        int      result;
+
+        if(log->segments[i] < segment)
+        {
+            continue;
+        }
+
+        result = scan_segment(log, log->segments[i], log->segments[i] == segment ? offset : 0, visit_live_record, walk, &end);
+        if(result < 0)
+        {
+            return -1;
+        }
+        if(result > 0)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+    Reads a counter key
+
+    @param
+    record: The record
+    number: Set to the key's value
+
+    @return
+    1: The key is a number
+    0: It is not, as for the counter itself
+ */
+static int parse_counter_key(const struct log_record *record, unsigned long *number)
+{
+    unsigned long value = 0;
+
+    if(record->key_len < 2 || record->key[record->key_len - 1] != '\0')
+    {
+        return 0;
+    }
+    for(uint32_t i = 0; i + 1 < record->key_len; i++)
+    {
+        if(record->key[i] < '0' || record->key[i] > '9')
+        {
+            return 0;
+        }
+        value = value * BASE_TEN + (unsigned long)(record->key[i] - '0');
+    }
+    *number = value;
+    return 1;
+}
+
+/*
+    Standard CRC-32 (IEEE 802.3), table driven
+
+    @param
+    crc: CRC of the data so far, 0 to start
+    data: More data
+    len: Length of data
+
+    @return
+    The updated CRC
+ */
+static uint32_t crc32_update(uint32_t crc, const char *data, size_t len)
+{
+    static uint32_t table[CRC32_TABLE_SIZE];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+    static int      table_ready = 0;            // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+    if(!table_ready)
+    {
+        for(uint32_t i = 0; i < CRC32_TABLE_SIZE; i++)
+        {
+            uint32_t c = i;
+
+            for(int bit = 0; bit < BITS_PER_BYTE; bit++)
+            {
+                c = (c & 1U) != 0 ? CRC32_POLYNOMIAL ^ (c >> 1U) : c >> 1U;
+            }
+            table[i] = c;
+        }
+        table_ready = 1;
+    }
+
+    crc = ~crc;
+    for(size_t i = 0; i < len; i++)
+    {
+        crc = table[(crc ^ (uint8_t)data[i]) & BYTE_MASK] ^ (crc >> BITS_PER_BYTE);
+    }
+    return ~crc;
+}
+
+/*
+    FNV-1a hash of a key
+
+    @param
+    key: The key
+    key_len: Length of the key
+
+    @return
+    The hash
+ */
+static uint64_t hash_key(const char *key, size_t key_len)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for(size_t i = 0; i < key_len; i++)
+    {
+        hash = (hash ^ (uint8_t)key[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+    Monotonic clock in milliseconds
+
+    @return
+    The time
+ */
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * MS_PER_SEC + ts.tv_nsec / NS_PER_MS;
+}
+
+/*
+    Builds the path of a segment file
+
+    @param
+    log: The log
+    segment: Segment id
+    path: Set to the path, LOG_PATH_LEN bytes
+ */
+static void segment_path(const struct seglog *log, uint32_t segment, char *path)
+{
+    snprintf(path, LOG_PATH_LEN, "%s/%0*u" SEGMENT_SUFFIX, log->dir, SEGMENT_DIGITS, segment);
+}
+
+/*
+    Recognises a segment file name
+
+    @param
+    name: Directory entry name
+    segment: Set to the segment id
+
+    @return
+    1: It is a segment
+    0: It is something else
+ */
+static int parse_segment_name(const char *name, uint32_t *segment)
+{
+    unsigned long id = 0;
+
+    if(strlen(name) != SEGMENT_DIGITS + strlen(SEGMENT_SUFFIX) || strcmp(name + SEGMENT_DIGITS, SEGMENT_SUFFIX) != 0)
+    {
+        return 0;
+    }
+    for(int i = 0; i < SEGMENT_DIGITS; i++)
+    {
+        if(name[i] < '0' || name[i] > '9')
+        {
+            return 0;
+        }
+        id = id * BASE_TEN + (unsigned long)(name[i] - '0');
+    }
+    *segment = (uint32_t)id;
+    return 1;
+}
+
+/*
+    qsort comparator for segment ids
+
+    @param
+    a: First id
+    b: Second id
+
+    @return
+    Negative, zero or positive as a is below, equal to or above b
+ */
+static int compare_segments(const void *a, const void *b)
+{
+    uint32_t left  = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+
+    return (left > right) - (left < right);
+}
+
+/*
+    Reads the segment ids in the log directory, oldest first
+
+    @param
+    log: The log, its segment list is replaced
+
+    @return
+    0: Listed
+    -1: The directory could not be read
+ */
+static int list_segments(struct seglog *log)
+{
+    DIR                 *dir;
+    const struct dirent *entry;
+    uint32_t             segment;
+
+    dir = opendir(log->dir);
+    if(dir == NULL)
+    {
+        return -1;
+    }
+
+    log->segment_count = 0;
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(parse_segment_name(entry->d_name, &segment) && push_segment(log, segment) != 0)
+        {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+
+    qsort(log->segments, log->segment_count, sizeof(uint32_t), compare_segments);
+    return 0;
+}
+
+/*
+    Adds a segment id to the end of the segment list
+
+    @param
+    log: The log
+    segment: Segment id
+
+    @return
+    0: Added
+    -1: Out of memory
+ */
+static int push_segment(struct seglog *log, uint32_t segment)
+{
+    if(log->segment_count == log->segment_capacity)
+    {
+        size_t    capacity = log->segment_capacity > 0 ? log->segment_capacity * 2 : SEGMENTS_INITIAL_CAPACITY;
+        uint32_t *segments = (uint32_t *)realloc(log->segments, capacity * sizeof(uint32_t));
+
+        if(segments == NULL)
+        {
+            return -1;
+        }
+        log->segments         = segments;
+        log->segment_capacity = capacity;
+    }
+    log->segments[log->segment_count++] = segment;
+    return 0;
+}
+
+/*
+    Finds the bucket of a key with linear probing
+
+    @param
+    log: The log, its index must have at least one bucket
+    key: The key
+    key_len: Length of the key
+    hash: hash_key of the key
+
+    @return
+    The key's bucket, or the empty bucket it would go in
+ */
+static struct log_entry *index_slot(struct seglog *log, const char *key, size_t key_len, uint64_t hash)
+{
+    size_t mask = log->capacity - 1;
+
+    for(size_t i = (size_t)hash & mask;; i = (i + 1) & mask)
+    {
+        struct log_entry *entry = &log->entries[i];
+
+        if(entry->key == NULL || (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0))
+        {
+            return entry;
+        }
+    }
+}
+
+/*
+    Doubles the index and rehashes every entry
+
+    @param
+    log: The log
+
+    @return
+    0: Grown
+    -1: Out of memory
+ */
+static int index_grow(struct seglog *log)
+{
+    struct log_entry *old      = log->entries;
+    size_t            old_size = log->capacity;
+    size_t            capacity = old_size > 0 ? old_size * 2 : INDEX_INITIAL_CAPACITY;
+
+    log->entries = (struct log_entry *)calloc(capacity, sizeof(struct log_entry));
+    if(log->entries == NULL)
+    {
+        log->entries = old;
+        return -1;
+    }
+    log->capacity = capacity;
+
+    for(size_t i = 0; i < old_size; i++)
+    {
+        if(old[i].key != NULL)
+        {
+            *index_slot(log, old[i].key, old[i].key_len, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/*
+    Points a key's index entry at a record, adding the key if it is new
+
+    @param
+    log: The log
+    record: The record, its key is copied when it is new to the index
+    segment: Segment the record is in
+
+    @return
+    0: Indexed
+    -1: Out of memory
+ */
+static int index_put(struct seglog *log, const struct log_record *record, uint32_t segment)
+{
+    uint64_t          hash = hash_key(record->key, record->key_len);
+    struct log_entry *entry;
+
+    if((log->count + 1) * PERCENT > log->capacity * INDEX_MAX_LOAD && index_grow(log) != 0)
+    {
+        return -1;
+    }
+
+    entry = index_slot(log, record->key, record->key_len, hash);
+    if(entry->key == NULL)
+    {
+        char *key;
+
+        key = (char *)malloc(record->key_len);
+        if(key == NULL)
+        {
+            return -1;
+        }
+        memcpy(key, record->key, record->key_len);
+        entry->key     = key;
+        entry->hash    = hash;
+        entry->key_len = record->key_len;
+        log->count++;
+    }
+    entry->segment = segment;
+    entry->offset  = record->offset;
+    entry->size    = record->size;
+    return 0;
+}
+
+/*
+    Empties the index, keeping its buckets
+
+    @param
+    log: The log
+ */
+static void index_clear(struct seglog *log)
+{
+    for(size_t i = 0; i < log->capacity; i++)
+    {
+        free(log->entries[i].key);
+        log->entries[i].key = NULL;
+    }
+    log->count = 0;
+}
+
+/*
+    Scan callback that indexes every record
+
+    @param
+    log: The log
+    segment: Segment being scanned
+    record: The record
+    arg: Unused
+
+    @return
+    0 to carry on, 1 if the index ran out of memory
+ */
+static int index_record(struct seglog *log, uint32_t segment, const struct log_record *record, void *arg)
+{
+    (void)arg;
+    return index_put(log, record, segment) != 0;
+}
+
+/*
+    Makes sure the next need bytes of a segment are in the scan buffer
+
+    @param
+    scan: The scan
+    need: Bytes wanted from the current position
+
+    @return
+    1: They are buffered
+    0: The segment ends first
+    -1: A read failed
+ */
+static int scan_fill(struct log_scan *scan, size_t need)
+{
+    if(scan->len - scan->pos >= need)
+    {
+        return 1;
+    }
+
+    memmove(scan->buffer, scan->buffer + scan->pos, scan->len - scan->pos);
+    scan->len -= scan->pos;
+    scan->pos  = 0;
+
+    if(need > scan->capacity)
+    {
+        char *buffer = (char *)realloc(scan->buffer, need);
+
+        if(buffer == NULL)
+        {
+            return -1;
+        }
+        scan->buffer   = buffer;
+        scan->capacity = need;
+    }
+
+    while(scan->len < need)
+    {
+        ssize_t n = pread(scan->fd, scan->buffer + scan->len, scan->capacity - scan->len, (off_t)scan->end);
+
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return n < 0 ? -1 : 0;
+        }
+        scan->len += (size_t)n;
+        scan->end += (uint64_t)n;
+    }
+    return 1;
+}
+
+/*
+    Reads the next record of a segment and checks it
+
+    @param
+    scan: The scan
+    record: Set to the record
+
+    @return
+    1: An intact record was read
+    0: The segment ends, cleanly or with a torn or damaged record
+    -1: A read failed
+ */
+static int scan_next(struct log_scan *scan, struct log_record *record)
+{
+    const char *header;
+    uint32_t    crc;
+    size_t      size;
+    int         result;
+
+    result = scan_fill(scan, RECORD_HEADER_SIZE);
+    if(result <= 0)
+    {
+        return result;
+    }
+
+    header = scan->buffer + scan->pos;
+    memcpy(&crc, header, sizeof(crc));
+    memcpy(&record->key_len, header + RECORD_LENGTHS_OFFSET, sizeof(uint32_t));
+    memcpy(&record->value_len, header + RECORD_LENGTHS_OFFSET + sizeof(uint32_t), sizeof(uint32_t));
+    if(record->key_len == 0 || record->key_len > MAX_RECORD_PART || record->value_len > MAX_RECORD_PART)
+    {
+        return 0;
+    }
+
+    size   = RECORD_HEADER_SIZE + (size_t)record->key_len + record->value_len;
+    result = scan_fill(scan, size);
+    if(result <= 0)
+    {
+        return result;
+    }
+
+    header = scan->buffer + scan->pos;
+    if(crc32_update(0, header + RECORD_LENGTHS_OFFSET, size - RECORD_LENGTHS_OFFSET) != crc)
+    {
+        return 0;
+    }
+
+    record->key    = header + RECORD_HEADER_SIZE;
+    record->value  = record->key + record->key_len;
+    record->offset = scan->end - (scan->len - scan->pos);
+    record->size   = (uint32_t)size;
+    scan->pos += size;
+    return 1;
+}
+
+/*
+    Runs a callback over the intact records of a segment
+
+    @param
+    log: The log
+    segment: Segment id
+    from: Offset to start at, on a record boundary
+    visit: Called for each record
+    arg: Passed to visit
+    end: Set to the offset just past the last intact record
+
+    @return
+    0: The scan reached the end of the intact records
+    1: visit stopped it
+    -1: The segment could not be opened or read
+ */
+static int scan_segment(struct seglog *log, uint32_t segment, uint64_t from, record_visit visit, void *arg, uint64_t *end)
+{
+    char              path[LOG_PATH_LEN];
+    struct log_scan   scan;
+    struct log_record record;
+    int               result;
+
+    segment_path(log, segment, path);
+    scan.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(scan.fd < 0)
+    {
+        return -1;
+    }
+    scan.buffer   = (char *)malloc(SCAN_BUFFER_SIZE);
+    scan.capacity = SCAN_BUFFER_SIZE;
+    scan.len      = 0;
+    scan.pos      = 0;
+    scan.end      = from;
+    *end          = from;
+    if(scan.buffer == NULL)
+    {
+        close(scan.fd);
+        return -1;
+    }
+
+    while((result = scan_next(&scan, &record)) > 0)
+    {
+        *end = record.offset + record.size;
+        if(visit(log, segment, &record, arg) != 0)
+        {
+            break;
+        }
+    }
+
+    free(scan.buffer);
+    close(scan.fd);
+    return result;    // 1 when visit stopped the scan, else 0 or -1 from scan_next
+}
+
+/*
+    Throws the index away and indexes every segment in the directory again
+
+    @param
+    log: The log
+
+    @return
+    0: Indexed
+    -1: The directory or a segment could not be read
+ */
+static int rebuild_index(struct seglog *log)
+{
+    index_clear(log);
+    if(log->capacity == 0 && index_grow(log) != 0)
+    {
+        return -1;
+    }
+    if(list_segments(log) != 0)
+    {
+        return -1;
+    }
+
+    log->indexed = 0;
+    for(size_t i = 0; i < log->segment_count; i++)
+    {
+        if(scan_segment(log, log->segments[i], 0, index_record, NULL, &log->indexed) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Tells whether a compaction has replaced segments this index points into. A
+    compaction always deletes the oldest segment it merges, so checking that the oldest
+    indexed segment still exists is enough.
+
+    @param
+    log: The log
+
+    @return
+    1: The index is stale
+    0: It is not
+ */
+static int index_is_stale(const struct seglog *log)
+{
+    char        path[LOG_PATH_LEN];
+    struct stat st;
+
+    if(log->segment_count < 2)
+    {
+        return 0;
+    }
+    segment_path(log, log->segments[0], path);
+    return stat(path, &st) != 0 && errno == ENOENT;
+}
+
+/*
+    Indexes what other processes appended since this one last looked
+
+    @param
+    log: The log
+
+    @return
+    0: The index is up to date
+    -1: The log could not be read
+ */
+static int catch_up(struct seglog *log)
+{
+    char        path[LOG_PATH_LEN];
+    struct stat st;
+    uint32_t    next;
+
+    if(log->segment_count == 0 || index_is_stale(log))
+    {
+        return rebuild_index(log);
+    }
+
+    for(;;)
+    {
+        uint32_t newest = log->segments[log->segment_count - 1];
+
+        segment_path(log, newest, path);
+        if(stat(path, &st) != 0)
+        {
+            return -1;
+        }
+        if((uint64_t)st.st_size > log->indexed && scan_segment(log, newest, log->indexed, index_record, NULL, &log->indexed) != 0)
+        {
+            return -1;
+        }
+
+        next = newest + 1;
+        segment_path(log, next, path);
+        if(access(path, F_OK) != 0)
+        {
+            return 0;
+        }
+
+        // The newest segment was sealed, so anything written to it is complete by now
+        if(scan_segment(log, newest, log->indexed, index_record, NULL, &log->indexed) != 0 || push_segment(log, next) != 0)
+        {
+            return -1;
+        }
+        log->indexed = 0;
+    }
+}
+
+/*
+    Makes sure active_fd is open on the newest segment, creating the first segment of
+    an empty log. Called with the log lock held.
+
+    @param
+    log: The log
+
+    @return
+    0: active_fd is the newest segment
+    -1: It could not be opened
+ */
+static int open_active(struct seglog *log)
+{
+    char     path[LOG_PATH_LEN];
+    uint32_t newest;
+
+    if(log->segment_count == 0 && push_segment(log, 1) != 0)
+    {
+        return -1;
+    }
+
+    newest = log->segments[log->segment_count - 1];
+    if(log->active_fd >= 0 && log->active_segment == newest)
+    {
+        return 0;
+    }
+
+    if(log->active_fd >= 0)
+    {
+        close(log->active_fd);
+    }
+    segment_path(log, newest, path);
+    log->active_fd      = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, LOG_FILE_MODE);
+    log->active_segment = newest;
+    return log->active_fd >= 0 ? 0 : -1;
+}
+
+/*
+    Seals the newest segment and starts the next one. Called with the log lock held.
+
+    @param
+    log: The log
+
+    @return
+    0: The new segment is active
+    -1: It could not be created
+ */
+static int roll_segment(struct seglog *log)
+{
+    if(push_segment(log, log->active_segment + 1) != 0)
+    {
+        return -1;
+    }
+    sync_file(log->active_fd);    // Sealed segments are only ever read again
+    log->indexed = 0;
+    return open_active(log);
+}
+
+/*
+    Writes one record: header, key and value
+
+    @param
+    dest: Where to write it, at least RECORD_HEADER_SIZE + key_len + value_len bytes
+    key: The key
+    key_len: Length of the key
+    value: The value
+    value_len: Length of the value
+
+    @return
+    Size of the record
+ */
+static size_t encode_record(char *dest, const char *key, size_t key_len, const char *value, size_t value_len)
+{
+    uint32_t lengths[2] = {(uint32_t)key_len, (uint32_t)value_len};
+    size_t   size       = RECORD_HEADER_SIZE + key_len + value_len;
+    uint32_t crc;
+
+    memcpy(dest + RECORD_LENGTHS_OFFSET, lengths, sizeof(lengths));
+    memcpy(dest + RECORD_HEADER_SIZE, key, key_len);
+    memcpy(dest + RECORD_HEADER_SIZE + key_len, value, value_len);
+    crc = crc32_update(0, dest + RECORD_LENGTHS_OFFSET, size - RECORD_LENGTHS_OFFSET);
+    memcpy(dest, &crc, sizeof(crc));
+    return size;
+}
+
+/*
+    Writes a whole buffer, retrying short writes
+
+    @param
+    fd: Where to write
+    data: What to write
+    len: Length of data
+
+    @return
+    0: Written
+    -1: write failed
+ */
+static int write_all(int fd, const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+    Grows the scratch buffer records are built and read in
+
+    @param
+    log: The log
+    size: Bytes needed
+
+    @return
+    0: The buffer holds at least size bytes
+    -1: Out of memory
+ */
+static int reserve_scratch(struct seglog *log, size_t size)
+{
+    char *scratch;
+
+    if(size <= log->scratch_size)
+    {
+        return 0;
+    }
+    scratch = (char *)realloc(log->scratch, size);
+    if(scratch == NULL)
+    {
+        return -1;
+    }
+    log->scratch      = scratch;
+    log->scratch_size = size;
+    return 0;
+}
+
+/*
+    Reads the record an index entry points at into the scratch buffer and checks it is
+    intact and still holds the key
+
+    @param
+    log: The log
+    entry: The index entry
+    key: The key looked up
+    key_len: Length of the key
+
+    @return
+    0: The record is in the scratch buffer
+    -1: It could not be read or no longer matches
+ */
+static int read_record(struct seglog *log, const struct log_entry *entry, const char *key, size_t key_len)
+{
+    char     path[LOG_PATH_LEN];
+    uint32_t crc;
+
+    if(log->read_fd < 0 || log->read_segment != entry->segment)
+    {
+        if(log->read_fd >= 0)
+        {
+            close(log->read_fd);
+        }
+        segment_path(log, entry->segment, path);
+        log->read_fd      = open(path, O_RDONLY | O_CLOEXEC);
+        log->read_segment = entry->segment;
+        if(log->read_fd < 0)
+        {
+            return -1;
+        }
+    }
+
+    if(reserve_scratch(log, entry->size) != 0 || pread(log->read_fd, log->scratch, entry->size, (off_t)entry->offset) != (ssize_t)entry->size)
+    {
+        return -1;
+    }
+
+    memcpy(&crc, log->scratch, sizeof(crc));
+    if(crc32_update(0, log->scratch + RECORD_LENGTHS_OFFSET, entry->size - RECORD_LENGTHS_OFFSET) != crc || memcmp(log->scratch + RECORD_HEADER_SIZE, key, key_len) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Flushes the newest segment if the fsync policy asks for it
+
+    @param
+    log: The log
+    fsync: The policy
+    interval_ms: Time between flushes for STORAGE_FSYNC_INTERVAL
+ */
+static void sync_policy(struct seglog *log, enum storage_fsync fsync, int interval_ms)
+{
+    long long now;
+
+    if(fsync == STORAGE_FSYNC_NONE)
+    {
+        return;
+    }
+
+    now = now_ms();
+    if(fsync == STORAGE_FSYNC_ALWAYS || now - log->synced_ms >= interval_ms)
+    {
+        sync_file(log->active_fd);
+        log->synced_ms = now;
+    }
+}
+
+/*
+    Collects the compaction child once it has finished
+
+    @param
+    log: The log
+ */
+static void reap_compactor(struct seglog *log)
+{
+    if(log->compactor > 0 && waitpid(log->compactor, NULL, WNOHANG) != 0)
+    {
+        log->compactor = 0;
+    }
+}
+
+/*
+    Forks a child to compact the sealed segments, unless one is still running
+
+    @param
+    log: The log
+ */
+static void start_compaction(struct seglog *log)
+{
+    pid_t pid;
+
+    if(log->compactor > 0)
+    {
+        return;
+    }
+
+    fflush(stdout);    // Or the child would print the worker's buffered output again
+    pid = fork();
+    if(pid < 0)
+    {
+        perror("compaction (fork)");
+        return;
+    }
+    if(pid > 0)
+    {
+        log->compactor = pid;
+        return;
+    }
+
+    // Client sockets inherited from the worker would otherwise stay open until the compaction ends
+    close_inherited_fds();
+    log->lock_fd   = -1;
+    log->active_fd = -1;
+    log->read_fd   = -1;
+    _exit(compact(log) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/*
+    Closes every descriptor but stdin, stdout and stderr
+ */
+static void close_inherited_fds(void)
+{
+    long max_fd;
+
+#if defined(__linux__) && defined(SYS_close_range)
+    if(syscall(SYS_close_range, FIRST_FD, ~0U, 0) == 0)
+    {
+        return;
+    }
+#endif
+    max_fd = sysconf(_SC_OPEN_MAX);
+    for(long fd = FIRST_FD; fd < max_fd; fd++)
+    {
+        close((int)fd);
+    }
+}
+
+/*
+    Copies the records of the sealed segments that are still the newest for their key
+    into a new file, then puts it in place of the newest sealed segment and deletes the
+    others. Runs in the forked child, and only in one process at a time.
+
+    @param
+    log: The child's copy of the log
+
+    @return
+    0: Compacted, or nothing to do
+    -1: Failed, the segments are left as they were
+ */
+static int compact(struct seglog *log)
+{
+    char              path[LOG_PATH_LEN];
+    char              tmp_path[LOG_PATH_LEN];
+    struct log_output output;
+    int               lock_fd;
+    int               result = 0;
+    size_t            sealed;
+    uint64_t          end;
+
+    snprintf(path, sizeof(path), "%s/" COMPACT_LOCK_NAME, log->dir);
+    lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, LOG_FILE_MODE);
+    if(lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        return 0;    // Another compaction is running
+    }
+
+    // Another process may have compacted since this one indexed
+    if(rebuild_index(log) != 0)
+    {
+        return -1;
+    }
+    if(log->segment_count < 3)
+    {
+        return 0;    // Merging fewer than two sealed segments frees nothing
+    }
+    sealed = log->segment_count - 1;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s/" COMPACT_TMP_NAME, log->dir);
+    output.fd      = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, LOG_FILE_MODE);
+    output.buffer  = (char *)malloc(SCAN_BUFFER_SIZE);
+    output.len     = 0;
+    output.written = 0;
+    if(output.fd < 0 || output.buffer == NULL)
+    {
+        return -1;
+    }
+
+    for(size_t i = 0; i < sealed && result == 0; i++)
+    {
+        result = scan_segment(log, log->segments[i], 0, copy_live_record, &output, &end);
+    }
+    if(result != 0 || flush_output(&output) != 0 || sync_file(output.fd) != 0 || close(output.fd) != 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    segment_path(log, log->segments[sealed - 1], path);
+    if(rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+    for(size_t i = 0; i + 1 < sealed; i++)
+    {
+        segment_path(log, log->segments[i], path);
+        unlink(path);
+    }
+
+    printf("Compacted %zu log segments into %llu bytes\n", sealed, (unsigned long long)output.written);
+    fflush(stdout);
+    return 0;
+}
+
+/*
+    Tells whether a record is the newest of its key
+
+    @param
+    log: The log
+    segment: Segment the record is in
+    record: The record
+
+    @return
+    1: The index points at it
+    0: A newer record of the key follows
+ */
+static int is_live(struct seglog *log, uint32_t segment, const struct log_record *record)
+{
+    const struct log_entry *entry = index_slot(log, record->key, record->key_len, hash_key(record->key, record->key_len));
+
+    return entry->key != NULL && entry->segment == segment && entry->offset == record->offset;
+}
+
+/*
+    Scan callback of log_each and log_range, hands the newest record of each key in the walk to the caller
+
+    @param
+    log: The log
+    segment: Segment being scanned
+    record: The record
+    arg: The log_walk
+
+    @return
+    What the caller's visit returned, 1 once a ranged walk passes its last key
+ */
+static int visit_live_record(struct seglog *log, uint32_t segment, const struct log_record *record, void *arg)
+{
+    const struct log_walk *walk = (const struct log_walk *)arg;
+    unsigned long          number;
+
+    if(walk->ranged && (!parse_counter_key(record, &number) || number < walk->first))
+    {
+        return 0;
+    }
+    if(walk->ranged && number > walk->last)
+    {
+        return 1;
+    }
+    if(!is_live(log, segment, record))
+    {
+        return 0;
+    }
+    return walk->visit(record->key, record->key_len, record->value, record->value_len, walk->arg);
+}
+
+/*
+    Scan callback of compact, copies the newest record of each key to the output
+
+    @param
+    log: The log
+    segment: Segment being scanned
+    record: The record
+    arg: The log_output
+
+    @return
+    0 to carry on, 1 if the output could not be written
+ */
+static int copy_live_record(struct seglog *log, uint32_t segment, const struct log_record *record, void *arg)
+{
+    struct log_output *output = (struct log_output *)arg;
+
+    if(!is_live(log, segment, record))
+    {
+        return 0;
+    }
+
+    if(output->len + record->size > SCAN_BUFFER_SIZE && flush_output(output) != 0)
+    {
+        return 1;
+    }
+    if(record->size > SCAN_BUFFER_SIZE)
+    {
+        output->written += record->size;
+        return write_all(output->fd, record->key - RECORD_HEADER_SIZE, record->size) != 0;
+    }
+    memcpy(output->buffer + output->len, record->key - RECORD_HEADER_SIZE, record->size);
+    output->len += record->size;
+    return 0;
+}
+
+/*
+    Writes out what a compaction has buffered
+
+    @param
+    output: The output
+
+    @return
+    0: Written
+    -1: write failed
+ */
+static int flush_output(struct log_output *output)
+{
+    if(write_all(output->fd, output->buffer, output->len) != 0)
+    {
+        return -1;
+    }
+    output->written += output->len;
+    output->len = 0;
+    return 0;
+}
@@ -0,0 +1,756 @@
+#include "snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define SNAPSHOT_MAGIC "REQDBSNP"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_PART ((uint32_t)1 << 30)    // Longest key or value read back
+#define STREAM_BUFFER_SIZE ((size_t)1 << 20)
+#define GZIP_WRITE_MODE "wb1"    // Fastest level, snapshots are about throughput more than size
+#define PLAIN_WRITE_MODE "wbT"   // zlib writes these uncompressed, and reads them back as they are
+#define SNAPSHOT_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+#define TIME_BATCH 1024
+#define U32_SIZE 4
+#define U64_SIZE 8
+#define PAIR_HEADER_SIZE 8    // Key length, value length
+#define TIME_ENTRY_SIZE 16
+#define TRAILER_SIZE 12    // Pair count, crc32
+#define BITS_PER_BYTE 8
+#define BYTE_MASK 0xFFU
+#define PROGRESS_EVERY 1024         // Pairs between looks at the clock
+#define PROGRESS_INTERVAL_MS 200    // How often the progress line is redrawn on a terminal
+#define MS_PER_SEC 1000
+#define NS_PER_MS 1000000
+#define BYTES_PER_MIB 1048576.0
+
+/*
+    Throughput so far, redrawn on stderr when it is a terminal
+ */
+struct snapshot_progress
+{
+    const char *verb;
+    uint64_t    pairs;
+    uint64_t    bytes;    // Uncompressed
+    long long   started_ms;
+    long long   shown_ms;
+    int         live;
+};
+
+/*
+    A snapshot being written or read, buffered in front of zlib
+ */
+struct snapshot_stream
+{
+    gzFile                   file;
+    char                    *buffer;
+    size_t                   len;
+    size_t                   pos;    // Next byte to hand out when reading
+    uLong                    crc;
+    char                    *data;    // Key and value of the pair just read
+    size_t                   data_size;
+    int                      failed;
+    struct snapshot_progress progress;
+};
+
+static int       open_stream(struct snapshot_stream *stream, const char *file, int writing, int compress);
+static int       close_stream(struct snapshot_stream *stream, int writing);
+static int       put_bytes(struct snapshot_stream *stream, const void *data, size_t len);
+static int       flush_stream(struct snapshot_stream *stream);
+static int       write_buffer(struct snapshot_stream *stream, const void *data, size_t len);
+static int       take_bytes(struct snapshot_stream *stream, void *dest, size_t len);
+static int       put_pair(const void *key, size_t key_len, const void *value, size_t value_len, void *arg);
+static int       take_pair(const void **key, size_t *key_len, const void **value, size_t *value_len, void *arg);
+static int       put_times(struct snapshot_stream *stream, struct time_index *index, uint64_t *count);
+static int       take_times(struct snapshot_stream *stream, struct time_index *index, uint64_t *count);
+static void      encode_u32(char *dest, uint32_t value);
+static void      encode_u64(char *dest, uint64_t value);
+static uint32_t  decode_u32(const char *src);
+static uint64_t  decode_u64(const char *src);
+static long long monotonic_ms(void);
+static void      progress_start(struct snapshot_progress *progress, const char *verb);
+static void      progress_update(struct snapshot_progress *progress);
+static void      progress_finish(const struct snapshot_progress *progress, uint64_t times);
+
+/*
+    Writes every key/value pair and time entry of a store to a snapshot
+
+    @param
+    store: An open store
+    file: Where to write, SNAPSHOT_STDIO for stdout
+    compress: 1 to gzip the snapshot
+
+    @return
+    0: Written, with a summary on stderr
+    -1: The store could not be read or the snapshot written, the reason is on stderr
+ */
+int snapshot_export(struct storage *store, const char *file, int compress)
+{
+    struct snapshot_stream stream;
+    char                   header[SNAPSHOT_MAGIC_LEN + U32_SIZE];
+    char                   trailer[TRAILER_SIZE];
+    uint64_t               times = 0;
+    const void            *counter;
+    size_t                 counter_len;
+    int                    result;
+
+    if(open_stream(&stream, file, 1, compress) != 0)
+    {
+        return -1;
+    }
+    progress_start(&stream.progress, "Exported");
+
+    memcpy(header, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    encode_u32(header + SNAPSHOT_MAGIC_LEN, SNAPSHOT_VERSION);
+    result = put_bytes(&stream, header, sizeof(header));
+
+    // In key order, since the log backend expects its keys appended oldest first
+    if(result == 0 && (storage_range(store, 0, ULONG_MAX, put_pair, &stream) != 0 || stream.failed))
+    {
+        fprintf(stderr, "Could not read the store\n");
+        result = -1;
+    }
+    counter = storage_fetch(store, STORAGE_COUNTER_KEY, &counter_len);
+    if(result == 0 && counter != NULL && put_pair(STORAGE_COUNTER_KEY, sizeof(STORAGE_COUNTER_KEY), counter, counter_len, &stream) != 0)
+    {
+        result = -1;
+    }
+    if(result == 0)
+    {
+        memset(trailer, 0, PAIR_HEADER_SIZE);
+        result = put_bytes(&stream, trailer, PAIR_HEADER_SIZE);    // A pair with an empty key ends the pairs
+    }
+    if(result == 0)
+    {
+        result = put_times(&stream, &store->times, &times);
+    }
+    if(result == 0)
+    {
+        encode_u64(trailer, stream.progress.pairs);
+        encode_u32(trailer + U64_SIZE, (uint32_t)stream.crc);
+        result = put_bytes(&stream, trailer, sizeof(trailer));
+    }
+
+    if(close_stream(&stream, 1) != 0 || result != 0)
+    {
+        return -1;
+    }
+    progress_finish(&stream.progress, times);
+    return 0;
+}
+
+/*
+    Stores every key/value pair and time entry of a snapshot in a store. Nothing checks
+    the snapshot's checksum before the pairs are stored, so import into a new store
+    and only keep it once this succeeds.
+
+    @param
+    store: A store opened writable, normally empty
+    file: Where to read, SNAPSHOT_STDIO for stdin. Uncompressed snapshots are read as well.
+
+    @return
+    0: Imported, with a summary on stderr
+    -1: The snapshot is damaged or the store could not be written, the reason is on stderr
+ */
+int snapshot_import(struct storage *store, const char *file)
+{
+    struct snapshot_stream stream;
+    char                   header[SNAPSHOT_MAGIC_LEN + U32_SIZE];
+    char                   trailer[TRAILER_SIZE];
+    uint64_t               times  = 0;
+    int                    result = 0;
+    uLong                  crc;
+
+    if(open_stream(&stream, file, 0, 0) != 0)
+    {
+        return -1;
+    }
+    progress_start(&stream.progress, "Imported");
+
+    if(take_bytes(&stream, header, sizeof(header)) != 0 || memcmp(header, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0 || decode_u32(header + SNAPSHOT_MAGIC_LEN) != SNAPSHOT_VERSION)
+    {
+        fprintf(stderr, "%s is not a version %d snapshot\n", file, SNAPSHOT_VERSION);
+        result = -1;
+    }
+    if(result == 0 && storage_load(store, take_pair, &stream) != 0)
+    {
+        fprintf(stderr, stream.failed ? "%s is truncated or damaged\n" : "Could not write the store\n", file);
+        result = -1;
+    }
+    if(result == 0 && take_times(&stream, &store->times, &times) != 0)
+    {
+        result = -1;
+    }
+    if(result == 0)
+    {
+        crc = stream.crc;
+        if(take_bytes(&stream, trailer, sizeof(trailer)) != 0 || decode_u64(trailer) != stream.progress.pairs || decode_u32(trailer + U64_SIZE) != (uint32_t)crc)
+        {
+            fprintf(stderr, "%s failed its checksum\n", file);
+            result = -1;
+        }
+    }
+
+    if(close_stream(&stream, 0) != 0 || result != 0)
+    {
+        return -1;
+    }
+    progress_finish(&stream.progress, times);
+    return 0;
+}
+
+/*
+    Opens a snapshot file, or stdin/stdout, through zlib
+
+    @param
+    stream: The stream to set up
+    file: The file, SNAPSHOT_STDIO for stdin or stdout
+    writing: 1 to write, 0 to read
+    compress: 1 to gzip what is written
+
+    @return
+    0: Open
+    -1: The file could not be opened or memory allocated, the reason is on stderr
+ */
+static int open_stream(struct snapshot_stream *stream, const char *file, int writing, int compress)
+{
+    int fd;
+
+    memset(stream, 0, sizeof(*stream));
+    if(strcmp(file, SNAPSHOT_STDIO) == 0)
+    {
+        fd = dup(writing ? STDOUT_FILENO : STDIN_FILENO);    // gzclose closes it
+    }
+    else
+    {
+        fd = writing ? open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, SNAPSHOT_FILE_MODE) : open(file, O_RDONLY | O_CLOEXEC);
+    }
+    if(fd < 0)
+    {
+        perror(file);
+        return -1;
+    }
+
+    stream->file   = gzdopen(fd, writing ? (compress ? GZIP_WRITE_MODE : PLAIN_WRITE_MODE) : "rb");
+    stream->buffer = (char *)malloc(STREAM_BUFFER_SIZE);
+    stream->crc    = crc32(0L, Z_NULL, 0);
+    if(stream->file == NULL || stream->buffer == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        if(stream->file != NULL)
+        {
+            gzclose(stream->file);
+        }
+        else
+        {
+            close(fd);
+        }
+        free(stream->buffer);
+        return -1;
+    }
+    gzbuffer(stream->file, (unsigned)STREAM_BUFFER_SIZE);
+    return 0;
+}
+
+/*
+    Flushes and closes a stream
+
+    @param
+    stream: The stream
+    writing: 1 if it was opened for writing
+
+    @return
+    0: Closed, everything written reached the file
+    -1: The last of it could not be written
+ */
+static int close_stream(struct snapshot_stream *stream, int writing)
+{
+    int result = 0;
+
+    if(writing && flush_stream(stream) != 0)
+    {
+        result = -1;
+    }
+    if(gzclose(stream->file) != Z_OK && writing)
+    {
+        fprintf(stderr, "Could not finish writing the snapshot\n");
+        result = -1;
+    }
+    free(stream->buffer);
+    free(stream->data);
+    return result;
+}
+
+/*
+    Adds bytes to a snapshot being written
+
+    @param
+    stream: The stream
+    data: The bytes
+    len: How many
+
+    @return
+    0: Buffered or written
+    -1: zlib could not write them, the reason is on stderr
+ */
+static int put_bytes(struct snapshot_stream *stream, const void *data, size_t len)
+{
+    stream->crc = crc32(stream->crc, (const Bytef *)data, (uInt)len);
+    stream->progress.bytes += len;
+
+    if(stream->len + len > STREAM_BUFFER_SIZE && flush_stream(stream) != 0)
+    {
+        return -1;
+    }
+    if(len > STREAM_BUFFER_SIZE)
+    {
+        return write_buffer(stream, data, len);
+    }
+    memcpy(stream->buffer + stream->len, data, len);
+    stream->len += len;
+    return 0;
+}
+
+/*
+    Hands what put_bytes buffered to zlib
+
+    @param
+    stream: The stream
+
+    @return
+    0: Written
+    -1: zlib could not write it, the reason is on stderr
+ */
+static int flush_stream(struct snapshot_stream *stream)
+{
+    if(write_buffer(stream, stream->buffer, stream->len) != 0)
+    {
+        return -1;
+    }
+    stream->len = 0;
+    return 0;
+}
+
+/*
+    Hands bytes to zlib
+
+    @param
+    stream: The stream
+    data: The bytes
+    len: How many
+
+    @return
+    0: Written
+    -1: zlib could not write them, the reason is on stderr
+ */
+static int write_buffer(struct snapshot_stream *stream, const void *data, size_t len)
+{
+    int errnum = Z_OK;
+
+    if(len > 0 && gzwrite(stream->file, data, (unsigned)len) != (int)len)
+    {
+        const char *message = gzerror(stream->file, &errnum);
+
+        fprintf(stderr, "Could not write the snapshot: %s\n", errnum == Z_ERRNO ? strerror(errno) : message);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Takes the next bytes of a snapshot being read
+
+    @param
+    stream: The stream
+    dest: Where to put them
+    len: How many
+
+    @return
+    0: Read
+    -1: The snapshot ended first or could not be read
+ */
+static int take_bytes(struct snapshot_stream *stream, void *dest, size_t len)
+{
+    char *out = (char *)dest;
+
+    stream->progress.bytes += len;
+    while(len > 0)
+    {
+        size_t available = stream->len - stream->pos;
+        int    n;
+
+        if(available > 0)
+        {
+            size_t chunk = available < len ? available : len;
+
+            memcpy(out, stream->buffer + stream->pos, chunk);
+            stream->crc = crc32(stream->crc, (const Bytef *)out, (uInt)chunk);
+            stream->pos += chunk;
+            out += chunk;
+            len -= chunk;
+            continue;
+        }
+
+        n = gzread(stream->file, stream->buffer, (unsigned)STREAM_BUFFER_SIZE);
+        if(n <= 0)
+        {
+            return -1;
+        }
+        stream->len = (size_t)n;
+        stream->pos = 0;
+    }
+    return 0;
+}
+
+/*
+    storage_range callback of an export, writes one pair
+
+    @param
+    key: The key
+    key_len: Length of the key
+    value: The value
+    value_len: Length of the value
+    arg: The stream
+
+    @return
+    0 to carry on, 1 to stop after a write error
+ */
+static int put_pair(const void *key, size_t key_len, const void *value, size_t value_len, void *arg)
+{
+    struct snapshot_stream *stream = (struct snapshot_stream *)arg;
+    char                    lengths[PAIR_HEADER_SIZE];
+
+    encode_u32(lengths, (uint32_t)key_len);
+    encode_u32(lengths + U32_SIZE, (uint32_t)value_len);
+    if(put_bytes(stream, lengths, sizeof(lengths)) != 0 || put_bytes(stream, key, key_len) != 0 || put_bytes(stream, value, value_len) != 0)
+    {
+        stream->failed = 1;
+        return 1;
+    }
+    stream->progress.pairs++;
+    progress_update(&stream->progress);
+    return 0;
+}
+
+/*
+    storage_load source of an import, reads one pair
+
+    @param
+    key: Set to the key
+    key_len: Set to the length of the key
+    value: Set to the value
+    value_len: Set to the length of the value
+    arg: The stream
+
+    @return
+    1: A pair was read
+    0: The pairs have ended
+    -1: The snapshot is truncated or damaged
+ */
+static int take_pair(const void **key, size_t *key_len, const void **value, size_t *value_len, void *arg)
+{
+    struct snapshot_stream *stream = (struct snapshot_stream *)arg;
+    char                    lengths[PAIR_HEADER_SIZE];
+    uint32_t                klen;
+    uint32_t                vlen;
+
+    stream->failed = 1;
+    if(take_bytes(stream, lengths, sizeof(lengths)) != 0)
+    {
+        return -1;
+    }
+    klen = decode_u32(lengths);
+    vlen = decode_u32(lengths + U32_SIZE);
+    if(klen == 0)
+    {
+        stream->failed = vlen != 0;
+        return vlen == 0 ? 0 : -1;
+    }
+    if(klen > SNAPSHOT_MAX_PART || vlen > SNAPSHOT_MAX_PART)
+    {
+        return -1;
+    }
+
+    if((size_t)klen + vlen > stream->data_size)
+    {
+        char *data = (char *)realloc(stream->data, (size_t)klen + vlen);
+
+        if(data == NULL)
+        {
+            return -1;
+        }
+        stream->data      = data;
+        stream->data_size = (size_t)klen + vlen;
+    }
+    if(take_bytes(stream, stream->data, (size_t)klen + vlen) != 0)
+    {
+        return -1;
+    }
+
+    *key           = stream->data;
+    *key_len       = klen;
+    *value         = stream->data + klen;
+    *value_len     = vlen;
+    stream->failed = 0;
+    stream->progress.pairs++;
+    progress_update(&stream->progress);
+    return 1;
+}
+
+/*
+    Writes the time entries of an export
+
+    @param
+    stream: The stream
+    index: The store's time index
+    count: Set to the number of entries
+
+    @return
+    0: Written
+    -1: The index could not be read or the snapshot written
+ */
+static int put_times(struct snapshot_stream *stream, struct time_index *index, uint64_t *count)
+{
+    struct time_entry entries[TIME_BATCH];
+    char              encoded[TIME_ENTRY_SIZE];
+    uint64_t          done = 0;
+
+    *count = time_index_count(index);    // Entries appended from here on are left out
+    encode_u64(encoded, *count);
+    if(put_bytes(stream, encoded, U64_SIZE) != 0)
+    {
+        return -1;
+    }
+    while(done < *count)
+    {
+        size_t want = *count - done < TIME_BATCH ? (size_t)(*count - done) : TIME_BATCH;
+        size_t got  = time_index_read(index, (size_t)done, entries, want);
+
+        if(got == 0)
+        {
+            fprintf(stderr, "Could not read the time index\n");
+            return -1;
+        }
+        for(size_t i = 0; i < got; i++)
+        {
+            encode_u64(encoded, (uint64_t)entries[i].time_ms);
+            encode_u64(encoded + U64_SIZE, entries[i].key);
+            if(put_bytes(stream, encoded, sizeof(encoded)) != 0)
+            {
+                return -1;
+            }
+        }
+        done += got;
+    }
+    return 0;
+}
+
+/*
+    Reads the time entries of an import into the store's time index
+
+    @param
+    stream: The stream
+    index: The store's time index
+    count: Set to the number of entries
+
+    @return
+    0: Read and written
+    -1: The snapshot is truncated or the index could not be written, the reason is on stderr
+ */
+static int take_times(struct snapshot_stream *stream, struct time_index *index, uint64_t *count)
+{
+    struct time_entry entries[TIME_BATCH];
+    char              encoded[TIME_ENTRY_SIZE];
+    size_t            batched = 0;
+
+    if(take_bytes(stream, encoded, U64_SIZE) != 0)
+    {
+        fprintf(stderr, "The snapshot is truncated\n");
+        return -1;
+    }
+    *count = decode_u64(encoded);
+
+    for(uint64_t i = 0; i < *count; i++)
+    {
+        if(take_bytes(stream, encoded, sizeof(encoded)) != 0)
+        {
+            fprintf(stderr, "The snapshot is truncated\n");
+            return -1;
+        }
+        entries[batched].time_ms = (int64_t)decode_u64(encoded);
+        entries[batched].key     = decode_u64(encoded + U64_SIZE);
+        batched++;
+        if(batched < TIME_BATCH && i + 1 < *count)
+        {
+            continue;
+        }
+        if(time_index_write(index, entries, batched) != 0)
+        {
+            perror("time_index_write");
+            return -1;
+        }
+        batched = 0;
+    }
+    return 0;
+}
+
+/*
+    Stores a 32-bit number little-endian
+
+    @param
+    dest: Where to put it, 4 bytes
+    value: The number
+ */
+static void encode_u32(char *dest, uint32_t value)
+{
+    for(size_t i = 0; i < U32_SIZE; i++)
+    {
+        dest[i] = (char)((value >> (i * BITS_PER_BYTE)) & BYTE_MASK);
+    }
+}
+
+/*
+    Stores a 64-bit number little-endian
+
+    @param
+    dest: Where to put it, 8 bytes
+    value: The number
+ */
+static void encode_u64(char *dest, uint64_t value)
+{
+    for(size_t i = 0; i < U64_SIZE; i++)
+    {
+        dest[i] = (char)((value >> (i * BITS_PER_BYTE)) & BYTE_MASK);
+    }
+}
+
+/*
+    Reads a little-endian 32-bit number
+
+    @param
+    src: The 4 bytes
+
+    @return
+    The number
+ */
+static uint32_t decode_u32(const char *src)
+{
+    uint32_t value = 0;
+
+    for(size_t i = 0; i < U32_SIZE; i++)
+    {
+        value |= (uint32_t)(unsigned char)src[i] << (i * BITS_PER_BYTE);
+    }
+    return value;
+}
+
+/*
+    Reads a little-endian 64-bit number
+
+    @param
+    src: The 8 bytes
+
+    @return
+    The number
+ */
+static uint64_t decode_u64(const char *src)
+{
+    uint64_t value = 0;
+
+    for(size_t i = 0; i < U64_SIZE; i++)
+    {
+        value |= (uint64_t)(unsigned char)src[i] << (i * BITS_PER_BYTE);
+    }
+    return value;
+}
+
+/*
+    Milliseconds on the monotonic clock
+
+    @return
+    The time
+ */
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * MS_PER_SEC + ts.tv_nsec / NS_PER_MS;
+}
+
+/*
+    Starts timing an export or import
+
+    @param
+    progress: The progress
+    verb: What the summary says was done, e.g. "Exported"
+ */
+static void progress_start(struct snapshot_progress *progress, const char *verb)
+{
+    progress->verb       = verb;
+    progress->pairs      = 0;
+    progress->bytes      = 0;
+    progress->started_ms = monotonic_ms();
+    progress->shown_ms   = progress->started_ms;
+    progress->live       = isatty(STDERR_FILENO);
+}
+
+/*
+    Redraws the progress line now and then, when stderr is a terminal
+
+    @param
+    progress: The progress
+ */
+static void progress_update(struct snapshot_progress *progress)
+{
+    long long now;
+    double    seconds;
+
+    if(!progress->live || progress->pairs % PROGRESS_EVERY != 0)
+    {
+        return;
+    }
+    now = monotonic_ms();
+    if(now - progress->shown_ms < PROGRESS_INTERVAL_MS)
+    {
+        return;
+    }
+    progress->shown_ms = now;
+    seconds            = (double)(now - progress->started_ms) / MS_PER_SEC;
+    fprintf(stderr, "\r%s %llu entries, %.1f MiB, %.1f MiB/s", progress->verb, (unsigned long long)progress->pairs, (double)progress->bytes / BYTES_PER_MIB, (double)progress->bytes / BYTES_PER_MIB / seconds);
+}
+
+/*
+    Prints the summary line on stderr, over the progress line if there is one
+
+    @param
+    progress: The progress
+    times: Time entries exported or imported
+ */
+static void progress_finish(const struct snapshot_progress *progress, uint64_t times)
+{
+    double seconds = (double)(monotonic_ms() - progress->started_ms) / MS_PER_SEC;
+
+    if(seconds <= 0)
+    {
+        seconds = 1.0 / MS_PER_SEC;
+    }
+    fprintf(stderr,
+            "%s%s %llu entries and %llu times, %.1f MiB in %.2f s (%.1f MiB/s)\n",
+            progress->live ? "\r" : "",
+            progress->verb,
+            (unsigned long long)progress->pairs,
+            (unsigned long long)times,
+            (double)progress->bytes / BYTES_PER_MIB,
+            seconds,
+            (double)progress->bytes / BYTES_PER_MIB / seconds);
+}
@@ -0,0 +1,923 @@
+#include "storage.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ndbm.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+typedef size_t datum_size;
+#else
+typedef int datum_size;
+#endif
+
+#define BASE_TEN 10
+#define DEFAULT_FSYNC_INTERVAL_MS 1000
+#define DEFAULT_SEGMENT_SIZE ((size_t)16 * 1024 * 1024)
+#define DEFAULT_COMPACT_SEGMENTS 4
+#define MIN_SEGMENT_SIZE 4096
+#define SPEC_SEPARATOR ','
+#define OPTION_LEN 64
+#define DB_NAME_LEN 256
+#define NDBM_LOCK_SUFFIX ".lock"
+#define NDBM_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+/*
+    An open ndbm store. gdbm reads its header when the files are opened, so writers in
+    different workers take turns: each holds an flock on <path>.lock from open to close.
+ */
+struct ndbm_state
+{
+    DBM *db;
+    int  lock_fd;    // -1 when opened read-only
+};
+
+/*
+    Hides the counter from storage_each callers
+ */
+struct visit_filter
+{
+    storage_visit visit;
+    void         *arg;
+};
+
+static int         parse_option(const char *option, size_t len, struct storage_config *config);
+static int         skip_counter(const void *key, size_t key_len, const void *value, size_t value_len, void *arg);
+static int         ndbm_open(struct storage *store, const char *path, int writable);
+static void        ndbm_close(struct storage *store);
+static const void *ndbm_fetch(struct storage *store, const void *key, size_t key_len, size_t *value_len);
+static int         ndbm_append(struct storage *store, const void *value, size_t value_len, char *key_out, size_t key_size);
+static int         ndbm_append_batch(struct storage *store, storage_value_source next, void *arg, unsigned long *first, unsigned long *count);
+static int         ndbm_store_pair(DBM *db, const char *key, const void *value, size_t value_len);
+static void        ndbm_counter(struct storage *store, unsigned long *counter);
+static void        ndbm_unlock(struct ndbm_state *state);
+static int         ndbm_each(struct storage *store, storage_visit visit, void *arg);
+static int         ndbm_range(struct storage *store, unsigned long first, unsigned long last, storage_visit visit, void *arg);
+static int         ndbm_load(struct storage *store, storage_source next, void *arg);
+static int         ndbm_destroy(const char *path);
+static int         ndbm_move(const char *from, const char *to);
+static int         file_name(char *name, size_t size, const char *path, const char *suffix);
+
+// The files dbm_open makes of a base name
+#ifdef __APPLE__
+static const char *const ndbm_suffixes[] = {".db"};
+#else
+static const char *const ndbm_suffixes[] = {".dir", ".pag"};
+#endif
+
+const struct storage_ops ndbm_storage_ops = {
+    "ndbm", 0, ndbm_open, ndbm_close, ndbm_fetch, ndbm_append, ndbm_append_batch, ndbm_each, ndbm_range, ndbm_load, ndbm_destroy, ndbm_move, NULL,
+};
+
+/*
+    Parses a backend spec: "ndbm", or "log" optionally followed by comma separated settings
+    fsync=none|always|<milliseconds>, segment=<bytes> and compact=<sealed segments, 0 for never>
+
+    @param
+    spec: The spec
+    config: Filled in with the backend and its settings
+
+    @return
+    0: The spec is valid
+    -1: Unknown backend or setting
+ */
+int storage_parse(const char *spec, struct storage_config *config)
+{
+    const char *comma = strchr(spec, SPEC_SEPARATOR);
+    size_t      len   = comma != NULL ? (size_t)(comma - spec) : strlen(spec);
+
+    config->fsync             = STORAGE_FSYNC_INTERVAL;
+    config->fsync_interval_ms = DEFAULT_FSYNC_INTERVAL_MS;
+    config->segment_size      = DEFAULT_SEGMENT_SIZE;
+    config->compact_segments  = DEFAULT_COMPACT_SEGMENTS;
+
+    if(len == strlen(ndbm_storage_ops.name) && strncmp(spec, ndbm_storage_ops.name, len) == 0)
+    {
+        config->ops = &ndbm_storage_ops;
+        return comma == NULL ? 0 : -1;    // ndbm has nothing to tune
+    }
+    if(len != strlen(log_storage_ops.name) || strncmp(spec, log_storage_ops.name, len) != 0)
+    {
+        return -1;
+    }
+
+    config->ops = &log_storage_ops;
+    while(comma != NULL)
+    {
+        const char *option = comma + 1;
+
+        comma = strchr(option, SPEC_SEPARATOR);
+        len   = comma != NULL ? (size_t)(comma - option) : strlen(option);
+        if(parse_option(option, len, config) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Parses one name=value setting of a log spec
+
+    @param
+    option: Start of the setting
+    len: Length of the setting
+    config: The settings to update
+
+    @return
+    0: The setting was applied
+    -1: Unknown setting or bad value
+ */
+static int parse_option(const char *option, size_t len, struct storage_config *config)
+{
+    char      name[OPTION_LEN];
+    char     *value;
+    char     *end;
+    long long number;
+
+    if(len >= sizeof(name))
+    {
+        return -1;
+    }
+    memcpy(name, option, len);
+    name[len] = '\0';
+
+    value = strchr(name, '=');
+    if(value == NULL)
+    {
+        return -1;
+    }
+    *value++ = '\0';
+
+    if(strcmp(name, "fsync") == 0 && strcmp(value, "none") == 0)
+    {
+        config->fsync = STORAGE_FSYNC_NONE;
+        return 0;
+    }
+    if(strcmp(name, "fsync") == 0 && strcmp(value, "always") == 0)
+    {
+        config->fsync = STORAGE_FSYNC_ALWAYS;
+        return 0;
+    }
+
+    errno  = 0;
+    number = strtoll(value, &end, BASE_TEN);
+    if(errno != 0 || end == value || *end != '\0' || number < 0 || number > INT32_MAX)
+    {
+        return -1;
+    }
+
+    if(strcmp(name, "fsync") == 0 && number > 0)
+    {
+        config->fsync             = STORAGE_FSYNC_INTERVAL;
+        config->fsync_interval_ms = (int)number;
+        return 0;
+    }
+    if(strcmp(name, "segment") == 0 && number >= MIN_SEGMENT_SIZE)
+    {
+        config->segment_size = (size_t)number;
+        return 0;
+    }
+    if(strcmp(name, "compact") == 0 && number != 1)    // Compacting a single segment frees nothing
+    {
+        config->compact_segments = (int)number;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+    Opens a store with the backend a spec was parsed into
+
+    @param
+    store: The store to open
+    config: Backend and settings from storage_parse
+    path: Base name of the store, the backend derives its file names from it
+    writable: 1 to create the store if needed and append to it, 0 to read it
+
+    @return
+    0: The store is open
+    -1: It could not be opened, errno is set
+ */
+int storage_open(struct storage *store, const struct storage_config *config, const char *path, int writable)
+{
+    store->ops    = config->ops;
+    store->config = *config;
+    store->state  = NULL;
+    if(store->ops->open(store, path, writable) != 0)
+    {
+        return -1;
+    }
+    if(time_index_open(&store->times, path, writable) != 0)
+    {
+        storage_close(store);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Closes a store, flushing whatever the backend still buffers
+
+    @param
+    store: The store
+ */
+void storage_close(struct storage *store)
+{
+    if(store->state != NULL)
+    {
+        store->ops->close(store);
+        time_index_close(&store->times);
+    }
+    store->state = NULL;
+}
+
+/*
+    Makes a store opened before a fork safe to use in the child, with the index it built
+    kept. Only a backend that may stay open in several processes can be carried over.
+
+    @param
+    store: The store, open or not
+
+    @return
+    0: The child can use the store
+    -1: Its files could not be reopened, the store is closed
+ */
+int storage_after_fork(struct storage *store)
+{
+    if(store->state == NULL)
+    {
+        return 0;
+    }
+    if(!store->ops->keep_open || (store->ops->after_fork != NULL && store->ops->after_fork(store) != 0) || time_index_after_fork(&store->times) != 0)
+    {
+        storage_close(store);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Looks up a NUL-terminated key
+
+    @param
+    store: The store
+    key: The key
+    value_len: Set to the length of the value
+
+    @return
+    The value, valid until the next call on the store, or NULL if the key is not stored
+ */
+const void *storage_fetch(struct storage *store, const char *key, size_t *value_len)
+{
+    return store->ops->fetch(store, key, strlen(key) + 1, value_len);
+}
+
+/*
+    Stores a NUL-terminated value under the next counter key, advances the counter and
+    records the time in the time index
+
+    @param
+    store: A store opened writable
+    value: The value
+    key_out: Set to the key the value was stored under
+    key_size: Size of key_out
+
+    @return
+    0: The value is stored
+    -1: It could not be stored
+ */
+int storage_append(struct storage *store, const char *value, char *key_out, size_t key_size)
+{
+    if(store->ops->append(store, value, strlen(value) + 1, key_out, key_size) != 0)
+    {
+        return -1;
+    }
+    if(time_index_append(&store->times, strtoull(key_out, NULL, BASE_TEN), 1) != 0)
+    {
+        perror("time_index_append");    // The value is stored, only --since/--until and -f miss it
+    }
+    return 0;
+}
+
+/*
+    Stores values under consecutive counter keys as one unit: the backend holds its lock
+    for the whole batch and stores the counter last, so no other append lands inside the
+    range and a batch that fails part way leaves the counter where it was. Values are
+    stored as given, callers that want them NUL-terminated include the NUL.
+
+    @param
+    store: A store opened writable
+    next: Called for each value until it returns 0
+    arg: Passed to next
+    first: Set to the key of the first value
+    count: Set to the number of values stored
+
+    @return
+    0: Every value is stored, or there were none
+    -1: next failed or a value could not be stored, the counter is unchanged
+ */
+int storage_append_batch(struct storage *store, storage_value_source next, void *arg, unsigned long *first, unsigned long *count)
+{
+    *count = 0;
+    if(store->ops->append_batch(store, next, arg, first, count) != 0)
+    {
+        return -1;
+    }
+    if(*count > 0 && time_index_append(&store->times, *first, *count) != 0)
+    {
+        perror("time_index_append");
+    }
+    return 0;
+}
+
+/*
+    Calls visit for every stored value, leaving out the counter
+
+    @param
+    store: The store
+    visit: Called with each key and value, a nonzero return stops the walk
+    arg: Passed to visit
+
+    @return
+    0: Every value was visited or visit stopped the walk
+    -1: The store could not be read
+ */
+int storage_each(struct storage *store, storage_visit visit, void *arg)
+{
+    struct visit_filter filter;
+
+    filter.visit = visit;
+    filter.arg   = arg;
+    return store->ops->each(store, skip_counter, &filter);
+}
+
+/*
+    Calls visit for the values stored under counter keys first to last, in the order they
+    were appended. Keys past the counter are not looked for.
+
+    @param
+    store: The store
+    first: First key
+    last: Last key, ULONG_MAX for no limit
+    visit: Called with each key and value, a nonzero return stops the walk
+    arg: Passed to visit
+
+    @return
+    0: Every value in the range was visited or visit stopped the walk
+    -1: The store could not be read
+ */
+int storage_range(struct storage *store, unsigned long first, unsigned long last, storage_visit visit, void *arg)
+{
+    if(first > last)
+    {
+        return 0;
+    }
+    return store->ops->range(store, first, last, visit, arg);
+}
+
+/*
+    Stores pairs under their own keys, replacing what the keys held. Meant for filling a
+    new store from a copy of another, so the counter is stored like any other key and
+    the time index is left alone.
+
+    @param
+    store: A store opened writable
+    next: Called for each pair until it returns 0
+    arg: Passed to next
+
+    @return
+    0: Every pair is stored
+    -1: next failed or a pair could not be stored
+ */
+int storage_load(struct storage *store, storage_source next, void *arg)
+{
+    return store->ops->load(store, next, arg);
+}
+
+/*
+    Deletes a store and its time index. A store that does not exist is not an error.
+
+    @param
+    config: Backend of the store
+    path: Base name of the store
+
+    @return
+    0: Nothing of the store is left
+    -1: Something could not be deleted
+ */
+int storage_destroy(const struct storage_config *config, const char *path)
+{
+    char times[TIME_INDEX_PATH_LEN];
+
+    if(file_name(times, sizeof(times), path, TIME_INDEX_SUFFIX) != 0 || config->ops->destroy(path) != 0)
+    {
+        return -1;
+    }
+    return unlink(times) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+/*
+    Moves a store and its time index to another base name, replacing any store there.
+    Nothing may have the store open.
+
+    @param
+    config: Backend of the store
+    from: Base name the store has now
+    to: Base name it gets
+
+    @return
+    0: Moved
+    -1: It could not be moved
+ */
+int storage_move(const struct storage_config *config, const char *from, const char *to)
+{
+    char from_times[TIME_INDEX_PATH_LEN];
+    char to_times[TIME_INDEX_PATH_LEN];
+
+    if(file_name(from_times, sizeof(from_times), from, TIME_INDEX_SUFFIX) != 0 || file_name(to_times, sizeof(to_times), to, TIME_INDEX_SUFFIX) != 0)
+    {
+        return -1;
+    }
+    if(config->ops->move(from, to) != 0)
+    {
+        return -1;
+    }
+    if(rename(from_times, to_times) == 0)
+    {
+        return 0;
+    }
+    return errno == ENOENT && (unlink(to_times) == 0 || errno == ENOENT) ? 0 : -1;    // No times to move, drop the old ones
+}
+
+/*
+    Builds a file name from a base name and a suffix
+
+    @param
+    name: Where to put it
+    size: Size of name
+    path: The base name
+    suffix: The suffix
+
+    @return
+    0: Built
+    -1: It does not fit, errno is ENAMETOOLONG
+ */
+static int file_name(char *name, size_t size, const char *path, const char *suffix)
+{
+    if((size_t)snprintf(name, size, "%s%s", path, suffix) >= size)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Passes everything but the counter on to the caller of storage_each
+
+    @param
+    key: The key
+    key_len: Length of the key
+    value: The value
+    value_len: Length of the value
+    arg: The visit_filter
+
+    @return
+    What the caller's visit returned
+ */
+static int skip_counter(const void *key, size_t key_len, const void *value, size_t value_len, void *arg)
+{
+    const struct visit_filter *filter = (const struct visit_filter *)arg;
+
+    if(key_len == sizeof(STORAGE_COUNTER_KEY) && memcmp(key, STORAGE_COUNTER_KEY, key_len) == 0)
+    {
+        return 0;
+    }
+    return filter->visit(key, key_len, value, value_len, filter->arg);
+}
+
+/*
+    Opens the ndbm files. gdbm locks them while they are open, so the server opens and
+    closes them around every request.
+
+    @param
+    store: The store
+    path: Base name of the .dir/.pag files
+    writable: 1 to open for writing, creating the files if needed
+
+    @return
+    0: Open
+    -1: dbm_open failed
+ */
+static int ndbm_open(struct storage *store, const char *path, int writable)
+{
+    struct ndbm_state *state;
+    char               name[DB_NAME_LEN];
+    char               lock_name[DB_NAME_LEN];
+
+    if((size_t)snprintf(name, sizeof(name), "%s", path) >= sizeof(name) || file_name(lock_name, sizeof(lock_name), path, NDBM_LOCK_SUFFIX) != 0)    // dbm_open takes a non-const name
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    state = (struct ndbm_state *)malloc(sizeof(*state));
+    if(state == NULL)
+    {
+        return -1;
+    }
+
+    state->lock_fd = -1;
+    if(writable)
+    {
+        state->lock_fd = open(lock_name, O_RDWR | O_CREAT | O_CLOEXEC, NDBM_MODE);
+        if(state->lock_fd < 0 || flock(state->lock_fd, LOCK_EX) != 0)
+        {
+            ndbm_unlock(state);
+            return -1;
+        }
+    }
+    state->db = dbm_open(name, writable ? O_RDWR | O_CREAT : O_RDONLY, NDBM_MODE);
+    if(state->db == NULL)
+    {
+        ndbm_unlock(state);
+        return -1;
+    }
+    store->state = state;
+    return 0;
+}
+
+/*
+    Closes the ndbm files, then lets the next writer in
+
+    @param
+    store: The store
+ */
+static void ndbm_close(struct storage *store)
+{
+    struct ndbm_state *state = (struct ndbm_state *)store->state;
+
+    dbm_close(state->db);
+    ndbm_unlock(state);
+}
+
+/*
+    Closes the lock file, which drops the lock, and frees the state
+
+    @param
+    state: The state, its files already closed
+ */
+static void ndbm_unlock(struct ndbm_state *state)
+{
+    int saved_errno = errno;
+
+    if(state->lock_fd >= 0)
+    {
+        close(state->lock_fd);
+    }
+    free(state);
+    errno = saved_errno;
+}
+
+/*
+    Looks up a key with dbm_fetch
+
+    @param
+    store: The store
+    key: The key
+    key_len: Length of the key
+    value_len: Set to the length of the value
+
+    @return
+    The value, or NULL if the key is not stored
+ */
+static const void *ndbm_fetch(struct storage *store, const void *key, size_t key_len, size_t *value_len)
+{
+    datum key_datum;
+    datum value;
+
+    key_datum.dptr  = (char *)(uintptr_t)key;    // ndbm's datum is not const, dbm_fetch only reads the key
+    key_datum.dsize = (datum_size)key_len;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+    value = dbm_fetch(((struct ndbm_state *)store->state)->db, key_datum);
+#pragma GCC diagnostic pop
+
+    *value_len = (size_t)value.dsize;
+    return value.dptr;
+}
+
+/*
+    Stores a value under the key held in the counter, then stores the incremented counter
+
+    @param
+    store: The store
+    value: The value
+    value_len: Length of the value
+    key_out: Set to the key the value was stored under
+    key_size: Size of key_out
+
+    @return
+    0: The value is stored
+    -1: dbm_store failed
+ */
+static int ndbm_append(struct storage *store, const void *value, size_t value_len, char *key_out, size_t key_size)
+{
+    DBM          *db = ((struct ndbm_state *)store->state)->db;
+    char          counter_buf[STORAGE_KEY_LEN];
+    unsigned long counter;
+    int           result;
+
+    ndbm_counter(store, &counter);
+    snprintf(key_out, key_size, "%lu", counter);
+    snprintf(counter_buf, sizeof(counter_buf), "%lu", counter + 1);
+    result = ndbm_store_pair(db, key_out, value, value_len);
+    if(result == 0)
+    {
+        ndbm_store_pair(db, STORAGE_COUNTER_KEY, counter_buf, strlen(counter_buf) + 1);
+    }
+    return result;
+}
+
+/*
+    Stores values under the keys from the counter on, then stores the counter past them.
+    The writer lock taken by ndbm_open keeps other appends out meanwhile. A batch that
+    fails partway is deleted again, so none of it is kept.
+
+    @param
+    store: The store
+    next: Hands out the values
+    arg: Passed to next
+    first: Set to the key of the first value
+    count: Set to the number of values stored
+
+    @return
+    0: Every value is stored
+    -1: next or dbm_store failed, nothing is stored
+ */
+static int ndbm_append_batch(struct storage *store, storage_value_source next, void *arg, unsigned long *first, unsigned long *count)
+{
+    DBM          *db = ((struct ndbm_state *)store->state)->db;
+    char          key[STORAGE_KEY_LEN];
+    const void   *value;
+    size_t        value_len;
+    unsigned long stored = 0;
+    int           more   = 0;
+    int           result = 0;
+
+    ndbm_counter(store, first);
+    while(result == 0 && (more = next(&value, &value_len, arg)) > 0)
+    {
+        snprintf(key, sizeof(key), "%lu", *first + stored);
+        result = ndbm_store_pair(db, key, value, value_len);
+        stored += result == 0 ? 1 : 0;
+    }
+    if(result == 0 && more < 0)
+    {
+        result = -1;
+    }
+    if(result == 0 && stored > 0)
+    {
+        snprintf(key, sizeof(key), "%lu", *first + stored);
+        result = ndbm_store_pair(db, STORAGE_COUNTER_KEY, key, strlen(key) + 1);
+    }
+    for(unsigned long i = 0; result != 0 && i < stored; i++)
+    {
+        datum key_datum;
+
+        snprintf(key, sizeof(key), "%lu", *first + i);
+        key_datum.dptr  = key;
+        key_datum.dsize = (datum_size)strlen(key) + 1;
+        dbm_delete(db, key_datum);
+    }
+    *count = result == 0 ? stored : 0;
+    return result;
+}
+
+/*
+    Stores one pair with dbm_store under a NUL-terminated key
+
+    @param
+    db: The open files
+    key: The key
+    value: The value
+    value_len: Length of the value
+
+    @return
+    0: Stored
+    -1: dbm_store failed
+ */
+static int ndbm_store_pair(DBM *db, const char *key, const void *value, size_t value_len)
+{
+    datum key_datum;
+    datum value_datum;
+
+    key_datum.dptr    = (char *)(uintptr_t)key;
+    key_datum.dsize   = (datum_size)strlen(key) + 1;
+    value_datum.dptr  = (char *)(uintptr_t)value;
+    value_datum.dsize = (datum_size)value_len;
+    return dbm_store(db, key_datum, value_datum, DBM_REPLACE) == 0 ? 0 : -1;
+}
+
+/*
+    Reads the key the next appended value gets
+
+    @param
+    store: The store
+    counter: Set to the counter, 0 when it is missing or not a number
+ */
+static void ndbm_counter(struct storage *store, unsigned long *counter)
+{
+    const char *counter_val;
+    size_t      counter_len;
+    char       *endptr = NULL;
+
+    *counter    = 0;
+    counter_val = (const char *)ndbm_fetch(store, STORAGE_COUNTER_KEY, sizeof(STORAGE_COUNTER_KEY), &counter_len);
+    if(counter_val == NULL)
+    {
+        return;
+    }
+    *counter = strtoul(counter_val, &endptr, BASE_TEN);
+    if(endptr == counter_val || *endptr != '\0')
+    {
+        fprintf(stderr, "Invalid counter value in DB: %s\n", counter_val);
+        *counter = 0;
+    }
+}
+
+/*
+    Walks the ndbm files in hash order
+
+    @param
+    store: The store
+    visit: Called with each key and value
+    arg: Passed to visit
+
+    @return
+    0: The walk finished or was stopped by visit
+ */
+static int ndbm_each(struct storage *store, storage_visit visit, void *arg)
+{
+    DBM  *db = ((struct ndbm_state *)store->state)->db;
+    datum key;
+    datum value;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+    for(key = dbm_firstkey(db); key.dptr != NULL; key = dbm_nextkey(db))
+    {
+        value = dbm_fetch(db, key);
+        if(value.dptr != NULL && visit(key.dptr, (size_t)key.dsize, value.dptr, (size_t)value.dsize, arg) != 0)
+        {
+            break;
+        }
+    }
+#pragma GCC diagnostic pop
+    return 0;
+}
+
+/*
+    Fetches counter keys one by one, since ndbm hands its keys out in hash order
+
+    @param
+    store: The store
+    first: First key
+    last: Last key
+    visit: Called with each key and value
+    arg: Passed to visit
+
+    @return
+    0: The walk finished or was stopped by visit
+ */
+static int ndbm_range(struct storage *store, unsigned long first, unsigned long last, storage_visit visit, void *arg)
+{
+    char          key[STORAGE_KEY_LEN];
+    const char   *counter_val;
+    const void   *value;
+    size_t        value_len;
+    unsigned long counter;
+
+    counter_val = (const char *)ndbm_fetch(store, STORAGE_COUNTER_KEY, sizeof(STORAGE_COUNTER_KEY), &value_len);
+    if(counter_val == NULL)
+    {
+        return 0;
+    }
+    counter = strtoul(counter_val, NULL, BASE_TEN);
+    if(counter == 0 || first >= counter)
+    {
+        return 0;
+    }
+    if(last > counter - 1)
+    {
+        last = counter - 1;
+    }
+
+    for(unsigned long k = first; k <= last; k++)
+    {
+        size_t key_len = (size_t)snprintf(key, sizeof(key), "%lu", k) + 1;
+
+        value = ndbm_fetch(store, key, key_len, &value_len);
+        if(value != NULL && visit(key, key_len, value, value_len, arg) != 0)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+    Stores each pair with dbm_store
+
+    @param
+    store: The store
+    next: Hands out the pairs
+    arg: Passed to next
+
+    @return
+    0: Every pair is stored
+    -1: next or dbm_store failed
+ */
+static int ndbm_load(struct storage *store, storage_source next, void *arg)
+{
+    DBM        *db = ((struct ndbm_state *)store->state)->db;
+    const void *key;
+    const void *value;
+    size_t      key_len;
+    size_t      value_len;
+    int         more;
+
+    while((more = next(&key, &key_len, &value, &value_len, arg)) > 0)
+    {
+        datum key_datum;
+        datum value_datum;
+
+        key_datum.dptr    = (char *)(uintptr_t)key;
+        key_datum.dsize   = (datum_size)key_len;
+        value_datum.dptr  = (char *)(uintptr_t)value;
+        value_datum.dsize = (datum_size)value_len;
+        if(dbm_store(db, key_datum, value_datum, DBM_REPLACE) != 0)
+        {
+            return -1;
+        }
+    }
+    return more;
+}
+
+/*
+    Deletes the files dbm_open made and the writer lock file
+
+    @param
+    path: Base name of the files
+
+    @return
+    0: None of the files is left
+    -1: One could not be deleted
+ */
+static int ndbm_destroy(const char *path)
+{
+    char name[DB_NAME_LEN];
+
+    for(size_t i = 0; i < sizeof(ndbm_suffixes) / sizeof(ndbm_suffixes[0]); i++)
+    {
+        if(file_name(name, sizeof(name), path, ndbm_suffixes[i]) != 0 || (unlink(name) != 0 && errno != ENOENT))
+        {
+            return -1;
+        }
+    }
+    return file_name(name, sizeof(name), path, NDBM_LOCK_SUFFIX) != 0 || (unlink(name) != 0 && errno != ENOENT) ? -1 : 0;
+}
+
+/*
+    Renames the files dbm_open made over the ones at the new base name. The lock files
+    stay where they are, so writers waiting on the new name still take turns with the
+    ones that hold it.
+
+    @param
+    from: Base name the files have now
+    to: Base name they get
+
+    @return
+    0: Both were renamed
+    -1: One could not be renamed
+ */
+static int ndbm_move(const char *from, const char *to)
+{
+    char from_name[DB_NAME_LEN];
+    char to_name[DB_NAME_LEN];
+
+    for(size_t i = 0; i < sizeof(ndbm_suffixes) / sizeof(ndbm_suffixes[0]); i++)
+    {
+        if(file_name(from_name, sizeof(from_name), from, ndbm_suffixes[i]) != 0 || file_name(to_name, sizeof(to_name), to, ndbm_suffixes[i]) != 0 || rename(from_name, to_name) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,325 @@
+#include "time_index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MS_PER_SEC 1000
+#define NS_PER_MS 1000000
+#define TIME_INDEX_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+#define APPEND_CHUNK 256    // Entries of a batch written per write
+
+static int reopen(struct time_index *index);
+static int read_entry(const struct time_index *index, size_t position, struct time_entry *entry);
+static int write_entries(int fd, const struct time_entry *entries, size_t count);
+
+/*
+    Opens the time index of a store
+
+    @param
+    index: The index
+    path: Base name of the store, the index is <path>.time
+    writable: 1 to create the file if needed and append to it
+
+    @return
+    0: Open, or read-only and not created yet
+    -1: The file could not be opened
+ */
+int time_index_open(struct time_index *index, const char *path, int writable)
+{
+    index->fd       = -1;
+    index->writable = writable;
+    if((size_t)snprintf(index->path, sizeof(index->path), "%s" TIME_INDEX_SUFFIX, path) >= sizeof(index->path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return reopen(index) == 0 || !writable ? 0 : -1;
+}
+
+/*
+    Closes the index
+
+    @param
+    index: The index
+ */
+void time_index_close(struct time_index *index)
+{
+    if(index->fd >= 0)
+    {
+        close(index->fd);
+    }
+    index->fd = -1;
+}
+
+/*
+    Gives a process forked with the index open a descriptor of its own, since the flock
+    that keeps appends in order is held by the open file and a shared one excludes nobody
+
+    @param
+    index: The index
+
+    @return
+    0: Reopened, or never opened
+    -1: The file could not be opened
+ */
+int time_index_after_fork(struct time_index *index)
+{
+    if(index->fd < 0)
+    {
+        return 0;
+    }
+    close(index->fd);
+    return reopen(index);
+}
+
+/*
+    Records that keys were just stored, all at the same time. The clock is read under the
+    lock and never goes below the last entry, which keeps the file sorted across workers.
+
+    @param
+    index: An index opened writable
+    key: The first counter key stored
+    count: How many keys from key on were stored, 1 for a single append
+
+    @return
+    0: Recorded
+    -1: The file could not be locked or written
+ */
+int time_index_append(struct time_index *index, uint64_t key, size_t count)
+{
+    struct time_entry entries[APPEND_CHUNK];
+    struct time_entry last;
+    struct stat       st;
+    int64_t           now;
+    int               result = 0;
+
+    if(index->fd < 0 && reopen(index) != 0)
+    {
+        return -1;
+    }
+    if(flock(index->fd, LOCK_EX) != 0)
+    {
+        return -1;
+    }
+
+    now = time_index_now_ms();
+    if(fstat(index->fd, &st) == 0 && st.st_size >= (off_t)sizeof(last) && read_entry(index, (size_t)st.st_size / sizeof(last) - 1, &last) == 0 && last.time_ms > now)
+    {
+        now = last.time_ms;
+    }
+
+    for(size_t done = 0; done < count && result == 0;)
+    {
+        size_t chunk = count - done < APPEND_CHUNK ? count - done : APPEND_CHUNK;
+
+        for(size_t i = 0; i < chunk; i++)
+        {
+            entries[i].time_ms = now;
+            entries[i].key     = key + done + i;
+        }
+        result = write_entries(index->fd, entries, chunk);
+        done += chunk;
+    }
+    flock(index->fd, LOCK_UN);
+    return result;
+}
+
+/*
+    Appends entries that already carry their times, as when a store is rebuilt from a
+    snapshot. The caller keeps them sorted.
+
+    @param
+    index: An index opened writable
+    entries: The entries
+    count: Number of entries
+
+    @return
+    0: Written
+    -1: The file could not be locked or written
+ */
+int time_index_write(struct time_index *index, const struct time_entry *entries, size_t count)
+{
+    int result;
+
+    if(index->fd < 0 && reopen(index) != 0)
+    {
+        return -1;
+    }
+    if(flock(index->fd, LOCK_EX) != 0)
+    {
+        return -1;
+    }
+    result = write_entries(index->fd, entries, count);
+    flock(index->fd, LOCK_UN);
+    return result;
+}
+
+/*
+    Counts the entries, picking up the file if it was created since the index was opened
+
+    @param
+    index: The index
+
+    @return
+    Number of complete entries
+ */
+size_t time_index_count(struct time_index *index)
+{
+    struct stat st;
+
+    if(index->fd < 0 && reopen(index) != 0)
+    {
+        return 0;
+    }
+    if(fstat(index->fd, &st) != 0)
+    {
+        return 0;
+    }
+    return (size_t)st.st_size / sizeof(struct time_entry);
+}
+
+/*
+    Reads consecutive entries
+
+    @param
+    index: The index
+    position: First entry to read
+    entries: Where to put them
+    count: Most entries to read
+
+    @return
+    Number of entries read
+ */
+size_t time_index_read(struct time_index *index, size_t position, struct time_entry *entries, size_t count)
+{
+    ssize_t n;
+
+    if(index->fd < 0)
+    {
+        return 0;
+    }
+    n = pread(index->fd, entries, count * sizeof(struct time_entry), (off_t)(position * sizeof(struct time_entry)));
+    return n > 0 ? (size_t)n / sizeof(struct time_entry) : 0;
+}
+
+/*
+    Binary searches for the first entry at or after a time
+
+    @param
+    index: The index
+    time_ms: The time
+
+    @return
+    Position of the entry, time_index_count if every entry is older
+ */
+size_t time_index_lower_bound(struct time_index *index, int64_t time_ms)
+{
+    size_t            low  = 0;
+    size_t            high = time_index_count(index);
+    struct time_entry entry;
+
+    while(low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+
+        if(read_entry(index, middle, &entry) != 0)
+        {
+            return high;
+        }
+        if(entry.time_ms < time_ms)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/*
+    Wall clock time in milliseconds
+
+    @return
+    Milliseconds since the epoch
+ */
+int64_t time_index_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * MS_PER_SEC + ts.tv_nsec / NS_PER_MS;
+}
+
+/*
+    Opens the index file, creating it when the index is writable
+
+    @param
+    index: The index
+
+    @return
+    0: Open
+    -1: It does not exist yet, or could not be opened
+ */
+static int reopen(struct time_index *index)
+{
+    index->fd = open(index->path, index->writable ? O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, TIME_INDEX_MODE);
+    return index->fd >= 0 ? 0 : -1;
+}
+
+/*
+    Reads one entry
+
+    @param
+    index: The index
+    position: The entry
+    entry: Where to put it
+
+    @return
+    0: Read
+    -1: It is not there
+ */
+static int read_entry(const struct time_index *index, size_t position, struct time_entry *entry)
+{
+    return pread(index->fd, entry, sizeof(*entry), (off_t)(position * sizeof(*entry))) == (ssize_t)sizeof(*entry) ? 0 : -1;
+}
+
+/*
+    Writes whole entries, retrying short writes
+
+    @param
+    fd: The index file
+    entries: The entries
+    count: Number of entries
+
+    @return
+    0: Written
+    -1: write failed
+ */
+static int write_entries(int fd, const struct time_entry *entries, size_t count)
+{
+    const char *data = (const char *)entries;
+    size_t      len  = count * sizeof(struct time_entry);
+
+    while(len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
@@ -0,0 +1,332 @@
+#include "timer_wheel.h"
+#include <time.h>
+
+#define TIMER_SLOT_MASK ((uint64_t)TIMER_SLOTS - 1)
+#define MS_PER_SEC 1000
+#define NS_PER_MS 1000000
+
+static void list_init(struct timer *head);
+static void list_append(struct timer *head, struct timer *timer);
+static void list_unlink(struct timer *timer);
+static void place(struct timer_wheel *wheel, struct timer *timer);
+static void cascade(struct timer_wheel *wheel, int level);
+static void tick(struct timer_wheel *wheel);
+
+/*
+    Reads the monotonic clock
+
+    @return
+    Milliseconds since an arbitrary point that does not move with the wall clock
+ */
+uint64_t timer_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MS_PER_SEC + (uint64_t)ts.tv_nsec / NS_PER_MS;
+}
+
+/*
+    Sets up an empty wheel
+
+    @param
+    wheel: The wheel
+    now_ms: Current time from timer_now_ms
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms)
+{
+    for(int level = 0; level < TIMER_LEVELS; level++)
+    {
+        for(int slot = 0; slot < TIMER_SLOTS; slot++)
+        {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    list_init(&wheel->expired);
+    wheel->now   = now_ms / TIMER_TICK_MS;
+    wheel->count = 0;
+}
+
+/*
+    Prepares a timer that is not on any wheel yet
+
+    @param
+    timer: The timer
+    kind: What the owner does when it fires
+    data: The owner
+ */
+void timer_init(struct timer *timer, int kind, void *data)
+{
+    timer->prev    = NULL;
+    timer->next    = NULL;
+    timer->expires = 0;
+    timer->kind    = kind;
+    timer->data    = data;
+}
+
+/*
+    Starts a timer, restarting it if it is already pending
+
+    @param
+    wheel: The wheel
+    timer: The timer
+    now_ms: Current time from timer_now_ms
+    timeout_ms: Milliseconds until it fires, rounded up to the next tick
+ */
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t now_ms, uint64_t timeout_ms)
+{
+    timer_cancel(wheel, timer);
+
+    timer->expires = (now_ms + timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    place(wheel, timer);
+    wheel->count++;
+}
+
+/*
+    Stops a timer, doing nothing if it is not pending
+
+    @param
+    wheel: The wheel
+    timer: The timer
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+    if(!timer_pending(timer))
+    {
+        return;
+    }
+    list_unlink(timer);
+    wheel->count--;
+}
+
+/*
+    Tells whether a timer is on a wheel
+
+    @param
+    timer: The timer
+
+    @return
+    1 if the timer is pending or expired and not yet handed out, 0 otherwise
+ */
+int timer_pending(const struct timer *timer)
+{
+    return timer->next != NULL;
+}
+
+/*
+    Advances the wheel to the current time and hands out one expired timer.
+    Call it until it returns NULL; an expired timer is no longer pending and may be added again.
+
+    @param
+    wheel: The wheel
+    now_ms: Current time from timer_now_ms
+
+    @return
+    An expired timer, or NULL if none is due
+ */
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now_ms)
+{
+    uint64_t      target = now_ms / TIMER_TICK_MS;
+    struct timer *timer;
+
+    // Nothing can fire on an empty wheel, skip straight to the current tick
+    if(wheel->count == 0 && wheel->now < target)
+    {
+        wheel->now = target;
+    }
+
+    while(wheel->expired.next == &wheel->expired && wheel->now < target)
+    {
+        wheel->now++;
+        tick(wheel);
+    }
+
+    timer = wheel->expired.next;
+    if(timer == &wheel->expired)
+    {
+        return NULL;
+    }
+    list_unlink(timer);
+    wheel->count--;
+    return timer;
+}
+
+/*
+    Works out how long an event loop may sleep before timer_wheel_expire has work to do
+
+    @param
+    wheel: The wheel
+    now_ms: Current time from timer_now_ms
+
+    @return
+    Milliseconds to sleep, or -1 if no timer is pending
+ */
+int timer_wheel_timeout_ms(const struct timer_wheel *wheel, uint64_t now_ms)
+{
+    uint64_t next;
+    uint64_t due_ms;
+
+    if(wheel->count == 0)
+    {
+        return -1;
+    }
+    if(wheel->expired.next != &wheel->expired)
+    {
+        return 0;
+    }
+
+    // The first busy level 0 slot, or the next cascade if level 0 is empty
+    next = (wheel->now | TIMER_SLOT_MASK) + 1;
+    for(uint64_t t = wheel->now + 1; t < next; t++)
+    {
+        const struct timer *head = &wheel->slots[0][t & TIMER_SLOT_MASK];
+
+        if(head->next != head)
+        {
+            next = t;
+            break;
+        }
+    }
+
+    due_ms = next * TIMER_TICK_MS;
+    if(due_ms <= now_ms)
+    {
+        return 0;
+    }
+    return (int)(due_ms - now_ms);
+}
+
+/*
+    Makes a list head point at itself
+
+    @param
+    head: The list head
+ */
+static void list_init(struct timer *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+/*
+    Appends a timer to a list
+
+    @param
+    head: The list head
+    timer: The timer
+ */
+static void list_append(struct timer *head, struct timer *timer)
+{
+    timer->prev      = head->prev;
+    timer->next      = head;
+    head->prev->next = timer;
+    head->prev       = timer;
+}
+
+/*
+    Takes a timer off its list
+
+    @param
+    timer: The timer
+ */
+static void list_unlink(struct timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev       = NULL;
+    timer->next       = NULL;
+}
+
+/*
+    Puts a timer in the slot matching how far away it is
+
+    @param
+    wheel: The wheel
+    timer: The timer
+ */
+static void place(struct timer_wheel *wheel, struct timer *timer)
+{
+    uint64_t delta;
+    int      level = 0;
+
+    if(timer->expires <= wheel->now)
+    {
+        list_append(&wheel->expired, timer);
+        return;
+    }
+
+    delta = timer->expires - wheel->now;
+    while(level < TIMER_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMER_LEVEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    // Anything beyond the top level waits in its last slot and is placed again when that cascades
+    if(delta >= ((uint64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS)))
+    {
+        list_append(&wheel->slots[level][((wheel->now >> (TIMER_LEVEL_BITS * level)) - 1) & TIMER_SLOT_MASK], timer);
+        return;
+    }
+    list_append(&wheel->slots[level][(timer->expires >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK], timer);
+}
+
+/*
+    Moves the timers of the current slot of a level down to where they belong now
+
+    @param
+    wheel: The wheel
+    level: The level to cascade
+ */
+static void cascade(struct timer_wheel *wheel, int level)
+{
+    struct timer *head = &wheel->slots[level][(wheel->now >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK];
+    struct timer  pending;
+
+    // Detach the whole slot first, place may put a timer back on the same level
+    if(head->next == head)
+    {
+        return;
+    }
+    pending.next       = head->next;
+    pending.prev       = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+
+    while(pending.next != &pending)
+    {
+        struct timer *timer = pending.next;
+
+        list_unlink(timer);
+        place(wheel, timer);
+    }
+}
+
+/*
+    Processes one tick: cascades the higher levels that wrapped and moves the due timers to the expired list
+
+    @param
+    wheel: The wheel
+ */
+static void tick(struct timer_wheel *wheel)
+{
+    struct timer *head;
+
+    for(int level = 1; level < TIMER_LEVELS; level++)
+    {
+        if(((wheel->now >> (TIMER_LEVEL_BITS * (level - 1))) & TIMER_SLOT_MASK) != 0)
+        {
+            break;
+        }
+        cascade(wheel, level);
+    }
+
+    head = &wheel->slots[0][wheel->now & TIMER_SLOT_MASK];
+    while(head->next != head)
+    {
+        struct timer *timer = head->next;
+
+        list_unlink(timer);
+        list_append(&wheel->expired, timer);
+    }
+}
@@ -0,0 +1,697 @@
+#include "tls.h"
+#include "would_block.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SESSION_CACHE_SLOTS 1024    // Sessions kept for clients resuming by session ID, a power of two
+#define SESSION_DER_MAX 1024        // Larger encoded sessions are not cached
+#define SESSION_LIFETIME 7200       // Seconds a session or ticket can be resumed
+#define SESSION_ID_CONTEXT "webserver"
+#define CIPHER_SUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"    // The ones the kernel offloads first
+#define BRIDGE_BUFFER 16384                                                                           // Plaintext of one full TLS record
+#define ALPN_PROTOCOLS "\x02h2\x08http/1.1"                                                            // What ALPN may pick, in order of preference
+#define WAIT_STEP_MS 10
+#define MS_PER_SEC 1000
+#define NS_PER_MS 1000000L
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/*
+    One session in the shared cache. Its fields are written only while seq is odd, by the
+    worker that moved it there, so a reader that sees the same even seq before and after
+    copying them has a consistent session.
+ */
+struct shared_session
+{
+    uint32_t      seq;
+    uint32_t      id_len;     // 0 while the slot is empty
+    uint32_t      der_len;    // Bytes of the encoded session
+    int64_t       expires;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char der[SESSION_DER_MAX];
+};
+
+/*
+    The context every connection's SSL is made from
+ */
+struct tls_server
+{
+    SSL_CTX               *ctx;
+    struct shared_session *sessions;    // SESSION_CACHE_SLOTS in one MAP_SHARED mapping, indexed by a hash of the session ID
+};
+
+/*
+    A connection the kernel does not encrypt. Its thread moves plaintext between the SSL
+    and one end of a socket pair, and the rest of the server uses the other end as if it
+    were the client's socket, passing it around and sending files to it.
+ */
+struct bridge
+{
+    SSL   *ssl;
+    int    fd;              // The client's socket
+    int    plain;           // This side of the socket pair
+    int    client_open;     // The client may send more
+    int    client_alive;    // The client can still be written to
+    int    server_open;     // The server side of the pair may send more
+    size_t in_len;          // Decrypted request bytes in in
+    size_t in_off;          // Of which already passed on to the server
+    size_t out_len;         // Response bytes in out
+    size_t out_off;         // Of which already sent to the client
+    char   in[BRIDGE_BUFFER];
+    char   out[BRIDGE_BUFFER];
+};
+
+static int                    store_session(SSL *ssl, SSL_SESSION *session);
+static SSL_SESSION           *find_session(SSL *ssl, const unsigned char *id, int id_len, int *copy);
+static void                   remove_session(SSL_CTX *ctx, SSL_SESSION *session);
+static struct shared_session *session_slot(const SSL_CTX *ctx, const unsigned char *id, unsigned int id_len);
+static int                    select_protocol(SSL *ssl, const unsigned char **out, unsigned char *out_len, const unsigned char *in, unsigned int in_len, void *arg);
+static int                    prepare_socket(SSL *ssl, int fd, int timeout);
+static int                    offloaded(SSL *ssl);
+static int                    start_bridge(SSL *ssl, int fd);
+static void                  *run_bridge(void *arg);
+static int                    pump_in(struct bridge *bridge, short *client_events, short *plain_events);
+static int                    pump_out(struct bridge *bridge, short *client_events, short *plain_events);
+
+static int bridges = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables) Bridge threads running in this process
+
+/*
+    Loads the certificate and key and sets up session resumption
+
+    @param
+    cert: PEM file with the certificate, followed by its chain
+    key: PEM file with the private key
+
+    @return
+    The server, or NULL after printing why it could not be set up
+ */
+struct tls_server *tls_server_create(const char *cert, const char *key)
+{
+    struct tls_server *server = (struct tls_server *)calloc(1, sizeof(struct tls_server));
+
+    if(server == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    server->sessions = (struct shared_session *)mmap(NULL, sizeof(struct shared_session) * SESSION_CACHE_SLOTS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(server->sessions == MAP_FAILED)
+    {
+        perror("TLS session cache (mmap)");
+        free(server);
+        return NULL;
+    }
+
+    server->ctx = SSL_CTX_new(TLS_server_method());
+    if(server->ctx == NULL || SSL_CTX_set_min_proto_version(server->ctx, TLS1_2_VERSION) != 1 || SSL_CTX_set_ciphersuites(server->ctx, CIPHER_SUITES) != 1 ||
+       SSL_CTX_use_certificate_chain_file(server->ctx, cert) != 1 || SSL_CTX_use_PrivateKey_file(server->ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(server->ctx) != 1)
+    {
+        fprintf(stderr, "TLS setup failed: %s\n", ERR_reason_error_string(ERR_get_error()));
+        tls_server_destroy(server);
+        return NULL;
+    }
+
+    SSL_CTX_set_options(server->ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#if defined(SSL_OP_ENABLE_KTLS)
+    SSL_CTX_set_options(server->ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    SSL_CTX_set_mode(server->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // Tickets are sealed with keys made here, before the fork, so they are the same in every worker.
+    // Sessions resumed by ID live in the shared mapping instead of each worker's own cache for the same reason.
+    SSL_CTX_set_app_data(server->ctx, server);
+    SSL_CTX_set_session_cache_mode(server->ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(server->ctx, store_session);
+    SSL_CTX_sess_set_get_cb(server->ctx, find_session);
+    SSL_CTX_sess_set_remove_cb(server->ctx, remove_session);
+    SSL_CTX_set_timeout(server->ctx, SESSION_LIFETIME);
+    SSL_CTX_set_session_id_context(server->ctx, (const unsigned char *)SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+    SSL_CTX_set_alpn_select_cb(server->ctx, select_protocol, NULL);
+
+    // OpenSSL writes to the socket with plain write(), a client that went away must not kill the worker
+    signal(SIGPIPE, SIG_IGN);
+    return server;
+}
+
+/*
+    Frees the context, connections made from it keep their own reference
+
+    @param
+    server: The server, may be NULL
+ */
+void tls_server_destroy(struct tls_server *server)
+{
+    if(server == NULL)
+    {
+        return;
+    }
+    SSL_CTX_free(server->ctx);
+    munmap(server->sessions, sizeof(struct shared_session) * SESSION_CACHE_SLOTS);
+    free(server);
+}
+
+/*
+    Runs the handshake of a new connection. When the kernel took over the encryption in
+    both directions the socket itself carries plaintext from then on. Otherwise a bridge
+    thread of this process keeps the connection for the rest of its life and the caller
+    gets the other end of its socket pair.
+
+    @param
+    server: The server
+    fd: The client's socket, still the caller's to close
+    timeout: Seconds each read and write of the handshake may take, 0 for no limit
+
+    @return
+    A descriptor to read requests from and write responses to, or -1 with errno set to
+    EAGAIN if the client was too slow and to EPROTO if the handshake failed
+ */
+int tls_accept(struct tls_server *server, int fd, int timeout)
+{
+    SSL *ssl  = SSL_new(server->ctx);
+    int  own  = dup(fd);
+    int  done = -1;
+
+    if(ssl == NULL || own < 0 || prepare_socket(ssl, own, timeout) != 0)
+    {
+        SSL_free(ssl);
+        if(own >= 0)
+        {
+            close(own);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    if(SSL_accept(ssl) == 1 && prepare_socket(ssl, own, 0) == 0)
+    {
+        const unsigned char *protocol;
+        unsigned int         protocol_len;
+
+        SSL_get0_alpn_selected(ssl, &protocol, &protocol_len);
+        printf("%s handshake on fd %d: %s session, %s, %.*s, %s\n",
+               SSL_get_version(ssl),
+               fd,
+               SSL_session_reused(ssl) ? "resumed" : "new",
+               SSL_get_cipher_name(ssl),
+               protocol_len > 0 ? (int)protocol_len : (int)strlen("no ALPN"),
+               protocol_len > 0 ? (const char *)protocol : "no ALPN",
+               offloaded(ssl) ? "encrypted by the kernel" : "encrypted by a bridge thread");
+        if(offloaded(ssl))
+        {
+            // The keys are in the kernel, the SSL is no longer needed and sendfile() is encrypted as it goes
+            SSL_free(ssl);
+            return own;
+        }
+        done = start_bridge(ssl, own);
+        if(done >= 0)
+        {
+            return done;
+        }
+    }
+    else
+    {
+        int         saved  = errno;
+        const char *reason = ERR_reason_error_string(ERR_get_error());
+
+        fprintf(stderr, "TLS handshake on fd %d failed: %s\n", fd, reason != NULL ? reason : strerror(saved));
+        ERR_clear_error();
+        errno = would_block(saved) ? EAGAIN : EPROTO;
+    }
+    SSL_free(ssl);
+    close(own);
+    return done;
+}
+
+/*
+    Waits for the bridges of this process to finish, before a retiring worker exits
+
+    @param
+    timeout: Most seconds to wait
+ */
+void tls_wait(int timeout)
+{
+    struct timespec step   = {0, WAIT_STEP_MS * NS_PER_MS};
+    long            waited = 0;
+
+    while(__atomic_load_n(&bridges, __ATOMIC_ACQUIRE) > 0 && waited < (long)timeout * MS_PER_SEC)
+    {
+        nanosleep(&step, NULL);
+        waited += WAIT_STEP_MS;
+    }
+}
+
+/*
+    Copies a new session into the shared cache, over whatever had its slot
+
+    @param
+    ssl: The connection that made it
+    session: The session
+
+    @return
+    0, OpenSSL keeps its own reference
+ */
+static int store_session(SSL *ssl, SSL_SESSION *session)
+{
+    unsigned int           id_len;
+    const unsigned char   *id      = SSL_SESSION_get_id(session, &id_len);
+    struct shared_session *slot    = session_slot(SSL_get_SSL_CTX(ssl), id, id_len);
+    int                    der_len = i2d_SSL_SESSION(session, NULL);
+    unsigned char         *der;
+    uint32_t               seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    // Too big, or another worker is writing the slot right now
+    if(id_len == 0 || der_len <= 0 || der_len > SESSION_DER_MAX || (seq & 1) != 0 ||
+       !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    der = slot->der;
+    i2d_SSL_SESSION(session, &der);
+    memcpy(slot->id, id, id_len);
+    slot->id_len  = id_len;
+    slot->der_len = (uint32_t)der_len;
+    slot->expires = (int64_t)time(NULL) + (int64_t)SSL_SESSION_get_timeout(session);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+    Looks up a session a client asks to resume, whichever worker made it
+
+    @param
+    ssl: The connection
+    id: The session ID the client sent
+    id_len: Its length
+    copy: Set to 0, the caller owns the returned session
+
+    @return
+    The session, or NULL if it is not cached, has expired or is being replaced
+ */
+static SSL_SESSION *find_session(SSL *ssl, const unsigned char *id, int id_len, int *copy)
+{
+    struct shared_session *slot  = session_slot(SSL_get_SSL_CTX(ssl), id, (unsigned int)id_len);
+    unsigned char          der[SESSION_DER_MAX];
+    const unsigned char   *start = der;
+    uint32_t               seq   = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    uint32_t               der_len;
+    int                    match;
+
+    *copy = 0;
+    if((seq & 1) != 0)
+    {
+        return NULL;
+    }
+    der_len = __atomic_load_n(&slot->der_len, __ATOMIC_RELAXED);
+    match   = __atomic_load_n(&slot->id_len, __ATOMIC_RELAXED) == (uint32_t)id_len && memcmp(slot->id, id, (size_t)id_len) == 0 && __atomic_load_n(&slot->expires, __ATOMIC_RELAXED) > (int64_t)time(NULL) && der_len <= SESSION_DER_MAX;
+    if(match)
+    {
+        memcpy(der, slot->der, der_len);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(!match || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+    {
+        return NULL;
+    }
+    return d2i_SSL_SESSION(NULL, &start, (long)der_len);
+}
+
+/*
+    Drops a session OpenSSL no longer wants resumed
+
+    @param
+    ctx: The context
+    session: The session
+ */
+static void remove_session(SSL_CTX *ctx, SSL_SESSION *session)
+{
+    unsigned int           id_len;
+    const unsigned char   *id   = SSL_SESSION_get_id(session, &id_len);
+    struct shared_session *slot = session_slot(ctx, id, id_len);
+    uint32_t               seq  = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    if((seq & 1) != 0 || slot->id_len != id_len || memcmp(slot->id, id, id_len) != 0 ||
+       !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    slot->id_len = 0;
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+    Slot of the shared cache a session ID belongs in
+
+    @param
+    ctx: The context, its app data is the tls_server
+    id: The session ID
+    id_len: Its length
+
+    @return
+    The slot
+ */
+static struct shared_session *session_slot(const SSL_CTX *ctx, const unsigned char *id, unsigned int id_len)
+{
+    const struct tls_server *server = (const struct tls_server *)SSL_CTX_get_app_data(ctx);
+    uint64_t                 hash   = FNV_OFFSET_BASIS;
+
+    for(unsigned int i = 0; i < id_len; i++)
+    {
+        hash ^= id[i];
+        hash *= FNV_PRIME;
+    }
+    return &server->sessions[hash & (SESSION_CACHE_SLOTS - 1)];
+}
+
+/*
+    Picks the application protocol of a connection during the handshake. HTTP/2 is
+    preferred, the worker tells the two apart by the preface HTTP/2 starts with.
+
+    @param
+    ssl: The connection
+    out: Set to the protocol picked, pointing into in
+    out_len: Set to its length
+    in: The protocols the client offered, in ALPN wire format
+    in_len: Length of in
+    arg: Unused
+
+    @return
+    SSL_TLSEXT_ERR_OK, or SSL_TLSEXT_ERR_NOACK to go on without ALPN if none matched
+ */
+static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *out_len, const unsigned char *in, unsigned int in_len, void *arg)
+{
+    unsigned char *selected;
+
+    (void)ssl;
+    (void)arg;
+    if(SSL_select_next_proto(&selected, out_len, (const unsigned char *)ALPN_PROTOCOLS, sizeof(ALPN_PROTOCOLS) - 1, in, in_len) != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/*
+    Attaches the socket to the SSL and bounds how long it blocks
+
+    @param
+    ssl: The connection
+    fd: Its socket
+    timeout: Seconds a read or write may block, 0 for no limit
+
+    @return
+    0: Ready
+    -1: The socket could not be set up
+ */
+static int prepare_socket(SSL *ssl, int fd, int timeout)
+{
+    struct timeval limit = {timeout, 0};
+
+    if(SSL_get_fd(ssl) != fd && SSL_set_fd(ssl, fd) != 1)
+    {
+        return -1;
+    }
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit)) != 0 || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit)) != 0)
+    {
+        perror("webserver (setsockopt TLS timeout)");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Tells whether the kernel encrypts and decrypts the connection on its own
+
+    @param
+    ssl: The connection, after its handshake
+
+    @return
+    1: Both directions are offloaded and nothing is left in the SSL's buffers
+    0: OpenSSL has to stay in the path
+ */
+static int offloaded(SSL *ssl)
+{
+#if defined(SSL_OP_ENABLE_KTLS)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) && SSL_has_pending(ssl) == 0;
+#else
+    (void)ssl;
+    return 0;
+#endif
+}
+
+/*
+    Starts the thread that carries a connection through a socket pair
+
+    @param
+    ssl: The connection, after its handshake
+    fd: Its socket, owned by the bridge from now on
+
+    @return
+    The descriptor the rest of the server uses for the connection, or -1 with errno set to
+    EPROTO if the bridge could not be started, ssl and fd are then still the caller's
+ */
+static int start_bridge(SSL *ssl, int fd)
+{
+    struct bridge *bridge = (struct bridge *)malloc(sizeof(struct bridge));
+    int            pair[2];
+    pthread_t      thread;
+    pthread_attr_t attr;
+    int            started;
+
+    if(bridge == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+    {
+        perror("webserver (TLS bridge)");
+        free(bridge);
+        errno = EPROTO;
+        return -1;
+    }
+    memset(bridge, 0, offsetof(struct bridge, in));
+    bridge->ssl          = ssl;
+    bridge->fd           = fd;
+    bridge->plain        = pair[0];
+    bridge->client_open  = 1;
+    bridge->client_alive = 1;
+    bridge->server_open  = 1;
+
+    // The thread sleeps in poll(), its own side never blocks so neither direction holds up the other
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+
+    __atomic_add_fetch(&bridges, 1, __ATOMIC_ACQ_REL);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&thread, &attr, run_bridge, bridge);
+    pthread_attr_destroy(&attr);
+    if(started != 0)
+    {
+        fprintf(stderr, "webserver (TLS bridge thread): %s\n", strerror(started));
+        __atomic_sub_fetch(&bridges, 1, __ATOMIC_ACQ_REL);
+        close(pair[0]);
+        close(pair[1]);
+        free(bridge);
+        errno = EPROTO;
+        return -1;
+    }
+    return pair[1];
+}
+
+/*
+    Body of a bridge thread. It runs until every copy of the server's end of the pair is
+    closed: the listener closes it when the client goes away or stays idle too long, and a
+    worker when it answers with Connection: close. The client closing its side only shuts
+    the pair's write side, so a response on its way is not cut short.
+
+    @param
+    arg: The struct bridge, freed on the way out
+
+    @return
+    NULL
+ */
+static void *run_bridge(void *arg)
+{
+    struct bridge *bridge = (struct bridge *)arg;
+
+    while(bridge->server_open || bridge->out_off < bridge->out_len)
+    {
+        struct pollfd fds[2];
+        short         client_events = 0;
+        short         plain_events  = 0;
+        int           progress;
+
+        progress = pump_in(bridge, &client_events, &plain_events);
+        progress |= pump_out(bridge, &client_events, &plain_events);
+        if(progress)
+        {
+            continue;
+        }
+
+        // A socket with nothing to wait for is left out, its hang-up would only wake us up
+        fds[0].fd     = client_events != 0 ? bridge->fd : -1;
+        fds[0].events = client_events;
+        fds[1].fd     = plain_events != 0 ? bridge->plain : -1;
+        fds[1].events = plain_events;
+        if(poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            perror("webserver (TLS bridge poll)");
+            break;
+        }
+    }
+
+    if(bridge->client_alive)
+    {
+        SSL_shutdown(bridge->ssl);
+    }
+    SSL_free(bridge->ssl);
+    close(bridge->fd);
+    close(bridge->plain);
+    free(bridge);
+    ERR_clear_error();
+    __atomic_sub_fetch(&bridges, 1, __ATOMIC_ACQ_REL);
+    return NULL;
+}
+
+/*
+    Decrypts request bytes from the client and passes them on to the server
+
+    @param
+    bridge: The bridge
+    client_events: What to poll the client's socket for, added to when it would block
+    plain_events: What to poll the pair for, added to when it would block
+
+    @return
+    1 if any bytes moved or a side closed, 0 if there is nothing to do but wait
+ */
+static int pump_in(struct bridge *bridge, short *client_events, short *plain_events)
+{
+    int progress = 0;
+
+    if(bridge->in_off == bridge->in_len && bridge->client_open)
+    {
+        int got = SSL_read(bridge->ssl, bridge->in, BRIDGE_BUFFER);
+        int error;
+
+        if(got > 0)
+        {
+            bridge->in_off = 0;
+            bridge->in_len = (size_t)got;
+            progress       = 1;
+        }
+        else if((error = SSL_get_error(bridge->ssl, got)) == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+        {
+            *client_events |= error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+        }
+        else
+        {
+            // Whoever holds the server's end sees end of file, a broken connection is not shut down cleanly either
+            bridge->client_open  = 0;
+            bridge->client_alive = bridge->client_alive && error == SSL_ERROR_ZERO_RETURN;
+            progress             = 1;
+            shutdown(bridge->plain, SHUT_WR);
+        }
+    }
+
+    if(bridge->in_off < bridge->in_len)
+    {
+        ssize_t written = write(bridge->plain, bridge->in + bridge->in_off, bridge->in_len - bridge->in_off);
+
+        if(written > 0)
+        {
+            bridge->in_off += (size_t)written;
+            progress = 1;
+        }
+        else if(would_block(errno))
+        {
+            *plain_events |= POLLOUT;
+        }
+        else
+        {
+            bridge->in_off      = bridge->in_len;
+            bridge->client_open = 0;
+            progress            = 1;
+        }
+    }
+    return progress;
+}
+
+/*
+    Reads response bytes from the server and encrypts them to the client. Once the client
+    can no longer be written to they are dropped, so the server side still drains to its end.
+
+    @param
+    bridge: The bridge
+    client_events: What to poll the client's socket for, added to when it would block
+    plain_events: What to poll the pair for, added to when it would block
+
+    @return
+    1 if any bytes moved or a side closed, 0 if there is nothing to do but wait
+ */
+static int pump_out(struct bridge *bridge, short *client_events, short *plain_events)
+{
+    int progress = 0;
+
+    if(bridge->out_off == bridge->out_len && bridge->server_open)
+    {
+        ssize_t got = read(bridge->plain, bridge->out, BRIDGE_BUFFER);
+
+        if(got > 0)
+        {
+            bridge->out_off = 0;
+            bridge->out_len = (size_t)got;
+            progress        = 1;
+        }
+        else if(got < 0 && would_block(errno))
+        {
+            *plain_events |= POLLIN;
+        }
+        else
+        {
+            bridge->server_open = 0;
+            progress            = 1;
+        }
+    }
+
+    if(bridge->out_off < bridge->out_len && !bridge->client_alive)
+    {
+        bridge->out_off = bridge->out_len;
+        progress        = 1;
+    }
+    else if(bridge->out_off < bridge->out_len)
+    {
+        int sent = SSL_write(bridge->ssl, bridge->out + bridge->out_off, (int)(bridge->out_len - bridge->out_off));
+        int error;
+
+        if(sent > 0)
+        {
+            bridge->out_off += (size_t)sent;
+            progress = 1;
+        }
+        else if((error = SSL_get_error(bridge->ssl, sent)) == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ)
+        {
+            *client_events |= error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+        }
+        else
+        {
+            bridge->client_alive = 0;
+            bridge->client_open  = 0;
+            bridge->out_off      = bridge->out_len;
+            progress             = 1;
+            shutdown(bridge->plain, SHUT_WR);
+        }
+    }
+    return progress;
+}
@@ -0,0 +1,518 @@
+#include "uring.h"
+#include <errno.h>
+#if defined(__linux__)
+    #include <fcntl.h>
+    #include <limits.h>
+    #include <linux/io_uring.h>
+    #include <stdint.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/syscall.h>
+    #include <sys/uio.h>
+    #include <unistd.h>
+
+    #define URING_ENTRIES 8
+    #define URING_FILE_SLOT 0     // The one registered file slot, reused by every file served
+    #define URING_MAX_BATCH 3     // Most entries one call submits: read, send and its timeout
+    #define URING_MAX_READ ((size_t)INT_MAX)
+
+static int                  map_rings(struct uring *ring, const struct io_uring_params *params);
+static int                  ops_supported(const struct uring *ring);
+static int                  register_resources(struct uring *ring);
+static struct io_uring_sqe *queue_sqe(struct uring *ring, unsigned char opcode, int fd, unsigned long long user_data);
+static int                  submit_and_wait(struct uring *ring, int *results, unsigned count);
+
+/*
+    Sets up a ring and checks that the running kernel supports everything the file path needs
+
+    @param
+    ring: The ring to set up, ring->fd is -1 if it could not be
+
+    @return
+    0: The ring is ready
+    -1: io_uring is unavailable, too old or not permitted, the caller falls back to plain system calls
+ */
+int uring_init(struct uring *ring)
+{
+    struct io_uring_params params;
+    off_t                  size;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int)syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+    if(ring->fd < 0)
+    {
+        ring->fd = -1;
+        return -1;
+    }
+
+    // Opening a file straight into a fixed slot (5.15) is the newest feature used, try it on the working directory
+    if(map_rings(ring, &params) != 0 || !ops_supported(ring) || register_resources(ring) != 0 || uring_open_file(ring, ".", &size) != 0)
+    {
+        uring_destroy(ring);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Unmaps and closes a ring, which also closes the file left in its fixed slot
+
+    @param
+    ring: The ring, may be partly set up
+ */
+void uring_destroy(struct uring *ring)
+{
+    if(ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if(ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if(ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if(ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    free(ring->buffer);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/*
+    Opens a file into the fixed slot and reads its size, both in one submission.
+    Whatever file the slot held before is closed by the kernel as it is replaced.
+
+    @param
+    ring: The ring
+    path: Path of the file
+    size: Output for the size of the file
+
+    @return
+    0: The file is in the slot
+    -1: The file could not be opened or sized, errno says why
+ */
+int uring_open_file(struct uring *ring, const char *path, off_t *size)
+{
+    struct io_uring_sqe *sqe;
+    struct statx         stx;
+    int                  results[2];
+
+    sqe             = queue_sqe(ring, IORING_OP_OPENAT, AT_FDCWD, 0);
+    sqe->addr       = (uintptr_t)path;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = URING_FILE_SLOT + 1;
+
+    sqe              = queue_sqe(ring, IORING_OP_STATX, AT_FDCWD, 1);
+    sqe->addr        = (uintptr_t)path;
+    sqe->len         = STATX_SIZE;
+    sqe->off         = (uintptr_t)&stx;
+    sqe->statx_flags = 0;
+
+    if(submit_and_wait(ring, results, 2) != 0)
+    {
+        return -1;
+    }
+    for(int i = 0; i < 2; i++)
+    {
+        if(results[i] < 0)
+        {
+            errno = -results[i];
+            return -1;
+        }
+    }
+
+    *size = (off_t)stx.stx_size;
+    return 0;
+}
+
+/*
+    Reads the file in the fixed slot into memory
+
+    @param
+    ring: The ring
+    dest: Where the content goes
+    size: Bytes to read, the size uring_open_file returned
+
+    @return
+    0: size bytes were read
+    -1: The read failed or the file shrank, errno says why
+ */
+int uring_read_file(struct uring *ring, char *dest, size_t size)
+{
+    size_t offset = 0;
+
+    while(offset < size)
+    {
+        struct io_uring_sqe *sqe;
+        size_t               length = size - offset < URING_MAX_READ ? size - offset : URING_MAX_READ;
+        int                  result;
+
+        sqe = queue_sqe(ring, IORING_OP_READ, URING_FILE_SLOT, 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->addr = (uintptr_t)(dest + offset);
+        sqe->len  = (unsigned)length;
+        sqe->off  = offset;
+
+        if(submit_and_wait(ring, &result, 1) != 0)
+        {
+            return -1;
+        }
+        if(result <= 0)
+        {
+            errno = result < 0 ? -result : EIO;
+            return -1;
+        }
+        offset += (size_t)result;
+    }
+    return 0;
+}
+
+/*
+    Copies the file in the fixed slot to a socket through the registered buffer.
+    Each chunk is a read linked to a send, and to a timeout on the send, in one submission.
+
+    @param
+    ring: The ring
+    sock: The client socket
+    size: Bytes to send, the size uring_open_file returned
+    write_timeout: Seconds one chunk may take to send, 0 for no limit
+
+    @return
+    0: The whole file was sent
+    -1: Reading or sending failed, errno is EAGAIN if the send timed out
+ */
+int uring_send_file(struct uring *ring, int sock, off_t size, int write_timeout)
+{
+    struct __kernel_timespec timeout = {0};
+    unsigned                 count   = write_timeout > 0 ? URING_MAX_BATCH : 2;
+    off_t                    offset  = 0;
+
+    timeout.tv_sec = write_timeout;
+
+    while(offset < size)
+    {
+        struct io_uring_sqe *sqe;
+        int                  results[URING_MAX_BATCH];
+        unsigned             length = size - offset < URING_CHUNK_SIZE ? (unsigned)(size - offset) : URING_CHUNK_SIZE;
+
+        sqe = queue_sqe(ring, IORING_OP_READ_FIXED, URING_FILE_SLOT, 0);
+        sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->addr      = (uintptr_t)ring->buffer;
+        sqe->len       = length;
+        sqe->off       = (unsigned long long)offset;
+        sqe->buf_index = 0;
+
+        sqe            = queue_sqe(ring, IORING_OP_SEND, sock, 1);
+        sqe->addr      = (uintptr_t)ring->buffer;
+        sqe->len       = length;
+        sqe->msg_flags = MSG_NOSIGNAL;
+
+        if(write_timeout > 0)
+        {
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe       = queue_sqe(ring, IORING_OP_LINK_TIMEOUT, -1, 2);
+            sqe->addr = (uintptr_t)&timeout;
+            sqe->len  = 1;
+        }
+
+        if(submit_and_wait(ring, results, count) != 0)
+        {
+            return -1;
+        }
+
+        // A short read breaks the link and cancels the send
+        if(results[0] < 0 || (unsigned)results[0] < length)
+        {
+            errno = results[0] < 0 ? -results[0] : EIO;
+            return -1;
+        }
+        if(write_timeout > 0 && results[2] == -ETIME)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        if(results[1] <= 0)
+        {
+            errno = results[1] < 0 ? -results[1] : EPIPE;
+            return -1;
+        }
+
+        // A partial send is picked up where it stopped by the next chunk
+        offset += results[1];
+    }
+    return 0;
+}
+
+/*
+    Maps the submission and completion rings and the submission entries
+
+    @param
+    ring: The ring, ring->fd is set up
+    params: What io_uring_setup returned
+
+    @return
+    0: The rings are mapped
+    -1: A mapping failed
+ */
+static int map_rings(struct uring *ring, const struct io_uring_params *params)
+{
+    void *mapped;
+
+    ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if(params->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    mapped = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(mapped == MAP_FAILED)
+    {
+        return -1;
+    }
+    ring->sq_ring = mapped;
+
+    if(params->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        mapped = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(mapped == MAP_FAILED)
+        {
+            return -1;
+        }
+        ring->cq_ring = mapped;
+    }
+
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    mapped          = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(mapped == MAP_FAILED)
+    {
+        return -1;
+    }
+    ring->sqes = mapped;
+
+    // The kernel aligns every field, going through void * tells the compiler so
+    ring->sq_head  = (unsigned *)(void *)((char *)ring->sq_ring + params->sq_off.head);
+    ring->sq_tail  = (unsigned *)(void *)((char *)ring->sq_ring + params->sq_off.tail);
+    ring->sq_mask  = (unsigned *)(void *)((char *)ring->sq_ring + params->sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(void *)((char *)ring->sq_ring + params->sq_off.array);
+    ring->cq_head  = (unsigned *)(void *)((char *)ring->cq_ring + params->cq_off.head);
+    ring->cq_tail  = (unsigned *)(void *)((char *)ring->cq_ring + params->cq_off.tail);
+    ring->cq_mask  = (unsigned *)(void *)((char *)ring->cq_ring + params->cq_off.ring_mask);
+    ring->cqes     = (char *)ring->cq_ring + params->cq_off.cqes;
+    return 0;
+}
+
+/*
+    Asks the kernel whether it supports every operation the file path submits
+
+    @param
+    ring: The ring
+
+    @return
+    1 if every operation is supported, 0 otherwise
+ */
+static int ops_supported(const struct uring *ring)
+{
+    static const unsigned char needed[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_SEND, IORING_OP_LINK_TIMEOUT};
+    struct io_uring_probe     *probe;
+    int                        supported = 1;
+
+    probe = (struct io_uring_probe *)calloc(1, sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    if(probe == NULL)
+    {
+        return 0;
+    }
+
+    if(syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) != 0)
+    {
+        free(probe);
+        return 0;
+    }
+
+    for(size_t i = 0; i < sizeof(needed); i++)
+    {
+        if(needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+            supported = 0;
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+/*
+    Registers the copy buffer and an empty fixed file slot with the kernel, so neither has to be
+    looked up or pinned again for every request
+
+    @param
+    ring: The ring
+
+    @return
+    0: Both are registered
+    -1: Allocation or registration failed
+ */
+static int register_resources(struct uring *ring)
+{
+    struct iovec iov;
+    int          files[1] = {-1};
+
+    ring->buffer = (char *)malloc(URING_CHUNK_SIZE);
+    if(ring->buffer == NULL)
+    {
+        return -1;
+    }
+
+    iov.iov_base = ring->buffer;
+    iov.iov_len  = URING_CHUNK_SIZE;
+    if(syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) != 0)
+    {
+        return -1;
+    }
+    if(syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, 1) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Claims the next submission entry, it is handed to the kernel by the next submit_and_wait
+
+    @param
+    ring: The ring
+    opcode: The operation
+    fd: The file or socket it works on, a slot index with IOSQE_FIXED_FILE
+    user_data: Index of its result in the results submit_and_wait fills in
+
+    @return
+    The zeroed entry
+ */
+static struct io_uring_sqe *queue_sqe(struct uring *ring, unsigned char opcode, int fd, unsigned long long user_data)
+{
+    struct io_uring_sqe *sqes  = (struct io_uring_sqe *)ring->sqes;
+    unsigned             index = (*ring->sq_tail + ring->queued) & *ring->sq_mask;
+    struct io_uring_sqe *sqe   = &sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode          = opcode;
+    sqe->fd              = fd;
+    sqe->user_data       = user_data;
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+/*
+    Submits the queued entries and waits for their completions, with a single io_uring_enter
+    unless a signal interrupts it
+
+    @param
+    ring: The ring
+    results: Output for the result of each entry, indexed by its user_data
+    count: Number of entries queued
+
+    @return
+    0: Every entry completed
+    -1: io_uring_enter failed
+ */
+static int submit_and_wait(struct uring *ring, int *results, unsigned count)
+{
+    unsigned tail = *ring->sq_tail + ring->queued;
+    unsigned done = 0;
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    ring->queued = 0;
+
+    // Every result is written by its completion, until then it reads as cancelled
+    for(unsigned i = 0; i < count; i++)
+    {
+        results[i] = -ECANCELED;
+    }
+
+    while(done < count)
+    {
+        const struct io_uring_cqe *cqes    = (const struct io_uring_cqe *)ring->cqes;
+        unsigned                   pending = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        unsigned                   head;
+
+        if(syscall(SYS_io_uring_enter, ring->fd, pending, count - done, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+
+        head = *ring->cq_head;
+        while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            const struct io_uring_cqe *cqe = &cqes[head & *ring->cq_mask];
+
+            if(cqe->user_data < count)
+            {
+                results[cqe->user_data] = cqe->res;
+                done++;
+            }
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+#else
+// io_uring is Linux only, elsewhere every call reports it unavailable
+int uring_init(struct uring *ring)
+{
+    ring->fd = -1;
+    errno    = ENOSYS;
+    return -1;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    ring->fd = -1;
+}
+
+int uring_open_file(struct uring *ring, const char *path, off_t *size)
+{
+    (void)ring;
+    (void)path;
+    (void)size;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_read_file(struct uring *ring, char *dest, size_t size)
+{
+    (void)ring;
+    (void)dest;
+    (void)size;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_send_file(struct uring *ring, int sock, off_t size, int write_timeout)
+{
+    (void)ring;
+    (void)sock;
+    (void)size;
+    (void)write_timeout;
+    errno = ENOSYS;
+    return -1;
+}
+#endif